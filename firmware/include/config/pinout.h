@@ -23,5 +23,7 @@
 #define AC_0CROSS_PIN        14 /**<\brief Zerocross sensor pin. */
 #define LED0_PIN             15 /**<\brief LED 0 control pin. */
 #define FLOW_RATE_PIN        18 /**<\brief Flow rate data pin. */
+//#define LMT01_GROUP_DATA_PIN 19 /**<\brief Optional group head LMT01 data pin. Leave undefined if not fitted. */
+//#define SCALE_DRDY_PIN       20 /**<\brief Optional NAU7802 data ready pin. Leave undefined if not wired and the scale is polled over I2C. */
 #define PRESSURE_SENSOR_PIN  28 /**<\brief Analog pressure sensor pin. */
 #endif
\ No newline at end of file
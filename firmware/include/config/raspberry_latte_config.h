@@ -18,9 +18,27 @@
 
 #define SCALE_CONVERSION_MG -0.152710615479
 
+/** 
+ * Scale conversion rate during autobrew shots. Weighing beans always uses the low-noise 10 SPS. 
+ * Conversions are read from the 10ms main loop so rates above 80 SPS would drop conversions.
+ */
+#define SCALE_SHOT_RATE SPS_080
+
+/** 
+ * Time between the scale's internal offset calibrations while idle. Calibrations only run while
+ * the pump is off and the scale is steady near zero. Set to 0 to disable.
+ */
+#define SCALE_OFFSET_CAL_PERIOD_MS 300000
+
 /** ml per pulse of pump flow sensor. */
 #define PULSE_TO_FLOW_CONVERSION_ML  0.5 
 
+/** 
+ * Time between switching the pump off and the flow through the flow sensor stopping. Volumetric
+ * triggers stop the pump this early. Increase if volumes overshoot. 
+ */
+#define PUMP_SHUTOFF_LAG_MS 100
+
 // Between two temp readings, the temperature must not change by more than this amount.
 #define THERMAL_RUNAWAY_WATCHER_MAX_CONSECUTIVE_TEMP_CHANGE_cC 1000
 
@@ -8,12 +8,24 @@
  * to a rate of change (i.e. flow-rate). Methods are provided for reading both the volume of 
  * flow and the flowrate.
  * 
+ * The pulses are timestamped by a PIO state machine so no interrupts are used. The timestamps
+ * wait in the PIO's FIFO until the volume or rate is read, at which point they are consumed as a
+ * batch. The FIFO holds 8 pulses so the flow meter should be read at least once every 8 pulses.
+ * 
+ * At low flows, only a few pulses arrive each second so the windowed slope lags or reads zero. The
+ * flowrate therefore blends the slope with the rate implied by the time between the last two pulses,
+ * relying fully on the period below a few pulses a second and fully on the slope at high rates.
+ * 
+ * Changelog:
+ * v0.2 - Moved pulse counting from a GPIO interrupt to a PIO program that timestamps each pulse.
+ * Added inter-pulse period rate for low flows.
+ * 
  * \{
  * 
  * \file flow_meter.h
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief Flow Meter driver header
- * \version 0.1
+ * \version 0.3
  * \date 2022-12-10
 */
 #ifndef FLOW_METER_H
@@ -23,6 +35,8 @@
 
 #include "utils/pid.h"
 
+//#define FLOW_METER_TESTS
+
 /** \brief Opaque object defining a single flow meter. */
 typedef struct flow_meter_s* flow_meter;
 
@@ -30,17 +44,18 @@ typedef struct flow_meter_s* flow_meter;
  * \brief Configures a single flow_meter structure.
  * 
  * Runs three main tasks
- * -# Sets up the pin as a digital input that is pulled down. 
- * -# Attaches callback using \ref gpio_multi_callback.
+ * -# Sets up the pin as a PIO input that is pulled down. 
+ * -# Loads the timestamping program into the PIO block (once per block) and claims a state machine.
  * -# Initializes the internal discrete_derivative.
  * 
+ * \param pio_num The PIO block (0 or 1) to run the timestamping program on.
  * \param pin_num The GPIO attached to the flow meter's signal wire.
  * \param conversion_factor The factor to convert from pulse counts to desired volume.
  * \param filter_span_ms The duration over which the slope will be computed.
  * \param sample_dwell_time_ms The minimum duration between samples.
  * \return A new flow_meter object on success. NULL on error.  
  */
-flow_meter flow_meter_setup(uint8_t pin_num, float conversion_factor, 
+flow_meter flow_meter_setup(uint8_t pio_num, uint8_t pin_num, float conversion_factor, 
                             uint16_t filter_span_ms, uint16_t sample_dwell_time_ms);
 
 /**
@@ -72,5 +87,17 @@ void flow_meter_zero(flow_meter fm);
  * \param fm The flow_meter object to destroy.
  */
 void flow_meter_deinit(flow_meter fm);
+
+#ifdef FLOW_METER_TESTS
+/**
+ * \brief Feed synthetic pulse trains through the consumer and rate estimators and print the results.
+ * 
+ * The last tests run in real time (about 17 s) and compare the accuracy and settling time of the 
+ * windowed slope with the blended rate.
+ * 
+ * Compiled by defining FLOW_METER_TESTS in header.
+ */
+void flow_meter_test();
+#endif
 #endif
 /** \} */
\ No newline at end of file
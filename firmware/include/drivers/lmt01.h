@@ -6,13 +6,27 @@
  * The LMT01 is a high precision temperature sensor that periodically sends a sequence current
  * pulses. The number of pulses is roughly proportional to the current temperature. This driver
  * counts the number of pulses using a PIO program and converts this to the corrsponding
- * temperature using linear interpolation between data points givin in the data sheet.
+ * temperature using linear interpolation between data points givin in the data sheet. The 
+ * interpolation uses a fixed-point LUT indexed by the pulse count so each sample takes a handful 
+ * of integer operations.
+ * 
+ * The PIO RX FIFO is drained by DMA into a ring of pulse counts. A second, chained DMA channel 
+ * records the time each count arrived so readings carry the time the pulse train ended rather 
+ * than the time they were read. The ring holds 1.6s of samples so it must be read at least that 
+ * often. A median of the latest ::LMT01_MEDIAN_LEN samples rejects single corrupted readings.
+ * 
+ * Up to ::LMT01_MAX_SENSORS sensors can share one PIO block. The program is loaded once and each 
+ * sensor claims its own state machine and two DMA channels. ::lmt01_read_array reads a set of 
+ * sensors in one pass.
+ * 
+ * Setup does not wait for the first sample. ::lmt01_get_status reports when the first valid 
+ * temperature has arrived and if the samples have stopped.
  * 
  * \{
  * \file
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief LMT01 Driver header
- * \version 0.1
+ * \version 0.6
  * \date 2022-08-16
  */
 
@@ -23,6 +37,24 @@
 #include "pico/stdlib.h"
 #include "hardware/pio.h"
 
+//#define LMT01_TESTS
+
+/** \brief The maximum number of sensors on one PIO block (one per state machine). */
+#define LMT01_MAX_SENSORS 4
+
+/** \brief Number of the latest samples used by ::lmt01_read_median. */
+#define LMT01_MEDIAN_LEN 5
+
+/** \brief Time without a valid sample after which a sensor is degraded. The LMT01 sends one every ~100ms. */
+#define LMT01_TIMEOUT_MS 1000
+
+/** \brief Status of a LMT01 sensor. */
+typedef enum {
+    LMT01_STARTING, /**< No valid temperature has been received yet. */
+    LMT01_READY,    /**< Valid temperatures are being received. */
+    LMT01_DEGRADED  /**< No valid temperature for ::LMT01_TIMEOUT_MS. */
+} lmt01_status;
+
 /** \brief A single LMT01 object. */
 typedef struct lmt01_s * lmt01;
 
@@ -30,11 +62,14 @@ typedef struct lmt01_s * lmt01;
  * \brief Configures the signal pin attached to a LMT01 temp sensor and starts a PIO 
  * program that counts the sensors pulse train
  * 
+ * Returns without waiting for a temperature. Reads return 0 until ::lmt01_get_status is ::LMT01_READY.
+ * 
  * \param pio_num    Either 0 or 1 indicating if PIO #0 or #1 should be used
  * \param dat_pin    Pin that the LMT01 is attached to
  * \param offset_16C A constant offset added to temp readings in 16*C
  * 
- * \returns A new LMT01 object
+ * \returns A new LMT01 object. NULL if memory could not be allocated, the PIO block is full, or no
+ * DMA channels are free.
  */
 lmt01 lmt01_setup(uint8_t pio_num, uint8_t dat_pin, int offset_16C);
 
@@ -57,8 +92,67 @@ int lmt01_read(lmt01 l);
 float lmt01_read_float(lmt01 l);
 
 /**
- * \brief Destroy a LMT01 object.
+ * \brief Returns the median of the latest ::LMT01_MEDIAN_LEN temperatures in cC.
+ * 
+ * \param l Pointer to lmt01 struct that contains the parameters for the LMT01 interface
+ * 
+ * \returns The median temperature in cC.
+ */
+int lmt01_read_median(lmt01 l);
+
+/**
+ * \brief Returns the median of the latest ::LMT01_MEDIAN_LEN temperatures in C.
+ * 
+ * \param l Pointer to lmt01 struct that contains the parameters for the LMT01 interface
+ * 
+ * \returns The median temperature in C.
+ */
+float lmt01_read_median_float(lmt01 l);
+
+/**
+ * \brief Returns the time the latest temperature was sent by the sensor.
+ * 
+ * \param l Pointer to lmt01 struct that contains the parameters for the LMT01 interface
+ * 
+ * \returns The time the latest sample's pulse train ended.
+ */
+absolute_time_t lmt01_read_time(lmt01 l);
+
+/**
+ * \brief Returns the status of the sensor.
+ * 
+ * \param l Pointer to lmt01 struct that contains the parameters for the LMT01 interface
+ * 
+ * \returns ::LMT01_READY if a valid temperature arrived within ::LMT01_TIMEOUT_MS, ::LMT01_STARTING
+ * if none has arrived yet, and ::LMT01_DEGRADED if none arrived within the timeout.
+ */
+lmt01_status lmt01_get_status(lmt01 l);
+
+/**
+ * \brief Read the median temperature of several sensors in one pass.
+ * 
+ * \param sensors Array of previously setup lmt01 objects.
+ * \param num_sensors Number of sensors in \p sensors. At most ::LMT01_MAX_SENSORS.
+ * \param temps_cC Array that the median temperatures, in cC, are written to.
+ * 
+ * \returns PICO_ERROR_INVALID_ARG if too many sensors are passed. Else PICO_ERROR_NONE.
+ */
+int lmt01_read_array(const lmt01 sensors [], uint8_t num_sensors, int temps_cC []);
+
+/**
+ * \brief Destroy a LMT01 object. Stops its state machine and DMA channels.
 */
 void lmt01_deinit(lmt01 l);
+
+#ifdef LMT01_TESTS
+/**
+ * \brief Compare the LUT conversion against the piecewise-linear float conversion for all pulse
+ * counts from 0 to 3300, decode simulated DMA rings for ::LMT01_MAX_SENSORS sensors in one pass, 
+ * and print the results.
+ * 
+ * Compiled by defining LMT01_TESTS in header.
+ */
+void lmt01_test();
+#endif
 #endif
 /** \} */
\ No newline at end of file
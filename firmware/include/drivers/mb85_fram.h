@@ -11,12 +11,25 @@
  * as normal in your program, and its value synced with the remote value on the FRAM IC
  * with ::mb85_fram_load and ::mb85_fram_save. 
  * 
+ * Linking returns a small ::mb85_fram_var handle that indexes a fixed table of 
+ * ::MB85_FRAM_MAX_VARS links allocated with the device, so loads and saves never search for 
+ * the link and nothing is allocated after ::mb85_fram_setup. Unlinking frees the slot for reuse.
+ * 
+ * ::mb85_fram_save_async queues the write on the I2C bus and returns at once, so saving a 
+ * large variable doesn't stall the caller. Transactions run in order so a later load or save 
+ * of the same variable sees the queued write. ::mb85_fram_save_range_async writes only part of a
+ * linked variable, and ::mb85_fram_load_from and ::mb85_fram_save_to_async copy a linked variable
+ * from or to another address (e.g. a stored profile) without relinking it.
+ * 
+ * The FRAM is run at up to ::MB85_FRAM_MAX_BAUDRATE (Fast-mode Plus) while other devices on the 
+ * bus keep their own speed.
+ * 
  * @{
  * 
  * \file mb85_fram.h
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief MB85 FRAM header
- * \version 0.1
+ * \version 0.5
  * \date 2022-11-14
  */
 
@@ -26,15 +39,25 @@
 #include "pico/stdlib.h"
 #include "utils/i2c_bus.h"
 
+/** \brief Fastest I2C clock of the MB85 FRAM. Set for the device by ::mb85_fram_setup. */
+#define MB85_FRAM_MAX_BAUDRATE 1000000
+
+/** \brief Number of variables that can be linked to each device at once. */
+#define MB85_FRAM_MAX_VARS 16
+
 /** \brief Indicate how the values should be initalized when linking remote var. */
 typedef enum {
     MB85_FRAM_INIT_FROM_VAR = 0, /**< Set the FRAM var to the local var when linking */
-    MB85_FRAM_INIT_FROM_FRAM = 1 /**< Set the local var to the FRAM var when linking */
+    MB85_FRAM_INIT_FROM_FRAM = 1, /**< Set the local var to the FRAM var when linking */
+    MB85_FRAM_INIT_NONE = 2       /**< Leave both the local and FRAM var as they are when linking */
     } mb85_fram_init_dir;
 
 /** \brief Object representing one MB85 FRAM chip. */
 typedef struct mb85_fram_s * mb85_fram;
 
+/** \brief Handle of a linked variable returned by ::mb85_fram_link_var. Negative values are errors. */
+typedef int16_t mb85_fram_var;
+
 /** \brief Verifies and configures a MB85 device struct. 
  * 
  * Once configured, the struct can be used to link local variables with remote variables stored in FRAM.
@@ -71,39 +94,101 @@ int mb85_fram_set_all(mb85_fram dev, uint8_t value);
  * \param var Pointer to the starting memory location of the local object that will be linked.
  * \param remote_addr Memory address where the remote variable is located.
  * \param num_bytes Size of object that will be stored. 
- * \param init_from_fram Indicates if the local variable is initalized from fram or vice vera (MB85_FRAM_INIT_FROM_VAR or MB85_FRAM_INIT_FROM_FRAM)
+ * \param init_from_fram Indicates if the local variable is initalized from fram or vice vera (MB85_FRAM_INIT_FROM_VAR or MB85_FRAM_INIT_FROM_FRAM).
+ * MB85_FRAM_INIT_NONE links without any I2C transaction.
  * 
- * \returns PICO_ERROR_NONE on success. I2C Bus error is problem communicating over I2C. 
+ * \returns The handle of the link used by the other functions on success. PICO_ERROR_INVALID_ARG if
+ * \p var is NULL or \p num_bytes is 0. PICO_ERROR_GENERIC if all ::MB85_FRAM_MAX_VARS links are used. 
+ * I2C Bus error is problem communicating over I2C, in which case nothing is linked. 
 */
-int mb85_fram_link_var(mb85_fram dev, void * var, reg_addr remote_addr, uint16_t num_bytes, mb85_fram_init_dir init_from_fram);
+mb85_fram_var mb85_fram_link_var(mb85_fram dev, void * var, reg_addr remote_addr, uint16_t num_bytes, mb85_fram_init_dir init_from_fram);
 
-/** \brief Breaks the link if it exists between the local object pointed at by var and the 
- * memory location on the remote device.
+/** \brief Breaks the link between a local object and the memory location on the remote device.
  * 
- * \param dev Initalized MB85 device to link with.
- * \param var Pointer to the starting memory location of the local object that will be unlinked.
+ * The handle may be returned by a later link so it must not be used again.
  * 
- * \returns PICO_ERROR_NONE. 
+ * \param dev Initalized MB85 device to unlink from.
+ * \param var Handle of the link.
+ * 
+ * \returns PICO_ERROR_NONE on success. PICO_ERROR_INVALID_ARG if the handle isn't linked. 
 */
-int mb85_fram_unlink_var(mb85_fram dev, void * var);
+int mb85_fram_unlink_var(mb85_fram dev, mb85_fram_var var);
 
 /** \brief Reads the current value stored in MB85 chip into remote_var 
  * 
  * \param dev Initalized MB85 device to read from.
- * \param var pointer to local variable linked to a remote variable
+ * \param var Handle of the link returned by ::mb85_fram_link_var.
  * 
- * \returns PICO_ERROR_NONE on success. PICO_ERROR_INVALID_ARG if no link found. I2C Bus error is problem reading over I2C.  
+ * \returns PICO_ERROR_NONE on success. PICO_ERROR_INVALID_ARG if the handle isn't linked. I2C Bus error is problem reading over I2C.  
 */
-int mb85_fram_load(mb85_fram dev, void * var);
+int mb85_fram_load(mb85_fram dev, mb85_fram_var var);
 
 /** \brief Writes the current values in remote_var onto MB85 chip 
  * 
  * \param dev Initalized MB85 device to write to.
- * \param var pointer to local variable linked to a remote variable
+ * \param var Handle of the link returned by ::mb85_fram_link_var.
+ * 
+ * \returns PICO_ERROR_NONE on success. PICO_ERROR_INVALID_ARG if the handle isn't linked. I2C Bus error is problem writing over I2C.  
+*/
+int mb85_fram_save(mb85_fram dev, mb85_fram_var var);
+
+/** \brief Queues a write of the current values in var onto MB85 chip and returns without waiting.
+ * 
+ * The local variable is sent as the write runs. It must stay valid until \p cb is called and any 
+ * changes made before then may or may not be saved.
+ * 
+ * \param dev Initalized MB85 device to write to.
+ * \param var Handle of the link returned by ::mb85_fram_link_var.
+ * \param cb Function called from the main loop once the write finishes. Can be NULL.
+ * \param data User data passed to \p cb.
+ * 
+ * \returns PICO_ERROR_NONE if queued. PICO_ERROR_INVALID_ARG if the handle isn't linked. I2C Bus error if the write couldn't be queued.  
+*/
+int mb85_fram_save_async(mb85_fram dev, mb85_fram_var var, i2c_bus_callback_t cb, void * data);
+
+/** \brief Queues a write of part of a linked variable onto MB85 chip and returns without waiting.
+ * 
+ * Only the bytes [offset, offset + num_bytes) of the local variable are written, to the same
+ * offset from its remote address. They must stay valid until \p cb is called.
+ * 
+ * \param dev Initalized MB85 device to write to.
+ * \param var Handle of the link returned by ::mb85_fram_link_var.
+ * \param offset Offset in bytes of the first byte to write.
+ * \param num_bytes Number of bytes to write.
+ * \param cb Function called from the main loop once the write finishes. Can be NULL.
+ * \param data User data passed to \p cb.
+ * 
+ * \returns PICO_ERROR_NONE if queued. PICO_ERROR_INVALID_ARG if the handle isn't linked or the range is empty or 
+ * outside the variable. I2C Bus error if the write couldn't be queued.  
+*/
+int mb85_fram_save_range_async(mb85_fram dev, mb85_fram_var var, uint16_t offset, uint16_t num_bytes, i2c_bus_callback_t cb, void * data);
+
+/** \brief Reads a linked variable's worth of bytes from another address on MB85 chip into the variable.
+ * 
+ * The link is unchanged, so later saves and loads still use the linked address.
+ * 
+ * \param dev Initalized MB85 device to read from.
+ * \param var Handle of the link returned by ::mb85_fram_link_var.
+ * \param remote_addr Starting address to read from.
+ * 
+ * \returns PICO_ERROR_NONE on success. PICO_ERROR_INVALID_ARG if the handle isn't linked. I2C Bus error is problem reading over I2C.  
+*/
+int mb85_fram_load_from(mb85_fram dev, mb85_fram_var var, reg_addr remote_addr);
+
+/** \brief Queues a write of a linked variable to another address on MB85 chip and returns without waiting.
+ * 
+ * The link is unchanged, so later saves and loads still use the linked address. The local 
+ * variable must stay valid until \p cb is called.
+ * 
+ * \param dev Initalized MB85 device to write to.
+ * \param var Handle of the link returned by ::mb85_fram_link_var.
+ * \param remote_addr Starting address to write to.
+ * \param cb Function called from the main loop once the write finishes. Can be NULL.
+ * \param data User data passed to \p cb.
  * 
- * \returns PICO_ERROR_NONE on success. PICO_ERROR_INVALID_ARG if no link found. I2C Bus error is problem writing over I2C.  
+ * \returns PICO_ERROR_NONE if queued. PICO_ERROR_INVALID_ARG if the handle isn't linked. I2C Bus error if the write couldn't be queued.  
 */
-int mb85_fram_save(mb85_fram dev, void * var);
+int mb85_fram_save_to_async(mb85_fram dev, mb85_fram_var var, reg_addr remote_addr, i2c_bus_callback_t cb, void * data);
 
 /** \brief Destroy a mb85_fram object. */
 void mb85_fram_deinit(mb85_fram dev);
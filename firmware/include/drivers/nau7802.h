@@ -16,11 +16,41 @@
  * IC will be initalized to default values, but these can be modified using the various helper 
  * functions.
  * 
+ * Bring-up does not block. ::nau7802_setup only allocates the object and checks that the IC
+ * responds. The reset, power-up, calibration, and zeroing are then run one step at a time by
+ * ::nau7802_tick, which should be called from the main loop. Each step either returns at once or
+ * times out, and a failed step restarts the bring-up. After a bounded number of failures, the 
+ * scale is reported as ::NAU7802_DEGRADED. Reads fail until the scale is ::NAU7802_READY.
+ * 
+ * Once ready, every conversion is read with one queued burst I2C read and stored with its time in 
+ * a ring of ::NAU7802_RING_LEN samples once the read finishes (see ::i2c_bus_process_completed). 
+ * All read functions return values from this ring and never touch the bus. If the DRDY pin is 
+ * attached with ::nau7802_setup_drdy, its rising edge queues the read and timestamps the 
+ * conversion. Otherwise ::nau7802_tick queues reads of the conversion ready bit and the conversion.
+ * 
+ * The conversion rate can be set from 10 to 320 SPS with ::nau7802_set_conversion_rate. All mg
+ * reads use an adaptive filter. While the weight is steady, it averages up to 
+ * ::NAU7802_FILTER_WINDOW_MS of conversions so faster, noisier rates keep the same resolution. 
+ * When two conversions in a row jump out of the noise band (a cup is placed or a pour starts) the
+ * average restarts from the new value so the filter settles within a few conversions. Single
+ * outliers are ignored. The filter uses only integer math.
+ * 
+ * The rate of change of the mass, e.g. the flow out of the portafilter, is estimated by a 
+ * \ref kalman_filter fed every timestamped conversion. It is read with ::nau7802_read_rate_mg_s.
+ * 
+ * Slow drift, e.g. from the boiler warming the load cell, can be removed by auto-zero tracking
+ * (::nau7802_set_auto_zero). While the scale is steady within ::NAU7802_AUTO_ZERO_BAND_MG of zero, 
+ * the origin follows the reading at up to ::NAU7802_AUTO_ZERO_MAX_MG_S. While auto-zero is on,
+ * the ADC's internal offset can also be recalibrated periodically (::nau7802_set_offset_cal_period_ms).
+ * 
+ * The configuration registers are mirrored in an \ref i2c_bus shadow so changing a setting is a
+ * single write, and the settings applied together during bring-up share one burst write.
+ * 
  * @{
  * \file
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief NAU7802 Library header
- * \version 0.1
+ * \version 0.12
  * \date 2022-08-16
  */
  
@@ -30,6 +60,26 @@
 #include "pico/stdlib.h"
 #include "utils/i2c_bus.h"
 
+//#define NAU7802_TESTS
+
+/** \brief Number of conversions kept by each scale. */
+#define NAU7802_RING_LEN 16
+
+/** \brief Time spanned by the filter's average when the weight is steady. */
+#define NAU7802_FILTER_WINDOW_MS 800
+
+/** \brief Smallest jump, in raw counts, that can be treated as a step by the filter. */
+#define NAU7802_FILTER_MIN_STEP 16
+
+/** \brief Fastest I2C clock of the NAU7802 (Fast-mode). Set for the scale by ::nau7802_setup. */
+#define NAU7802_MAX_BAUDRATE 400000
+
+/** \brief Auto-zero only adjusts the origin while the reading is within this many mg of zero. */
+#define NAU7802_AUTO_ZERO_BAND_MG 500
+
+/** \brief The fastest drift, in mg/s, that auto-zero removes. */
+#define NAU7802_AUTO_ZERO_MAX_MG_S 20
+
 /** \brief Abstract object representing a NAU7802 IC. */
 typedef struct nau7802_s * nau7802;
 
@@ -148,6 +198,19 @@ typedef enum {
     PGA_OFF = 0,
 } pga_setting;
 
+/** \brief A single conversion and the time it was ready. */
+typedef struct {
+    uint32_t raw;         /**< The raw 24 bit conversion. */
+    absolute_time_t time; /**< The time the conversion was ready. */
+} nau7802_sample;
+
+/** \brief Status of the scale's bring-up. */
+typedef enum {
+    NAU7802_STARTING, /**< Bring-up is still running. */
+    NAU7802_READY,    /**< Scale is configured, calibrated, and zeroed. */
+    NAU7802_DEGRADED  /**< Bring-up failed too many times and was abandoned. */
+} nau7802_status;
+
 /** 
  * \brief Sets and clears the reset bit in the NAU7802. This clears the registers
  * and returns the chip to a known state. Setup operations must be repeated after
@@ -267,6 +330,50 @@ int nau7802_set_chopper_clock(nau7802 scale, chp_clk val);
  */
 int nau7802_set_pga_filter(nau7802 scale, pga_setting off_on);
 
+/**
+ * \brief Enable or disable auto-zero tracking. Disabled by default.
+ * 
+ * Should be disabled while a shot is being poured so the first drips aren't zeroed away.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \param enable True to track the origin. False to hold it.
+ */
+void nau7802_set_auto_zero(nau7802 scale, bool enable);
+
+/**
+ * \brief Set the time between internal offset calibrations. Disabled by default.
+ * 
+ * A calibration only starts while auto-zero is enabled and the scale is steady. Conversions stop
+ * while it runs (a few hundred ms) and the filter restarts afterwards.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \param period_ms Minimum time between calibrations in ms. 0 disables them.
+ */
+void nau7802_set_offset_cal_period_ms(nau7802 scale, uint32_t period_ms);
+
+/**
+ * \brief Set the conversion rate of the NAU7802 and the matching filter length.
+ * 
+ * The filter's window is set to ::NAU7802_FILTER_WINDOW_MS of conversions at the new rate and its
+ * average is restarted. The first few conversions at the new rate are left out of the filter while
+ * the ADC settles. If the scale is not ready, the rate is applied once bring-up reaches the 
+ * configuration step.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \param rate Enumerated conversion rate. Options are SPS_010, SPS_020, SPS_040, SPS_080, and SPS_320.
+ * 
+ * \return NAU7802_SUCCESS if successful and an error code otherwise.
+ */
+int nau7802_set_conversion_rate(nau7802 scale, conversion_rate rate);
+
+/**
+ * \brief Get the selected conversion rate.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \return The conversion rate.
+ */
+conversion_rate nau7802_get_conversion_rate(nau7802 scale);
+
 /**
  * \brief Calibrate the NAU7802.
  * 
@@ -286,15 +393,48 @@ bool nau7802_data_ready(nau7802 scale);
 /**
  * \brief Read the latest conversion result into dst. If no conversion has ever been read, 0 is returned.
  * 
+ * The conversion is read from RAM. No I2C transactions are made.
+ * 
  * \param scale   Pointer to previously setup scale object
  * \param dst Pointer to 32 bit buffer to store conversion result.  
  * 
- * \return NAU7802_SUCCESS if successful and an error code otherwise.
+ * \return NAU7802_SUCCESS if successful and an error code otherwise. An error is returned if the
+ * scale is not ready.
  */
 int nau7802_read_raw(nau7802 scale, uint32_t * dst);
 
 /**
- * \brief Read the latest conversion result and convert into milligrams.
+ * \brief Read the output of the adaptive filter. This is the value used for all mg reads.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \param dst Pointer to 32 bit buffer to store the filtered conversion result.  
+ * 
+ * \return NAU7802_SUCCESS if successful and an error code otherwise.
+ */
+int nau7802_read_filtered(nau7802 scale, uint32_t * dst);
+
+/**
+ * \brief Get the total number of conversions read. Can be used to check for new samples.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \return The number of conversions read since setup.
+ */
+uint32_t nau7802_sample_count(nau7802 scale);
+
+/**
+ * \brief Read a recent conversion and its time from the ring.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \param age The number of conversions before the latest. 0 is the latest conversion.
+ * \param dst Pointer to the sample the conversion is copied into.
+ * 
+ * \return PICO_ERROR_NONE if successful. PICO_ERROR_INVALID_ARG if the sample is older than the ring 
+ * or hasn't been read yet. PICO_ERROR_GENERIC if the scale isn't ready.
+ */
+int nau7802_read_sample(nau7802 scale, uint8_t age, nau7802_sample * dst);
+
+/**
+ * \brief Read the filtered conversion result and convert into milligrams.
  * 
  * \param scale   Pointer to previously setup scale object
  * \returns The latest conversion shifted by the last zero point and converted to milligrams. 
@@ -302,6 +442,14 @@ int nau7802_read_raw(nau7802 scale, uint32_t * dst);
  */
 int nau7802_read_mg(nau7802 scale);
 
+/**
+ * \brief Read the estimated rate of change of the mass.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \returns The rate of change of the mass in mg/s. 0 if the scale isn't ready.
+ */
+int32_t nau7802_read_rate_mg_s(nau7802 scale);
+
 /**
  * \brief Saves the current conversion result and subtracts this from future reads. 
  * 
@@ -321,7 +469,9 @@ int nau7802_zero(nau7802 scale);
 bool nau7802_at_val_mg(nau7802 scale, int val);
 
 /**
- * Initialize HW and set NAU7802 registers to the default values:
+ * \brief Create a NAU7802 object and start its bring-up.
+ * 
+ * The IC is brought up by ::nau7802_tick with the following default values:
  * - Internal analog power source,
  * - Digital power on,
  * - Analog power on,
@@ -330,17 +480,65 @@ bool nau7802_at_val_mg(nau7802 scale, int val);
  * - Amplifier gain set to 128,
  * - Chop clock off,
  * - Activate PGA filter,
+ * - Conversion rate from ::nau7802_set_conversion_rate (10 SPS by default),
  * - Start conversions.
  * 
+ * The first conversion is used as the origin. The scale's I2C clock is set to ::NAU7802_MAX_BAUDRATE.
+ * 
  * \param nau7802_i2c pointer to desired I2C instance. Should be initalized with i2c_bus_setup
  * \param conversion_factor_mg The conversion factor that takes the raw value and converts it to mg.
  * 
- * \returns Newly created NAU7802 object. 
+ * \returns Newly created NAU7802 object. NULL if memory could not be allocated. 
  */
 nau7802 nau7802_setup(i2c_inst_t * nau7802_i2c, float conversion_factor_mg);
 
+/**
+ * \brief Attach the NAU7802's DRDY pin so each conversion is read once, when it is ready.
+ * 
+ * The pin's rising edge is handled by a deferred \ref gpio_multi_callback so the read runs from
+ * the main loop, not the interrupt.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \param drdy_pin The GPIO attached to the DRDY pin.
+ * \returns PICO_ERROR_NONE if successful. Else an error code.
+ */
+int nau7802_setup_drdy(nau7802 scale, uint8_t drdy_pin);
+
+/**
+ * \brief Run the next step of the scale's bring-up if it is not finished.
+ * 
+ * Each call makes at most a few short I2C transactions and never waits on the IC. Once the scale
+ * is ready, a read of any waiting conversion is queued. Without a DRDY pin, this queues two I2C 
+ * reads per call.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \returns The status of the scale after the step.
+ */
+nau7802_status nau7802_tick(nau7802 scale);
+
+/**
+ * \brief Get the status of the scale's bring-up.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \returns The status of the scale.
+ */
+nau7802_status nau7802_get_status(nau7802 scale);
+
 /** \brief Destroy the passed in scale object. */
 void nau7802_deinit(nau7802 scale);
 
+#ifdef NAU7802_TESTS
+/**
+ * \brief Run the adaptive filter and a moving average over synthetic traces and print the results.
+ * 
+ * The traces are a steady weight, a cup placed on the scale, and a pour, each with noise. The 
+ * noise of the steady weight, the time to settle after the step, and the error while pouring are
+ * compared. The mass rate estimate is then checked against noisy ramps of several rates, with 
+ * both signs of the conversion factor since the shipped load cell's is negative. Finally,
+ * auto-zero is run against a slowly drifting empty scale. Compiled by defining NAU7802_TESTS in header.
+ */
+void nau7802_test();
+#endif
+
 #endif
 /** \} */
\ No newline at end of file
@@ -8,6 +8,16 @@
  * flow and current pressure can be computed. Note that pressure is computed from flow 
  * and may be inaccurate.
  * 
+ * A Kalman filter also estimates the flow by fusing the flow meter pulses, the changes in 
+ * commanded power, and any external flow measurements (e.g. the rate of change of the output 
+ * mass). The estimate reacts faster and is smoother than the windowed flow meter rate. It is 
+ * updated by ::ulka_pump_tick and used for ::ulka_pump_get_pressure_estimate_mbar and 
+ * ::ulka_pump_pressure_mbar_to_power.
+ * 
+ * The same estimate tracks the volume pumped since ::ulka_pump_zero_volume. Since the estimate 
+ * interpolates between flow meter pulses, ::ulka_pump_volume_reached can stop the pump on a 
+ * predicted crossing that accounts for the flow that continues after the pump is switched off.
+ * 
  * \ingroup drivers
  * @{
  * \file
@@ -23,6 +33,9 @@
 #include "utils/phasecontrol.h"
 #include "drivers/flow_meter.h"
 
+//#define ULKA_PUMP_BENCHMARK
+//#define ULKA_PUMP_TESTS
+
 /** \brief Opaque object defining a single Ulka vibratory pump. */
 typedef struct ulka_pump_s* ulka_pump;
 
@@ -50,11 +63,12 @@ ulka_pump ulka_pump_setup(uint8_t zerocross_pin, uint8_t out_pin, int32_t zerocr
  * it is destroyed. 
  * 
  * \param p Previously setup pump that the flow meter will be associated with.
+ * \param pio_num The PIO block (0 or 1) used to timestamp the flow meter's pulses.
  * \param pin_num The digital pin attached to the flow meter.
  * \param ml_per_tick How many ml corresponds with a single pulse from the flowmeter.
  * \return PICO_ERROR_NONE on success. Else and error code is returned. 
  */
-int ulka_pump_setup_flow_meter(ulka_pump p, uint8_t pin_num, float ml_per_tick);
+int ulka_pump_setup_flow_meter(ulka_pump p, uint8_t pio_num, uint8_t pin_num, float ml_per_tick);
 
 /**
  * \brief Set the pump's percent power.
@@ -76,6 +90,18 @@ uint8_t ulka_pump_pwr_percent(ulka_pump p, uint8_t power_percent);
 */
 uint8_t ulka_pump_pressure_to_power(ulka_pump p, const float target_pressure_bar);
 
+/**
+ * \brief Converts a target pressure in mbar into the required power clipped between 0 and 100.
+ * 
+ * Uses the fixed-point lookup tables built when the pump is setup so no floating point math or
+ * search over every linear region is needed. The power is computed at the estimated flow.
+ * 
+ * \param p The ulka_pump object being used
+ * \param target_pressure_mbar The pressure that is being targeted in mbar
+ * \returns The pump power required to reach the target pressure, clipped between 0 and 100. 
+*/
+uint8_t ulka_pump_pressure_mbar_to_power(ulka_pump p, int32_t target_pressure_mbar);
+
 /**
  * \brief Turns the pump off.
  * 
@@ -117,6 +143,14 @@ uint8_t ulka_pump_get_pwr(ulka_pump p);
  */
 float ulka_pump_get_flow_ml_s(ulka_pump p);
 
+/**
+ * \brief Return the flowrate of the pump in ul/s.
+ * 
+ * \param p A previously setup pump struct with a configured flow meter.
+ * \return the current flow rate in ul/s if the flow meter is configured. Else 0.
+ */
+int32_t ulka_pump_get_flow_ul_s(ulka_pump p);
+
 /**
  * \brief Return the pressure of the pump.
  * 
@@ -125,10 +159,82 @@ float ulka_pump_get_flow_ml_s(ulka_pump p);
  * at powers.
  * 
  * \param p A previously setup pump struct with a configured flow meter.
- * \return the current pressure in millibar if the flow meter has been configured. Else 0.
+ * \return the current pressure in bar if the flow meter has been configured. Else 0.
  */
 float ulka_pump_get_pressure_bar(ulka_pump p);
 
+/**
+ * \brief Return the pressure of the pump in mbar.
+ * 
+ * Integer version of ::ulka_pump_get_pressure_bar that reads the precomputed pressure LUT.
+ * 
+ * \param p A previously setup pump struct with a configured flow meter.
+ * \return the current pressure in mbar if the flow meter has been configured. Else 0.
+ */
+int32_t ulka_pump_get_pressure_mbar(ulka_pump p);
+
+/**
+ * \brief Update the pump's flow estimate with the latest flow meter reading.
+ * 
+ * Should be called once per control loop before reading any estimates.
+ * 
+ * \param p A previously setup pump struct with a configured flow meter.
+ */
+void ulka_pump_tick(ulka_pump p);
+
+/**
+ * \brief Fuse an external flow measurement into the pump's flow estimate.
+ * 
+ * \param p A previously setup pump struct with a configured flow meter.
+ * \param flow_ul_s The measured flow in ul/s.
+ * \param var The variance of the measurement in (ul/s)^2.
+ */
+void ulka_pump_add_flow_measurement(ulka_pump p, int32_t flow_ul_s, uint32_t var);
+
+/**
+ * \brief Return the estimated flowrate of the pump.
+ * 
+ * \param p A previously setup pump struct with a configured flow meter.
+ * \return The estimated flow in ul/s if the flow meter is configured. Else 0.
+ */
+int32_t ulka_pump_get_flow_estimate_ul_s(ulka_pump p);
+
+/**
+ * \brief Return the pressure of the pump computed from the estimated flow.
+ * 
+ * \param p A previously setup pump struct with a configured flow meter.
+ * \return The estimated pressure in mbar if the flow meter is configured. Else 0.
+ */
+int32_t ulka_pump_get_pressure_estimate_mbar(ulka_pump p);
+
+/**
+ * \brief Return the estimated volume pumped since the last call to ::ulka_pump_zero_volume.
+ * 
+ * \param p A previously setup pump struct with a configured flow meter.
+ * \return The estimated volume in ul if the flow meter is configured. Else 0.
+ */
+int32_t ulka_pump_get_volume_estimate_ul(ulka_pump p);
+
+/**
+ * \brief Zero the flow meter and the estimated volume. The flow estimate is kept.
+ * 
+ * \param p A previously setup pump struct with a configured flow meter.
+ */
+void ulka_pump_zero_volume(ulka_pump p);
+
+/**
+ * \brief Check if the pumped volume will reach a target if the pump is switched off now.
+ * 
+ * The estimated volume is extrapolated by the estimated flow over \p lag_ms. This accounts for
+ * the water that continues through the flow meter after the pump is switched off.
+ * 
+ * \param p A previously setup pump struct with a configured flow meter.
+ * \param target_ul The target volume in ul.
+ * \param lag_ms The time between switching the pump off and the flow stopping in ms.
+ * \return True if the predicted volume is at or above the target. False if not or no flow meter.
+ */
+bool ulka_pump_volume_reached(ulka_pump p, int32_t target_ul, uint32_t lag_ms);
+
 /**
  * \brief Check if pump is locked.
  * 
@@ -144,5 +250,27 @@ bool ulka_pump_is_locked(ulka_pump p);
  */
 void ulka_pump_deinit(ulka_pump p);
 
+#ifdef ULKA_PUMP_BENCHMARK
+/**
+ * \brief Compare the fixed-point pressure model against the original floating point model.
+ * 
+ * Prints the cycles per call of both implementations and the maximum error of the fixed-point
+ * version over a sweep of power, flow, and pressure. Compiled by defining ULKA_PUMP_BENCHMARK in header.
+ */
+void ulka_pump_benchmark();
+#endif
+
+#ifdef ULKA_PUMP_TESTS
+/**
+ * \brief Dose a set of target volumes against a simulated pulse train and print the results.
+ * 
+ * Each case runs the pump at a constant flow and switches it off once ::ulka_pump_volume_reached
+ * is true. The simulated flow continues for a fixed shutoff delay. The dispensed volume is 
+ * compared to the target and to stopping on the first pulse past the target. Compiled by 
+ * defining ULKA_PUMP_TESTS in header.
+ */
+void ulka_pump_test();
+#endif
+
 #endif
 /** @} */
\ No newline at end of file
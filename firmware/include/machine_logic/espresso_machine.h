@@ -11,7 +11,13 @@
  * -# Update pump: Set the pumps power setting according to the switch state and/or autobrew routine.
  * -# Update LEDs: Set the LEDs to display the correct information given the machine context. 
  * 
- * Each of these 5 steps are run each time ::espresso_machine_tick is called. 
+ * Each of these 5 steps are run each time ::espresso_machine_tick is called. Each shot pulled is
+ * also summarized in the \ref shot_log, before the LEDs are updated.
+ * 
+ * Setup does not wait on the scale or thermometers. Their bring-up is advanced by each tick before
+ * the steps above so the boiler can be controlled as soon as its thermometer reports. The boiler
+ * is held off while its thermometer is starting and shut down if it degrades. A degraded scale
+ * never fires the mass triggers so autobrew legs fall back to their timeouts.
  * 
  * \{
  * \file
@@ -48,6 +54,7 @@ typedef struct {
 typedef struct {
     uint16_t setpoint;    /**< \brief Current setpoint of the boiler. */
     int16_t temperature;  /**< \brief Current temperature of the boiler. */
+    int16_t group_temperature; /**< \brief Current temperature of the group head. 0 if no sensor is fitted. */
     uint8_t power_level;  /**< \brief Current power level applied to the boiler. */
     uint16_t error_sum;   /**< \brief Current error sum of the boiler's controller. */
     uint16_t error_slope; /**< \brief Current error slope of the boiler's controller. */
@@ -70,9 +77,22 @@ typedef struct {
  * \brief The current state of a scale.
  */
 typedef struct {
-    int32_t val_mg; /**< \brief Value of the scale in mg. */
+    int32_t val_mg;    /**< \brief Value of the scale in mg. */
+    int32_t rate_mg_s; /**< \brief Rate of change of the scale in mg/s (i.e. the output flow during a shot). */
 } espresso_machine_scale_state;
 
+/**
+ * \brief The status of the machine's slower peripherals. 
+ * 
+ * These are brought up in the background after ::espresso_machine_setup returns. Each value is 0
+ * while starting, 1 once ready, and 2 if degraded (see ::lmt01_status and ::nau7802_status).
+ */
+typedef struct {
+    uint8_t scale;         /**< \brief Status of the scale's ADC. */
+    uint8_t boiler_thermo; /**< \brief Status of the boiler thermometer. */
+    uint8_t group_thermo;  /**< \brief Status of the group head thermometer. Always starting if no sensor is fitted. */
+} espresso_machine_driver_state;
+
 /**
  * \brief The full state of a single boiler espresso machine.
  */
@@ -81,6 +101,7 @@ typedef struct {
     espresso_machine_boiler_state boiler;   /**< \brief State of espresso machine boiler */
     espresso_machine_pump_state pump;       /**< \brief State of espresso machine pump */
     espresso_machine_scale_state scale;     /**< \brief State of espresso machine scale */
+    espresso_machine_driver_state drivers;  /**< \brief Status of the slower peripherals */
     uint8_t autobrew_leg;                   /**< \brief Current leg of the autobrew routine or 0 if not running */
 } espresso_machine_state;
 
@@ -100,10 +121,12 @@ int espresso_machine_setup(espresso_machine_viewer * state_viewer);
  * \brief Tick the espresso machine.
  * 
  * This takes the following steps:
+ * -# Advance the peripheral bring-up
  * -# Read the switch state
  * -# Update the machine settings
  * -# Update the boiler
  * -# Update the pump
+ * -# Update the shot log
  * -# Update the LEDs
  * These functions populate the state_viewer passed into the setup function.
  */
@@ -15,13 +15,25 @@
  *  
  * Finally, the library also saves and loads the machine settings. Any changes made to the profile 
  * must be manually saved with a similar process. However, the current state of the settings is 
- * maintained between startups. 
+ * maintained between startups. Saves are queued on the I2C bus so adjusting a setting never 
+ * stalls the main loop. Only the settings that changed are written, once they have been left
+ * alone for a moment or the settings tree returns to root, so repeated adjustments of one setting
+ * cost a single small write.
+ * 
+ * The current settings and each profile are stored in fixed size blocks followed by a header with
+ * a magic number, the layout version, and a CRC of each block. At startup only the CRC of the 
+ * current settings is checked. Their values are range checked (and reset to defaults if invalid)
+ * only if it doesn't match. Profiles are checked the same way when loaded. If the header holds an 
+ * older layout version, or is missing as in the first layout, the blocks are converted in place 
+ * by a table of migrations before anything is read, so adding or reordering a ::setting_id 
+ * doesn't scramble the saved settings. A header from newer firmware is left untouched and the 
+ * defaults are used, without saving any changes, so downgrading never overwrites newer settings.
  * @{
  * 
  * \file machine_settings.h
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief Machine Settings header
- * \version 1.0
+ * \version 1.7
  * \date 2023-07-01
  */
 
@@ -31,12 +43,22 @@
 #include "pico/stdlib.h"         // Typedefs
 #include "drivers/mb85_fram.h"   // FRAM memory driver to store settings
 
+//#define MACHINE_SETTINGS_TESTS
+
 #define NUM_AUTOBREW_LEGS 9           /**<\brief The max number of autobrew legs in the settings. */
-#define NUM_AUTOBREW_PARAMS_PER_LEG 7 /**<\brief The number of settings per autobrew leg. */
+#define NUM_AUTOBREW_PARAMS_PER_LEG 8 /**<\brief The number of settings per autobrew leg. */
+
+/** \brief Value of ::machine_settings_get_profile when the settings don't match a profile. */
+#define MACHINE_SETTINGS_NO_PROFILE 0xFF
 
 typedef int16_t machine_setting; /**< \brief Generic machine setting field with range from 0 to 65535 */
 
-/** \brief Enumerated list naming the indicies of the settings array. */
+/** 
+ * \brief Enumerated list naming the indicies of the settings array. 
+ * 
+ * The IDs are the order of the settings in the FRAM. Adding, removing, or moving one needs a new
+ * layout version with a migration in machine_settings.c, or the saved settings are scrambled.
+ */
 typedef enum {
     MS_TEMP_BREW_10C = 0,             /**<\brief The temp for brew and autobrew mode. */
     MS_TEMP_HOT_10C,                  /**<\brief The temp for hot-water mode. */
@@ -45,12 +67,14 @@ typedef enum {
     MS_WEIGHT_YIELD_10g,              /**<\brief The target yield. */
     MS_POWER_BREW_PER,                /**<\brief Pump power while in brew mode. */
     MS_POWER_HOT_PER,                 /**<\brief Pump power while in hot-water mode. */
+    MS_VOLUME_HOT_ml,                 /**<\brief Volume dispensed in hot-water mode. Set to 0 to run until switched off. */
     MS_A1_REF_STYLE_ENM,              /**<\brief The reference style (PWR, FLOW, or PRSR) for autobrew leg 1. */
     MS_A1_REF_START_per_100mlps_10bar,/**<\brief The starting reference for autobrew leg 1. If percent, use directly. If flow, divide by 100 for ml/s. If pressure, divide by 10 for bar. */
     MS_A1_REF_END_per_100mlps_10bar,  /**<\brief The ending reference for autobrew leg 1. If percent, use directly. If flow, divide by 100 for ml/s. If pressure, divide by 10 for bar. */
     MS_A1_TRGR_FLOW_100mlps,          /**<\brief Flow that triggers autobrew leg 1 to end. Set to 0 to disable. */
     MS_A1_TRGR_PRSR_10bar,            /**<\brief Pressure that triggers autobrew leg 1 to end. Set to 0 to disable. */
     MS_A1_TRGR_MASS_10g,              /**<\brief Weight that triggers autobrew leg 1 to end. Set to 0 to disable. */
+    MS_A1_TRGR_VOL_ml,                /**<\brief Pumped volume that triggers autobrew leg 1 to end. Set to 0 to disable. */
     MS_A1_TIMEOUT_10s,                /**<\brief Time that triggers autobrew leg 1 to end. Set to 0 to disable leg. */
     MS_A2_REF_STYLE_ENM,              /**<\brief The reference style (PWR, FLOW, or PRSR) for autobrew leg 2. */
     MS_A2_REF_START_per_100mlps_10bar,/**<\brief The starting reference for autobrew leg 2. If percent, use directly. If flow, divide by 100 for ml/s. If pressure, divide by 10 for bar. */
@@ -58,6 +82,7 @@ typedef enum {
     MS_A2_TRGR_FLOW_100mlps,          /**<\brief Flow that triggers autobrew leg 2 to end. Set to 0 to disable. */
     MS_A2_TRGR_PRSR_10bar,            /**<\brief Pressure that triggers autobrew leg 2 to end. Set to 0 to disable. */
     MS_A2_TRGR_MASS_10g,              /**<\brief Weight that triggers autobrew leg 2 to end. Set to 0 to disable. */
+    MS_A2_TRGR_VOL_ml,                /**<\brief Pumped volume that triggers autobrew leg 2 to end. Set to 0 to disable. */
     MS_A2_TIMEOUT_10s,                /**<\brief Time that triggers autobrew leg 2 to end. Set to 0 to disable leg. */
     MS_A3_REF_STYLE_ENM,              /**<\brief The reference style (PWR, FLOW, or PRSR) for autobrew leg 3. */
     MS_A3_REF_START_per_100mlps_10bar,/**<\brief The starting reference for autobrew leg 3. If percent, use directly. If flow, divide by 100 for ml/s. If pressure, divide by 10 for bar. */
@@ -65,6 +90,7 @@ typedef enum {
     MS_A3_TRGR_FLOW_100mlps,          /**<\brief Flow that triggers autobrew leg 3 to end. Set to 0 to disable. */
     MS_A3_TRGR_PRSR_10bar,            /**<\brief Pressure that triggers autobrew leg 3 to end. Set to 0 to disable. */
     MS_A3_TRGR_MASS_10g,              /**<\brief Weight that triggers autobrew leg 3 to end. Set to 0 to disable. */
+    MS_A3_TRGR_VOL_ml,                /**<\brief Pumped volume that triggers autobrew leg 3 to end. Set to 0 to disable. */
     MS_A3_TIMEOUT_10s,                /**<\brief Time that triggers autobrew leg 3 to end. Set to 0 to disable leg. */
     MS_A4_REF_STYLE_ENM,              /**<\brief The reference style (PWR, FLOW, or PRSR) for autobrew leg 4. */
     MS_A4_REF_START_per_100mlps_10bar,/**<\brief The starting reference for autobrew leg 4. If percent, use directly. If flow, divide by 100 for ml/s. If pressure, divide by 10 for bar. */
@@ -72,6 +98,7 @@ typedef enum {
     MS_A4_TRGR_FLOW_100mlps,          /**<\brief Flow that triggers autobrew leg 4 to end. Set to 0 to disable. */
     MS_A4_TRGR_PRSR_10bar,            /**<\brief Pressure that triggers autobrew leg 4 to end. Set to 0 to disable. */
     MS_A4_TRGR_MASS_10g,              /**<\brief Weight that triggers autobrew leg 4 to end. Set to 0 to disable. */
+    MS_A4_TRGR_VOL_ml,                /**<\brief Pumped volume that triggers autobrew leg 4 to end. Set to 0 to disable. */
     MS_A4_TIMEOUT_10s,                /**<\brief Time that triggers autobrew leg 4 to end. Set to 0 to disable leg. */
     MS_A5_REF_STYLE_ENM,              /**<\brief The reference style (PWR, FLOW, or PRSR) for autobrew leg 5. */
     MS_A5_REF_START_per_100mlps_10bar,/**<\brief The starting reference for autobrew leg 5. If percent, use directly. If flow, divide by 100 for ml/s. If pressure, divide by 10 for bar. */
@@ -79,6 +106,7 @@ typedef enum {
     MS_A5_TRGR_FLOW_100mlps,          /**<\brief Flow that triggers autobrew leg 5 to end. Set to 0 to disable. */
     MS_A5_TRGR_PRSR_10bar,            /**<\brief Pressure that triggers autobrew leg 5 to end. Set to 0 to disable. */
     MS_A5_TRGR_MASS_10g,              /**<\brief Weight that triggers autobrew leg 5 to end. Set to 0 to disable. */
+    MS_A5_TRGR_VOL_ml,                /**<\brief Pumped volume that triggers autobrew leg 5 to end. Set to 0 to disable. */
     MS_A5_TIMEOUT_10s,                /**<\brief Time that triggers autobrew leg 5 to end. Set to 0 to disable leg. */
     MS_A6_REF_STYLE_ENM,              /**<\brief The reference style (PWR, FLOW, or PRSR) for autobrew leg 6. */
     MS_A6_REF_START_per_100mlps_10bar,/**<\brief The starting reference for autobrew leg 6. If percent, use directly. If flow, divide by 100 for ml/s. If pressure, divide by 10 for bar. */
@@ -86,6 +114,7 @@ typedef enum {
     MS_A6_TRGR_FLOW_100mlps,          /**<\brief Flow that triggers autobrew leg 6 to end. Set to 0 to disable. */
     MS_A6_TRGR_PRSR_10bar,            /**<\brief Pressure that triggers autobrew leg 6 to end. Set to 0 to disable. */
     MS_A6_TRGR_MASS_10g,              /**<\brief Weight that triggers autobrew leg 6 to end. Set to 0 to disable. */
+    MS_A6_TRGR_VOL_ml,                /**<\brief Pumped volume that triggers autobrew leg 6 to end. Set to 0 to disable. */
     MS_A6_TIMEOUT_10s,                /**<\brief Time that triggers autobrew leg 6 to end. Set to 0 to disable leg. */
     MS_A7_REF_STYLE_ENM,              /**<\brief The reference style (PWR, FLOW, or PRSR) for autobrew leg 7. */
     MS_A7_REF_START_per_100mlps_10bar,/**<\brief The starting reference for autobrew leg 7. If percent, use directly. If flow, divide by 100 for ml/s. If pressure, divide by 10 for bar. */
@@ -93,6 +122,7 @@ typedef enum {
     MS_A7_TRGR_FLOW_100mlps,          /**<\brief Flow that triggers autobrew leg 7 to end. Set to 0 to disable. */
     MS_A7_TRGR_PRSR_10bar,            /**<\brief Pressure that triggers autobrew leg 7 to end. Set to 0 to disable. */
     MS_A7_TRGR_MASS_10g,              /**<\brief Weight that triggers autobrew leg 7 to end. Set to 0 to disable. */
+    MS_A7_TRGR_VOL_ml,                /**<\brief Pumped volume that triggers autobrew leg 7 to end. Set to 0 to disable. */
     MS_A7_TIMEOUT_10s,                /**<\brief Time that triggers autobrew leg 7 to end. Set to 0 to disable leg. */
     MS_A8_REF_STYLE_ENM,              /**<\brief The reference style (PWR, FLOW, or PRSR) for autobrew leg 8. */
     MS_A8_REF_START_per_100mlps_10bar,/**<\brief The starting reference for autobrew leg 8. If percent, use directly. If flow, divide by 100 for ml/s. If pressure, divide by 10 for bar. */
@@ -100,6 +130,7 @@ typedef enum {
     MS_A8_TRGR_FLOW_100mlps,          /**<\brief Flow that triggers autobrew leg 8 to end. Set to 0 to disable. */
     MS_A8_TRGR_PRSR_10bar,            /**<\brief Pressure that triggers autobrew leg 8 to end. Set to 0 to disable. */
     MS_A8_TRGR_MASS_10g,              /**<\brief Weight that triggers autobrew leg 8 to end. Set to 0 to disable. */
+    MS_A8_TRGR_VOL_ml,                /**<\brief Pumped volume that triggers autobrew leg 8 to end. Set to 0 to disable. */
     MS_A8_TIMEOUT_10s,                /**<\brief Time that triggers autobrew leg 8 to end. Set to 0 to disable leg. */
     MS_A9_REF_STYLE_ENM,              /**<\brief The reference style (PWR, FLOW, or PRSR) for autobrew leg 9. */
     MS_A9_REF_START_per_100mlps_10bar,/**<\brief The starting reference for autobrew leg 9. If percent, use directly. If flow, divide by 100 for ml/s. If pressure, divide by 10 for bar. */
@@ -107,6 +138,7 @@ typedef enum {
     MS_A9_TRGR_FLOW_100mlps,          /**<\brief Flow that triggers autobrew leg 9 to end. Set to 0 to disable. */
     MS_A9_TRGR_PRSR_10bar,            /**<\brief Pressure that triggers autobrew leg 9 to end. Set to 0 to disable. */
     MS_A9_TRGR_MASS_10g,              /**<\brief Weight that triggers autobrew leg 9 to end. Set to 0 to disable. */
+    MS_A9_TRGR_VOL_ml,                /**<\brief Pumped volume that triggers autobrew leg 9 to end. Set to 0 to disable. */
     MS_A9_TIMEOUT_10s,                /**<\brief Time that triggers autobrew leg 9 to end. Set to 0 to disable leg. */
     NUM_SETTINGS,                     /**<\brief The number of settings that are managed. */
     MS_UI_MASK                        /**<\brief ui mask for flashing values on LEDs */
@@ -127,7 +159,9 @@ typedef enum {
     MS_CMD_SUBFOLDER_3 = '3', /**<\brief Enter subfolder 3. */
     MS_CMD_ROOT = 'r',        /**<\brief Go to root folder. */
     MS_CMD_UP = 'u',          /**<\brief Go up a level. */ 
-    MS_CMD_PRINT = 'p'        /**<\brief Print current settings. */
+    MS_CMD_PRINT = 'p',       /**<\brief Print current settings. */
+    MS_CMD_I2C_TRACE = 'i',   /**<\brief Print and restart the I2C bus trace. Needs I2C_BUS_TRACE in i2c_bus.h. */
+    MS_CMD_SHOT_LOG = 'l'     /**<\brief Print the shot log, newest first (see \ref shot_log). */
 } setting_command;
 
 /** \brief Initialize the settings and attach to memory device. 
@@ -142,6 +176,13 @@ void machine_settings_setup(mb85_fram mem);
 */
 machine_setting machine_settings_get(setting_id id);
 
+/**
+ * \brief Get the profile the current settings were last loaded from or saved to.
+ * \returns The profile number or ::MACHINE_SETTINGS_NO_PROFILE if a setting has changed since 
+ * (or no profile has been used since startup).
+ */
+uint8_t machine_settings_get_profile();
+
 /**
  * \brief Navigates the internal setting's tree and updates values accordingly.
  * 
@@ -165,5 +206,19 @@ int machine_settings_print();
  * \return PICO_ERROR_NONE if library is setup. Else PICO_ERROR_GENERIC.
  */
 int machine_settings_print_local_ui();
+
+#ifdef MACHINE_SETTINGS_TESTS
+/**
+ * \brief Boot the settings against an emulated 32 KiB MB85 FRAM on i2c0 and print the results.
+ * 
+ * Checks a blank FRAM, the migration of an image in the old 70-setting layout (current settings
+ * and profiles), that a second boot writes nothing, that a header from newer firmware is left 
+ * untouched, and the range check after a CRC mismatch. The setup clears the screen, so the results
+ * are printed once every test has run. Requires I2C_BUS_EMULATION. i2c0 must have been setup and 
+ * the settings must not be in use. They are detached when the tests finish. Compiled by defining
+ * MACHINE_SETTINGS_TESTS in header.
+ */
+void machine_settings_test();
+#endif
 #endif
 /** @} */
\ No newline at end of file
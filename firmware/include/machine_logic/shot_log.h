@@ -0,0 +1,158 @@
+/**
+ * \defgroup shot_log Shot Log Library
+ * \ingroup machine_logic
+ *
+ * \brief Persistent, circular log of shot summaries kept in the MB85 FRAM.
+ *
+ * Each shot is summarized in a fixed size ::shot_log_record (mode, profile, duration, yield,
+ * volume, peak pressure, and boiler temperature stats). The records are stored in a ring of slots
+ * starting after a small header at ::SHOT_LOG_START_ADDR. The header holds the slot of the next
+ * record, the number of records, and the next shot number, so appending writes one record and the
+ * header and never searches the log. Once full, the oldest record is overwritten. FRAM doesn't
+ * wear under repeated writes so the header is simply rewritten in place.
+ *
+ * A shot is recorded by calling ::shot_log_start when the pump is switched on, ::shot_log_update
+ * each tick while it runs, and ::shot_log_finish once it stops. Shots shorter than
+ * ::SHOT_LOG_MIN_DURATION_MS (e.g. flushes) are not logged. Writes are queued on the I2C bus.
+ *
+ * Records are read newest first with ::shot_log_read. ::shot_log_print starts printing the log
+ * to the standard output one record per call of ::shot_log_tick so a long log never stalls the
+ * main loop.
+ *
+ * \{
+ * \file shot_log.h
+ * \author Richard Hall (hallboyone@icloud.com)
+ * \brief Shot Log header
+ * \version 0.4
+ * \date 2026-10-18
+ */
+
+#ifndef SHOT_LOG_H
+#define SHOT_LOG_H
+
+#include "pico/stdlib.h"
+#include "drivers/mb85_fram.h"
+
+//#define SHOT_LOG_TESTS
+
+/** \brief FRAM address of the log header. The machine settings, their profiles, and their header end before it. */
+#define SHOT_LOG_START_ADDR 0x0800
+
+/** \brief The most records kept. Fewer are kept if the FRAM is too small. */
+#define SHOT_LOG_MAX_RECORDS 1024
+
+/** \brief Shots shorter than this are not logged. */
+#define SHOT_LOG_MIN_DURATION_MS 2000
+
+/** \brief Profile ID of a shot pulled with settings that don't match a saved profile. */
+#define SHOT_LOG_NO_PROFILE 0xFF
+
+/**
+ * \brief Summary of a single shot as stored in the FRAM.
+ *
+ * The fields are naturally aligned so the record has no padding and the same layout on every target.
+ */
+typedef struct {
+    uint16_t shot_num;             /**< \brief Number of the shot. Counts up from 0 and wraps. */
+    uint8_t mode;                  /**< \brief Mode the shot was pulled in (see ::espresso_machine_modes). */
+    uint8_t profile;               /**< \brief Profile the settings were loaded from or ::SHOT_LOG_NO_PROFILE. */
+    uint16_t duration_100ms;       /**< \brief Duration the pump was on in units of 0.1 s. */
+    int16_t yield_100mg;           /**< \brief Change of the scale over the shot in units of 0.1 g. */
+    uint16_t volume_ml;            /**< \brief Volume pumped in ml. */
+    uint16_t peak_pressure_10mbar; /**< \brief Peak estimated pump pressure in units of 10 mbar. */
+    int16_t temp_min_cC;           /**< \brief Lowest boiler temperature in cC. */
+    int16_t temp_mean_cC;          /**< \brief Mean boiler temperature in cC. */
+    int16_t temp_max_cC;           /**< \brief Highest boiler temperature in cC. */
+    uint8_t reserved;              /**< \brief Unused. Written as 0. */
+    uint8_t check;                 /**< \brief CRC-8 of the preceding bytes. */
+} shot_log_record;
+
+/**
+ * \brief Attach the log to the FRAM and load its header.
+ *
+ * If no valid header is found (e.g. first use, or the FRAM size changed) an empty log is started.
+ *
+ * \param mem The FRAM holding the log. Setup with ::mb85_fram_setup. Can be NULL.
+ * \return PICO_ERROR_NONE if setup. PICO_ERROR_GENERIC if \p mem is NULL, too small, or has no free links. 
+ * Else the I2C error.
+ */
+int shot_log_setup(mb85_fram mem);
+
+/**
+ * \brief Start summarizing a shot.
+ *
+ * \param mode The mode the shot is pulled in.
+ * \param profile The profile of the current settings or ::SHOT_LOG_NO_PROFILE.
+ * \param mass_mg The scale's reading before the shot.
+ */
+void shot_log_start(uint8_t mode, uint8_t profile, int32_t mass_mg);
+
+/**
+ * \brief Add the latest boiler temperature and pump pressure to the running shot. Does nothing
+ * if no shot is running.
+ *
+ * \param temp_cC The boiler temperature in cC.
+ * \param pressure_mbar The estimated pump pressure in mbar.
+ */
+void shot_log_update(int16_t temp_cC, int32_t pressure_mbar);
+
+/**
+ * \brief Finish the running shot and queue its record to be appended to the log.
+ *
+ * \param mass_mg The scale's reading at the end of the shot.
+ * \param volume_ul The volume pumped during the shot in ul.
+ * \return PICO_ERROR_NONE if queued. PICO_ERROR_GENERIC if no shot was running, the log isn't setup, or
+ * the shot was too short. Else the I2C error.
+ */
+int shot_log_finish(int32_t mass_mg, int32_t volume_ul);
+
+/**
+ * \brief Check if a shot is being summarized.
+ *
+ * \return True if ::shot_log_start has been called without a matching ::shot_log_finish.
+ */
+bool shot_log_running();
+
+/**
+ * \brief Get the number of records in the log.
+ *
+ * \return The number of records that can be read with ::shot_log_read.
+ */
+uint16_t shot_log_count();
+
+/**
+ * \brief Read a record from the log.
+ *
+ * \param age The age of the record with 0 being the newest.
+ * \param dst Pointer to where the record is copied.
+ * \return PICO_ERROR_NONE on success. PICO_ERROR_INVALID_ARG if there are not more than \p age records.
+ * PICO_ERROR_IO if the record failed its check. Else the I2C error.
+ */
+int shot_log_read(uint16_t age, shot_log_record * dst);
+
+/**
+ * \brief Start printing the log, newest first, to the standard output. The records are printed
+ * by ::shot_log_tick.
+ */
+void shot_log_print();
+
+/**
+ * \brief Print the next record if the log is being printed.
+ */
+void shot_log_tick();
+
+#ifdef SHOT_LOG_TESTS
+/**
+ * \brief Run the log against an emulated 32 KiB MB85 FRAM on i2c0 and print the results.
+ *
+ * Checks the capacity of a blank FRAM, that short shots are skipped, the fields and raw layout of
+ * a record, that the log is found again after a reboot, the wrap after 1032 shots, and that a
+ * corrupted record is rejected. Finally, setup is run with too few free FRAM links and must
+ * free the ones it made. Shot durations are faked so the tests take no real shot time.
+ * Requires I2C_BUS_EMULATION. i2c0 must have been setup and the log must not be in use. It is
+ * detached when the tests finish. Compiled by defining SHOT_LOG_TESTS in header.
+ */
+void shot_log_test();
+#endif
+#endif
+/** \} */
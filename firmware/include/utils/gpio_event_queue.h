@@ -0,0 +1,110 @@
+/**
+ * \defgroup gpio_event_queue GPIO Event Queue Library
+ * \ingroup utils
+ * \version 0.2
+ * 
+ * \brief Lock-free single-producer/single-consumer ring of GPIO events.
+ * 
+ * Lets an interrupt record a GPIO event (pin, event mask, and time) in a few tens of cycles so the
+ * work triggered by the event can be done later from the main loop. Exactly one context may push
+ * (e.g. the GPIO IRQ) and exactly one context may pop (e.g. the main loop). No locks or disabled
+ * interrupts are needed; the producer and consumer each own one index and publish it with 
+ * release/acquire ordering.
+ * 
+ * If the queue is full, the oldest unread event is overwritten and counted as dropped when the
+ * consumer next pops. The newest events are the ones kept since consumers like AC zero-cross
+ * phase control need the most recent edge, not a stale one. 
+ * 
+ * \{
+ * 
+ * \file gpio_event_queue.h
+ * \author Richard Hall (hallboyone@icloud.com)
+ * \brief GPIO Event Queue header
+ * \version 0.2
+ * \date 2026-10-18
+ */
+#ifndef GPIO_EVENT_QUEUE_H
+#define GPIO_EVENT_QUEUE_H
+
+#include "pico/stdlib.h"
+
+//#define GPIO_EVENT_QUEUE_TESTS
+
+/** \brief A single GPIO event. */
+typedef struct {
+    uint32_t timestamp_us; /**< \brief Low 32 bits of the time of the event in us since boot. */
+    uint8_t gpio;          /**< \brief GPIO number that generated the event. */
+    uint8_t events;        /**< \brief The GPIO events (e.g. GPIO_IRQ_EDGE_RISE) that occurred. */
+} gpio_event;
+
+/** \brief Opaque object defining a single SPSC queue of GPIO events. */
+typedef struct gpio_event_queue_s * gpio_event_queue;
+
+/**
+ * \brief Setup a new, empty queue.
+ * 
+ * \param capacity_pow2 The queue keeps the newest 2^capacity_pow2 - 1 events. Must be between 1 and 15.
+ * \return A new gpio_event_queue object. NULL on error.
+ */
+gpio_event_queue gpio_event_queue_setup(uint8_t capacity_pow2);
+
+/**
+ * \brief Add an event to the queue. Only call from the producer context.
+ * 
+ * Never fails. If the queue is full, the oldest unread event is overwritten.
+ * 
+ * \param q The queue to add to.
+ * \param e The event to copy into the queue.
+ */
+void gpio_event_queue_push(gpio_event_queue q, const gpio_event * e);
+
+/**
+ * \brief Remove the oldest event from the queue. Only call from the consumer context.
+ * 
+ * Events overwritten since the last pop are skipped and added to the dropped count.
+ * 
+ * \param q The queue to remove from.
+ * \param e Location the event is copied into.
+ * \return True if an event was removed. False if the queue was empty.
+ */
+bool gpio_event_queue_pop(gpio_event_queue q, gpio_event * e);
+
+/**
+ * \brief Number of events currently waiting in the queue.
+ * 
+ * \param q The queue to check.
+ * \return The number of events in the queue.
+ */
+uint32_t gpio_event_queue_size(gpio_event_queue q);
+
+/**
+ * \brief Number of events overwritten because the queue was full.
+ * 
+ * Only updated by ::gpio_event_queue_pop, so it lags until the consumer catches up.
+ * 
+ * \param q The queue to check.
+ * \return The total number of dropped events.
+ */
+uint32_t gpio_event_queue_dropped(gpio_event_queue q);
+
+/**
+ * \brief Destroys a gpio_event_queue object. Neither side may be using the queue.
+ * 
+ * \param q The queue to destroy.
+ */
+void gpio_event_queue_deinit(gpio_event_queue q);
+
+#ifdef GPIO_EVENT_QUEUE_TESTS
+/**
+ * \brief Stress test the queue with a timer interrupt as the producer and print the results.
+ * 
+ * A repeating timer pushes sequence numbers every few microseconds while the main loop pops
+ * them. Every popped event must be the next expected sequence number once drops are accounted for.
+ * The queue is then overfilled to check that the oldest events are the ones dropped.
+ * Compiled by defining GPIO_EVENT_QUEUE_TESTS in header.
+ */
+void gpio_event_queue_test();
+#endif
+
+#endif
+/** \} */
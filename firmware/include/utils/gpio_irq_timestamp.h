@@ -4,12 +4,15 @@
  * 
  * These times can be read by the program later. Useful for debouncing, for example.
  * 
+ * The IRQ only queues the event (see ::gpio_multi_callback_attach_deferred). Queued events are
+ * processed when a timestamp is read, so reads must be made from the main loop.
+ * 
  * @{
  * 
  * \file gpio_irq_timestamp.h
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief GPIO IRQ Timestamp header
- * \version 0.1
+ * \version 0.2
  * \date 2023-01-24
  */
 #ifndef GPIO_IRQ_TIMESTAMP_H
@@ -23,7 +26,8 @@
  *
  * \param gpio GPIO number to setup (<32)
  * \param events Either GPIO_IRQ_EDGE_FALL or GPIO_IRQ_EDGE_RISE
- * \return PICO_ERROR_INVALID_ARG if invalid argument passed in. Else PICO_ERROR_NONE 
+ * \return PICO_ERROR_INVALID_ARG if invalid argument passed in. PICO_ERROR_GENERIC if the event
+ * could not be queued. Else PICO_ERROR_NONE 
  */
 int gpio_irq_timestamp_setup(uint8_t gpio, uint32_t events);
 
@@ -11,12 +11,17 @@
  * pico SDK. If one component of your firmware uses this library, all components should use
  * it.
  * 
+ * Callbacks can either run in the IRQ or be deferred. Deferred callbacks cost the IRQ only a 
+ * timestamp and a push to a \ref gpio_event_queue. They are run from the main loop by
+ * ::gpio_multi_callback_process_deferred with the time the event occurred. Only use immediate 
+ * callbacks for work that cannot wait for the next loop (e.g. scheduling phase-control outputs).
+ * 
  * \{
  * 
  * \file gpio_multi_callback.h
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief GPIO Multi-Callback header
- * \version 0.2
+ * \version 0.4
  * \date 2023-01-24
 */
 #ifndef GPIO_MULTI_CALLBACK
@@ -27,6 +32,9 @@
 /** \brief A callback function triggered by GPIO events. */
 typedef void (*gpio_multi_callback_t)(uint gpio, uint32_t event, void* data);
 
+/** \brief A deferred callback function. Also receives the low 32 bits of the event time in us since boot. */
+typedef void (*gpio_multi_callback_deferred_t)(uint gpio, uint32_t event, uint32_t timestamp_us, void* data);
+
 /**
  * \brief Attach a callback to a GPIO for specific events
  * 
@@ -42,6 +50,38 @@ typedef void (*gpio_multi_callback_t)(uint gpio, uint32_t event, void* data);
  */
 int gpio_multi_callback_attach(uint8_t gpio, uint32_t event_mask, bool enabled, gpio_multi_callback_t cb, void * data);
 
+/**
+ * \brief Attach a deferred callback to a GPIO for specific events
+ * 
+ * Same as ::gpio_multi_callback_attach except the callback is not run in the IRQ. Instead, the
+ * event is queued and the callback is run by ::gpio_multi_callback_process_deferred.
+ * 
+ * \param gpio The GPIO number to attach to
+ * \param event_mask The events that will trigger interrupt
+ * \param enabled Flag indicating if interrupt should be active
+ * \param cb Pointer to deferred callback function
+ * \param data User data that will be passed to callback function
+ * \return PICO_ERROR_NONE if no error. PICO_ERROR_GENERIC if the event queue could not be created.
+ */
+int gpio_multi_callback_attach_deferred(uint8_t gpio, uint32_t event_mask, bool enabled, 
+                                        gpio_multi_callback_deferred_t cb, void * data);
+
+/**
+ * \brief Run the deferred callbacks for all queued events.
+ * 
+ * Must only be called from the main loop (the single consumer of the event queue). 
+ * 
+ * \return The number of events processed.
+ */
+uint gpio_multi_callback_process_deferred();
+
+/**
+ * \brief Number of deferred events dropped because the queue was full. The oldest events are dropped.
+ * 
+ * \return The total number of dropped events.
+ */
+uint32_t gpio_multi_callback_dropped_events();
+
 /**
  * \brief Enable or disable the interrupt for the given events
  * 
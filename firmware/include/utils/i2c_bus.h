@@ -7,11 +7,47 @@
  * write to bits in register, etc.). This library abstracts this away to simply be calling a 
  * function and passing in the device and register addresses and other needed information.
  * 
+ * Transactions are queued and run by the I2C interrupt so the bus never stalls the main loop. 
+ * The async functions (e.g. ::i2c_bus_write_bytes_async) return as soon as the transaction is 
+ * queued. Its callback is run from the main loop by ::i2c_bus_process_completed once it finishes.
+ * Transactions on a bus always run, and complete, in the order they were queued. The blocking 
+ * functions queue their transaction behind any waiting ones and wait for it to finish.
+ * 
+ * An optional shadow of a device's registers (::i2c_bus_shadow) removes the read from most 
+ * read-modify-writes. Bits the device changes itself (status flags, self-clearing commands) are
+ * marked volatile and are always read from the device. Writes to the other bits use the cached 
+ * value so they take one transaction. Bit fields can also be staged and flushed together so fields
+ * in the same register, or in neighbouring registers, are written at once.
+ * 
+ * Devices can be given their own maximum clock with ::i2c_bus_set_device_baudrate. The bus clock
+ * is switched between transactions whenever the next one targets a device with a different speed.
+ * The timing of each speed is computed once so the switch only writes a few registers. Devices
+ * without a speed use the baudrate passed to ::i2c_bus_setup. 
+ * 
+ * Every transaction has a deadline: its time on the bus at its speed plus the bus's timeout
+ * (::i2c_bus_set_timeout_us). A transaction that misses its deadline, e.g. because EMI left a 
+ * device holding SDA low, is stopped and the bus is cleared with up to 9 SCL pulses and a stop 
+ * before the controller is reset. Failed transactions are retried up to ::I2C_BUS_MAX_RETRIES 
+ * times. Deadlines are checked by ::i2c_bus_process_completed and while a blocking call waits.
+ * The failures of each device are counted (::i2c_bus_get_device_stats).
+ * 
+ * Defining I2C_BUS_TRACE in this header records the count, bytes, time on the bus, and latency
+ * (queued to finished) of the transactions with each device, split into reads and writes, with a
+ * log2 histogram of the latency. ::i2c_bus_trace_print prints it. Without I2C_BUS_TRACE the trace
+ * functions are empty and no time is spent recording.
+ * 
+ * Defining I2C_BUS_EMULATION allows devices to be replaced by emulators 
+ * (::i2c_bus_attach_emulator). Transactions with an emulated device run through the same queue, 
+ * retries, and trace, but are handed to the emulator's read and write functions instead of the 
+ * controller. See \ref i2c_emulator for emulators of the devices on the machine. An emulator can 
+ * also stall mid-transaction and hold SDA low for a number of SCL pulses, so the deadline and bus
+ * clear are exercised too.
+ * 
  * \{
  * \file 
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief I2C Bus header
- * \version 0.1
+ * \version 0.8
  * \date 2022-08-17
  */
 
@@ -21,10 +57,26 @@
 #include "pico/stdlib.h"
 #include "hardware/i2c.h"
 
+//#define I2C_BUS_TRACE
+//#define I2C_BUS_EMULATION
+//#define I2C_BUS_TESTS
+//#define I2C_BUS_BENCHMARK
+
 #define I2C_BUS_SUCCESS 0              /**< \brief Code used to indicate a successful I2C operations */
 #define I2C_BUS_ERROR_WRITE_FAILURE -1 /**< \brief Code used to indicate a failed I2C write operation */
 #define I2C_BUS_ERROR_READ_FAILURE  -2 /**< \brief Code used to indicate a failed I2C read operation */
 #define I2C_BUS_ERROR_CONFIGURATION -3 /**< \brief Code for invalid I2C configuration values */
+#define I2C_BUS_ERROR_QUEUE_FULL    -4 /**< \brief Code used when a transaction could not be queued */
+#define I2C_BUS_ERROR_TIMEOUT       -5 /**< \brief Code used when a transaction missed its deadline */
+
+#define I2C_BUS_QUEUE_LEN 16 /**< \brief Number of transactions that can be queued on each bus. Must be a power of 2. */
+#define I2C_BUS_INLINE_LEN 8 /**< \brief Writes up to this many bytes are copied when queued. */
+#define I2C_BUS_MAX_SPEEDS 4 /**< \brief Number of distinct clock speeds on each bus, including the default. */
+#define I2C_BUS_MAX_RETRIES 2 /**< \brief Number of times a failed transaction is retried. */
+#define I2C_BUS_DEFAULT_TIMEOUT_US 2000 /**< \brief Time a transaction may take beyond its time on the bus. */
+#define I2C_BUS_TRACE_ENTRIES 8 /**< \brief Number of device and direction pairs traced on each bus. */
+#define I2C_BUS_TRACE_BINS 16   /**< \brief Bins of the latency histogram. Bin n counts latencies in [2^(n-1), 2^n) us. */
+#define I2C_BUS_MAX_EMULATORS 4 /**< \brief Number of emulated devices on each bus. */
 
 typedef uint8_t byte;           /**< \brief Type name for a single byte of data */
 typedef uint8_t dev_addr;       /**< \brief Type name for a device address */
@@ -40,11 +92,55 @@ typedef struct{
     uint8_t reg_addr_len; /**< \brief Address space for I2C device */
 } bit_range;
 
+/**
+ * \brief Function called from the main loop when a queued transaction finishes.
+ * 
+ * \param result I2C_BUS_SUCCESS if the transaction succeeded. Else an I2C_BUS error code.
+ * \param data The user data passed when the transaction was queued.
+ */
+typedef void (*i2c_bus_callback_t)(int result, void * data);
+
+/** \brief Failure counts of one device. Counts stop at UINT16_MAX. */
+typedef struct {
+    uint16_t errors;   /**< \brief Transactions that failed after all of their retries. */
+    uint16_t retries;  /**< \brief Attempts repeated after a NACK, abort, or timeout. */
+    uint16_t timeouts; /**< \brief Attempts that missed their deadline. Each one cleared the bus. */
+} i2c_bus_device_stats;
+
+#ifdef I2C_BUS_EMULATION
+/**
+ * \brief Function emulating a read from a device's registers.
+ * 
+ * \param data The user data passed when the emulator was attached.
+ * \param reg The first register address.
+ * \param len The number of registers to read.
+ * \param dst Where the register values are written.
+ * \return I2C_BUS_SUCCESS if the device would ACK the read. Else an I2C_BUS error code. A positive
+ * count if the device stalled mid-transaction and holds SDA low until SCL is pulsed that many times.
+ */
+typedef int (*i2c_bus_emulator_read_t)(void * data, reg_addr reg, uint len, byte * dst);
+
+/**
+ * \brief Function emulating a write to a device's registers.
+ * 
+ * \param data The user data passed when the emulator was attached.
+ * \param reg The first register address.
+ * \param len The number of registers written. 0 if only the address was sent.
+ * \param src The values written.
+ * \return I2C_BUS_SUCCESS if the device would ACK the write. Else an I2C_BUS error code. A positive
+ * count if the device stalled mid-transaction and holds SDA low until SCL is pulsed that many times.
+ */
+typedef int (*i2c_bus_emulator_write_t)(void * data, reg_addr reg, uint len, const byte * src);
+#endif
+
+/** \brief Opaque object holding the shadow of a block of registers on one device. */
+typedef struct i2c_bus_shadow_s * i2c_bus_shadow;
+
 /**
  * \brief Setup a I2C bus attached to the indicated pins.
  * 
  * \param bus Pointer to i2c_inst_t that will be initalized
- * \param baudrate The target baudrate.
+ * \param baudrate The target baudrate. Used for devices without their own speed.
  * \param scl_pin GPIO number for the clock pin
  * \param sda_pin GPIO number for the data pin
  * 
@@ -52,6 +148,45 @@ typedef struct{
  */
 int i2c_bus_setup(i2c_inst_t * bus, uint baudrate, uint8_t scl_pin, uint8_t sda_pin);
 
+/**
+ * \brief Set the clock used for all transactions with a device.
+ * 
+ * Transactions already queued keep the speed they were queued with. Devices sharing a speed 
+ * share its timing so a bus supports up to ::I2C_BUS_MAX_SPEEDS different speeds. 
+ * 
+ * \param bus The I2C instance the device is attached to. Must have been setup.
+ * \param dev The device address. must be less than 0x80.
+ * \param max_baudrate The fastest clock the device (and the bus wiring) supports. Up to 1 MHz.
+ * 
+ * \return I2C_BUS_SUCCESS If successful. I2C_BUS_ERROR_CONFIGURATION if the bus isn't setup, the 
+ * baudrate can't be generated, or there are already ::I2C_BUS_MAX_SPEEDS speeds. The device then 
+ * keeps its previous speed.
+ */
+int i2c_bus_set_device_baudrate(i2c_inst_t * bus, dev_addr dev, uint max_baudrate);
+
+/**
+ * \brief Set how long a transaction may take beyond its time on the bus before it is stopped.
+ * 
+ * Transactions already queued or running keep their deadline.
+ * 
+ * \param bus The I2C instance to configure. Must have been setup.
+ * \param timeout_us The allowed time in us. Defaults to ::I2C_BUS_DEFAULT_TIMEOUT_US.
+ * 
+ * \return I2C_BUS_SUCCESS If successful. I2C_BUS_ERROR_CONFIGURATION if the bus isn't setup.
+ */
+int i2c_bus_set_timeout_us(i2c_inst_t * bus, uint32_t timeout_us);
+
+/**
+ * \brief Get the failure counts of a device.
+ * 
+ * \param bus The I2C instance the device is attached to.
+ * \param dev The device address. must be less than 0x80.
+ * \param stats Set to the device's counts.
+ * 
+ * \return I2C_BUS_SUCCESS If successful. I2C_BUS_ERROR_CONFIGURATION if the bus isn't setup.
+ */
+int i2c_bus_get_device_stats(i2c_inst_t * bus, dev_addr dev, i2c_bus_device_stats * stats);
+
 /**
  * \brief Checks to see if a device at the given address is attached to i2c bus
  * 
@@ -81,7 +216,7 @@ void i2c_bus_set_bits(byte* buf, bit_range bits, uint8_t val);
  * \param reg_addr_len The length of the address in bytes. Allows up to 4 byte (32bit) address spaces
  * \param len The number of registers to read
  * \param dst A pointer to a byte array where the data should be stored. Must be large enough to hold len bytes.
- * \return I2C_BUS_SUCCESS If successful. Else either I2C_BUS_ERROR_WRITE_FAILURE or I2C_BUS_ERROR_READ_FAILURE.
+ * \return I2C_BUS_SUCCESS If successful. Else I2C_BUS_ERROR_WRITE_FAILURE, I2C_BUS_ERROR_READ_FAILURE, or I2C_BUS_ERROR_TIMEOUT.
  */
 int i2c_bus_read_bytes(i2c_inst_t * bus, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, uint len, byte * dst);
 
@@ -94,7 +229,7 @@ int i2c_bus_read_bytes(i2c_inst_t * bus, dev_addr dev, reg_addr reg, uint8_t reg
  * \param reg_addr_len The length of the address in bytes. Allows up to 4 byte (32bit) address spaces
  * \param len The number of registers to read
  * \param src A pointer to a byte array containing the bytes to write.
- * \return I2C_BUS_SUCCESS If successful. Else either I2C_BUS_ERROR_WRITE_FAILURE.
+ * \return I2C_BUS_SUCCESS If successful. Else I2C_BUS_ERROR_WRITE_FAILURE or I2C_BUS_ERROR_TIMEOUT.
  */
 int i2c_bus_write_bytes(i2c_inst_t * bus, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, uint len, byte * src);
 
@@ -121,5 +256,208 @@ int i2c_bus_read_bits(i2c_inst_t * bus, const dev_addr dev, const bit_range bits
  * \return I2C_BUS_SUCCESS If successful. Else either I2C_BUS_ERROR_WRITE_FAILURE or I2C_BUS_ERROR_READ_FAILURE.
  */
 int i2c_bus_write_bits(i2c_inst_t * bus, const dev_addr dev, const bit_range bits, const byte val);
+
+/**
+ * \brief Queue a read of bytes from a register on a device connected to a I2C bus.
+ * 
+ * \param bus The I2C instance the device is attached to.
+ * \param dev The device address. must be less than 0x80.
+ * \param reg The register address on the device.
+ * \param reg_addr_len The length of the address in bytes. Allows up to 4 byte (32bit) address spaces
+ * \param len The number of registers to read
+ * \param dst A pointer to a byte array where the data should be stored. Must be large enough to hold len 
+ * bytes and stay valid until \p cb is called.
+ * \param cb Function called once the read finishes. Can be NULL.
+ * \param data User data passed to \p cb.
+ * \return I2C_BUS_SUCCESS if queued. I2C_BUS_ERROR_QUEUE_FULL or I2C_BUS_ERROR_CONFIGURATION if not.
+ */
+int i2c_bus_read_bytes_async(i2c_inst_t * bus, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, uint len, byte * dst,
+                             i2c_bus_callback_t cb, void * data);
+
+/**
+ * \brief Queue a write of bytes to a register on a device connected to a I2C bus.
+ * 
+ * Up to ::I2C_BUS_INLINE_LEN bytes are copied when queued. Longer writes are sent straight from 
+ * \p src, so it must stay valid until \p cb is called. 
+ * 
+ * \param bus The I2C instance the device is attached to.
+ * \param dev The device address. must be less than 0x80.
+ * \param reg The register address on the device.
+ * \param reg_addr_len The length of the address in bytes. Allows up to 4 byte (32bit) address spaces
+ * \param len The number of registers to write
+ * \param src A pointer to a byte array containing the bytes to write.
+ * \param cb Function called once the write finishes. Can be NULL.
+ * \param data User data passed to \p cb.
+ * \return I2C_BUS_SUCCESS if queued. I2C_BUS_ERROR_QUEUE_FULL or I2C_BUS_ERROR_CONFIGURATION if not.
+ */
+int i2c_bus_write_bytes_async(i2c_inst_t * bus, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, uint len, byte * src,
+                              i2c_bus_callback_t cb, void * data);
+
+/**
+ * \brief Run the callbacks of all finished transactions in the order they were queued.
+ * 
+ * Must only be called from the main loop. Callbacks may queue new transactions or make blocking calls. A running 
+ * transaction past its deadline is stopped and the bus recovered first.
+ * 
+ * \return The number of finished transactions.
+ */
+uint i2c_bus_process_completed();
+
+/**
+ * \brief Check if a bus has no queued or running transactions.
+ * 
+ * \param bus The I2C instance to check.
+ * \return True if the bus is idle. False else.
+ */
+bool i2c_bus_is_idle(i2c_inst_t * bus);
+
+/**
+ * \brief Print the trace of every bus since it was last reset and then reset it.
+ * 
+ * For each device and direction: the number of transactions, bytes sent or received, time on the
+ * bus and its share of the trace's duration, min/mean/max latency, and the latency histogram.
+ * Does nothing unless I2C_BUS_TRACE is defined.
+ */
+void i2c_bus_trace_print();
+
+/**
+ * \brief Clear the trace of every bus. Does nothing unless I2C_BUS_TRACE is defined.
+ */
+void i2c_bus_trace_reset();
+
+#ifdef I2C_BUS_EMULATION
+/**
+ * \brief Replace a device on a bus with an emulator.
+ * 
+ * Transactions with the device that start after this call are run by \p read and \p write. They
+ * are called from wherever the transaction starts (the main loop or the I2C IRQ) and must not 
+ * block. A stalled transaction runs until its deadline and the bus is cleared as if the device 
+ * was real. The device also appears connected to ::i2c_bus_is_connected.
+ * 
+ * \param bus The I2C instance the device is attached to. Must have been setup.
+ * \param dev The device address. must be less than 0x80.
+ * \param read Function run for reads of the device.
+ * \param write Function run for writes to the device.
+ * \param data User data passed to \p read and \p write.
+ * \return I2C_BUS_SUCCESS if attached. I2C_BUS_ERROR_CONFIGURATION if the bus isn't setup or 
+ * already has ::I2C_BUS_MAX_EMULATORS emulators.
+ */
+int i2c_bus_attach_emulator(i2c_inst_t * bus, dev_addr dev, i2c_bus_emulator_read_t read, 
+                            i2c_bus_emulator_write_t write, void * data);
+
+/**
+ * \brief Remove the emulator of a device. The bus must be idle.
+ * 
+ * \param bus The I2C instance the device is attached to.
+ * \param dev The device address.
+ */
+void i2c_bus_detach_emulator(i2c_inst_t * bus, dev_addr dev);
+#endif
+
+#ifdef I2C_BUS_TESTS
+/**
+ * \brief Run the queue against an emulated device on i2c0 and print the results.
+ * 
+ * Checks that interleaved reads and writes run and call back in the order they were queued, that
+ * a blocking call waits behind queued transactions, that a full queue rejects transactions until
+ * it is processed, and that callbacks which queue and block run exactly once. The device then 
+ * NACKs, stalls holding SDA for a few pulses, and holds SDA for good to check the retries, the 
+ * deadline, and the bus clear. i2c0 must have been setup. Requires I2C_BUS_EMULATION. Compiled by
+ * defining I2C_BUS_TESTS in header.
+ */
+void i2c_bus_test();
+#endif
+
+#ifdef I2C_BUS_BENCHMARK
+/**
+ * \brief Measure the throughput of block reads and writes with a device at each speed it supports.
+ * 
+ * Times blocking reads, blocking writes, and reads queued back to back at 100 kHz, 400 kHz, and 
+ * 1 MHz (up to \p max_baudrate) and prints the bytes per second of each next to the bus's ideal.
+ * The writes put back the data read so the device's contents are unchanged. Compiled by defining
+ * I2C_BUS_BENCHMARK in header.
+ * 
+ * \param bus The I2C instance the device is attached to. Must have been setup.
+ * \param dev The device address. must be less than 0x80.
+ * \param reg The register address of the block read and written. Must be writable.
+ * \param reg_addr_len The length of the address in bytes.
+ * \param max_baudrate The fastest clock the device supports. The device is left at this speed.
+ */
+void i2c_bus_benchmark(i2c_inst_t * bus, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, uint max_baudrate);
+#endif
+
+/**
+ * \brief Setup a shadow of a block of single byte registers on a device.
+ * 
+ * Registers are cached the first time they are read or written. The volatile bits of a register 
+ * are never cached and are written as 0 when the register's other bits are written, so they must be
+ * read-only or only act when a 1 is written (e.g. a start calibration bit). Registers with all bits
+ * volatile are not cached at all and use the plain read-modify-write. Flushes write runs of 
+ * neighbouring registers in one transaction so the device must auto-increment its register address.
+ * 
+ * \param bus The I2C instance the device is attached to.
+ * \param dev The device address. must be less than 0x80.
+ * \param first_reg The address of the first register in the block.
+ * \param reg_addr_len The length of the register addresses in bytes.
+ * \param num_regs The number of registers in the block.
+ * \param volatile_bits Mask of the volatile bits of each register in the block. Copied.
+ * \return A new i2c_bus_shadow object. NULL on error.
+ */
+i2c_bus_shadow i2c_bus_shadow_setup(i2c_inst_t * bus, dev_addr dev, reg_addr first_reg, uint8_t reg_addr_len, 
+                                    uint8_t num_regs, const byte * volatile_bits);
+
+/**
+ * \brief Forget every cached register and any staged bits. Call after the device is reset.
+ * 
+ * \param s The shadow to clear.
+ */
+void i2c_bus_shadow_invalidate(i2c_bus_shadow s);
+
+/**
+ * \brief Read a range of bits. Cached bits are read without any I2C transaction.
+ * 
+ * \param s The shadow of the device's registers.
+ * \param bits The range of bits to read from.
+ * \param dst A pointer to a byte where the data will be stored.
+ * \return I2C_BUS_SUCCESS If successful. Else either I2C_BUS_ERROR_WRITE_FAILURE or I2C_BUS_ERROR_READ_FAILURE.
+ */
+int i2c_bus_shadow_read_bits(i2c_bus_shadow s, const bit_range bits, byte * dst);
+
+/**
+ * \brief Stage a write to a range of bits. Nothing is written until ::i2c_bus_shadow_flush.
+ * 
+ * The register is read first if it isn't cached. Registers that aren't shadowed are written straight away.
+ * 
+ * \param s The shadow of the device's registers.
+ * \param bits The range of bits to write to.
+ * \param val The bit data that will be written to range. Bit 0 of val will be written to bit from_bit in reg.
+ * \return I2C_BUS_SUCCESS If successful. Else either I2C_BUS_ERROR_WRITE_FAILURE or I2C_BUS_ERROR_READ_FAILURE.
+ */
+int i2c_bus_shadow_stage_bits(i2c_bus_shadow s, const bit_range bits, const byte val);
+
+/**
+ * \brief Write every register with staged bits. Runs of neighbouring registers are written in one transaction.
+ * 
+ * \param s The shadow of the device's registers.
+ * \return I2C_BUS_SUCCESS If successful. Else I2C_BUS_ERROR_WRITE_FAILURE and the failed registers are no longer cached.
+ */
+int i2c_bus_shadow_flush(i2c_bus_shadow s);
+
+/**
+ * \brief Write to a range of bits. Equivalent to ::i2c_bus_shadow_stage_bits then ::i2c_bus_shadow_flush.
+ * 
+ * \param s The shadow of the device's registers.
+ * \param bits The range of bits to write to.
+ * \param val The bit data that will be written to range. Bit 0 of val will be written to bit from_bit in reg.
+ * \return I2C_BUS_SUCCESS If successful. Else either I2C_BUS_ERROR_WRITE_FAILURE or I2C_BUS_ERROR_READ_FAILURE.
+ */
+int i2c_bus_shadow_write_bits(i2c_bus_shadow s, const bit_range bits, const byte val);
+
+/**
+ * \brief Destroy a shadow.
+ * 
+ * \param s The shadow to destroy.
+ */
+void i2c_bus_shadow_deinit(i2c_bus_shadow s);
 #endif
 /** \} */
\ No newline at end of file
@@ -0,0 +1,149 @@
+/**
+ * \defgroup i2c_emulator I2C Device Emulators
+ * \ingroup utils
+ *
+ * \brief Register-level emulators of the I2C devices on the machine.
+ *
+ * The emulators attach to an \ref i2c_bus with ::i2c_bus_attach_emulator so the unmodified
+ * drivers run without the devices. This allows the drivers (and everything built on them) to be
+ * exercised on a bare board, or off-target with a host build of the SDK functions they use.
+ * Requires I2C_BUS_EMULATION to be defined in i2c_bus.h. Otherwise this library is empty.
+ *
+ * The NAU7802 emulator has the registers of the IC. The reset, power-up ready, and cycle start
+ * bits work as on the IC. While conversions are on, a new conversion of the input
+ * (::i2c_emulator_nau7802_set_input) plus uniform noise is made every period of the conversion
+ * rate in CTRL2. It sets the CR bit, which is cleared when the conversion is read. Starting a
+ * calibration with CALS stops conversions for ::I2C_EMULATOR_NAU7802_CAL_CONVERSIONS periods
+ * before CALS clears. The register address auto-increments and wraps at 0x1F. Its transactions
+ * are counted (::i2c_emulator_nau7802_transaction_count) to measure the driver's bus traffic.
+ *
+ * The MB85 FRAM emulator is a block of memory with a 2 byte address that wraps at its size, so
+ * ::mb85_fram_get_max_addr finds the emulated size. It counts the data bytes written
+ * (::i2c_emulator_mb85_bytes_written) to measure the write traffic of its users.
+ *
+ * \{
+ *
+ * \file i2c_emulator.h
+ * \author Richard Hall (hallboyone@icloud.com)
+ * \brief I2C Device Emulators header
+ * \version 0.3
+ * \date 2026-10-18
+ */
+#ifndef I2C_EMULATOR_H
+#define I2C_EMULATOR_H
+
+#include "pico/stdlib.h"
+#include "utils/i2c_bus.h"
+
+#ifdef I2C_BUS_EMULATION
+
+//#define I2C_EMULATOR_TESTS
+
+/** \brief Conversion periods an emulated NAU7802 calibration takes. */
+#define I2C_EMULATOR_NAU7802_CAL_CONVERSIONS 2
+
+/** \brief Opaque object emulating one NAU7802. */
+typedef struct i2c_emulator_nau7802_s * i2c_emulator_nau7802;
+
+/** \brief Opaque object emulating one MB85 FRAM. */
+typedef struct i2c_emulator_mb85_s * i2c_emulator_mb85;
+
+/**
+ * \brief Create an emulated NAU7802 and attach it to a bus in place of the IC.
+ *
+ * The emulator starts powered down with its registers at their reset values and an input of 0.
+ *
+ * \param bus The I2C instance to attach to. Must have been setup with i2c_bus_setup.
+ * \return The new emulator. NULL if it couldn't be allocated or attached.
+ */
+i2c_emulator_nau7802 i2c_emulator_nau7802_setup(i2c_inst_t * bus);
+
+/**
+ * \brief Set the raw value the emulated ADC converts.
+ *
+ * \param emu The emulator to update.
+ * \param raw The 24 bit two's complement conversion without noise.
+ */
+void i2c_emulator_nau7802_set_input(i2c_emulator_nau7802 emu, int32_t raw);
+
+/**
+ * \brief Set the noise added to each conversion.
+ *
+ * \param emu The emulator to update.
+ * \param amplitude Each conversion has uniform noise within +/- amplitude counts. 0 for none.
+ */
+void i2c_emulator_nau7802_set_noise(i2c_emulator_nau7802 emu, uint32_t amplitude);
+
+/**
+ * \brief Get the number of conversions the emulator has made.
+ *
+ * \param emu The emulator.
+ * \return The number of conversions since the emulator was setup.
+ */
+uint32_t i2c_emulator_nau7802_conversion_count(i2c_emulator_nau7802 emu);
+
+/**
+ * \brief Get the number of reads and writes of the emulated NAU7802.
+ *
+ * \param emu The emulator.
+ * \return The number of transactions since the emulator was setup.
+ */
+uint32_t i2c_emulator_nau7802_transaction_count(i2c_emulator_nau7802 emu);
+
+/**
+ * \brief Detach an emulated NAU7802 from its bus and free it. The bus must be idle.
+ *
+ * \param emu The emulator to destroy.
+ */
+void i2c_emulator_nau7802_deinit(i2c_emulator_nau7802 emu);
+
+/**
+ * \brief Create an emulated MB85 FRAM and attach it to a bus in place of the IC.
+ *
+ * \param bus The I2C instance to attach to. Must have been setup with i2c_bus_setup.
+ * \param address_pins Bitfield of the address pins pulled high [0,7].
+ * \param size_bytes The size of the memory. Must be a power of 2 between 512 B and 64 KiB.
+ * \return The new emulator. NULL if the arguments are invalid or it couldn't be allocated or attached.
+ */
+i2c_emulator_mb85 i2c_emulator_mb85_setup(i2c_inst_t * bus, dev_addr address_pins, uint32_t size_bytes);
+
+/**
+ * \brief Get the emulated memory to inspect or modify it directly.
+ *
+ * \param emu The emulator.
+ * \return Pointer to the emulator's size_bytes of memory.
+ */
+byte * i2c_emulator_mb85_memory(i2c_emulator_mb85 emu);
+
+/**
+ * \brief Get the number of data bytes written to the emulated FRAM, not counting the addresses.
+ *
+ * \param emu The emulator.
+ * \return The number of bytes written since the emulator was setup.
+ */
+uint32_t i2c_emulator_mb85_bytes_written(i2c_emulator_mb85 emu);
+
+/**
+ * \brief Detach an emulated MB85 FRAM from its bus and free it. The bus must be idle.
+ *
+ * \param emu The emulator to destroy.
+ */
+void i2c_emulator_mb85_deinit(i2c_emulator_mb85 emu);
+
+#ifdef I2C_EMULATOR_TESTS
+/**
+ * \brief Run the MB85 and NAU7802 drivers against the emulators on i2c0 and print the results.
+ *
+ * Checks the FRAM size probe, fill, and a save and load of a linked variable, then brings up a
+ * scale, follows a step in the input, and counts the conversions read at 80 SPS. The scale's 
+ * transactions are counted during bring-up, while it is polled and read many times a tick, and 
+ * for writes to its cached configuration. The DRDY path isn't covered since it needs the pin.
+ * Each test prints its timing. i2c0 must have been setup and the real devices (if any) are not
+ * used.
+ */
+void i2c_emulator_test();
+#endif
+
+#endif
+#endif
+/** \} */
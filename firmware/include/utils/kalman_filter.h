@@ -0,0 +1,135 @@
+/**
+ * \defgroup kalman_filter Kalman Filter Library
+ * \ingroup utils
+ * \version 0.3
+ *
+ * \brief Two-state (value and rate) Kalman filter using fixed-point math.
+ *
+ * The filter tracks a value and its rate of change (e.g. volume and flow) under a constant rate
+ * model where the rate is driven by white noise. Measurements of either the value, the rate, or
+ * both can be fused as they become available, each with its own variance. Between measurements,
+ * ::kalman_filter_predict propagates the state to the current time.
+ *
+ * All math is done with integers. The state is stored with 8 fractional bits and the covariance
+ * as 64 bit integers with 8 fractional bits so the small process noise added every tick is not lost.
+ * Values are expected to stay under about 8 million and rates under about 8 million per second.
+ * The variances saturate at a standard deviation of 65536 so a filter can predict for any length of 
+ * time without measurements.
+ *
+ * \{
+ *
+ * \file
+ * \author Richard Hall (hallboyone@icloud.com)
+ * \brief Kalman Filter header
+ * \version 0.3
+ * \date 2026-10-18
+ */
+
+#ifndef KALMAN_FILTER_H
+#define KALMAN_FILTER_H
+
+#include "pico/stdlib.h"
+
+//#define KALMAN_FILTER_TESTS
+
+/** \brief Opaque object defining a two-state Kalman filter. */
+typedef struct kalman_filter_s * kalman_filter;
+
+/**
+ * \brief Setup a new two-state Kalman filter.
+ *
+ * \param rate_noise Variance added to the rate each second, in (rate units)^2/s. Larger values
+ * make the filter follow rate changes faster at the cost of more noise.
+ *
+ * \return A new kalman_filter object. NULL on error.
+ */
+kalman_filter kalman_filter_setup(uint32_t rate_noise);
+
+/**
+ * \brief Reset the state of the filter.
+ *
+ * The value and rate are set to the passed values and known exactly. The rate variance is set to
+ * one second of process noise so the next measurements quickly pull the estimate in.
+ *
+ * \param kf The kalman_filter object to reset.
+ * \param value The new value estimate.
+ * \param rate The new rate estimate.
+ * \param t_ms The time of the reset in ms.
+ */
+void kalman_filter_reset(kalman_filter kf, int32_t value, int32_t rate, uint32_t t_ms);
+
+/**
+ * \brief Propagate the state and covariance of the filter forward to \p t_ms.
+ *
+ * Should be called before every group of measurement updates. Times earlier than the last
+ * predicted time are ignored.
+ *
+ * \param kf The kalman_filter object to propagate.
+ * \param t_ms The current time in ms.
+ */
+void kalman_filter_predict(kalman_filter kf, uint32_t t_ms);
+
+/**
+ * \brief Fuse a measurement of the value into the estimate.
+ *
+ * \param kf The kalman_filter object to update.
+ * \param value The measured value.
+ * \param var The variance of the measurement in (value units)^2.
+ */
+void kalman_filter_update_value(kalman_filter kf, int32_t value, uint32_t var);
+
+/**
+ * \brief Fuse a measurement of the rate into the estimate.
+ *
+ * \param kf The kalman_filter object to update.
+ * \param rate The measured rate in units/s.
+ * \param var The variance of the measurement in (rate units)^2.
+ */
+void kalman_filter_update_rate(kalman_filter kf, int32_t rate, uint32_t var);
+
+/**
+ * \brief Add uncertainty to the current rate estimate.
+ *
+ * Used when a known input is about to change the rate (e.g. a new pump power) so the filter
+ * tracks the step quickly instead of treating it as noise.
+ *
+ * \param kf The kalman_filter object to update.
+ * \param rate_var Variance to add to the rate in (rate units)^2.
+ */
+void kalman_filter_add_rate_uncertainty(kalman_filter kf, uint32_t rate_var);
+
+/**
+ * \brief Get the current value estimate.
+ *
+ * \param kf The kalman_filter object to read.
+ * \return The estimated value.
+ */
+int32_t kalman_filter_value(kalman_filter kf);
+
+/**
+ * \brief Get the current rate estimate.
+ *
+ * \param kf The kalman_filter object to read.
+ * \return The estimated rate in units/s.
+ */
+int32_t kalman_filter_rate(kalman_filter kf);
+
+/**
+ * \brief Destroys a kalman_filter object.
+ *
+ * \param kf The kalman_filter object to destroy.
+ */
+void kalman_filter_deinit(kalman_filter kf);
+
+#ifdef KALMAN_FILTER_TESTS
+/**
+ * \brief Run a set of tests on a simulated flow meter pulse train and print the results.
+ *
+ * The next test follows a flow after an hour without measurements. The last one follows a falling, 
+ * negative value and negative rate measurements. Compiled by defining KALMAN_FILTER_TESTS in header.
+ */
+void kalman_filter_test();
+#endif
+
+#endif
+/** \} */
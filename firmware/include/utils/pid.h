@@ -1,7 +1,7 @@
 /**
  * \defgroup pid PID Controller Library
  * \ingroup utils
- * \version 0.3
+ * \version 0.4
  * 
  * \brief Implementation of a PID controller.
  * 
@@ -17,6 +17,8 @@
  * windup bounds that automatically clip the error sum at user-defined values.
  * 
  * Changelog:
+ * v0.4 - Added optional sensor timestamps so the sum and slope use the time a reading was taken.
+ * 
  * v0.3 - Made structs opaque to ensure proper usage.
  * 
  * v0.2 - Switched from floating point data to integer data. Input is still floating point, however.
@@ -82,6 +84,12 @@ typedef struct {
  */
 typedef pid_data (*sensor_getter)();
 
+/**
+ * \brief Typedef of pointer to function taking no parameters but returning the time, in ms since boot,
+ * of the latest sensor reading.
+ */
+typedef pid_time (*sensor_time_getter)();
+
 /**
  * \brief Typedef of pointer to function that takes a float and applies it to some plant. Used to
  * apply inputs from controller.
@@ -259,6 +267,18 @@ void pid_update_setpoint(pid controller, const pid_data setpoint);
  */
 void pid_update_bias(pid controller, float bias);
 
+/**
+ * \brief Set the function returning the time of the latest feedback reading.
+ * 
+ * By default, readings are timestamped when the controller ticks. Sensors that sample on their own 
+ * schedule can provide their sample times instead so the integral and derivative use the real spacing
+ * between readings.
+ * 
+ * \param controller The pid object to update.
+ * \param read_time Function returning the time of the latest feedback reading. NULL to use the tick time.
+ */
+void pid_set_sensor_time_getter(pid controller, sensor_time_getter read_time);
+
 /**
  * \brief If the minimum time between ticks has elapsed, run one loop of the controller. This requires reading the sensor,
  * updating the sum and slope terms, computing the input, and applying it to the plant (if not NULL). 
@@ -3,82 +3,296 @@
  * \ingroup flow_meter
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief Flow Meter driver source
- * \version 0.1
+ * \version 0.3
  * \date 2022-12-10
  */
 
 #include "drivers/flow_meter.h"
+#include "flow_meter.pio.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
+
+#include "hardware/clocks.h"
 
-#include "utils/gpio_multi_callback.h"
 #include "utils/macros.h"
 
+/** \brief Frequency of the PIO counter in Hz. Each count takes 5 cycles and equals 1us. */
+#define FLOW_METER_PIO_CLOCK_HZ 5000000
+
+/** \brief Pulse rate below which only the inter-pulse period is used to compute the flow. */
+#define FLOW_METER_PERIOD_ONLY_HZ 2.0f
+/** \brief Pulse rate above which only the windowed slope is used to compute the flow. */
+#define FLOW_METER_WINDOW_ONLY_HZ 8.0f
+
+/** \brief Offset of the flow_meter program in each PIO block or -1 if not loaded. */
+static int _program_offset [2] = {-1, -1};
+
 /** \brief Structure managing a single flowmeter. */
 typedef struct flow_meter_s {
     uint8_t pin;                   /**< \brief The GPIO attached to the flow meter's signal. */
-    float conversion_factor;        /**< \brief Factor converting pulse counts to volume. */
+    PIO pio;                       /**< \brief The PIO instance timestamping the flow meter's edges. */
+    uint sm;                       /**< \brief The state machine timestamping the flow meter's edges. */
+    float conversion_factor;       /**< \brief Factor converting pulse counts to volume. */
     uint pulse_count;              /**< \brief Number of pulses since last zero. */
+    uint64_t last_pulse_us;        /**< \brief Time of the most recent pulse in us since boot. */
+    uint64_t prev_pulse_us;        /**< \brief Time of the pulse before the most recent one in us since boot. */
+    uint32_t timeout_us;           /**< \brief Time without pulses after which the flow is zero. */
     discrete_derivative flow_rate; /**< \brief Derivative structure for tracking the flow rate in pulse/ms. */
 } flow_meter_;
 
 /**
- * \brief Simple callback that increments the corresponding flow_meter's pulse count by 1 and
- * adds the new point to the discrete_derivative
+ * \brief Count a batch of pulses and add them to the flow rate filter with their true times.
  * 
- * \param gpio GPIO number triggering callback
- * \param event Event triggering callback
- * \param data pointer to flow_meter associated with GPIO number
+ * \param fm The flow_meter the pulses belong to.
+ * \param timestamps_us The time of each pulse in us since boot, oldest first.
+ * \param num_pulses The number of pulses in \p timestamps_us.
  */
-static void _flow_meter_callback(uint gpio, uint32_t event, void* data){
-    UNUSED_PARAMETER(gpio);
-    UNUSED_PARAMETER(event);
-    flow_meter fm = (flow_meter)data;
-    fm->pulse_count += 1;
-    discrete_derivative_add_value(fm->flow_rate, fm->pulse_count);
+static void _flow_meter_consume(flow_meter fm, const uint64_t * timestamps_us, uint num_pulses){
+    for(uint i = 0; i < num_pulses; i++){
+        fm->pulse_count += 1;
+        // A gap longer than the timeout means the flow had stopped so there is no valid period yet
+        fm->prev_pulse_us = (timestamps_us[i] - fm->last_pulse_us > fm->timeout_us ? 0 : fm->last_pulse_us);
+        fm->last_pulse_us = timestamps_us[i];
+        const datapoint dp = {.t = timestamps_us[i]/1000, .v = fm->pulse_count};
+        discrete_derivative_add_datapoint(fm->flow_rate, dp);
+    }
 }
 
-flow_meter flow_meter_setup(uint8_t pin_num, float conversion_factor, 
-                            uint16_t filter_span_ms, uint16_t sample_dwell_time_ms){
-    flow_meter fm = malloc(sizeof(flow_meter_));
+/**
+ * \brief Drain the edge timestamps from the PIO's RX FIFO and consume them as a single batch.
+ * 
+ * The PIO counter holds the low 32 bits of the time in us, so each timestamp is extended to 64
+ * bits relative to the current time.
+ * 
+ * \param fm The flow_meter to update.
+ */
+static void _flow_meter_drain(flow_meter fm){
+    uint64_t timestamps_us [8]; // Joined RX FIFO holds 8 entries
+    uint num_pulses = 0;
+    while(num_pulses < 8 && !pio_sm_is_rx_fifo_empty(fm->pio, fm->sm)){
+        // Store the raw counter until the current time is known
+        timestamps_us[num_pulses++] = ~pio_sm_get(fm->pio, fm->sm);
+    }
+    if(num_pulses == 0) return;
+
+    const uint64_t now_us = time_us_64();
+    for(uint i = 0; i < num_pulses; i++){
+        timestamps_us[i] = now_us - (uint32_t)((uint32_t)now_us - (uint32_t)timestamps_us[i]);
+    }
+    _flow_meter_consume(fm, timestamps_us, num_pulses);
+}
 
-    if(pin_num >= 32) return NULL;
+/**
+ * \brief Compute the pulse rate from the time between the last two pulses.
+ * 
+ * Once the time since the last pulse grows longer than the last period, the next pulse is late and
+ * the rate can be no more than one pulse over the time since the last pulse. This lets the rate
+ * decay smoothly when the flow stops. After the timeout, the rate is zero.
+ * 
+ * \param fm The flow_meter to compute the rate of.
+ * \param now_us The current time in us since boot.
+ * \return The pulse rate in pulses/s or -1 if fewer than two pulses have been seen since the flow started.
+ */
+static float _flow_meter_period_rate(flow_meter fm, uint64_t now_us){
+    const uint64_t since_us = now_us - fm->last_pulse_us;
+    if(since_us > fm->timeout_us) return 0;
+    if(fm->prev_pulse_us == 0) return -1;
+    return 1e6f/MAX(fm->last_pulse_us - fm->prev_pulse_us, since_us);
+}
+
+/**
+ * \brief Blend the period and windowed pulse rates.
+ * 
+ * The period rate reacts within a single pulse but is noisy at high rates, while the windowed rate 
+ * is smooth at high rates but lags and quantizes badly at low ones. The weight of the windowed
+ * rate ramps linearly from 0 to 1 between FLOW_METER_PERIOD_ONLY_HZ and FLOW_METER_WINDOW_ONLY_HZ.
+ * 
+ * \param period_rate The rate from ::_flow_meter_period_rate in pulses/s. Negative if unknown.
+ * \param window_rate The rate from the discrete_derivative in pulses/s.
+ * \return The blended rate in pulses/s.
+ */
+static float _flow_meter_blend_rate(float period_rate, float window_rate){
+    // No period has been measured since the flow started
+    if(period_rate < 0) return window_rate;
+    const float w = CLAMP((period_rate - FLOW_METER_PERIOD_ONLY_HZ)/(FLOW_METER_WINDOW_ONLY_HZ - FLOW_METER_PERIOD_ONLY_HZ), 0, 1);
+    return (1-w)*period_rate + w*window_rate;
+}
+
+/**
+ * \brief Setup and start the PIO program defined in flow_meter.pio
+ * 
+ * \param fm The flow_meter structure that will be attached to the PIO program.
+ * \param offset The offset into the current PIO memory in which the program is loaded.
+ */
+static inline void _flow_meter_program_init(flow_meter fm, uint offset){
+    pio_sm_set_consecutive_pindirs(fm->pio, fm->sm, fm->pin, 1, false);
+    pio_gpio_init(fm->pio, fm->pin);
+    gpio_set_pulls(fm->pin, false, true);
 
-    gpio_set_dir(pin_num, false);
-    gpio_set_pulls(pin_num, false, true);
+    pio_sm_config c = flow_meter_program_get_default_config(offset);
+    sm_config_set_jmp_pin(&c, fm->pin);
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_RX);
+    sm_config_set_clkdiv(&c, (float)clock_get_hz(clk_sys)/FLOW_METER_PIO_CLOCK_HZ);
 
+    pio_sm_init(fm->pio, fm->sm, offset, &c);
+    pio_sm_set_enabled(fm->pio, fm->sm, true);
+
+    // Seed the counter so ~x matches time_us_32
+    pio_sm_put_blocking(fm->pio, fm->sm, ~time_us_32());
+}
+
+flow_meter flow_meter_setup(uint8_t pio_num, uint8_t pin_num, float conversion_factor, 
+                            uint16_t filter_span_ms, uint16_t sample_dwell_time_ms){
+    if(pin_num >= 32 || pio_num > 1) return NULL;
+
+    flow_meter fm = malloc(sizeof(flow_meter_));
     fm->pin = pin_num;
+    fm->pio = (pio_num==0 ? pio0 : pio1);
     fm->conversion_factor = conversion_factor;
     fm->pulse_count = 0;
-    
-    fm->flow_rate = discrete_derivative_setup(filter_span_ms, sample_dwell_time_ms);
+    fm->last_pulse_us = 0;
+    fm->prev_pulse_us = 0;
+    fm->timeout_us = 1000*filter_span_ms;
 
-    // Every time the flow meter pin falls, trigger callback
-    if(PICO_ERROR_NONE != gpio_multi_callback_attach(pin_num, GPIO_IRQ_EDGE_FALL, true, &_flow_meter_callback, fm)){
+    // Load the program once per PIO block and share it between flow meters
+    if(_program_offset[pio_num] < 0){
+        if(!pio_can_add_program(fm->pio, &flow_meter_program)){
+            free(fm);
+            return NULL;
+        }
+        _program_offset[pio_num] = pio_add_program(fm->pio, &flow_meter_program);
+    }
+    const int sm = pio_claim_unused_sm(fm->pio, false);
+    if(sm < 0){
         free(fm);
         return NULL;
     }
+    fm->sm = sm;
+
+    fm->flow_rate = discrete_derivative_setup(filter_span_ms, sample_dwell_time_ms);
+    _flow_meter_program_init(fm, _program_offset[pio_num]);
     return fm;
 }
 
 float flow_meter_volume(flow_meter fm){
+    _flow_meter_drain(fm);
     return fm->pulse_count * fm->conversion_factor;
 }
 
 float flow_meter_rate(flow_meter fm){
+    _flow_meter_drain(fm);
     // Values are only added when pulse is read. Add value here to go to zero when no pulses happen.
     discrete_derivative_add_value(fm->flow_rate, fm->pulse_count);
     // discrete_derivatives are in units/ms. Scale by 1000 to get units/s
-    return 1000.0 * discrete_derivative_read(fm->flow_rate) * fm->conversion_factor;
+    const float window_rate = 1000.0 * discrete_derivative_read(fm->flow_rate);
+    return _flow_meter_blend_rate(_flow_meter_period_rate(fm, time_us_64()), window_rate) * fm->conversion_factor;
 }
 
 void flow_meter_zero(flow_meter fm){
+    _flow_meter_drain(fm);
     fm->pulse_count = 0;
+    // Forget the last pulses so the period rate doesn't blend in the previous interval
+    fm->last_pulse_us = 0;
+    fm->prev_pulse_us = 0;
     discrete_derivative_reset(fm->flow_rate);
 }
 
 void flow_meter_deinit(flow_meter fm){
+    pio_sm_set_enabled(fm->pio, fm->sm, false);
+    pio_sm_unclaim(fm->pio, fm->sm);
     discrete_derivative_deinit(fm->flow_rate);
     free(fm);
-}
\ No newline at end of file
+}
+
+#ifdef FLOW_METER_TESTS
+#define TEST_NUM_PULSES 40
+#define TEST_TICK_MS 10
+
+/** \brief Segment of the simulated flow profile used to compare the rate estimators. */
+typedef struct {
+    uint32_t duration_ms; /**< \brief Length of the segment. */
+    float flow_ml_s;      /**< \brief Flow through the simulated meter during the segment. */
+} flow_meter_test_segment;
+
+void flow_meter_test(){
+    flow_meter_ fm_ = {.conversion_factor = 0.5, .pulse_count = 0, .last_pulse_us = 0, .prev_pulse_us = 0, .timeout_us = 1505000};
+    flow_meter fm = &fm_;
+    fm->flow_rate = discrete_derivative_setup(1505, 100);
+
+    // 40 pulses at 4 Hz (2 ml/s) ending at the current time, consumed in batches of up to 8
+    uint64_t timestamps_us [TEST_NUM_PULSES];
+    uint64_t now_us = time_us_64();
+    for(uint i = 0; i < TEST_NUM_PULSES; i++){
+        timestamps_us[i] = now_us - (TEST_NUM_PULSES-1-i)*250000ull;
+    }
+    for(uint i = 0; i < TEST_NUM_PULSES; i += 8){
+        _flow_meter_consume(fm, &timestamps_us[i], MIN(8, TEST_NUM_PULSES - i));
+    }
+
+    const float volume = fm->pulse_count * fm->conversion_factor;
+    const float rate = 1000.0 * discrete_derivative_read(fm->flow_rate) * fm->conversion_factor;
+    printf("Test 1:  %s (volume %0.2f ml, expected 20.00 ml)\n", (volume == 20.0f ? "PASS" : "FAIL"), volume);
+    printf("Test 2:  %s (rate %0.3f ml/s, expected 2.000 ml/s)\n", (rate > 1.95f && rate < 2.05f ? "PASS" : "FAIL"), rate);
+    printf("Test 3:  %s (last pulse %llu us, expected %llu us)\n", (fm->last_pulse_us == now_us ? "PASS" : "FAIL"), 
+           fm->last_pulse_us, now_us);
+
+    // Run a synthetic pulse train in real time and compare the windowed and blended rates
+    const flow_meter_test_segment profile [] = {{5000, 0.5}, {4000, 2.0}, {3000, 6.0}, {3000, 0}};
+    // Zero by hand since the test meter has no PIO to drain
+    fm->pulse_count = 0;
+    fm->last_pulse_us = 0;
+    fm->prev_pulse_us = 0;
+    discrete_derivative_reset(fm->flow_rate);
+    sleep_ms(2000); // Let the earlier pulses time out
+    float volume_ml = 0;
+    for(uint s = 0; s < sizeof(profile)/sizeof(profile[0]); s++){
+        int32_t window_settle_ms = -1, blend_settle_ms = -1;
+        float window_err = 0, blend_err = 0;
+        uint num_err = 0;
+        const float tol = MAX(0.1f*profile[s].flow_ml_s, 0.1f);
+
+        for(uint32_t t = 0; t < profile[s].duration_ms; t += TEST_TICK_MS){
+            sleep_ms(TEST_TICK_MS);
+            now_us = time_us_64();
+
+            // Add any pulses that would have happened during the last tick
+            const uint prev_pulses = volume_ml/fm->conversion_factor;
+            volume_ml += profile[s].flow_ml_s*TEST_TICK_MS/1000.0f;
+            const uint new_pulses = volume_ml/fm->conversion_factor;
+            for(uint p = prev_pulses + 1; p <= new_pulses; p++){
+                const float frac = (p*fm->conversion_factor - (volume_ml - profile[s].flow_ml_s*TEST_TICK_MS/1000.0f))
+                                   /(profile[s].flow_ml_s*TEST_TICK_MS/1000.0f);
+                const uint64_t ts = now_us - (uint64_t)((1-frac)*1000*TEST_TICK_MS);
+                _flow_meter_consume(fm, &ts, 1);
+            }
+
+            discrete_derivative_add_value(fm->flow_rate, fm->pulse_count);
+            const float window_rate = 1000.0 * discrete_derivative_read(fm->flow_rate);
+            const float window_ml_s = window_rate*fm->conversion_factor;
+            const float blend_ml_s = _flow_meter_blend_rate(_flow_meter_period_rate(fm, now_us), window_rate)*fm->conversion_factor;
+
+            if(window_settle_ms < 0 && fabsf(window_ml_s - profile[s].flow_ml_s) <= tol) window_settle_ms = t;
+            if(blend_settle_ms < 0 && fabsf(blend_ml_s - profile[s].flow_ml_s) <= tol) blend_settle_ms = t;
+            if(t >= profile[s].duration_ms/2){
+                window_err += fabsf(window_ml_s - profile[s].flow_ml_s);
+                blend_err += fabsf(blend_ml_s - profile[s].flow_ml_s);
+                num_err++;
+            }
+        }
+        // A rate that never settled took at least the whole segment
+        if(window_settle_ms < 0) window_settle_ms = profile[s].duration_ms;
+        if(blend_settle_ms < 0) blend_settle_ms = profile[s].duration_ms;
+        window_err /= num_err;
+        blend_err /= num_err;
+
+        // Allow a few ticks of slack when both are limited by the same pulse
+        const bool pass = blend_settle_ms <= window_settle_ms + 5*TEST_TICK_MS && blend_err <= MAX(window_err, tol);
+        printf("Test %d:  %s (%0.1f ml/s: window settled in %ld ms with mean error %0.3f ml/s, blend %ld ms and %0.3f ml/s)\n",
+               s+4, (pass ? "PASS" : "FAIL"), profile[s].flow_ml_s, window_settle_ms, window_err, blend_settle_ms, blend_err);
+    }
+
+    discrete_derivative_deinit(fm->flow_rate);
+}
+#endif
@@ -3,7 +3,7 @@
  * \ingroup lmt01
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief LMT01 Driver source
- * \version 0.1
+ * \version 0.6
  * \date 2022-08-16
  */
 
@@ -11,8 +11,16 @@
 #include "lmt01.pio.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/timer.h"
+#include "utils/macros.h"
+
+#define LMT01_RING_BITS 4                          // Each DMA ring holds 16 samples (1.6s of readings)
+#define LMT01_RING_LEN (1 << LMT01_RING_BITS)
+#define LMT01_RING_BYTES (LMT01_RING_LEN*sizeof(uint32_t))
 
 /**
  * \brief Structure for interfacing with a single LMT01 sensor.
@@ -23,8 +31,23 @@ typedef struct lmt01_s{
     uint8_t _dat_pin; /**< \brief The GPIO pin attached to the LMT01 signal. */
     int _latest_temp; /**< \brief The most recent temp read by the sensor. */
     int _offset;      /**< \brief The constant offset added to the temp readings. */
+    uint _dma_count;  /**< \brief DMA channel moving pulse counts from the RX FIFO into ::_counts. */
+    uint _dma_time;   /**< \brief DMA channel copying the timer into ::_times after each count. */
+    uint32_t * _counts; /**< \brief Ring of pulse counts written by DMA. Aligned to its size. */
+    uint32_t * _times;  /**< \brief Ring of the low 32 bits of each sample's time in us written by DMA. Aligned to its size. */
+    uint8_t _read_idx;  /**< \brief Index of the next unread sample in the rings. */
+    absolute_time_t _latest_time;       /**< \brief Time of the most recent sample. */
+    absolute_time_t _setup_time;        /**< \brief Time the sensor was setup. */
+    int _history [LMT01_MEDIAN_LEN];    /**< \brief The most recent temps used by the median filter. */
+    uint8_t _history_idx;               /**< \brief Index of the oldest temp in ::_history. */
+    uint8_t _history_num;               /**< \brief Number of valid temps in ::_history. */
 } lmt01_;
 
+/** \brief Offset of the shared program in each PIO block. -1 if not loaded. */
+static int _program_offset [2] = {-1, -1};
+/** \brief Number of sensors running the shared program in each PIO block. */
+static uint8_t _program_users [2] = {0, 0};
+
 /** \brief The pulse counts defining the piecewise-linear regions. */
 static const int PULSE_COUNTS [21] = { 
     26, 181, 338, 494, 651, 808,
@@ -47,54 +70,51 @@ static const int PULSE_SHIFTS [20] = {
     -802, -791, -791, -791, -777, 
     -777, -777, -777, -742, -798};
 
+#define LUT_PULSE_BUCKET_SHIFT 4   // Each bucket spans 16 pulses, less than the narrowest region
+#define LUT_PULSE_BUCKET_NUM   256 // Buckets cover 0 to 4095 pulses
+#define LUT_Q 16                   // Fractional bits of the fixed-point coefficients
+
+/** \brief Region holding the first pulse count of each bucket. At most one boundary falls within a bucket. */
+static uint8_t _region_lut [LUT_PULSE_BUCKET_NUM];
+static int32_t _slope_q [20];     /**< \brief PULSE_SLOPES in cC/pulse scaled by 2^LUT_Q. */
+static int32_t _intercept_q [20]; /**< \brief PULSE_SHIFTS in cC scaled by 2^LUT_Q. */
+static bool _lut_ready = false;
+
 /**
- * \brief Converts a pulse count to the corresponding temperature multiplied by 16
+ * \brief Fill the fixed-point coefficients and region LUT from the piecewise-linear tables.
  * 
- * \param pulse_count the number of pulses from the LMT01 sensor
- * \return The corresponding temp. Divide by 16 to get temp in C
+ * The tables are shared by all sensors and only built once.
  */
-static inline int _lmt01_pulse_to_temp(const int pulse_count){
-    if (pulse_count < PULSE_COUNTS[1]){
-        return (pulse_count*PULSE_SLOPES[0] + PULSE_SHIFTS[0]);
-    } else if (pulse_count < PULSE_COUNTS[2]){
-        return (pulse_count*PULSE_SLOPES[1] + PULSE_SHIFTS[1]);
-    } else if (pulse_count < PULSE_COUNTS[3]){
-        return (pulse_count*PULSE_SLOPES[2] + PULSE_SHIFTS[2]);
-    } else if (pulse_count < PULSE_COUNTS[4]){
-        return (pulse_count*PULSE_SLOPES[3] + PULSE_SHIFTS[3]);
-    } else if (pulse_count < PULSE_COUNTS[5]){
-        return (pulse_count*PULSE_SLOPES[4] + PULSE_SHIFTS[4]);
-    } else if (pulse_count < PULSE_COUNTS[6]){
-        return (pulse_count*PULSE_SLOPES[5] + PULSE_SHIFTS[5]);
-    } else if (pulse_count < PULSE_COUNTS[7]){
-        return (pulse_count*PULSE_SLOPES[6] + PULSE_SHIFTS[6]);
-    } else if (pulse_count < PULSE_COUNTS[8]){
-        return (pulse_count*PULSE_SLOPES[7] + PULSE_SHIFTS[7]);
-    } else if (pulse_count < PULSE_COUNTS[9]){
-        return (pulse_count*PULSE_SLOPES[8] + PULSE_SHIFTS[8]);
-    } else if (pulse_count < PULSE_COUNTS[10]){
-        return (pulse_count*PULSE_SLOPES[9] + PULSE_SHIFTS[9]);
-    } else if (pulse_count < PULSE_COUNTS[11]){
-        return (pulse_count*PULSE_SLOPES[10] + PULSE_SHIFTS[10]);
-    } else if (pulse_count < PULSE_COUNTS[12]){
-        return (pulse_count*PULSE_SLOPES[11] + PULSE_SHIFTS[11]);
-    } else if (pulse_count < PULSE_COUNTS[13]){
-        return (pulse_count*PULSE_SLOPES[12] + PULSE_SHIFTS[12]);
-    } else if (pulse_count < PULSE_COUNTS[14]){
-        return (pulse_count*PULSE_SLOPES[13] + PULSE_SHIFTS[13]);
-    } else if (pulse_count < PULSE_COUNTS[15]){
-        return (pulse_count*PULSE_SLOPES[14] + PULSE_SHIFTS[14]);
-    } else if (pulse_count < PULSE_COUNTS[16]){
-        return (pulse_count*PULSE_SLOPES[15] + PULSE_SHIFTS[15]);
-    } else if (pulse_count < PULSE_COUNTS[17]){
-        return (pulse_count*PULSE_SLOPES[16] + PULSE_SHIFTS[16]);
-    } else if (pulse_count < PULSE_COUNTS[18]){
-        return (pulse_count*PULSE_SLOPES[17] + PULSE_SHIFTS[17]);
-    } else if (pulse_count < PULSE_COUNTS[19]){
-        return (pulse_count*PULSE_SLOPES[18] + PULSE_SHIFTS[18]);
-    } else {
-        return (pulse_count*PULSE_SLOPES[19] + PULSE_SHIFTS[19]);
+static void _lmt01_build_lut(){
+    if(_lut_ready) return;
+
+    for(uint8_t r = 0; r < 20; r++){
+        _slope_q[r]     = (int32_t)((100.f/16)*(1<<LUT_Q)*PULSE_SLOPES[r] + 0.5f);
+        _intercept_q[r] = (100*(1<<LUT_Q)/16)*PULSE_SHIFTS[r];
+    }
+
+    uint8_t r = 0;
+    for(uint16_t b = 0; b < LUT_PULSE_BUCKET_NUM; b++){
+        while(r < 19 && (b << LUT_PULSE_BUCKET_SHIFT) >= PULSE_COUNTS[r+1]) r++;
+        _region_lut[b] = r;
     }
+    _lut_ready = true;
+}
+
+/**
+ * \brief Converts a pulse count to the corresponding temperature in cC
+ * 
+ * The bucket LUT gives the region of the bucket's first pulse count and a single compare 
+ * handles a region boundary inside the bucket.
+ * 
+ * \param pulse_count the number of pulses from the LMT01 sensor
+ * \return The corresponding temp in cC
+ */
+static inline int _lmt01_pulse_to_temp(uint32_t pulse_count){
+    pulse_count = MIN(pulse_count, (LUT_PULSE_BUCKET_NUM << LUT_PULSE_BUCKET_SHIFT) - 1);
+    uint8_t r = _region_lut[pulse_count >> LUT_PULSE_BUCKET_SHIFT];
+    if(r < 19 && pulse_count >= (uint32_t)PULSE_COUNTS[r+1]) r++;
+    return (_slope_q[r]*(int32_t)pulse_count + _intercept_q[r] + (1 << (LUT_Q-1))) >> LUT_Q;
 }
 
 /**
@@ -124,28 +144,169 @@ static inline void _lmt01_program_init(lmt01 l, uint offset) {
     pio_sm_set_enabled(l->_pio, l->_sm, true);
 }
 
+/**
+ * \brief Start a pair of chained DMA channels that log every pulse count and its arrival time.
+ * 
+ * The count channel waits on the RX FIFO and moves one count into ::_counts. It then triggers the 
+ * time channel which copies the raw timer into ::_times and triggers the count channel again. Both
+ * rings wrap in hardware so the CPU never has to restart the transfers.
+ * 
+ * \param l The \ref lmt01 structure whose rings will be filled.
+ */
+static inline void _lmt01_dma_init(lmt01 l){
+    dma_channel_config c = dma_channel_get_default_config(l->_dma_count);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, LMT01_RING_BITS + 2);
+    channel_config_set_dreq(&c, pio_get_dreq(l->_pio, l->_sm, false));
+    channel_config_set_chain_to(&c, l->_dma_time);
+    dma_channel_configure(l->_dma_count, &c, l->_counts, &l->_pio->rxf[l->_sm], 1, false);
+
+    c = dma_channel_get_default_config(l->_dma_time);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, LMT01_RING_BITS + 2);
+    channel_config_set_chain_to(&c, l->_dma_count);
+    dma_channel_configure(l->_dma_time, &c, l->_times, &timer_hw->timerawl, 1, false);
+
+    dma_channel_start(l->_dma_count);
+}
+
+/**
+ * \brief Convert a single pulse count and add it to the sensor's history.
+ * 
+ * \param l The \ref lmt01 structure the sample belongs to.
+ * \param pulse_count The pulse count sent by the sensor.
+ * \param t_us The low 32 bits of the sample time in us.
+ * \param now_us The current time in us. Used to extend \p t_us to 64 bits.
+ */
+static void _lmt01_add_sample(lmt01 l, uint32_t pulse_count, uint32_t t_us, uint64_t now_us){
+    const int temp = l->_offset + _lmt01_pulse_to_temp(pulse_count);
+
+    // Drop pulse trains that were cut short or corrupted
+    if(temp <= 0 || temp > 17500) return;
+
+    l->_latest_temp = temp;
+    update_us_since_boot(&l->_latest_time, now_us - (uint32_t)((uint32_t)now_us - t_us));
+    l->_history[l->_history_idx] = temp;
+    l->_history_idx = (l->_history_idx + 1) % LMT01_MEDIAN_LEN;
+    l->_history_num = MIN(l->_history_num + 1, LMT01_MEDIAN_LEN);
+}
+
+/**
+ * \brief Process all samples that DMA has completed since the last call.
+ * 
+ * A sample is complete once its time has been written so the time channel's write address marks
+ * the end of the new data. 
+ * 
+ * \param l The \ref lmt01 structure to update.
+ * \param now_us The current time in us.
+ */
+static void _lmt01_drain(lmt01 l, uint64_t now_us){
+    const uint32_t write_addr = dma_channel_hw_addr(l->_dma_time)->write_addr;
+    const uint8_t write_idx = ((write_addr - (uint32_t)(uintptr_t)l->_times)/sizeof(uint32_t)) & (LMT01_RING_LEN-1);
+    while(l->_read_idx != write_idx){
+        _lmt01_add_sample(l, l->_counts[l->_read_idx], l->_times[l->_read_idx], now_us);
+        l->_read_idx = (l->_read_idx + 1) & (LMT01_RING_LEN-1);
+    }
+}
+
+/**
+ * \brief Compute the median of the sensor's temperature history.
+ * 
+ * \param l The \ref lmt01 structure to read.
+ * \return The median temperature in cC. 0 if there is no history.
+ */
+static int _lmt01_median(lmt01 l){
+    // Insertion sort a copy of the history. Only a handful of values so this is quick.
+    int sorted [LMT01_MEDIAN_LEN];
+    for(uint8_t i = 0; i < l->_history_num; i++){
+        int j = i;
+        while(j > 0 && sorted[j-1] > l->_history[i]){
+            sorted[j] = sorted[j-1];
+            j--;
+        }
+        sorted[j] = l->_history[i];
+    }
+    return (l->_history_num == 0 ? 0 : sorted[l->_history_num/2]);
+}
+
 lmt01 lmt01_setup(uint8_t pio_num, uint8_t dat_pin, int offset_16C){
     lmt01 l = malloc(sizeof(lmt01_));
+    if(l == NULL) return NULL;
 
     l->_dat_pin = dat_pin;
     l->_offset = offset_16C;
-    // Load pio program into memory
+    l->_latest_temp = 0;
+    l->_latest_time = nil_time;
+    l->_setup_time = get_absolute_time();
+    l->_read_idx = 0;
+    l->_history_idx = 0;
+    l->_history_num = 0;
+
+    // Rings must be aligned to their size for the DMA to wrap them
+    l->_counts = aligned_alloc(LMT01_RING_BYTES, LMT01_RING_BYTES);
+    l->_times = aligned_alloc(LMT01_RING_BYTES, LMT01_RING_BYTES);
+    if(l->_counts == NULL || l->_times == NULL){
+        free(l->_counts);
+        free(l->_times);
+        free(l);
+        return NULL;
+    }
+
+    // Load the program once per PIO block and share it between sensors
     l->_pio =  (pio_num==0 ? pio0 : pio1);
-    uint offset = pio_add_program(l->_pio, &lmt01_program);
-    l->_sm = pio_claim_unused_sm(l->_pio, true);
-    _lmt01_program_init(l, offset);
+    _lmt01_build_lut();
+    const int sm = pio_claim_unused_sm(l->_pio, false);
+    if(sm < 0 || (_program_offset[pio_num] < 0 && !pio_can_add_program(l->_pio, &lmt01_program))){
+        if(sm >= 0) pio_sm_unclaim(l->_pio, sm);
+        free(l->_counts);
+        free(l->_times);
+        free(l);
+        return NULL;
+    }
+    if(_program_offset[pio_num] < 0) _program_offset[pio_num] = pio_add_program(l->_pio, &lmt01_program);
+    _program_users[pio_num]++;
+    l->_sm = sm;
 
-    while(l->_latest_temp<=0 || l->_latest_temp>17500){
-        // Wait till a valid temperature is measured
-        lmt01_read(l);
+    const int dma_count = dma_claim_unused_channel(false);
+    const int dma_time = dma_claim_unused_channel(false);
+    if(dma_count < 0 || dma_time < 0){
+        if(dma_count >= 0) dma_channel_unclaim(dma_count);
+        if(dma_time >= 0) dma_channel_unclaim(dma_time);
+        pio_sm_unclaim(l->_pio, sm);
+        if(--_program_users[pio_num] == 0){
+            pio_remove_program(l->_pio, &lmt01_program, _program_offset[pio_num]);
+            _program_offset[pio_num] = -1;
+        }
+        free(l->_counts);
+        free(l->_times);
+        free(l);
+        return NULL;
     }
+    l->_dma_count = dma_count;
+    l->_dma_time = dma_time;
+    _lmt01_dma_init(l);
+    _lmt01_program_init(l, _program_offset[pio_num]);
     return l;
 }
 
-int lmt01_read(lmt01 l){
-    while(!pio_sm_is_rx_fifo_empty(l->_pio, l->_sm)){
-        l->_latest_temp = l->_offset + (100*_lmt01_pulse_to_temp(pio_sm_get_blocking(l->_pio, l->_sm))/16);
+lmt01_status lmt01_get_status(lmt01 l){
+    const uint64_t now_us = time_us_64();
+    _lmt01_drain(l, now_us);
+
+    // Time out from the latest valid sample or, if there are none, from setup
+    const uint64_t since_us = to_us_since_boot(l->_history_num == 0 ? l->_setup_time : l->_latest_time);
+    if(now_us - since_us > 1000*LMT01_TIMEOUT_MS){
+        return LMT01_DEGRADED;
     }
+    return (l->_history_num == 0 ? LMT01_STARTING : LMT01_READY);
+}
+
+int lmt01_read(lmt01 l){
+    _lmt01_drain(l, time_us_64());
     return l->_latest_temp;
 }
 
@@ -153,6 +314,130 @@ float lmt01_read_float(lmt01 l){
     return lmt01_read(l)/100.;
 }
 
+int lmt01_read_median(lmt01 l){
+    _lmt01_drain(l, time_us_64());
+    return _lmt01_median(l);
+}
+
+float lmt01_read_median_float(lmt01 l){
+    return lmt01_read_median(l)/100.;
+}
+
+absolute_time_t lmt01_read_time(lmt01 l){
+    _lmt01_drain(l, time_us_64());
+    return l->_latest_time;
+}
+
+int lmt01_read_array(const lmt01 sensors [], uint8_t num_sensors, int temps_cC []){
+    if(num_sensors > LMT01_MAX_SENSORS) return PICO_ERROR_INVALID_ARG;
+
+    const uint64_t now_us = time_us_64();
+    for(uint8_t i = 0; i < num_sensors; i++){
+        _lmt01_drain(sensors[i], now_us);
+        temps_cC[i] = _lmt01_median(sensors[i]);
+    }
+    return PICO_ERROR_NONE;
+}
+
 void lmt01_deinit(lmt01 l){
+    // Stop the state machine first so the count channel can't be paced again
+    pio_sm_set_enabled(l->_pio, l->_sm, false);
+    dma_channel_abort(l->_dma_time);
+    dma_channel_abort(l->_dma_count);
+    dma_channel_unclaim(l->_dma_time);
+    dma_channel_unclaim(l->_dma_count);
+    pio_sm_unclaim(l->_pio, l->_sm);
+
+    // Remove the shared program once its last sensor is gone
+    const uint8_t pio_num = (l->_pio == pio0 ? 0 : 1);
+    if(--_program_users[pio_num] == 0){
+        pio_remove_program(l->_pio, &lmt01_program, _program_offset[pio_num]);
+        _program_offset[pio_num] = -1;
+    }
+    free(l->_counts);
+    free(l->_times);
     free(l);
-}
\ No newline at end of file
+}
+
+#ifdef LMT01_TESTS
+/** \brief Original floating point conversion used as the test reference. Returns the temp in cC without truncation. */
+static float _lmt01_pulse_to_temp_float(int pulse_count){
+    uint8_t r = 0;
+    while(r < 19 && pulse_count >= PULSE_COUNTS[r+1]) r++;
+    return 100*(pulse_count*PULSE_SLOPES[r] + PULSE_SHIFTS[r])/16;
+}
+
+#define TEST_MAX_PULSE_COUNT 3300
+
+void lmt01_test(){
+    _lmt01_build_lut();
+    const float cycles_per_us = clock_get_hz(clk_sys)/1e6f;
+    volatile int32_t sink = 0; // Keeps the timed loops from being optimized away
+
+    float max_err = 0;
+    for(int pc = 0; pc <= TEST_MAX_PULSE_COUNT; pc++){
+        const float err = _lmt01_pulse_to_temp(pc) - _lmt01_pulse_to_temp_float(pc);
+        max_err = MAX(max_err, (err < 0 ? -err : err));
+    }
+
+    uint32_t t0 = time_us_32();
+    for(int pc = 0; pc <= TEST_MAX_PULSE_COUNT; pc++) sink += _lmt01_pulse_to_temp(pc);
+    const uint32_t lut_us = time_us_32() - t0;
+    t0 = time_us_32();
+    for(int pc = 0; pc <= TEST_MAX_PULSE_COUNT; pc++) sink += _lmt01_pulse_to_temp_float(pc);
+    const uint32_t float_us = time_us_32() - t0;
+
+    printf("Test 1:  %s (max error %0.3f cC over 0 to %d pulses, expected at most 1 cC)\n", 
+           (max_err <= 1 ? "PASS" : "FAIL"), max_err, TEST_MAX_PULSE_COUNT);
+    printf("Conversion: LUT %.1f cycles/call, float %.1f cycles/call\n", 
+           cycles_per_us*lut_us/(TEST_MAX_PULSE_COUNT+1), cycles_per_us*float_us/(TEST_MAX_PULSE_COUNT+1));
+    UNUSED_PARAMETER(sink);
+
+    // Multi-channel decode: fill each sensor's rings as the DMA would and read them in one pass.
+    // The channels are claimed but never started so their write addresses can be set directly.
+    const uint8_t num_samples [LMT01_MAX_SENSORS] = {1, 3, 7, LMT01_RING_LEN + 2};
+    lmt01_ sensors [LMT01_MAX_SENSORS];
+    lmt01 sensor_ptrs [LMT01_MAX_SENSORS];
+    int temps_cC [LMT01_MAX_SENSORS];
+    const uint32_t now_us = time_us_32();
+    for(uint8_t i = 0; i < LMT01_MAX_SENSORS; i++){
+        lmt01 l = &sensors[i];
+        sensor_ptrs[i] = l;
+        *l = (lmt01_){._offset = 0, ._read_idx = 0, ._history_idx = 0, ._history_num = 0};
+        l->_counts = aligned_alloc(LMT01_RING_BYTES, LMT01_RING_BYTES);
+        l->_times = aligned_alloc(LMT01_RING_BYTES, LMT01_RING_BYTES);
+        const int dma_time = dma_claim_unused_channel(false);
+        if(dma_time < 0){
+            printf("Test %d:  FAIL (no free DMA channel for sensor %d)\n", i+2, i);
+            for(uint8_t k = 0; k < i; k++) dma_channel_unclaim(sensors[k]._dma_time);
+            for(uint8_t k = 0; k <= i; k++){
+                free(sensors[k]._counts);
+                free(sensors[k]._times);
+            }
+            return;
+        }
+        l->_dma_time = dma_time;
+
+        // Sensor i reads about 20C + 10C*i. One sample in the middle is corrupted.
+        const uint32_t base_count = 1100 + 160*i;
+        for(uint8_t k = 0; k < num_samples[i]; k++){
+            const uint8_t idx = k & (LMT01_RING_LEN-1);
+            l->_counts[idx] = (k == num_samples[i]/2 && k > 0 ? 3 : base_count + (k % 3));
+            l->_times[idx] = now_us - 1000*(num_samples[i] - k);
+        }
+        dma_channel_hw_addr(l->_dma_time)->write_addr = (uint32_t)(uintptr_t)&l->_times[num_samples[i] & (LMT01_RING_LEN-1)];
+    }
+    lmt01_read_array(sensor_ptrs, LMT01_MAX_SENSORS, temps_cC);
+    for(uint8_t i = 0; i < LMT01_MAX_SENSORS; i++){
+        const float expected = _lmt01_pulse_to_temp_float(1100 + 160*i + 1);
+        const int64_t age_us = absolute_time_diff_us(sensors[i]._latest_time, get_absolute_time());
+        const bool pass = (temps_cC[i] - expected <= 150 && temps_cC[i] - expected >= -150) 
+                          && age_us >= 1000 && age_us < 2000;
+        printf("Test %d:  %s (sensor %d: median %d cC, expected about %0.0f cC, latest sample %lld us old)\n", 
+               i+2, (pass ? "PASS" : "FAIL"), i, temps_cC[i], expected, age_us);
+        dma_channel_unclaim(sensors[i]._dma_time);
+        free(sensors[i]._counts);
+        free(sensors[i]._times);
+    }
+}
+#endif
@@ -5,7 +5,7 @@
  * \file mb85_fram.c
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief MB85 FRAM source
- * \version 0.1
+ * \version 0.5
  * \date 2022-11-14
  */
 #include "drivers/mb85_fram.h"
@@ -24,11 +24,9 @@ typedef struct {
 
 /** \brief Struct representing a single FRAM IC. */
 typedef struct mb85_fram_s {
-    i2c_inst_t * bus;            /**< I2C bus the chip is attached to */
-    dev_addr addr;               /**< Value of address pins on MB85 device */
-    mb85_fram_remote_var * vars; /**< Array of all remote vars linked to device */
-    uint16_t num_vars;           /**< Number of vars linked to device */
-    uint16_t var_buf_len;        /**< Size of vars buffer */
+    i2c_inst_t * bus;                                 /**< I2C bus the chip is attached to */
+    dev_addr addr;                                    /**< Value of address pins on MB85 device */
+    mb85_fram_remote_var vars [MB85_FRAM_MAX_VARS];   /**< Table of links indexed by handle. Free slots have a NULL local_addr */
 } mb85_fram_;
 
 /** \brief Read value from MB85 device over I2C 
@@ -57,34 +55,16 @@ static int mb85_fram_i2c_write(mb85_fram dev, reg_addr mem_addr, uint16_t len, u
     return i2c_bus_write_bytes(dev->bus, dev->addr, mem_addr, 2, len, src);
 }
 
-/** \brief Iterate through the current device variables looking for one matching var.
+/** \brief Look up the link with the given handle.
  * 
- * \param dev Initalized MB85 device struct that will be searched.
- * \param var Pointer to variable is the subject of the search.
+ * \param dev Initalized MB85 device struct holding the link.
+ * \param var Handle returned by ::mb85_fram_link_var.
  * 
- * \returns Pointer to internal variable structure if a match is found. Else, returns NULL.
+ * \returns Pointer to internal variable structure if the handle is linked. Else, returns NULL.
 */
-static mb85_fram_remote_var * mb85_fram_find_var(mb85_fram dev, void * var){
-    uint8_t * var_addr = (uint8_t*)var;
-    uint16_t var_idx = 0;
-    for(var_idx = 0; var_idx < dev->num_vars; var_idx++){
-        if (dev->vars[var_idx].local_addr == var_addr) return &(dev->vars[var_idx]);
-    }
-    return NULL;
-}
-
-/** \brief Double the size of the variable buffer if full. 
- * 
- * \param dev Initalized MB85 device struct.
-*/
-static void mb85_fram_resize_buf(mb85_fram dev){
-    if(dev->var_buf_len == dev->num_vars){
-        mb85_fram_remote_var * old_var_buf = dev->vars;
-        dev->vars = (mb85_fram_remote_var*)malloc(2*dev->var_buf_len*sizeof(mb85_fram_remote_var));
-        memcpy(dev->vars, old_var_buf, dev->num_vars*sizeof(mb85_fram_remote_var));
-        free(old_var_buf);
-        dev->var_buf_len *= 2;
-    }
+static inline mb85_fram_remote_var * mb85_fram_get_var(mb85_fram dev, mb85_fram_var var){
+    if(var < 0 || var >= MB85_FRAM_MAX_VARS || dev->vars[var].local_addr == NULL) return NULL;
+    return &(dev->vars[var]);
 }
 
 mb85_fram mb85_fram_setup(i2c_inst_t * nau7802_i2c, dev_addr address_pins, uint8_t * init_val){
@@ -94,11 +74,11 @@ mb85_fram mb85_fram_setup(i2c_inst_t * nau7802_i2c, dev_addr address_pins, uint8
     
     dev->addr = MB85_DEVICE_CODE | address_pins;
     dev->bus = nau7802_i2c;
+    // Falls back to the bus's default clock if the speed can't be added
+    i2c_bus_set_device_baudrate(dev->bus, dev->addr, MB85_FRAM_MAX_BAUDRATE);
     if(!i2c_bus_is_connected(dev->bus, dev->addr)) return NULL;
 
-    dev->var_buf_len = 16;
-    dev->vars = (mb85_fram_remote_var*)malloc(dev->var_buf_len*sizeof(mb85_fram_remote_var));
-    dev->num_vars = 0;
+    memset(dev->vars, 0, sizeof(dev->vars));
     
     if(init_val != NULL){
         mb85_fram_set_all(dev, *init_val);
@@ -146,49 +126,75 @@ int mb85_fram_set_all(mb85_fram dev, uint8_t value){
     return PICO_ERROR_NONE;
 }
 
-int mb85_fram_link_var(mb85_fram dev, void * var, reg_addr remote_addr, uint16_t num_bytes, mb85_fram_init_dir init_from_fram){
-    mb85_fram_resize_buf(dev);
-    dev->vars[dev->num_vars].local_addr = (uint8_t*)var;
-    dev->vars[dev->num_vars].remote_addr = remote_addr;
-    dev->vars[dev->num_vars].num_bytes = num_bytes;
+mb85_fram_var mb85_fram_link_var(mb85_fram dev, void * var, reg_addr remote_addr, uint16_t num_bytes, mb85_fram_init_dir init_from_fram){
+    if(var == NULL || num_bytes == 0) return PICO_ERROR_INVALID_ARG;
 
-    dev->num_vars += 1;
+    // Only linking searches the table. Every other call indexes it with the handle.
+    mb85_fram_var handle = 0;
+    while(handle < MB85_FRAM_MAX_VARS && dev->vars[handle].local_addr != NULL) handle++;
+    if(handle == MB85_FRAM_MAX_VARS) return PICO_ERROR_GENERIC;
 
-    if(init_from_fram){
-        return mb85_fram_load(dev, var);
-    } else {
-        return mb85_fram_save(dev, var);
+    dev->vars[handle].local_addr = (uint8_t*)var;
+    dev->vars[handle].remote_addr = remote_addr;
+    dev->vars[handle].num_bytes = num_bytes;
+
+    int result = PICO_ERROR_NONE;
+    if(init_from_fram == MB85_FRAM_INIT_FROM_FRAM){
+        result = mb85_fram_load(dev, handle);
+    } else if(init_from_fram == MB85_FRAM_INIT_FROM_VAR){
+        result = mb85_fram_save(dev, handle);
+    }
+    if(result){
+        dev->vars[handle].local_addr = NULL;
+        return result;
     }
+    return handle;
 }
 
-int mb85_fram_unlink_var(mb85_fram dev, void * var){
-    for (uint16_t i = 0; i < dev->num_vars; i++){
-        if (dev->vars[i].local_addr == var){
-            // Shift all remaining elements left by 1 space to overwrite unlinked var
-            for (uint16_t j = i+1; j < dev->num_vars; j++){
-                dev->vars[j-1] = dev->vars[j];
-            }
-            dev->num_vars -= 1;
-            return PICO_ERROR_NONE;
-        }
-    }
+int mb85_fram_unlink_var(mb85_fram dev, mb85_fram_var var){
+    mb85_fram_remote_var * var_s = mb85_fram_get_var(dev, var);
+    if(var_s == NULL) return PICO_ERROR_INVALID_ARG;
+    var_s->local_addr = NULL;
     return PICO_ERROR_NONE;
 }
 
-int mb85_fram_load(mb85_fram dev, void * var){
-    mb85_fram_remote_var * var_s = mb85_fram_find_var(dev, var);
+int mb85_fram_load(mb85_fram dev, mb85_fram_var var){
+    mb85_fram_remote_var * var_s = mb85_fram_get_var(dev, var);
+    if(var_s == NULL) return PICO_ERROR_INVALID_ARG;
+    return mb85_fram_i2c_read(dev, var_s->remote_addr, var_s->num_bytes, var_s->local_addr);
+}
+
+int mb85_fram_save(mb85_fram dev, mb85_fram_var var){
+    mb85_fram_remote_var * var_s = mb85_fram_get_var(dev, var);
+    if(var_s == NULL) return PICO_ERROR_INVALID_ARG;
+    return mb85_fram_i2c_write(dev, var_s->remote_addr, var_s->num_bytes, var_s->local_addr);
+}
+
+int mb85_fram_save_async(mb85_fram dev, mb85_fram_var var, i2c_bus_callback_t cb, void * data){
+    mb85_fram_remote_var * var_s = mb85_fram_get_var(dev, var);
+    if(var_s == NULL) return PICO_ERROR_INVALID_ARG;
+    return i2c_bus_write_bytes_async(dev->bus, dev->addr, var_s->remote_addr, 2, var_s->num_bytes, var_s->local_addr, cb, data);
+}
+
+int mb85_fram_save_range_async(mb85_fram dev, mb85_fram_var var, uint16_t offset, uint16_t num_bytes, i2c_bus_callback_t cb, void * data){
+    mb85_fram_remote_var * var_s = mb85_fram_get_var(dev, var);
+    if(var_s == NULL || num_bytes == 0 || offset + num_bytes > var_s->num_bytes) return PICO_ERROR_INVALID_ARG;
+    return i2c_bus_write_bytes_async(dev->bus, dev->addr, var_s->remote_addr + offset, 2, num_bytes, var_s->local_addr + offset, cb, data);
+}
+
+int mb85_fram_load_from(mb85_fram dev, mb85_fram_var var, reg_addr remote_addr){
+    mb85_fram_remote_var * var_s = mb85_fram_get_var(dev, var);
     if(var_s == NULL) return PICO_ERROR_INVALID_ARG;
-    return mb85_fram_i2c_read(dev, var_s->remote_addr, var_s->num_bytes, (uint8_t*)var);
+    return mb85_fram_i2c_read(dev, remote_addr, var_s->num_bytes, var_s->local_addr);
 }
 
-int mb85_fram_save(mb85_fram dev, void * var){
-    mb85_fram_remote_var * var_s = mb85_fram_find_var(dev, var);
+int mb85_fram_save_to_async(mb85_fram dev, mb85_fram_var var, reg_addr remote_addr, i2c_bus_callback_t cb, void * data){
+    mb85_fram_remote_var * var_s = mb85_fram_get_var(dev, var);
     if(var_s == NULL) return PICO_ERROR_INVALID_ARG;
-    return mb85_fram_i2c_write(dev, var_s->remote_addr, var_s->num_bytes, (uint8_t*)var);
+    return i2c_bus_write_bytes_async(dev->bus, dev->addr, remote_addr, 2, var_s->num_bytes, var_s->local_addr, cb, data);
 }
 
 void mb85_fram_deinit(mb85_fram dev){
-    free(dev->vars);
     free(dev);
 }
 /** @} */
\ No newline at end of file
@@ -4,26 +4,96 @@
  * \file nau7802.c
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief NAU7802 Library source
- * \version 0.2
+ * \version 0.12
  * \date 2022-08-16
 */
 
 #include "drivers/nau7802.h"
 
 #include <stdlib.h>
+#ifdef NAU7802_TESTS
+#include <stdio.h>
+#include <math.h>
+#endif
+
+#include "utils/gpio_multi_callback.h"
+#include "utils/kalman_filter.h"
+#include "utils/macros.h"
+
+#define FILTER_Q 4          // Fractional bits of the filter state. 24 bit conversions leave room in 32 bits.
+#define FILTER_FAST_LEN 4   // Length of the fast EMA used to detect steps and trends.
+#define FILTER_NOISE_SHIFT 4 // The noise estimate averages roughly the last 16 conversions.
+
+#ifndef RATE_EST_RATE_NOISE
+#define RATE_EST_RATE_NOISE 250000  // Mass rate variance added each second by the estimator in (mg/s)^2/s
+#endif
+#define RATE_EST_STEP_SIGMAS 8      // Two mass innovations in a row beyond this are a step, not a change in rate
+
+/** \brief State of the adaptive filter applied to the conversions. */
+typedef struct {
+    int32_t est_q;    /**< The filtered conversion scaled by 2^FILTER_Q. */
+    int32_t fast_q;   /**< Fast EMA of the conversions scaled by 2^FILTER_Q. */
+    int32_t mad_q;    /**< Mean absolute second difference of the conversions scaled by 2^FILTER_Q. */
+    int32_t prev [2]; /**< The previous two conversions, newest first. */
+    uint8_t num_prev; /**< Number of valid conversions in ::prev. */
+    uint16_t n;       /**< Number of conversions averaged since the last step. 0 if reset. */
+    uint16_t n_max;   /**< The most conversions averaged. Beyond this the filter is an EMA. */
+    int8_t out_dir;   /**< Sign of the previous conversion's deviation if it was out of band. Else 0. */
+} _nau7802_filter;
 
 /** \brief Implementation of an object representing a NAU7802 IC. */
 typedef struct nau7802_s{
     i2c_inst_t * bus;           /**< The I2C bus that the sensor is attached to. */
+    i2c_bus_shadow regs;        /**< Shadow of the registers so configuration writes skip the read. */
     float conversion_factor_mg; /**< The conversion for the given sensor to mg. */
     uint32_t latest_val;        /**< Last ADC reading */
+    int8_t drdy_pin;            /**< GPIO attached to the DRDY pin. -1 if the CR bit is polled instead. */
+    bool read_pending;          /**< True while a queued read of a conversion hasn't finished. */
+    uint8_t read_buf [3];       /**< Destination of the queued conversion read. */
+    uint64_t read_time_us;      /**< The time of the conversion being read in us since boot. */
+    uint8_t cr_buf;             /**< Destination of the queued read of the CR bit when polling. */
+    nau7802_sample ring [NAU7802_RING_LEN]; /**< The latest conversions and their times. */
+    uint32_t num_samples;       /**< Total number of conversions read. The newest is at num_samples-1 in the ring. */
+    conversion_rate rate;       /**< The selected conversion rate. */
+    _nau7802_filter filter;     /**< The adaptive filter applied to settled conversions. */
+    uint32_t first_valid;       /**< Count of the first conversion that has settled at the selected rate. */
+    uint32_t filtered_val;      /**< Output of the adaptive filter. */
+    kalman_filter rate_est;     /**< Estimates the mass and its rate in mg and mg/s from the conversions. */
+    int8_t rate_out_dir;        /**< Sign of the previous conversion's innovation if it was out of band. Else 0. */
+    bool auto_zero;             /**< True if the origin tracks slow drift near zero. */
+    absolute_time_t last_auto_zero; /**< The time the origin was last adjusted by auto-zero. */
+    uint32_t offset_cal_period_ms;  /**< Time between internal offset calibrations while idle. 0 if disabled. */
+    absolute_time_t last_offset_cal; /**< The time the last internal offset calibration started. */
+    bool offset_cal_running;    /**< True while an internal offset calibration is running. */
     uint32_t origin;            /**< The current origin of the sensor. */
+    nau7802_status status;      /**< Status of the scale's bring-up. */
+    uint8_t init_step;          /**< The current step of the bring-up state machine. */
+    uint8_t init_attempts;      /**< Number of failed bring-up attempts. */
+    absolute_time_t step_start; /**< The time the current bring-up step started. */
 } nau7802_;
 
+/** \brief Steps of the bring-up state machine run by ::nau7802_tick. */
+enum _nau7802_init_steps {
+    _INIT_CONNECT,   /**< Check the IC responds and set the reset bit. */
+    _INIT_RESET,     /**< Clear the reset bit and power up the digital logic. */
+    _INIT_POWER_UP,  /**< Wait for the power-up ready bit, then configure and start calibration. */
+    _INIT_CALIBRATE, /**< Wait for calibration to finish, then start conversions. */
+    _INIT_ZERO,      /**< Wait for the first conversion and use it as the origin. */
+    _INIT_DONE       /**< Bring-up finished or abandoned. */
+};
+
 /**\brief The number of times to attempt to setup sensor before erroring. */
 static const uint8_t MAX_SETUP_ATTEMPTS = 10;
 /**\brief The length of time to wait for the calibration before erroring. */
 static const uint CALIBRATION_TIMEOUT_US = 1000000;
+/**\brief The length of time to wait for the IC to power up before erroring. */
+static const uint POWER_UP_TIMEOUT_US = 25000;
+/**\brief The length of time to wait for the first conversion before erroring. */
+static const uint FIRST_CONVERSION_TIMEOUT_US = 1000000;
+/**\brief The number of conversions dropped after changing the rate while the ADC's filter settles. */
+static const uint8_t RATE_SETTLE_CONVERSIONS = 3;
+/**\brief The time between auto-zero adjustments. */
+static const uint AUTO_ZERO_PERIOD_MS = 500;
 
 const dev_addr _nau7802_addr = 0x2A;     /**< I2C address of the NAU7802 IC */
 
@@ -92,6 +162,19 @@ const bit_range BITS_PGA_CAP     = {.from = 7, .to = 7, .in_reg = REG_PWR_CTRL,
 
 const bit_range BITS_REVISION_ID = {.from = 0, .to = 3, .in_reg = REG_DEV_REV, .reg_addr_len = 1};
 
+/** 
+ * \brief Bits of registers 0x00-0x1F changed by the NAU7802 itself. Status bits, the calibration
+ * results, the conversion, and the reserved/OTP registers are never cached. 
+ */
+static const byte _nau7802_volatile_bits [0x20] = {
+    [REG_PU_CTRL]  = 0x28, // PUR and CR
+    [REG_CTRL_2]   = 0x0C, // CALS and CAL_ERR
+    [0x03 ... 0x10] = 0xFF, // Offset and gain calibration
+    [REG_ADCO_B2 ... REG_ADCO_B0] = 0xFF,
+    [0x16 ... 0x1A] = 0xFF, // OTP
+    [0x1D ... 0x1E] = 0xFF, // Reserved
+};
+
 /**
  * \brief Read the bits in reg idx specified by bit_range bits into dst.
  * 
@@ -102,7 +185,7 @@ const bit_range BITS_REVISION_ID = {.from = 0, .to = 3, .in_reg = REG_DEV_REV, .
  * \return NAU7802_SUCCESS if successful and an error code otherwise. 
  */
 static int nau7802_read_bits(nau7802 scale, const bit_range bits, uint8_t * dst){
-    return i2c_bus_read_bits(scale->bus, _nau7802_addr, bits, dst);
+    return i2c_bus_shadow_read_bits(scale->regs, bits, dst);
 }
 
 /**
@@ -115,7 +198,20 @@ static int nau7802_read_bits(nau7802 scale, const bit_range bits, uint8_t * dst)
  * \return NAU7802_SUCCESS if successful and an error code otherwise. 
  */
 static int nau7802_write_bits(nau7802 scale, const bit_range bits, uint8_t val){
-    return i2c_bus_write_bits(scale->bus, _nau7802_addr, bits, val);
+    return i2c_bus_shadow_write_bits(scale->regs, bits, val);
+}
+
+/**
+ * \brief Stage a val for specific bits. Staged bits are written together by i2c_bus_shadow_flush.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \param bits A bit_range struct indicating the register address and bits to write.
+ * \param val The value that will be written to the bits. 
+ * 
+ * \return NAU7802_SUCCESS if successful and an error code otherwise. 
+ */
+static int nau7802_stage_bits(nau7802 scale, const bit_range bits, uint8_t val){
+    return i2c_bus_shadow_stage_bits(scale->regs, bits, val);
 }
 
 int nau7802_reset(nau7802 scale){
@@ -124,6 +220,8 @@ int nau7802_reset(nau7802 scale){
         return result;
     }
     sleep_ms(1);
+    // Every register is back to its default
+    i2c_bus_shadow_invalidate(scale->regs);
     result = nau7802_write_bits(scale, BITS_RESET, 0);
     return result;
 }
@@ -204,25 +302,347 @@ bool nau7802_data_ready(nau7802 scale){
     return is_ready;
 }
 
-int nau7802_read_raw(nau7802 scale, uint32_t * dst){
-    if (nau7802_data_ready(scale)){
-        int result = i2c_bus_read_bytes(scale->bus, _nau7802_addr, REG_ADCO_B2, 1, 3, (uint8_t*)dst);
-        if(result != I2C_BUS_SUCCESS) return result;
+/**
+ * \brief Restart the filter's average. The noise estimate is kept.
+ * 
+ * \param f The filter to reset.
+ * \param n_max The most conversions to average.
+ */
+static void _nau7802_filter_reset(_nau7802_filter * f, uint16_t n_max){
+    f->n = 0;
+    f->n_max = MAX(1, n_max);
+    f->num_prev = 0;
+    f->out_dir = 0;
+}
 
-        uint32_t b0 = ((*dst)&0xFF0000);
-        uint32_t b1 = ((*dst)&0x00FF00);
-        uint32_t b2 = ((*dst)&0x0000FF);
-        *dst = (b0>>16) | (b1) | (b2<<16);
-        scale->latest_val = *dst;
+/**
+ * \brief Add a conversion to the adaptive filter.
+ * 
+ * The noise is estimated from the mean absolute second difference of the conversions. This is 
+ * about twice the noise's standard deviation and is not biased by a steady pour. 
+ * 
+ * While the weight is steady, the output is the cumulative average since the last step. Once
+ * ::n_max conversions are averaged, it becomes an EMA with the same time constant. Two kinds of 
+ * change restart the average:
+ * - Step: Two conversions in a row on the same side of a short EMA and more than ~4 standard 
+ *   deviations from it (e.g. a cup placed or a fast pour). The average restarts at the conversion. 
+ *   A single conversion this far out is an outlier and is ignored.
+ * - Trend: The short EMA moves ~2 standard deviations from the output (e.g. a slow pour). The 
+ *   average restarts at the short EMA.
+ * 
+ * \param f The filter to update.
+ * \param x The new conversion.
+ * \return The filtered conversion.
+ */
+static uint32_t _nau7802_filter_update(_nau7802_filter * f, uint32_t x){
+    const int32_t x_q = (int32_t)x << FILTER_Q;
+
+    // Update the noise estimate. Each conversion's share is clipped so a step can't inflate it much.
+    if(f->num_prev == 2){
+        int32_t d2_q = (x_q - 2*(f->prev[0] << FILTER_Q) + (f->prev[1] << FILTER_Q));
+        d2_q = MIN((d2_q < 0 ? -d2_q : d2_q), 4*f->mad_q + (NAU7802_FILTER_MIN_STEP << FILTER_Q));
+        f->mad_q += (d2_q - f->mad_q) >> FILTER_NOISE_SHIFT;
+    }
+    f->prev[1] = f->prev[0];
+    f->prev[0] = x;
+    f->num_prev = MIN(f->num_prev + 1, 2);
+
+    if(f->n == 0){
+        f->est_q = x_q;
+        f->fast_q = x_q;
+        f->n = 1;
+        return x;
+    }
+
+    const int32_t r_q = x_q - f->fast_q;
+    const int32_t step_band_q = MAX(NAU7802_FILTER_MIN_STEP << FILTER_Q, 2*f->mad_q);
+    if((r_q < 0 ? -r_q : r_q) > step_band_q){
+        const int8_t dir = (r_q > 0 ? 1 : -1);
+        if(f->out_dir == dir){
+            f->est_q = x_q;
+            f->fast_q = x_q;
+            f->n = 1;
+            f->out_dir = 0;
+        } else {
+            f->out_dir = dir;
+        }
+        return (f->est_q + (1 << (FILTER_Q-1))) >> FILTER_Q;
+    }
+    f->out_dir = 0;
+
+    f->fast_q += r_q/FILTER_FAST_LEN;
+    if(f->n < f->n_max) f->n++;
+    f->est_q += (x_q - f->est_q)/f->n;
+
+    const int32_t trend_q = f->fast_q - f->est_q;
+    if((trend_q < 0 ? -trend_q : trend_q) > MAX(NAU7802_FILTER_MIN_STEP << FILTER_Q, f->mad_q)){
+        f->est_q = f->fast_q;
+        f->n = MIN(FILTER_FAST_LEN, f->n_max);
+    }
+    return (f->est_q + (1 << (FILTER_Q-1))) >> FILTER_Q;
+}
+
+/**
+ * \brief Add a conversion to the ring, the adaptive filter, and the mass rate estimate.
+ * 
+ * The rate estimate is a \ref kalman_filter fed the unfiltered mass (without the origin) with the
+ * variance of the adaptive filter's noise estimate. A conversion far from the predicted mass is
+ * skipped as an outlier. If the next one is also far on the same side, it is a step (e.g. a cup
+ * placed) so the estimate jumps to the new mass and keeps its rate. A steady pour matches the 
+ * prediction so it never looks like a step.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \param raw The raw 24 bit conversion.
+ * \param t_us The time of the conversion in us since boot.
+ */
+static void _nau7802_add_conversion(nau7802 scale, uint32_t raw, uint64_t t_us){
+    scale->latest_val = raw;
+
+    nau7802_sample * sample = &scale->ring[scale->num_samples % NAU7802_RING_LEN];
+    sample->raw = raw;
+    update_us_since_boot(&sample->time, t_us);
+    scale->num_samples++;
+
+    if(scale->num_samples <= scale->first_valid) return;
+    scale->filtered_val = _nau7802_filter_update(&scale->filter, raw);
+
+    const uint32_t t_ms = t_us/1000;
+    const int32_t mass_mg = scale->conversion_factor_mg*(int32_t)raw;
+    if(scale->num_samples == scale->first_valid + 1){
+        kalman_filter_reset(scale->rate_est, mass_mg, 0, t_ms);
+        scale->rate_out_dir = 0;
+        return;
+    }
+
+    // The mean absolute second difference is ~1.95 standard deviations of the noise
+    const float sigma_mg = scale->conversion_factor_mg*(scale->filter.mad_q >> FILTER_Q)/1.95f;
+    const int32_t band_mg = 1 + RATE_EST_STEP_SIGMAS*(sigma_mg < 0 ? -sigma_mg : sigma_mg);
+    kalman_filter_predict(scale->rate_est, t_ms);
+    const int32_t innovation_mg = mass_mg - kalman_filter_value(scale->rate_est);
+    if((innovation_mg < 0 ? -innovation_mg : innovation_mg) > band_mg){
+        const int8_t dir = (innovation_mg > 0 ? 1 : -1);
+        if(scale->rate_out_dir == dir){
+            kalman_filter_reset(scale->rate_est, mass_mg, kalman_filter_rate(scale->rate_est), t_ms);
+            scale->rate_out_dir = 0;
+        } else {
+            scale->rate_out_dir = dir;
+        }
     } else {
-        *dst = scale->latest_val;
+        scale->rate_out_dir = 0;
+        kalman_filter_update_value(scale->rate_est, mass_mg, MAX(1, (uint32_t)(sigma_mg*sigma_mg)));
+    }
+}
+
+/**
+ * \brief Convert a conversion rate setting into samples per second.
+ */
+static uint16_t _nau7802_rate_sps(conversion_rate rate){
+    switch(rate){
+    case SPS_020: return 20;
+    case SPS_040: return 40;
+    case SPS_080: return 80;
+    case SPS_320: return 320;
+    default:      return 10;
+    }
+}
+
+/**
+ * \brief Restart the filter and rate estimate after the conversions change abruptly.
+ * 
+ * The filter's window is set for the selected rate. The next few conversions are dropped while
+ * the ADC settles.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ */
+static void _nau7802_restart_filter(nau7802 scale){
+    // Average over the same time at every rate so the noise of a steady weight matches
+    _nau7802_filter_reset(&scale->filter, (_nau7802_rate_sps(scale->rate)*NAU7802_FILTER_WINDOW_MS)/1000);
+    scale->first_valid = scale->num_samples + RATE_SETTLE_CONVERSIONS;
+}
+
+/** \brief Check if the filtered value is within ::NAU7802_AUTO_ZERO_BAND_MG of the origin. */
+static bool _nau7802_near_zero(nau7802 scale){
+    const float mg_per_count = (scale->conversion_factor_mg < 0 ? -scale->conversion_factor_mg : scale->conversion_factor_mg);
+    const int32_t drift = (int32_t)scale->filtered_val - (int32_t)scale->origin;
+    return mg_per_count*(drift < 0 ? -drift : drift) <= NAU7802_AUTO_ZERO_BAND_MG;
+}
+
+/**
+ * \brief Move the origin towards the filtered value if the scale is steady near zero.
+ * 
+ * Runs at most every ::AUTO_ZERO_PERIOD_MS. The scale is steady if the adaptive filter has averaged 
+ * its full window without a step or trend. The origin moves by at most ::NAU7802_AUTO_ZERO_MAX_MG_S
+ * so only slow drift is removed. Anything placed on the scale is outside ::NAU7802_AUTO_ZERO_BAND_MG.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \param now The current time.
+ */
+static void _nau7802_track_zero(nau7802 scale, absolute_time_t now){
+    if(absolute_time_diff_us(scale->last_auto_zero, now) < 1000*AUTO_ZERO_PERIOD_MS) return;
+    scale->last_auto_zero = now;
+    if(scale->filter.n < scale->filter.n_max || scale->num_samples <= scale->first_valid) return;
+    if(!_nau7802_near_zero(scale)) return;
+
+    const float mg_per_count = (scale->conversion_factor_mg < 0 ? -scale->conversion_factor_mg : scale->conversion_factor_mg);
+    const int32_t drift = (int32_t)scale->filtered_val - (int32_t)scale->origin;
+    const int32_t max_step = MAX(1, (NAU7802_AUTO_ZERO_MAX_MG_S*AUTO_ZERO_PERIOD_MS)/(1000*mg_per_count));
+    scale->origin += CLAMP(drift, -max_step, max_step);
+}
+
+/**
+ * \brief Start or finish an internal offset calibration while the scale is idle.
+ * 
+ * A calibration is started once ::offset_cal_period_ms has passed, auto-zero is enabled, and the 
+ * scale is steady within ::NAU7802_AUTO_ZERO_BAND_MG of zero. With a cup on the scale, removing the
+ * drift would show as a step that auto-zero can't absorb. Conversions stop until it finishes. Afterwards the filter is restarted since 
+ * the corrected offset shifts the conversions.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \param now The current time.
+ */
+static void _nau7802_offset_cal_tick(nau7802 scale, absolute_time_t now){
+    if(scale->offset_cal_running){
+        uint8_t cal_running = 1;
+        if(nau7802_read_bits(scale, BITS_CALS, &cal_running) == I2C_BUS_SUCCESS && cal_running
+           && absolute_time_diff_us(scale->last_offset_cal, now) < CALIBRATION_TIMEOUT_US){
+            return;
+        }
+        scale->offset_cal_running = false;
+        _nau7802_restart_filter(scale);
+    } else if(scale->offset_cal_period_ms > 0 && scale->auto_zero 
+              && scale->filter.n == scale->filter.n_max && scale->num_samples > scale->first_valid
+              && _nau7802_near_zero(scale)
+              && absolute_time_diff_us(scale->last_offset_cal, now) > 1000*(int64_t)scale->offset_cal_period_ms){
+        scale->last_offset_cal = now;
+        if(nau7802_stage_bits(scale, BITS_CAL_MODE, MODE_OFF_INT) == I2C_BUS_SUCCESS
+           && nau7802_stage_bits(scale, BITS_CALS, 1) == I2C_BUS_SUCCESS
+           && i2c_bus_shadow_flush(scale->regs) == I2C_BUS_SUCCESS){
+            scale->offset_cal_running = true;
+        }
+    }
+}
+
+/**
+ * \brief Add the conversion read by ::_nau7802_queue_conversion to the ring. 
+ * 
+ * Runs from the main loop once the read finishes. When polling, the CR bit read just before is 
+ * checked first. A failed read is dropped. DRDY stays high (or the CR bit set) so the conversion
+ * is read again on the next tick.
+ */
+static void _nau7802_conversion_callback(int result, void * data){
+    nau7802 scale = (nau7802)data;
+    scale->read_pending = false;
+    if(result != I2C_BUS_SUCCESS) return;
+    if(scale->drdy_pin < 0 && !(scale->cr_buf & (1u << BITS_CR.from))) return;
+
+    const uint32_t b2 = scale->read_buf[0];
+    const uint32_t b1 = scale->read_buf[1];
+    const uint32_t b0 = scale->read_buf[2];
+    _nau7802_add_conversion(scale, (b2<<16) | (b1<<8) | b0, scale->read_time_us);
+}
+
+/**
+ * \brief Queue a burst read of the 3 conversion bytes. The conversion is added to the ring once 
+ * the read finishes.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \param t_us The time of the conversion in us since boot.
+ * \return I2C_BUS_SUCCESS if queued or a read is already waiting. Else an error code.
+ */
+static int _nau7802_queue_conversion(nau7802 scale, uint64_t t_us){
+    if(scale->read_pending) return I2C_BUS_SUCCESS;
+
+    scale->read_time_us = t_us;
+    int result = i2c_bus_read_bytes_async(scale->bus, _nau7802_addr, REG_ADCO_B2, 1, 3, scale->read_buf,
+                                          &_nau7802_conversion_callback, scale);
+    scale->read_pending = (result == I2C_BUS_SUCCESS);
+    return result;
+}
+
+/**
+ * \brief Queue a read of the latest conversion if one is waiting.
+ * 
+ * With a DRDY pin, conversions are normally read by ::_nau7802_drdy_callback and this only checks
+ * the pin. The pin stays high until the conversion is read so this also recovers a missed edge.
+ * Without one, reads of the CR bit and the conversion are queued back to back. The conversion is 
+ * only kept if the CR bit was set. This costs a second transaction while no conversion is ready but
+ * reads each conversion within one tick.
+ * 
+ * \param scale   Pointer to previously setup scale object
+ * \return I2C_BUS_SUCCESS if successful, even when no new conversion is ready. Else an error code.
+ */
+static int _nau7802_poll(nau7802 scale){
+    if(scale->read_pending) return I2C_BUS_SUCCESS;
+    if(scale->drdy_pin >= 0){
+        return (gpio_get(scale->drdy_pin) ? _nau7802_queue_conversion(scale, time_us_64()) : I2C_BUS_SUCCESS);
     }
+
+    int result = i2c_bus_read_bytes_async(scale->bus, _nau7802_addr, REG_PU_CTRL, 1, 1, &scale->cr_buf, NULL, NULL);
+    if(result != I2C_BUS_SUCCESS) return result;
+    return _nau7802_queue_conversion(scale, time_us_64());
+}
+
+/**
+ * \brief Deferred callback for the rising edge of the DRDY pin. Queues a read of the new conversion.
+ * 
+ * Runs from the main loop so the I2C bus is never used from an interrupt. If the conversion
+ * was already read by ::_nau7802_poll, the pin is low and nothing is done.
+ */
+static void _nau7802_drdy_callback(uint gpio, uint32_t event, uint32_t timestamp_us, void * data){
+    nau7802 scale = (nau7802)data;
+    if(!gpio_get(gpio)) return;
+    if(scale->status != NAU7802_READY && scale->init_step != _INIT_ZERO) return;
+
+    const uint64_t now_us = time_us_64();
+    _nau7802_queue_conversion(scale, now_us - (uint32_t)((uint32_t)now_us - timestamp_us));
+}
+
+int nau7802_read_raw(nau7802 scale, uint32_t * dst){
+    if(scale->status != NAU7802_READY) return PICO_ERROR_GENERIC;
+
+    *dst = scale->latest_val;
+    return I2C_BUS_SUCCESS;
+}
+
+uint32_t nau7802_sample_count(nau7802 scale){
+    return scale->num_samples;
+}
+
+int nau7802_read_sample(nau7802 scale, uint8_t age, nau7802_sample * dst){
+    if(scale->status != NAU7802_READY) return PICO_ERROR_GENERIC;
+    if(age >= NAU7802_RING_LEN || age >= scale->num_samples) return PICO_ERROR_INVALID_ARG;
+
+    *dst = scale->ring[(scale->num_samples - 1 - age) % NAU7802_RING_LEN];
+    return PICO_ERROR_NONE;
+}
+
+int nau7802_setup_drdy(nau7802 scale, uint8_t drdy_pin){
+    gpio_init(drdy_pin);
+    gpio_set_dir(drdy_pin, false);
+    gpio_pull_down(drdy_pin);
+
+    int result = gpio_multi_callback_attach_deferred(drdy_pin, GPIO_IRQ_EDGE_RISE, true, &_nau7802_drdy_callback, scale);
+    if(result != PICO_ERROR_NONE) return result;
+
+    scale->drdy_pin = drdy_pin;
+    return PICO_ERROR_NONE;
+}
+
+int nau7802_read_filtered(nau7802 scale, uint32_t * dst){
+    if(scale->status != NAU7802_READY) return PICO_ERROR_GENERIC;
+
+    *dst = scale->filtered_val;
     return I2C_BUS_SUCCESS;
 }
 
+int32_t nau7802_read_rate_mg_s(nau7802 scale){
+    if(scale->status != NAU7802_READY) return 0;
+    return kalman_filter_rate(scale->rate_est);
+}
+
 int nau7802_read_mg(nau7802 scale){
     uint32_t val;
-    if(nau7802_read_raw(scale, &val)!= I2C_BUS_SUCCESS){
+    if(nau7802_read_filtered(scale, &val)!= I2C_BUS_SUCCESS){
         return 0;
     }
 
@@ -230,7 +650,7 @@ int nau7802_read_mg(nau7802 scale){
 }
 
 int nau7802_zero(nau7802 scale){
-    if(nau7802_read_raw(scale, &scale->origin)!= I2C_BUS_SUCCESS){
+    if(nau7802_read_filtered(scale, &scale->origin)!= I2C_BUS_SUCCESS){
         return PICO_ERROR_GENERIC;
     }
     else{
@@ -238,81 +658,412 @@ int nau7802_zero(nau7802 scale){
     }
 }
 
+void nau7802_set_auto_zero(nau7802 scale, bool enable){
+    scale->auto_zero = enable;
+}
+
+void nau7802_set_offset_cal_period_ms(nau7802 scale, uint32_t period_ms){
+    scale->offset_cal_period_ms = period_ms;
+}
+
+int nau7802_set_conversion_rate(nau7802 scale, conversion_rate rate){
+    // Before the scale is ready, the rate is written by the bring-up
+    if(scale->status == NAU7802_READY){
+        int result = nau7802_write_bits(scale, BITS_CRS, rate);
+        if(result != I2C_BUS_SUCCESS) return result;
+    }
+
+    scale->rate = rate;
+    _nau7802_restart_filter(scale);
+    return I2C_BUS_SUCCESS;
+}
+
+conversion_rate nau7802_get_conversion_rate(nau7802 scale){
+    return scale->rate;
+}
+
 bool nau7802_at_val_mg(nau7802 scale, int val){
     return nau7802_read_mg(scale) >= val;
 }
 
+/**
+ * \brief Record a failed bring-up step and restart from the beginning.
+ * 
+ * Once ::MAX_SETUP_ATTEMPTS attempts have failed, the scale is marked as degraded and the
+ * bring-up is abandoned.
+ */
+static void _nau7802_init_failed(nau7802 scale){
+    scale->init_attempts++;
+    if(scale->init_attempts >= MAX_SETUP_ATTEMPTS){
+        scale->status = NAU7802_DEGRADED;
+        scale->init_step = _INIT_DONE;
+    } else {
+        scale->init_step = _INIT_CONNECT;
+    }
+}
+
+/**
+ * \brief Move the bring-up to the next step and restart the step timer.
+ */
+static inline void _nau7802_init_next(nau7802 scale, uint8_t step){
+    scale->init_step = step;
+    scale->step_start = get_absolute_time();
+}
+
 /**
  * \brief Assign standard values to the registers of the NAU7802 chip.
  * 
+ * Every field is staged first so fields sharing a register, and neighbouring registers, are 
+ * written in as few transactions as possible.
+ * 
  * \returns PICO_OK if setup successfully. Else returns error code.
  */
-static int _nau7802_setup(nau7802 scale){
-    if(!i2c_bus_is_connected(scale->bus, _nau7802_addr)){
-        return PICO_ERROR_GENERIC;
-    }
-    if(nau7802_reset(scale)){
+static int _nau7802_configure(nau7802 scale){
+    if(nau7802_stage_bits(scale, BITS_PWR_UP_A, PWR_ON)){
         return PICO_ERROR_GENERIC;
     }
-    if(nau7802_set_digital_power(scale, PWR_ON)){
+    if(nau7802_stage_bits(scale, BITS_VLDO, VLDO_3_0)){
         return PICO_ERROR_GENERIC;
     }
-    if(nau7802_set_analog_power_supply(scale, AVDD_SRC_INTERNAL)){
-        return PICO_ERROR_GENERIC;
-    }
-    if(!nau7802_wait_till_ready_ms(scale, 25)){
-        return PICO_ERROR_TIMEOUT;
-    }
-    if(nau7802_set_analog_power(scale, PWR_ON)){
+    if(nau7802_stage_bits(scale, BITS_LDO_MODE, LDO_MODE_ACCURATE)){
         return PICO_ERROR_GENERIC;
     }
-    if(nau7802_set_ldo_voltage(scale, VLDO_3_0)){
+    if(nau7802_stage_bits(scale, BITS_GAIN, GAIN_128)){
         return PICO_ERROR_GENERIC;
     }
-    if(nau7802_set_ldo_mode(scale, LDO_MODE_ACCURATE)){
+    if(nau7802_stage_bits(scale, BITS_REG_CHPS, CHP_CLK_OFF)){
         return PICO_ERROR_GENERIC;
     }
-    if(nau7802_set_gain(scale, GAIN_128)){
+    if(nau7802_stage_bits(scale, BITS_PGA_CAP, PGA_ON)){
         return PICO_ERROR_GENERIC;
     }
-    if(nau7802_set_chopper_clock(scale, CHP_CLK_OFF)){
+    if(nau7802_stage_bits(scale, BITS_CRS, scale->rate)){
         return PICO_ERROR_GENERIC;
     }
-    if(nau7802_set_pga_filter(scale, PGA_ON)){
+    if(i2c_bus_shadow_flush(scale->regs)){
         return PICO_ERROR_GENERIC;
     }
-    if(nau7802_calibrate(scale)){
-        return PICO_ERROR_GENERIC;
-    }
-    if(nau7802_set_conversions(scale, CONVERSIONS_ON)){
-        return PICO_ERROR_GENERIC;
+    return PICO_OK;
+}
+
+nau7802_status nau7802_tick(nau7802 scale){
+    const int64_t step_us = absolute_time_diff_us(scale->step_start, get_absolute_time());
+    uint8_t buf = 0;
+
+    switch(scale->init_step){
+    case _INIT_CONNECT:
+        // The IC is about to be reset (or may have been power cycled) so nothing cached is valid
+        i2c_bus_shadow_invalidate(scale->regs);
+        if(!i2c_bus_is_connected(scale->bus, _nau7802_addr) || nau7802_write_bits(scale, BITS_RESET, 1)){
+            _nau7802_init_failed(scale);
+        } else {
+            _nau7802_init_next(scale, _INIT_RESET);
+        }
+        break;
+    case _INIT_RESET:
+        // The reset bit must be held for at least 1ms
+        if(step_us < 1000) break;
+        if(nau7802_stage_bits(scale, BITS_RESET, 0)
+           || nau7802_stage_bits(scale, BITS_PWR_UP_D, PWR_ON)
+           || nau7802_stage_bits(scale, BITS_AVDD_S, AVDD_SRC_INTERNAL)
+           || i2c_bus_shadow_flush(scale->regs)){
+            _nau7802_init_failed(scale);
+        } else {
+            _nau7802_init_next(scale, _INIT_POWER_UP);
+        }
+        break;
+    case _INIT_POWER_UP:
+        if(!nau7802_is_ready(scale)){
+            if(step_us > POWER_UP_TIMEOUT_US) _nau7802_init_failed(scale);
+            break;
+        }
+        if(_nau7802_configure(scale) || nau7802_write_bits(scale, BITS_CALS, 1)){
+            _nau7802_init_failed(scale);
+        } else {
+            _nau7802_init_next(scale, _INIT_CALIBRATE);
+        }
+        break;
+    case _INIT_CALIBRATE:
+        if(nau7802_read_bits(scale, BITS_CALS, &buf)){
+            _nau7802_init_failed(scale);
+        } else if(buf){
+            if(step_us > CALIBRATION_TIMEOUT_US) _nau7802_init_failed(scale);
+        } else if(nau7802_read_bits(scale, BITS_CAL_ERR, &buf) || buf 
+                  || nau7802_set_conversions(scale, CONVERSIONS_ON)){
+            _nau7802_init_failed(scale);
+        } else {
+            _nau7802_init_next(scale, _INIT_ZERO);
+        }
+        break;
+    case _INIT_ZERO:
+        if(_nau7802_poll(scale)){
+            _nau7802_init_failed(scale);
+        } else if(scale->latest_val != 0){
+            scale->filtered_val = scale->latest_val;
+            scale->origin = scale->latest_val;
+            scale->status = NAU7802_READY;
+            scale->init_step = _INIT_DONE;
+        } else if(step_us > FIRST_CONVERSION_TIMEOUT_US){
+            _nau7802_init_failed(scale);
+        }
+        break;
+    case _INIT_DONE:
+        if(scale->status != NAU7802_READY) break;
+        // Conversion reads are queued by the DRDY callback or polled once per tick
+        if(!scale->offset_cal_running) _nau7802_poll(scale);
+        if(scale->auto_zero) _nau7802_track_zero(scale, get_absolute_time());
+        _nau7802_offset_cal_tick(scale, get_absolute_time());
+        break;
+    default:
+        break;
     }
+    return scale->status;
+}
 
-    return PICO_OK;
+nau7802_status nau7802_get_status(nau7802 scale){
+    return scale->status;
 }
 
 nau7802 nau7802_setup(i2c_inst_t * nau7802_i2c, float conversion_factor_mg){
     nau7802 scale = malloc(sizeof(nau7802_));
+    if(scale == NULL) return NULL;
+    scale->rate_est = kalman_filter_setup(RATE_EST_RATE_NOISE);
+    if(scale->rate_est == NULL){
+        free(scale);
+        return NULL;
+    }
+    scale->regs = i2c_bus_shadow_setup(nau7802_i2c, _nau7802_addr, 0x00, 1, sizeof(_nau7802_volatile_bits), _nau7802_volatile_bits);
+    if(scale->regs == NULL){
+        kalman_filter_deinit(scale->rate_est);
+        free(scale);
+        return NULL;
+    }
 
+    // Falls back to the bus's default clock if the speed can't be added
+    i2c_bus_set_device_baudrate(nau7802_i2c, _nau7802_addr, NAU7802_MAX_BAUDRATE);
     scale->bus = nau7802_i2c;
     scale->conversion_factor_mg = conversion_factor_mg;
     scale->latest_val = 0;
+    scale->drdy_pin = -1;
+    scale->read_pending = false;
+    scale->num_samples = 0;
+    scale->filtered_val = 0;
+    scale->filter.mad_q = 0;
     scale->origin = 0;
+    scale->auto_zero = false;
+    scale->last_auto_zero = nil_time;
+    scale->offset_cal_period_ms = 0;
+    scale->last_offset_cal = get_absolute_time();
+    scale->offset_cal_running = false;
+    scale->status = NAU7802_STARTING;
+    nau7802_set_conversion_rate(scale, SPS_DEFAULT);
+    scale->init_attempts = 0;
+    _nau7802_init_next(scale, _INIT_CONNECT);
 
-    // Try to setup scale up to ten times.
-    for(int i = 0; i < MAX_SETUP_ATTEMPTS; i++){
-        if(_nau7802_setup(scale) == PICO_ERROR_NONE) break;
-        if(i == MAX_SETUP_ATTEMPTS-1){
-            return NULL;
-        } 
-    }
-
-    while(scale->origin == 0){
-        nau7802_zero(scale);
-    }
+    // Run the first step so a missing scale is found straight away
+    nau7802_tick(scale);
     return scale;
 }
 
 void nau7802_deinit(nau7802 scale){
+    if(scale->drdy_pin >= 0) gpio_multi_callback_clear(scale->drdy_pin);
+    // A queued read still points at the scale
+    while(scale->read_pending) i2c_bus_process_completed();
+    kalman_filter_deinit(scale->rate_est);
+    i2c_bus_shadow_deinit(scale->regs);
     free(scale);
-}
\ No newline at end of file
+}
+
+#ifdef NAU7802_TESTS
+#define TEST_SPS 80            // Shot rate
+#define TEST_NOISE 60          // Raw noise at 80 SPS. About 20 counts at 10 SPS.
+#define TEST_BASE 0x200000     // Empty scale
+#define TEST_CUP 20000         // ~3g cup
+#define TEST_POUR_PER_S 13000  // ~2g/s pour
+#define TEST_SETTLED 60        // Settled once within one 80 SPS noise sigma (~9mg)
+#define TEST_BOXCAR_LEN 8      // 100ms moving average
+#define TEST_MG_PER_COUNT 0.15f
+
+/** \brief Deterministic noise with a roughly normal distribution and a standard deviation of TEST_NOISE. */
+static int32_t _nau7802_test_noise(){
+    static uint32_t lcg = 12345;
+    int32_t sum = 0;
+    for(uint8_t i = 0; i < 4; i++){
+        lcg = 1664525*lcg + 1013904223;
+        sum += (int32_t)(lcg >> 16) - 32768;
+    }
+    // Sum of 4 uniforms on [-32768, 32768) has a standard deviation of ~37837
+    return (sum*TEST_NOISE)/37837;
+}
+
+/** \brief Filter outputs for a single conversion. */
+typedef struct {
+    int32_t adaptive;
+    int32_t boxcar;
+    int32_t ema;
+} _nau7802_test_out;
+
+/** \brief Filters compared by the tests. */
+typedef struct {
+    _nau7802_filter adaptive;
+    uint32_t boxcar [TEST_BOXCAR_LEN];
+    uint32_t boxcar_n;
+    int32_t ema_q;
+} _nau7802_test_filters;
+
+static void _nau7802_test_reset(_nau7802_test_filters * f){
+    f->adaptive.mad_q = 0;
+    _nau7802_filter_reset(&f->adaptive, (TEST_SPS*NAU7802_FILTER_WINDOW_MS)/1000);
+    f->boxcar_n = 0;
+    f->ema_q = TEST_BASE << FILTER_Q;
+}
+
+/** \brief Run a conversion through each filter and return each output's error from the true value. */
+static _nau7802_test_out _nau7802_test_step(_nau7802_test_filters * f, uint32_t x, int32_t truth){
+    _nau7802_test_out out;
+    out.adaptive = (int32_t)_nau7802_filter_update(&f->adaptive, x) - truth;
+
+    f->boxcar[f->boxcar_n++ % TEST_BOXCAR_LEN] = x;
+    const uint8_t n = MIN(TEST_BOXCAR_LEN, f->boxcar_n);
+    int64_t sum = 0;
+    for(uint8_t i = 0; i < n; i++) sum += f->boxcar[i];
+    out.boxcar = sum/n - truth;
+
+    // EMA with the same time constant as the adaptive filter's steady state
+    f->ema_q += (((int32_t)x << FILTER_Q) - f->ema_q)/f->adaptive.n_max;
+    out.ema = ((f->ema_q + (1 << (FILTER_Q-1))) >> FILTER_Q) - truth;
+    return out;
+}
+
+void nau7802_test(){
+    _nau7802_test_filters f;
+    _nau7802_test_out e;
+
+    // Test 1: Steady weight for 10s with one outlier. RMS error over the last 8s.
+    _nau7802_test_reset(&f);
+    int64_t sq [3] = {0, 0, 0};
+    int32_t max_adaptive = 0;
+    const int n_steady = 10*TEST_SPS;
+    for(int i = 0; i < n_steady; i++){
+        const int32_t x = TEST_BASE + _nau7802_test_noise() + (i == n_steady/2 ? 5000 : 0);
+        e = _nau7802_test_step(&f, x, TEST_BASE);
+        if(i >= 2*TEST_SPS){
+            sq[0] += e.adaptive*e.adaptive;
+            sq[1] += e.boxcar*e.boxcar;
+            sq[2] += e.ema*e.ema;
+            max_adaptive = MAX(max_adaptive, (e.adaptive < 0 ? -e.adaptive : e.adaptive));
+        }
+    }
+    const int n_sq = n_steady - 2*TEST_SPS;
+    const float rms [3] = {sqrtf(sq[0]/n_sq), sqrtf(sq[1]/n_sq), sqrtf(sq[2]/n_sq)};
+    printf("Test 1:  %s (steady RMS adaptive %.1f, boxcar %.1f, EMA %.1f counts. Max adaptive error %d with a 5000 count outlier)\n",
+           (rms[0] <= rms[1] && max_adaptive < 5*TEST_NOISE ? "PASS" : "FAIL"), rms[0], rms[1], rms[2], (int)max_adaptive);
+
+    // Test 2: Cup placed after 2s of the steady weight. Time until each output stays settled.
+    int last_unsettled [3] = {0, 0, 0};
+    const int n_step = 6*TEST_SPS;
+    for(int i = 0; i < n_step; i++){
+        const int32_t truth = TEST_BASE + TEST_CUP;
+        e = _nau7802_test_step(&f, truth + _nau7802_test_noise(), truth);
+        if(abs(e.adaptive) > TEST_SETTLED) last_unsettled[0] = i+1;
+        if(abs(e.boxcar) > TEST_SETTLED)   last_unsettled[1] = i+1;
+        if(abs(e.ema) > TEST_SETTLED)      last_unsettled[2] = i+1;
+    }
+    const int settle_ms [3] = {1000*last_unsettled[0]/TEST_SPS, 1000*last_unsettled[1]/TEST_SPS, 1000*last_unsettled[2]/TEST_SPS};
+    printf("Test 2:  %s (step settle time adaptive %d ms, boxcar %d ms, EMA %d ms)\n",
+           (settle_ms[0] <= 2*settle_ms[1] && settle_ms[0] < settle_ms[2] ? "PASS" : "FAIL"), settle_ms[0], settle_ms[1], settle_ms[2]);
+
+    // Test 3: Pour for 3s. RMS error while pouring.
+    sq[0] = sq[1] = sq[2] = 0;
+    const int n_pour = 3*TEST_SPS;
+    for(int i = 0; i < n_pour; i++){
+        const int32_t truth = TEST_BASE + TEST_CUP + (TEST_POUR_PER_S*(i+1))/TEST_SPS;
+        e = _nau7802_test_step(&f, truth + _nau7802_test_noise(), truth);
+        sq[0] += (int64_t)e.adaptive*e.adaptive;
+        sq[1] += (int64_t)e.boxcar*e.boxcar;
+        sq[2] += (int64_t)e.ema*e.ema;
+    }
+    const float pour_rms [3] = {sqrtf(sq[0]/n_pour), sqrtf(sq[1]/n_pour), sqrtf(sq[2]/n_pour)};
+    printf("Test 3:  %s (pour RMS error adaptive %.1f, boxcar %.1f, EMA %.1f counts)\n",
+           (pour_rms[0] <= pour_rms[1] && pour_rms[0] < pour_rms[2] ? "PASS" : "FAIL"), pour_rms[0], pour_rms[1], pour_rms[2]);
+
+    // Test 4-9: Mass rate. Steady, cup placed, steady, then a pour. Error over the last 2s of the pour.
+    // Run with both signs of the conversion factor. The shipped load cell reads fewer counts as
+    // mass is added, so every mass is negative.
+    const int32_t pour_mg_s [3] = {500, 2000, 4000};
+    const float mg_per_count [2] = {TEST_MG_PER_COUNT, -TEST_MG_PER_COUNT};
+    nau7802_ scale = {.conversion_factor_mg = TEST_MG_PER_COUNT, .num_samples = 0, .first_valid = 0};
+    scale.rate_est = kalman_filter_setup(RATE_EST_RATE_NOISE);
+    for(uint8_t sign = 0; sign < 2; sign++){
+        scale.conversion_factor_mg = mg_per_count[sign];
+        const int32_t cup = (mg_per_count[sign] > 0 ? TEST_CUP : -TEST_CUP);
+        for(uint8_t k = 0; k < 3; k++){
+            scale.filter.mad_q = 0;
+            _nau7802_filter_reset(&scale.filter, (TEST_SPS*NAU7802_FILTER_WINDOW_MS)/1000);
+            scale.first_valid = scale.num_samples;
+
+            int32_t max_step_rate = 0;
+            int rise_ms = -1;
+            int64_t err_sum = 0;
+            int n_err = 0;
+            uint64_t t_us = 1000000;
+            const int n_total = 7*TEST_SPS;
+            for(int i = 0; i < n_total; i++){
+                t_us += 1000000/TEST_SPS;
+                int32_t truth = TEST_BASE;
+                if(i >= TEST_SPS)   truth += cup;
+                if(i >= 3*TEST_SPS) truth += (pour_mg_s[k]*(i - 3*TEST_SPS))/(TEST_SPS*mg_per_count[sign]);
+                _nau7802_add_conversion(&scale, truth + _nau7802_test_noise(), t_us);
+
+                const int32_t rate = kalman_filter_rate(scale.rate_est);
+                if(i >= TEST_SPS && i < 3*TEST_SPS) max_step_rate = MAX(max_step_rate, abs(rate));
+                if(i >= 3*TEST_SPS && rise_ms < 0 && 10*rate >= 9*pour_mg_s[k]) rise_ms = (1000*(i - 3*TEST_SPS))/TEST_SPS;
+                if(i >= 5*TEST_SPS){
+                    err_sum += abs(rate - pour_mg_s[k]);
+                    n_err++;
+                }
+            }
+            const int32_t mean_err = err_sum/n_err;
+            printf("Test %d:  %s (%.2f mg/count, pour %d mg/s: 90%% rise %d ms, mean rate error %d mg/s, peak rate after cup placed %d mg/s)\n", 
+                   4 + 3*sign + k, (rise_ms >= 0 && mean_err < 50 + pour_mg_s[k]/20 && max_step_rate < 500 ? "PASS" : "FAIL"),
+                   mg_per_count[sign], (int)pour_mg_s[k], rise_ms, (int)mean_err, (int)max_step_rate);
+        }
+    }
+    scale.conversion_factor_mg = TEST_MG_PER_COUNT;
+
+    // Test 10: Auto-zero. Empty scale at 10 SPS drifting 1 mg/s for 10 minutes, then a cup is placed.
+    const int drift_sps = 10;
+    const int n_drift = 600*drift_sps;
+    const int n_cup = 20*drift_sps;
+    int32_t zero_err_mg [2];
+    int32_t cup_err_mg = 0;
+    for(uint8_t az = 0; az < 2; az++){
+        scale.filter.mad_q = 0;
+        _nau7802_filter_reset(&scale.filter, (drift_sps*NAU7802_FILTER_WINDOW_MS)/1000);
+        scale.first_valid = scale.num_samples;
+        scale.origin = TEST_BASE;
+        update_us_since_boot(&scale.last_auto_zero, 0);
+
+        uint64_t t_us = 1000000;
+        for(int i = 0; i < n_drift + n_cup; i++){
+            t_us += 1000000/drift_sps;
+            int32_t truth = TEST_BASE + (i/drift_sps)/TEST_MG_PER_COUNT;
+            if(i >= n_drift) truth += TEST_CUP;
+            _nau7802_add_conversion(&scale, truth + _nau7802_test_noise()/3, t_us);
+            if(az){
+                absolute_time_t now;
+                update_us_since_boot(&now, t_us);
+                _nau7802_track_zero(&scale, now);
+            }
+            if(i == n_drift - 1){
+                zero_err_mg[az] = TEST_MG_PER_COUNT*((int32_t)scale.filtered_val - (int32_t)scale.origin);
+            }
+        }
+        if(az) cup_err_mg = TEST_MG_PER_COUNT*((int32_t)scale.filtered_val - (int32_t)scale.origin - TEST_CUP);
+    }
+    printf("Test 10: %s (zero error after 600 mg of drift: auto-zero %d mg, none %d mg. Cup error with auto-zero %d mg)\n",
+           (abs(zero_err_mg[1]) < 50 && abs(zero_err_mg[0]) > 500 && abs(cup_err_mg) < 50 ? "PASS" : "FAIL"),
+           (int)zero_err_mg[1], (int)zero_err_mg[0], (int)cup_err_mg);
+    kalman_filter_deinit(scale.rate_est);
+}
+#endif
@@ -14,10 +14,13 @@
 #include "stdlib.h"
 #include <stdio.h>
 
+#include "utils/kalman_filter.h"
 #include "utils/macros.h"
 
 #define ULKA_PUMP_FLOW_FILTER_SPAN_MS 1505
 #define ULKA_PUMP_FLOW_SAMPLE_RATE_MS 100
+#define ULKA_PUMP_FLOW_EST_RATE_NOISE 10000   // Flow variance added each second by the estimator in (ul/s)^2/s
+#define ULKA_PUMP_FLOW_EST_MAX_STEP_UL_S 10000 // Largest flow change expected from a single power change
 
 /** \brief Struct containing the fields for the actuation and measurement of a single Ulka pump */
 typedef struct ulka_pump_s {
@@ -25,6 +28,9 @@ typedef struct ulka_pump_s {
     flow_meter flow_ml_s;  /**< \brief Flow meter measuring the current flow rate through the pump in ul/ms. */
     bool locked;           /**< \brief Flag indicating if the pump is locked. */
     uint8_t power_percent; /**< \brief The current percent power applied to the pump. */
+    kalman_filter flow_est;   /**< \brief Estimator fusing the flow meter pulses, power changes, and external flow rates. */
+    int32_t ul_per_pulse;     /**< \brief Volume of a single flow meter pulse in ul. */
+    int32_t last_volume_ul;   /**< \brief Flow meter volume at the last estimator tick. */
 } ulka_pump_;
 
 /**
@@ -46,25 +52,159 @@ static const float OFFSET [NUM_LINEAR_REGIONS]    = { 0,      2.6426, 4.0434, 2.
 static const float PUMP_GAIN [NUM_LINEAR_REGIONS] = { 0.4319, 0.0686, 0.0640, 0.1425, 0.1532, 0.1626, 0.0955, 0.0847, 0.1405, 0.1258};
 static const float FLOW_GAIN [NUM_LINEAR_REGIONS] = {-0.6476,-1.0042,-1.2913,-1.5014,-1.5692,-1.6878,-1.6701,-1.6412,-1.6984,-1.6838};
 
+#define LUT_FLOW_BUCKET_SHIFT  9  // Each flow bucket spans 512 ul/s
+#define LUT_FLOW_BUCKET_NUM    21 // Flow buckets cover 0 to 10.24 ml/s
+#define LUT_PRESSURE_STEP_SHIFT 8  // Each pressure step spans 256 mbar
+#define LUT_PRESSURE_STEP_NUM  67 // Pressure steps cover 0 to 16.9 bar
+#define MODEL_Q 12                // Fractional bits of the fixed-point model coefficients
+
+/** \brief Modeled pressure in mbar indexed by percent power and flow bucket. Not clipped at 0. */
+static int16_t _pressure_lut [101][LUT_FLOW_BUCKET_NUM];
+
+/** 
+ * \brief Lowest linear region that may satisfy a target pressure, indexed by flow bucket and pressure step.
+ * 
+ * Raising either flow or pressure can only push the chosen region higher, so the region stored for the
+ * lower corner of each cell is a valid starting point for the search within that cell.
+ */
+static uint8_t _region_lut [LUT_FLOW_BUCKET_NUM][LUT_PRESSURE_STEP_NUM];
+
+static int32_t _offset_q [NUM_LINEAR_REGIONS];     /**< \brief OFFSET in mbar scaled by 2^MODEL_Q. */
+static int32_t _pump_gain_q [NUM_LINEAR_REGIONS];  /**< \brief PUMP_GAIN in mbar/% scaled by 2^MODEL_Q. */
+static int32_t _flow_gain_q [NUM_LINEAR_REGIONS];  /**< \brief FLOW_GAIN in mbar/(ul/s) scaled by 2^MODEL_Q. */
+static int32_t _region_max_q [NUM_LINEAR_REGIONS]; /**< \brief Pressure at the top of each region with no flow. */
+static bool _luts_ready = false;
+
+/**
+ * \brief Index of the first linear region strong enough to reach \p target_mbar at \p flow_ul_s.
+ * 
+ * \param start_region The region to start searching from.
+ * \param target_mbar The target pressure in mbar.
+ * \param flow_ul_s The flowrate in ul/s. Must be between 0 and the top of the flow LUT. 
+ * \return The region index or NUM_LINEAR_REGIONS if no region is strong enough.
+ */
+static uint8_t _ulka_pump_find_region(uint8_t start_region, int32_t target_mbar, int32_t flow_ul_s){
+    const int32_t target_q = target_mbar << MODEL_Q;
+    uint8_t i = start_region;
+    while(i < NUM_LINEAR_REGIONS && _region_max_q[i] + _flow_gain_q[i]*flow_ul_s <= target_q) i++;
+    return i;
+}
+
+/**
+ * \brief Fill the fixed-point coefficients and lookup tables from the floating point model.
+ * 
+ * The tables are shared by all pumps and only built once.
+ */
+static void _ulka_pump_build_luts(){
+    if(_luts_ready) return;
+
+    for(uint8_t i = 0; i < NUM_LINEAR_REGIONS; i++){
+        _offset_q[i]     = (int32_t)(1000*(1<<MODEL_Q)*OFFSET[i]    + 0.5f);
+        _pump_gain_q[i]  = (int32_t)(1000*(1<<MODEL_Q)*PUMP_GAIN[i] + 0.5f);
+        _flow_gain_q[i]  = (int32_t)(     (1<<MODEL_Q)*FLOW_GAIN[i] - 0.5f);
+        _region_max_q[i] = _offset_q[i] + _pump_gain_q[i]*LINEAR_REGION_SPAN*(i+1);
+    }
+
+    for(uint8_t pwr = 0; pwr <= 100; pwr++){
+        const uint8_t r = (pwr == 0 ? 0 : (pwr-1)/LINEAR_REGION_SPAN);
+        for(uint8_t k = 0; k < LUT_FLOW_BUCKET_NUM; k++){
+            const float p_mbar = 1000*(OFFSET[r] + PUMP_GAIN[r]*pwr) + FLOW_GAIN[r]*(k << LUT_FLOW_BUCKET_SHIFT);
+            _pressure_lut[pwr][k] = (pwr == 0 ? 0 : (int16_t)(p_mbar + (p_mbar > 0 ? 0.5f : -0.5f)));
+        }
+    }
+
+    for(uint8_t k = 0; k < LUT_FLOW_BUCKET_NUM; k++){
+        for(uint8_t j = 0; j < LUT_PRESSURE_STEP_NUM; j++){
+            _region_lut[k][j] = _ulka_pump_find_region(0, j << LUT_PRESSURE_STEP_SHIFT, k << LUT_FLOW_BUCKET_SHIFT);
+        }
+    }
+    _luts_ready = true;
+}
+
+/**
+ * \brief Modeled pressure for a given power and flow using the pressure LUT.
+ * 
+ * The model is linear in flow so interpolating between flow buckets is exact up to rounding. 
+ * Flows outside the table are extrapolated from the nearest bucket pair.
+ * 
+ * \param power_percent Pump power between 0 and 100.
+ * \param flow_ul_s Flowrate through the pump in ul/s.
+ * \return Pressure in mbar clipped to be non-negative.
+ */
+static int32_t _ulka_pump_model_mbar(uint8_t power_percent, int32_t flow_ul_s){
+    if(power_percent == 0) return 0;
+
+    const int32_t k = CLAMP(flow_ul_s >> LUT_FLOW_BUCKET_SHIFT, 0, LUT_FLOW_BUCKET_NUM-2);
+    const int32_t frac = flow_ul_s - (k << LUT_FLOW_BUCKET_SHIFT);
+    const int16_t * row = _pressure_lut[power_percent];
+    const int32_t p_mbar = row[k] + (((row[k+1] - row[k])*frac) >> LUT_FLOW_BUCKET_SHIFT);
+    return (p_mbar > 0 ? p_mbar : 0);
+}
+
+/**
+ * \brief Power needed to reach \p target_mbar at \p flow_ul_s.
+ * 
+ * The region LUT gives the lowest candidate region in constant time and the remaining search only
+ * steps past regions whose threshold falls inside the current LUT cell.
+ * 
+ * \param target_mbar The pressure being targeted in mbar.
+ * \param flow_ul_s Flowrate through the pump in ul/s.
+ * \return The required power clipped between 0 and 100.
+ */
+static uint8_t _ulka_pump_model_power(int32_t target_mbar, int32_t flow_ul_s){
+    if(target_mbar < 0) return 0;
+
+    target_mbar = MIN(target_mbar, INT16_MAX);
+    flow_ul_s = CLAMP(flow_ul_s, 0, (LUT_FLOW_BUCKET_NUM-1) << LUT_FLOW_BUCKET_SHIFT);
+    const uint8_t k = flow_ul_s >> LUT_FLOW_BUCKET_SHIFT;
+    const uint8_t j = MIN(target_mbar >> LUT_PRESSURE_STEP_SHIFT, LUT_PRESSURE_STEP_NUM-1);
+    const uint8_t r = _ulka_pump_find_region(_region_lut[k][j], target_mbar, flow_ul_s);
+
+    // None of the regions are strong enough. Return full strength.
+    if(r == NUM_LINEAR_REGIONS) return 100;
+
+    // power = 1 + (target - FLOW_GAIN*flow - OFFSET)/PUMP_GAIN, truncated toward zero
+    const int32_t num_q = (target_mbar << MODEL_Q) - _flow_gain_q[r]*flow_ul_s - _offset_q[r] + _pump_gain_q[r];
+    if(num_q <= 0) return 0;
+    const int32_t power = num_q/_pump_gain_q[r];
+    return MIN(power, 100);
+}
+
 ulka_pump ulka_pump_setup(uint8_t zerocross_pin, uint8_t out_pin, int32_t zerocross_shift_us, uint8_t zerocross_event){
     ulka_pump p = malloc(sizeof(ulka_pump_));
     p->locked = true;
     p->power_percent = 0;
     p->flow_ml_s = NULL;
+    p->flow_est = NULL;
+    _ulka_pump_build_luts();
     p->driver = phasecontrol_setup(zerocross_pin, out_pin, zerocross_shift_us, zerocross_event);
     return p;
 }
 
-int ulka_pump_setup_flow_meter(ulka_pump p, uint8_t pin_num, float ml_per_tick){
+int ulka_pump_setup_flow_meter(ulka_pump p, uint8_t pio_num, uint8_t pin_num, float ml_per_tick){
     if(p->flow_ml_s != NULL) flow_meter_deinit(p->flow_ml_s);
+    if(p->flow_est == NULL) p->flow_est = kalman_filter_setup(ULKA_PUMP_FLOW_EST_RATE_NOISE);
 
-    p->flow_ml_s = flow_meter_setup(pin_num, ml_per_tick, ULKA_PUMP_FLOW_FILTER_SPAN_MS, ULKA_PUMP_FLOW_SAMPLE_RATE_MS);
-    return (p->flow_ml_s == NULL ? PICO_ERROR_GENERIC : PICO_ERROR_NONE);
+    p->flow_ml_s = flow_meter_setup(pio_num, pin_num, ml_per_tick, ULKA_PUMP_FLOW_FILTER_SPAN_MS, ULKA_PUMP_FLOW_SAMPLE_RATE_MS);
+    if(p->flow_ml_s == NULL || p->flow_est == NULL) return PICO_ERROR_GENERIC;
+
+    p->ul_per_pulse = (int32_t)(1000*ml_per_tick + 0.5f);
+    p->last_volume_ul = 0;
+    kalman_filter_reset(p->flow_est, 0, 0, to_ms_since_boot(get_absolute_time()));
+    return PICO_ERROR_NONE;
 }
 
 uint8_t ulka_pump_pwr_percent(ulka_pump p, uint8_t power_percent){
     if(!p->locked){
-        p->power_percent = CLAMP(power_percent, 0, 100);
+        power_percent = CLAMP(power_percent, 0, 100);
+        if(p->flow_est != NULL && power_percent != p->power_percent){
+            // Let the flow estimate move by about as much as the step in power changes the flow.
+            const uint8_t r = (MAX(power_percent, p->power_percent)-1)/LINEAR_REGION_SPAN;
+            const int32_t flow_step = MIN(abs(power_percent - p->power_percent)*(_pump_gain_q[r]/-_flow_gain_q[r]), 
+                                          ULKA_PUMP_FLOW_EST_MAX_STEP_UL_S);
+            kalman_filter_add_rate_uncertainty(p->flow_est, flow_step*flow_step);
+        }
+        p->power_percent = power_percent;
         phasecontrol_set_duty_cycle(p->driver, _percent_to_power_lut[p->power_percent]);
         return p->power_percent;
     }
@@ -72,19 +212,12 @@ uint8_t ulka_pump_pwr_percent(ulka_pump p, uint8_t power_percent){
 }
 
 uint8_t ulka_pump_pressure_to_power(ulka_pump p, const float target_pressure_bar){
-    if(p->flow_ml_s == NULL || target_pressure_bar < 0) return 0;
-    
-    const float flowrate = ulka_pump_get_flow_ml_s(p);
-    for(uint i = 0; i < NUM_LINEAR_REGIONS; i++){
-        // Check if the power in each linear region is strong enough to reach flowrate. If it is, then compute
-        // the required power and return.
-        if(OFFSET[i] + PUMP_GAIN[i]*LINEAR_REGION_SPAN*(i+1) + FLOW_GAIN[i]*flowrate > target_pressure_bar){
-            const float power = 1 + (target_pressure_bar - FLOW_GAIN[i]*flowrate - OFFSET[i])/PUMP_GAIN[i];
-            return CLAMP(power, 0, 100);
-        }
-    }
-    // None of the regions are strong enough. Return full strength.
-    return 100;
+    return ulka_pump_pressure_mbar_to_power(p, (int32_t)(1000*target_pressure_bar));
+}
+
+uint8_t ulka_pump_pressure_mbar_to_power(ulka_pump p, int32_t target_pressure_mbar){
+    if(p->flow_ml_s == NULL) return 0;
+    return _ulka_pump_model_power(target_pressure_mbar, ulka_pump_get_flow_estimate_ul_s(p));
 }
 
 void ulka_pump_off(ulka_pump p){
@@ -108,15 +241,93 @@ float ulka_pump_get_flow_ml_s(ulka_pump p){
     return (p->flow_ml_s == NULL ? 0 : flow_meter_rate(p->flow_ml_s));
 }
 
+int32_t ulka_pump_get_flow_ul_s(ulka_pump p){
+    return (p->flow_ml_s == NULL ? 0 : (int32_t)(1000*flow_meter_rate(p->flow_ml_s)));
+}
+
 float ulka_pump_get_pressure_bar(ulka_pump p){
-    if(p->flow_ml_s == NULL || p->power_percent == 0) return 0;
+    return ulka_pump_get_pressure_mbar(p)/1000.f;
+}
 
-    // Index of the linear region indexed by the percent power (1-10, 11-20, ..., 91-100)
-    const uint8_t active_region = (p->power_percent-1)/LINEAR_REGION_SPAN;
-    const float p_bar = OFFSET[active_region]
-                        + PUMP_GAIN[active_region]*p->power_percent 
-                        + FLOW_GAIN[active_region]*ulka_pump_get_flow_ml_s(p);
-    return (p_bar > 0 ? p_bar : 0);
+int32_t ulka_pump_get_pressure_mbar(ulka_pump p){
+    if(p->flow_ml_s == NULL) return 0;
+    return _ulka_pump_model_mbar(p->power_percent, ulka_pump_get_flow_ul_s(p));
+}
+
+/**
+ * \brief Fuse the latest flow meter volume into the flow estimate.
+ * 
+ * \param p Pump with an estimator to update.
+ * \param volume_ul The current flow meter volume in ul.
+ * \param t_ms The current time in ms.
+ */
+static void _ulka_pump_update_estimate(ulka_pump p, int32_t volume_ul, uint32_t t_ms){
+    kalman_filter_predict(p->flow_est, t_ms);
+
+    if(volume_ul < p->last_volume_ul){
+        // Flow meter was zeroed. Restart the volume but keep the flow.
+        kalman_filter_reset(p->flow_est, volume_ul, kalman_filter_rate(p->flow_est), t_ms);
+    } else if(volume_ul != p->last_volume_ul){
+        // A pulse just arrived so the volume is known to within the meter's repeatability
+        kalman_filter_update_value(p->flow_est, volume_ul, (p->ul_per_pulse/10)*(p->ul_per_pulse/10));
+    } else if(kalman_filter_value(p->flow_est) > volume_ul + p->ul_per_pulse){
+        // The next pulse is overdue so the flow is lower than estimated. Softly bound the volume.
+        kalman_filter_update_value(p->flow_est, volume_ul + p->ul_per_pulse, p->ul_per_pulse*p->ul_per_pulse/3);
+    }
+    p->last_volume_ul = volume_ul;
+}
+
+/**
+ * \brief Checks if the volume will have reached a target once \p lag_ms has passed.
+ * 
+ * \param volume_ul The current volume estimate in ul.
+ * \param flow_ul_s The current flow estimate in ul/s.
+ * \param target_ul The target volume in ul.
+ * \param lag_ms The time until the flow stops in ms.
+ * \return True if the predicted volume is at or above the target.
+ */
+static inline bool _ulka_pump_predict_volume_reached(int32_t volume_ul, int32_t flow_ul_s, int32_t target_ul, uint32_t lag_ms){
+    return volume_ul + (int32_t)(((int64_t)flow_ul_s*lag_ms)/1000) >= target_ul;
+}
+
+void ulka_pump_tick(ulka_pump p){
+    if(p->flow_ml_s == NULL) return;
+
+    const int32_t volume_ul = (int32_t)(1000*flow_meter_volume(p->flow_ml_s) + 0.5f);
+    _ulka_pump_update_estimate(p, volume_ul, to_ms_since_boot(get_absolute_time()));
+}
+
+void ulka_pump_add_flow_measurement(ulka_pump p, int32_t flow_ul_s, uint32_t var){
+    if(p->flow_est == NULL) return;
+    kalman_filter_update_rate(p->flow_est, flow_ul_s, var);
+}
+
+int32_t ulka_pump_get_flow_estimate_ul_s(ulka_pump p){
+    if(p->flow_est == NULL) return 0;
+    return MAX(kalman_filter_rate(p->flow_est), 0);
+}
+
+int32_t ulka_pump_get_pressure_estimate_mbar(ulka_pump p){
+    if(p->flow_ml_s == NULL) return 0;
+    return _ulka_pump_model_mbar(p->power_percent, ulka_pump_get_flow_estimate_ul_s(p));
+}
+
+int32_t ulka_pump_get_volume_estimate_ul(ulka_pump p){
+    if(p->flow_est == NULL) return 0;
+    return MAX(kalman_filter_value(p->flow_est), 0);
+}
+
+void ulka_pump_zero_volume(ulka_pump p){
+    if(p->flow_ml_s == NULL) return;
+    flow_meter_zero(p->flow_ml_s);
+    p->last_volume_ul = 0;
+    kalman_filter_reset(p->flow_est, 0, kalman_filter_rate(p->flow_est), to_ms_since_boot(get_absolute_time()));
+}
+
+bool ulka_pump_volume_reached(ulka_pump p, int32_t target_ul, uint32_t lag_ms){
+    if(p->flow_est == NULL) return false;
+    return _ulka_pump_predict_volume_reached(ulka_pump_get_volume_estimate_ul(p), ulka_pump_get_flow_estimate_ul_s(p), 
+                                             target_ul, lag_ms);
 }
 
 bool ulka_pump_is_locked(ulka_pump p){
@@ -125,7 +336,149 @@ bool ulka_pump_is_locked(ulka_pump p){
 
 void ulka_pump_deinit(ulka_pump p){
     if(p->flow_ml_s != NULL) flow_meter_deinit(p->flow_ml_s);
+    if(p->flow_est != NULL) kalman_filter_deinit(p->flow_est);
     phasecontrol_deinit(p->driver);
     free(p);
 }
-/** @} */
\ No newline at end of file
+#ifdef ULKA_PUMP_BENCHMARK
+#include "hardware/clocks.h"
+
+/** \brief Original floating point pressure model used as the benchmark reference. */
+static float _ulka_pump_model_bar_float(uint8_t power_percent, float flowrate){
+    if(power_percent == 0) return 0;
+    const uint8_t r = (power_percent-1)/LINEAR_REGION_SPAN;
+    const float p_bar = OFFSET[r] + PUMP_GAIN[r]*power_percent + FLOW_GAIN[r]*flowrate;
+    return (p_bar > 0 ? p_bar : 0);
+}
+
+/** \brief Original floating point inverse model used as the benchmark reference. */
+static uint8_t _ulka_pump_model_power_float(float target_pressure_bar, float flowrate){
+    if(target_pressure_bar < 0) return 0;
+    for(uint i = 0; i < NUM_LINEAR_REGIONS; i++){
+        if(OFFSET[i] + PUMP_GAIN[i]*LINEAR_REGION_SPAN*(i+1) + FLOW_GAIN[i]*flowrate > target_pressure_bar){
+            const float power = 1 + (target_pressure_bar - FLOW_GAIN[i]*flowrate - OFFSET[i])/PUMP_GAIN[i];
+            return CLAMP(power, 0, 100);
+        }
+    }
+    return 100;
+}
+
+#define BENCH_FLOW_STEP_UL_S     125
+#define BENCH_FLOW_MAX_UL_S    10000
+#define BENCH_PRESSURE_STEP_MBAR  50
+#define BENCH_PRESSURE_MAX_MBAR 17000
+
+void ulka_pump_benchmark(){
+    _ulka_pump_build_luts();
+    const float cycles_per_us = clock_get_hz(clk_sys)/1e6f;
+    volatile int32_t sink = 0; // Keeps the timed loops from being optimized away
+
+    // Forward model: accuracy
+    int32_t fwd_max_err = 0;
+    uint32_t fwd_calls = 0;
+    for(uint8_t pwr = 0; pwr <= 100; pwr++){
+        for(int32_t f = 0; f <= BENCH_FLOW_MAX_UL_S; f += BENCH_FLOW_STEP_UL_S){
+            const int32_t ref = (int32_t)(1000*_ulka_pump_model_bar_float(pwr, f/1000.f) + 0.5f);
+            const int32_t err = abs(_ulka_pump_model_mbar(pwr, f) - ref);
+            fwd_max_err = MAX(fwd_max_err, err);
+            fwd_calls++;
+        }
+    }
+
+    // Forward model: timing
+    uint32_t t0 = time_us_32();
+    for(uint8_t pwr = 0; pwr <= 100; pwr++){
+        for(int32_t f = 0; f <= BENCH_FLOW_MAX_UL_S; f += BENCH_FLOW_STEP_UL_S) sink += _ulka_pump_model_mbar(pwr, f);
+    }
+    const uint32_t fwd_fixed_us = time_us_32() - t0;
+    t0 = time_us_32();
+    for(uint8_t pwr = 0; pwr <= 100; pwr++){
+        for(int32_t f = 0; f <= BENCH_FLOW_MAX_UL_S; f += BENCH_FLOW_STEP_UL_S) sink += _ulka_pump_model_bar_float(pwr, f/1000.f);
+    }
+    const uint32_t fwd_float_us = time_us_32() - t0;
+
+    // Inverse model: accuracy
+    int32_t inv_max_err = 0;
+    uint32_t inv_calls = 0, inv_mismatch = 0;
+    for(int32_t f = 0; f <= BENCH_FLOW_MAX_UL_S; f += BENCH_FLOW_STEP_UL_S){
+        for(int32_t t = 0; t <= BENCH_PRESSURE_MAX_MBAR; t += BENCH_PRESSURE_STEP_MBAR){
+            const int32_t err = abs(_ulka_pump_model_power(t, f) - _ulka_pump_model_power_float(t/1000.f, f/1000.f));
+            inv_max_err = MAX(inv_max_err, err);
+            if(err != 0) inv_mismatch++;
+            inv_calls++;
+        }
+    }
+
+    // Inverse model: timing
+    t0 = time_us_32();
+    for(int32_t f = 0; f <= BENCH_FLOW_MAX_UL_S; f += BENCH_FLOW_STEP_UL_S){
+        for(int32_t t = 0; t <= BENCH_PRESSURE_MAX_MBAR; t += BENCH_PRESSURE_STEP_MBAR) sink += _ulka_pump_model_power(t, f);
+    }
+    const uint32_t inv_fixed_us = time_us_32() - t0;
+    t0 = time_us_32();
+    for(int32_t f = 0; f <= BENCH_FLOW_MAX_UL_S; f += BENCH_FLOW_STEP_UL_S){
+        for(int32_t t = 0; t <= BENCH_PRESSURE_MAX_MBAR; t += BENCH_PRESSURE_STEP_MBAR) sink += _ulka_pump_model_power_float(t/1000.f, f/1000.f);
+    }
+    const uint32_t inv_float_us = time_us_32() - t0;
+
+    printf("Pressure model (%lu calls): fixed %.1f cycles/call, float %.1f cycles/call, max error %ld mbar\n",
+           fwd_calls, cycles_per_us*fwd_fixed_us/fwd_calls, cycles_per_us*fwd_float_us/fwd_calls, fwd_max_err);
+    printf("Inverse model  (%lu calls): fixed %.1f cycles/call, float %.1f cycles/call, max error %ld%% (%lu mismatches)\n",
+           inv_calls, cycles_per_us*inv_fixed_us/inv_calls, cycles_per_us*inv_float_us/inv_calls, inv_max_err, inv_mismatch);
+    UNUSED_PARAMETER(sink);
+}
+#endif
+
+#ifdef ULKA_PUMP_TESTS
+#define TEST_TICK_MS        10     // Period of the simulated main loop
+#define TEST_UL_PER_PULSE   500    // Volume of a simulated flow meter pulse
+#define TEST_RISE_MS        150    // Time constant of the simulated flow when the pump switches on
+#define TEST_SHUTOFF_MS     100    // Simulated time between switching the pump off and the flow stopping
+#define TEST_TARGET_UL      100000 // Volume to dose in each test
+
+void ulka_pump_test(){
+    const int32_t flows_ul_s [] = {1000, 2000, 4000, 6000};
+    uint32_t rand_state = 1;
+    ulka_pump_ sim = {.flow_ml_s = NULL, .ul_per_pulse = TEST_UL_PER_PULSE, .last_volume_ul = 0};
+    sim.flow_est = kalman_filter_setup(ULKA_PUMP_FLOW_EST_RATE_NOISE);
+
+    for(uint i = 0; i < sizeof(flows_ul_s)/sizeof(flows_ul_s[0]); i++){
+        // Start from rest and let the estimate expect a step in flow like ulka_pump_pwr_percent does
+        kalman_filter_reset(sim.flow_est, 0, 0, 0);
+        kalman_filter_add_rate_uncertainty(sim.flow_est, flows_ul_s[i]*flows_ul_s[i]);
+        sim.last_volume_ul = 0;
+
+        float flow_ul_s = 0, volume_ul = 0, next_pulse_ul = TEST_UL_PER_PULSE;
+        int32_t meter_ul = 0;
+        float predicted_ul = -1, naive_ul = -1;
+        for(uint32_t t_ms = 0; predicted_ul < 0 || naive_ul < 0; t_ms += TEST_TICK_MS){
+            // Step the simulated flow and pulse train. Pulses vary by up to 3% in volume.
+            flow_ul_s += (flows_ul_s[i] - flow_ul_s)*TEST_TICK_MS/TEST_RISE_MS;
+            volume_ul += flow_ul_s*TEST_TICK_MS/1000;
+            while(volume_ul >= next_pulse_ul){
+                meter_ul += TEST_UL_PER_PULSE;
+                rand_state = 1664525*rand_state + 1013904223;
+                next_pulse_ul += TEST_UL_PER_PULSE*(0.97f + 0.06f*(rand_state >> 8)/(1 << 24));
+            }
+
+            // Dispensed volume includes the flow that continues after switching the pump off
+            _ulka_pump_update_estimate(&sim, meter_ul, t_ms);
+            if(predicted_ul < 0 && ulka_pump_volume_reached(&sim, TEST_TARGET_UL, TEST_SHUTOFF_MS)){
+                predicted_ul = volume_ul + flow_ul_s*TEST_SHUTOFF_MS/1000;
+            }
+            if(naive_ul < 0 && meter_ul >= TEST_TARGET_UL){
+                naive_ul = volume_ul + flow_ul_s*TEST_SHUTOFF_MS/1000;
+            }
+        }
+        const float err_ml = (predicted_ul - TEST_TARGET_UL)/1000;
+        const float naive_err_ml = (naive_ul - TEST_TARGET_UL)/1000;
+        const bool pass = (err_ml < TEST_UL_PER_PULSE/1000.f && err_ml > -TEST_UL_PER_PULSE/1000.f 
+                           && (err_ml < 0 ? -err_ml : err_ml) <= (naive_err_ml < 0 ? -naive_err_ml : naive_err_ml));
+        printf("Test %d:  %s (%0.1f ml/s: dispensed %0.2f ml, stopping on meter %0.2f ml, target %0.2f ml)\n", 
+               i+1, (pass ? "PASS" : "FAIL"), flows_ul_s[i]/1000.f, predicted_ul/1000, naive_ul/1000, TEST_TARGET_UL/1000.f);
+    }
+    kalman_filter_deinit(sim.flow_est);
+}
+#endif
+
+/** @} */
@@ -18,13 +18,16 @@
 
 #include "machine_logic/autobrew.h"
 #include "machine_logic/machine_settings.h"
+#include "machine_logic/shot_log.h"
 
 #include "drivers/nau7802.h"
 #include "drivers/lmt01.h"
 #include "drivers/ulka_pump.h"
+#include "drivers/mb85_fram.h"
 
 #include "utils/thermal_runaway_watcher.h"
 #include "utils/gpio_irq_timestamp.h"
+#include "utils/gpio_multi_callback.h"
 #include "utils/binary_output.h"
 #include "utils/binary_input.h"
 #include "utils/slow_pwm.h"
@@ -45,8 +48,15 @@ static absolute_time_t         ac_on_time;  /**< Records the time of when the ma
 static binary_output           solenoid;    /**< Drives the digital output for the solenoid. */
 static slow_pwm                heater;      /**< PWM signal for the SSR driving the boiler. */
 static lmt01                   thermo;      /**< Boiler thermometer. */
+#ifdef LMT01_GROUP_DATA_PIN
+static lmt01                   group_thermo;/**< Group head thermometer. */
+#endif
 static nau7802                 scale;       /**< Output scale. */
 static ulka_pump               pump;        /**< The vibratory pump. */
+static mb85_fram               mem;         /**< FRAM holding the settings and shot log. */
+
+/** Set once hot-water mode has dispensed its volume. Cleared when the pump is switched off. */
+static bool hot_water_dispensed = false;
 
 /** Boiler controller */
 static pid  heater_pid;
@@ -83,10 +93,19 @@ static inline bool is_ac_on_and_settled(){
 /** 
  * \brief Getter for the boiler temp. 
  * Used as a helper function for the boiler PID controller.
- * \returns The current boiler temp in C. 
+ * \returns The median of the latest boiler temps in C. 
  */
 static pid_data read_boiler_thermo_C(){
-    return lmt01_read_float(thermo);
+    return lmt01_read_median_float(thermo);
+}
+
+/** 
+ * \brief Getter for the time of the latest boiler temp. 
+ * Used as a helper function for the boiler PID controller.
+ * \returns The time the latest boiler temp was sampled in ms since boot. 
+ */
+static pid_time read_boiler_thermo_time_ms(){
+    return to_ms_since_boot(lmt01_read_time(thermo));
 }
 
 /** 
@@ -136,9 +155,9 @@ static bool scale_at_val(int32_t val_mg){
  */
 static bool system_at_flow(int32_t flow_ul_s){
     if(flow_ul_s > 0){
-        return 1000.0*ulka_pump_get_flow_ml_s(pump) >= flow_ul_s;
+        return ulka_pump_get_flow_estimate_ul_s(pump) >= flow_ul_s;
     } else {
-        return 1000.0*ulka_pump_get_flow_ml_s(pump) <= -flow_ul_s;
+        return ulka_pump_get_flow_estimate_ul_s(pump) <= -flow_ul_s;
     }
 }
 
@@ -150,19 +169,27 @@ static bool system_at_flow(int32_t flow_ul_s){
  */
 static bool system_at_pressure(int32_t pressure_mbar){
     if(pressure_mbar > 0){
-        return ulka_pump_get_pressure_bar(pump) >= (pressure_mbar/1000.);
+        return ulka_pump_get_pressure_estimate_mbar(pump) >= pressure_mbar;
     } else {
-        return ulka_pump_get_pressure_bar(pump) <= -(pressure_mbar/1000.);
+        return ulka_pump_get_pressure_estimate_mbar(pump) <= -pressure_mbar;
     }
 }
 
+/** 
+ * \brief Checks if the volume pumped since the pump switch was turned on will reach the passed
+ * in value once the pump is switched off.
+ */
+static bool system_at_volume(int32_t volume_ul){
+    return ulka_pump_volume_reached(pump, volume_ul, PUMP_SHUTOFF_LAG_MS);
+}
+
 /** 
  * \brief Returns the pump power required to hit target pressure (clipped between 0 and 100).
  * \param target_pressure_mbar The pressure in mbar that is targeted.
  * \returns The pump power needed to hit the target pressure in percent power.
 */
 static uint8_t get_power_for_pressure(uint16_t target_pressure_mbar){
-    return ulka_pump_pressure_to_power(pump, target_pressure_mbar/1000.0);
+    return ulka_pump_pressure_mbar_to_power(pump, target_pressure_mbar);
 }
 
 /** \brief Returns the pump power needed to regulated to the target flow rate.
@@ -216,6 +243,9 @@ static void espresso_machine_autobrew_setup(){
             const machine_setting t_mass = machine_settings_get(MS_A1_TRGR_MASS_10g + offset);
             if(t_mass>0) autobrew_leg_add_trigger(leg_id, scale_at_val, 100*t_mass);
 
+            const machine_setting t_vol = machine_settings_get(MS_A1_TRGR_VOL_ml + offset);
+            if(t_vol>0) autobrew_leg_add_trigger(leg_id, system_at_volume, 1000*t_vol);
+
             // Zero scale on first non-zero leg found
             if(is_first_leg){
                 is_first_leg = false;
@@ -234,7 +264,8 @@ static void espresso_machine_autobrew_setup(){
  * The mode dial sets flags for its current value and if it changed. If it does 
  * change, the scale is zeroed for weighing beans.
  * 
- * The pump switch sets flags for its current value and if it changed.
+ * The pump switch sets flags for its current value and if it changed. If switched on, the
+ * pumped volume is zeroed for the volumetric triggers.
  */
 static void espresso_machine_update_switches(){
     const bool new_ac_switch = is_ac_on();
@@ -257,6 +288,7 @@ static void espresso_machine_update_switches(){
     if(_state.switches.pump_switch != new_pump_switch){
         _state.switches.pump_switch_changed = (_state.switches.pump_switch ? -1 : 1);
         _state.switches.pump_switch = new_pump_switch;
+        if(new_pump_switch) ulka_pump_zero_volume(pump);
     } else {
         _state.switches.pump_switch_changed = 0;
     }
@@ -295,8 +327,11 @@ static void espresso_machine_update_settings(){
  * facilitate its easy access.
 */
 static void espresso_machine_update_pump(){
-    // Lock the pump if AC is off OR pump is on and the mode has changed or it has been locked already.
-    if(!is_ac_on_and_settled() || thermal_runaway_watcher_errored(trw)
+    // Refresh the flow and pressure estimates used by the autobrew triggers
+    ulka_pump_tick(pump);
+
+    // Lock the pump if AC is off, the boiler can't be monitored, OR pump is on and the mode has changed or it has been locked already.
+    if(!is_ac_on_and_settled() || thermal_runaway_watcher_errored(trw) || _state.drivers.boiler_thermo == LMT01_DEGRADED
        || (_state.switches.pump_switch && (_state.switches.mode_dial_changed || ulka_pump_is_locked(pump)))){
         ulka_pump_lock(pump);
     } else {
@@ -310,8 +345,14 @@ static void espresso_machine_update_pump(){
         autobrew_reset();
         ulka_pump_off(pump);
         binary_output_put(solenoid, 0, 0);
+        hot_water_dispensed = false;
     } else if (MODE_HOT == _state.switches.mode_dial){
-        ulka_pump_pwr_percent(pump, machine_settings_get(MS_POWER_HOT_PER));
+        // Dispense the set volume, if any, and then wait for the pump switch to be turned off
+        const machine_setting hot_volume_ml = machine_settings_get(MS_VOLUME_HOT_ml);
+        if(hot_volume_ml > 0 && !hot_water_dispensed){
+            hot_water_dispensed = system_at_volume(1000*hot_volume_ml);
+        }
+        ulka_pump_pwr_percent(pump, (hot_water_dispensed ? 0 : machine_settings_get(MS_POWER_HOT_PER)));
         binary_output_put(solenoid, 0, 0);
     } else if (MODE_MANUAL == _state.switches.mode_dial){
         ulka_pump_pwr_percent(pump, machine_settings_get(MS_POWER_BREW_PER));
@@ -333,18 +374,61 @@ static void espresso_machine_update_pump(){
     // Update Pump States
     _state.pump.pump_lock     = ulka_pump_is_locked(pump);
     _state.pump.power_level   = ulka_pump_get_pwr(pump);
-    _state.pump.flowrate_ml_s = ulka_pump_get_flow_ml_s(pump);
-    _state.pump.pressure_bar  = ulka_pump_get_pressure_bar(pump);
+    _state.pump.flowrate_ml_s = ulka_pump_get_flow_estimate_ul_s(pump)/1000.f;
+    _state.pump.pressure_bar  = ulka_pump_get_pressure_estimate_mbar(pump)/1000.f;
+}
+
+/**
+ * \brief Advance the bring-up of the scale, record the status of each peripheral, and save the
+ * scale's mass and mass rate.
+ * 
+ * The scale runs at SCALE_SHOT_RATE while the pump is on in auto mode so the mass triggers react 
+ * quickly. Otherwise it runs at the low-noise 10 SPS for weighing beans. Auto-zero tracking is
+ * paused while the pump is on so the first drips of a shot aren't zeroed away.
+ */
+static void espresso_machine_update_drivers(){
+    const conversion_rate scale_rate = (_state.switches.pump_switch && MODE_AUTO == _state.switches.mode_dial
+                                        ? SCALE_SHOT_RATE : SPS_010);
+    if(nau7802_get_conversion_rate(scale) != scale_rate){
+        nau7802_set_conversion_rate(scale, scale_rate);
+    }
+    nau7802_set_auto_zero(scale, !_state.switches.pump_switch);
+    _state.drivers.scale = nau7802_tick(scale);
+    _state.scale.val_mg = nau7802_read_mg(scale);
+    _state.scale.rate_mg_s = nau7802_read_rate_mg_s(scale);
+    _state.drivers.boiler_thermo = lmt01_get_status(thermo);
+    #ifdef LMT01_GROUP_DATA_PIN
+    _state.drivers.group_thermo = lmt01_get_status(group_thermo);
+    #endif
 }
 
 /**
  * \brief Updates the boiler's setpoint based on the machine's mode, saves its state,
  * and ticks its controller.
+ * 
+ * The boiler is held off until its thermometer is ready. If the thermometer degrades, the
+ * boiler and pump are shut down.
  */
 static void espresso_machine_update_boiler(){
-    _state.boiler.temperature = lmt01_read(thermo);
+    #ifdef LMT01_GROUP_DATA_PIN
+    const lmt01 thermos [2] = {thermo, group_thermo};
+    int temps_cC [2];
+    lmt01_read_array(thermos, 2, temps_cC);
+    _state.boiler.temperature = temps_cC[0];
+    _state.boiler.group_temperature = temps_cC[1];
+    #else
+    _state.boiler.temperature = lmt01_read_median(thermo);
+    #endif
 
     #ifdef ENABLE_BOILER
+    if(_state.drivers.boiler_thermo != LMT01_READY){
+        if(_state.drivers.boiler_thermo == LMT01_DEGRADED) espresso_machine_e_stop();
+        else slow_pwm_set_duty(heater, 0);
+        _state.boiler.setpoint = 0;
+        _state.boiler.power_level = slow_pwm_get_duty(heater);
+        return;
+    }
+
     // Update setpoints
     if(is_ac_on_and_settled()){
         if(_state.switches.mode_dial == MODE_STEAM){
@@ -372,6 +456,25 @@ static void espresso_machine_update_boiler(){
     #endif
 }
 
+/**
+ * \brief Summarize each shot into the shot log and print the log if requested.
+ * 
+ * A shot runs while the pump is on and unlocked in manual or auto mode.
+ */
+static void espresso_machine_update_shot_log(){
+    const bool brewing = _state.switches.pump_switch && !_state.pump.pump_lock
+                         && (MODE_MANUAL == _state.switches.mode_dial || MODE_AUTO == _state.switches.mode_dial);
+    if(brewing){
+        if(!shot_log_running()){
+            shot_log_start(_state.switches.mode_dial, machine_settings_get_profile(), _state.scale.val_mg);
+        }
+        shot_log_update(_state.boiler.temperature, ulka_pump_get_pressure_estimate_mbar(pump));
+    } else if(shot_log_running()){
+        shot_log_finish(_state.scale.val_mg, ulka_pump_get_volume_estimate_ul(pump));
+    }
+    shot_log_tick();
+}
+
 /**
  * \brief Updates the 3 LEDs on the front of the machine.
  * 
@@ -407,7 +510,9 @@ int espresso_machine_setup(espresso_machine_viewer * state_viewer){
 
     i2c_bus_setup(bus, 100000, I2C_SCL_PIN, I2C_SDA_PIN);
 
-    machine_settings_setup(mb85_fram_setup(bus, 0x00, NULL));
+    mem = mb85_fram_setup(bus, 0x00, NULL);
+    machine_settings_setup(mem);
+    shot_log_setup(mem);
 
     autobrew_init();
 
@@ -419,6 +524,7 @@ int espresso_machine_setup(espresso_machine_viewer * state_viewer){
     heater = slow_pwm_setup(HEATER_PWM_PIN, 1260, 64);
     const pid_gains boiler_K = {.p = BOILER_PID_GAIN_P, .i = BOILER_PID_GAIN_I, .d = BOILER_PID_GAIN_D, .f = BOILER_PID_GAIN_F};
     heater_pid = pid_setup(boiler_K, &read_boiler_thermo_C, &read_pump_flowrate_ul_s, &apply_boiler_input, 0, 1, 100, 1000);
+    pid_set_sensor_time_getter(heater_pid, &read_boiler_thermo_time_ms);
     trw = thermal_runaway_watcher_setup(THERMAL_RUNAWAY_WATCHER_MAX_CONSECUTIVE_TEMP_CHANGE_cC,
                                         THERMAL_RUNAWAY_WATCHER_CONVERGENCE_TOL_cC,
                                         THERMAL_RUNAWAY_WATCHER_DIVERGENCE_TOL_cC,
@@ -439,17 +545,24 @@ int espresso_machine_setup(espresso_machine_viewer * state_viewer){
 
     // Setup the pump
     pump = ulka_pump_setup(AC_0CROSS_PIN, PUMP_OUT_PIN, AC_0CROSS_SHIFT, ZEROCROSS_EVENT_RISING);
-    ulka_pump_setup_flow_meter(pump, FLOW_RATE_PIN, PULSE_TO_FLOW_CONVERSION_ML);
+    ulka_pump_setup_flow_meter(pump, 1, FLOW_RATE_PIN, PULSE_TO_FLOW_CONVERSION_ML);
 
     // Setup solenoid as a binary output
     uint8_t solenoid_pin [1] = {SOLENOID_PIN};
     solenoid = binary_output_setup(solenoid_pin, 1);
 
-    // Setup nau7802
+    // Start the nau7802 bring-up. It is finished by the tick.
     scale = nau7802_setup(bus, SCALE_CONVERSION_MG);
+    #ifdef SCALE_DRDY_PIN
+    nau7802_setup_drdy(scale, SCALE_DRDY_PIN);
+    #endif
+    nau7802_set_offset_cal_period_ms(scale, SCALE_OFFSET_CAL_PERIOD_MS);
 
-    // Setup thermometer
+    // Setup thermometer. The first temperature arrives in the background.
     thermo = lmt01_setup(0, LMT01_DATA_PIN, BOILER_TEMP_OFFSET_cC);
+    #ifdef LMT01_GROUP_DATA_PIN
+    group_thermo = lmt01_setup(0, LMT01_GROUP_DATA_PIN, 0);
+    #endif
 
     // Setup AC power sensor
     gpio_irq_timestamp_setup(AC_0CROSS_PIN, ZEROCROSS_EVENT_RISING);
@@ -461,10 +574,15 @@ int espresso_machine_setup(espresso_machine_viewer * state_viewer){
 }
 
 void espresso_machine_tick(){
+    gpio_multi_callback_process_deferred();
+    // Hand finished I2C transactions (e.g. conversion reads) to their drivers
+    i2c_bus_process_completed();
+    espresso_machine_update_drivers();
     espresso_machine_update_switches();
     espresso_machine_update_settings();
     espresso_machine_update_boiler();
     espresso_machine_update_pump();
+    espresso_machine_update_shot_log();
     espresso_machine_update_leds();
 }
 
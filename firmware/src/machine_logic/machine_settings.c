@@ -5,15 +5,19 @@
  * \file machine_settings.c
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief Machine Settings source
- * \version 1.0
+ * \version 1.7
  * \date 2023-07-01
  */
 
 #include "machine_logic/machine_settings.h"
 
+#include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "machine_logic/local_ui.h"
+#include "machine_logic/shot_log.h"
 #include "utils/value_flasher.h"
 #include "utils/macros.h"
 
@@ -34,6 +38,48 @@ static const reg_addr MACHINE_SETTINGS_START_ADDR = 0x0000;
 /** \brief The size, in bytes, of a single settings profile */
 static const uint16_t MACHINE_SETTINGS_MEMORY_SIZE = NUM_SETTINGS * sizeof(machine_setting);
 
+/** 
+ * \brief Version of the settings layout in the FRAM. Bump it and add an entry to ::_layouts 
+ * whenever a setting_id is added, removed, or moved.
+ */
+#define MACHINE_SETTINGS_LAYOUT_VERSION 1
+
+/** \brief Settings in each block of the current layout. Catches a ::setting_id added without a new layout. */
+#define MACHINE_SETTINGS_LAYOUT_NUM_SETTINGS 80
+
+static_assert(NUM_SETTINGS == MACHINE_SETTINGS_LAYOUT_NUM_SETTINGS, 
+              "setting_id changed: bump MACHINE_SETTINGS_LAYOUT_VERSION and add a migration to _layouts");
+
+/** \brief Number of saved profiles. */
+#define MACHINE_SETTINGS_NUM_PROFILES 9
+
+/** \brief Number of settings blocks in the FRAM. The current settings followed by each profile. */
+#define MACHINE_SETTINGS_NUM_BLOCKS (1 + MACHINE_SETTINGS_NUM_PROFILES)
+
+/** \brief Bytes between the start of each settings block. Leaves room for 96 settings. */
+#define MACHINE_SETTINGS_BLOCK_STRIDE 0x00C0
+
+/** \brief Address in the FRAM of the ::machine_settings_header. Follows the last block. */
+#define MACHINE_SETTINGS_HEADER_ADDR (MACHINE_SETTINGS_NUM_BLOCKS*MACHINE_SETTINGS_BLOCK_STRIDE)
+
+/** \brief Value marking a valid settings header ("MS"). */
+#define MACHINE_SETTINGS_MAGIC 0x4D53
+
+/** \brief Header describing the settings blocks stored in the FRAM. */
+typedef struct {
+    uint16_t magic;                              /**<\brief ::MACHINE_SETTINGS_MAGIC if the header is valid. */
+    uint16_t version;                            /**<\brief Layout version of the blocks. */
+    uint16_t crc [MACHINE_SETTINGS_NUM_BLOCKS];  /**<\brief CRC-16 of each block. */
+} machine_settings_header;
+
+static_assert(NUM_SETTINGS*sizeof(machine_setting) <= MACHINE_SETTINGS_BLOCK_STRIDE, "Settings block overflows its stride");
+static_assert(MACHINE_SETTINGS_HEADER_ADDR + sizeof(machine_settings_header) <= SHOT_LOG_START_ADDR, "Settings overlap the shot log");
+
+/** \brief Local copy of the settings header. */
+static machine_settings_header _header;
+/** \brief FRAM link of ::_header. */
+static mb85_fram_var _header_var;
+
 /** \brief Pointer to FRAM memory IC object where settings are stored */
 static mb85_fram _mem = NULL;
 
@@ -44,6 +90,32 @@ static uint8_t _ui_mask;
 
 /** \brief Internal settings array holding the current settings */
 static machine_setting _ms [NUM_SETTINGS];
+/** \brief FRAM link of ::_ms. */
+static mb85_fram_var _ms_var;
+
+/** \brief Time, in ms, settings must be left unchanged before changes are written to the FRAM. */
+#define MACHINE_SETTINGS_FLUSH_DELAY_MS 500
+
+/** 
+ * \brief Longest run of unchanged settings written to join two changed ones in a single write.
+ * A setting is 2 bytes while starting another write costs 3 (device and memory address).
+ */
+#define MACHINE_SETTINGS_FLUSH_MAX_GAP 1
+
+/** \brief Bitfield of the settings changed since they were last written to the FRAM. */
+static uint32_t _dirty [(NUM_SETTINGS + 31)/32];
+
+/** \brief Time, in us since boot, the changed settings are written to the FRAM. */
+static uint64_t _flush_time_us;
+
+/** \brief True if the CRC of the current settings couldn't be queued after they were written. */
+static bool _crc_pending = false;
+
+/** \brief True if the FRAM holds a layout from newer firmware. It is left untouched and the defaults are used. */
+static bool _read_only = false;
+
+/** \brief The profile the settings match or ::MACHINE_SETTINGS_NO_PROFILE if changed since. */
+static uint8_t _profile = MACHINE_SETTINGS_NO_PROFILE;
 
 /**
  * \brief The scale, bounds, and default for a machine setting.
@@ -66,19 +138,14 @@ static const machine_setting_specs _specs [NUM_SETTINGS] = {
     {.scale = 10,  .min = 0,   .max = 600,  .std = 300 , .ln_idx = 5},// MS_WEIGHT_YIELD_10g
     {.scale = 1,   .min = 0,   .max = 100,  .std = 100 , .ln_idx = 6},// MS_POWER_BREW_PER,   
     {.scale = 1,   .min = 0,   .max = 100,  .std = 20  , .ln_idx = 7},// MS_POWER_HOT_PER
-    {.scale = 0,   .min = 0,   .max = 2,    .std = 0   , .ln_idx = 13},// MS_A1_REF_STYLE_ENM
-    {.scale = 10,  .min = 0,   .max = 300,  .std = 25  , .ln_idx = 13},// MS_A1_REF_START_per_100mlps_10bar
-    {.scale = 1,   .min = 0,   .max = 300,  .std = 25  , .ln_idx = 13},// MS_A1_REF_END_per_100mlps_10bar
-    {.scale = 100, .min =-300, .max = 300,  .std = 0   , .ln_idx = 13},// MS_A1_TRGR_FLOW_100mlps
-    {.scale = 10,  .min =-150, .max = 150,  .std = 0   , .ln_idx = 13},// MS_A1_TRGR_PRSR_10bar
-    {.scale = 10,  .min =-300, .max = 300,  .std = 0   , .ln_idx = 13},// MS_A1_TRGR_MASS_10g
-    {.scale = 10,  .min = 0,   .max = 600,  .std = 0   , .ln_idx = 13},// MS_A1_TIMEOUT_s
+    {.scale = 1,   .min = 0,   .max = 1000, .std = 0   , .ln_idx = 8},// MS_VOLUME_HOT_ml
     {.scale = 0,   .min = 0,   .max = 2,    .std = 0   , .ln_idx = 14},// MS_A1_REF_STYLE_ENM
     {.scale = 10,  .min = 0,   .max = 300,  .std = 25  , .ln_idx = 14},// MS_A1_REF_START_per_100mlps_10bar
     {.scale = 1,   .min = 0,   .max = 300,  .std = 25  , .ln_idx = 14},// MS_A1_REF_END_per_100mlps_10bar
     {.scale = 100, .min =-300, .max = 300,  .std = 0   , .ln_idx = 14},// MS_A1_TRGR_FLOW_100mlps
     {.scale = 10,  .min =-150, .max = 150,  .std = 0   , .ln_idx = 14},// MS_A1_TRGR_PRSR_10bar
     {.scale = 10,  .min =-300, .max = 300,  .std = 0   , .ln_idx = 14},// MS_A1_TRGR_MASS_10g
+    {.scale = 1,   .min = 0,   .max = 1000, .std = 0   , .ln_idx = 14},// MS_A1_TRGR_VOL_ml
     {.scale = 10,  .min = 0,   .max = 600,  .std = 0   , .ln_idx = 14},// MS_A1_TIMEOUT_s
     {.scale = 0,   .min = 0,   .max = 2,    .std = 0   , .ln_idx = 15},// MS_A1_REF_STYLE_ENM
     {.scale = 10,  .min = 0,   .max = 300,  .std = 25  , .ln_idx = 15},// MS_A1_REF_START_per_100mlps_10bar
@@ -86,6 +153,7 @@ static const machine_setting_specs _specs [NUM_SETTINGS] = {
     {.scale = 100, .min =-300, .max = 300,  .std = 0   , .ln_idx = 15},// MS_A1_TRGR_FLOW_100mlps
     {.scale = 10,  .min =-150, .max = 150,  .std = 0   , .ln_idx = 15},// MS_A1_TRGR_PRSR_10bar
     {.scale = 10,  .min =-300, .max = 300,  .std = 0   , .ln_idx = 15},// MS_A1_TRGR_MASS_10g
+    {.scale = 1,   .min = 0,   .max = 1000, .std = 0   , .ln_idx = 15},// MS_A1_TRGR_VOL_ml
     {.scale = 10,  .min = 0,   .max = 600,  .std = 0   , .ln_idx = 15},// MS_A1_TIMEOUT_s
     {.scale = 0,   .min = 0,   .max = 2,    .std = 0   , .ln_idx = 16},// MS_A1_REF_STYLE_ENM
     {.scale = 10,  .min = 0,   .max = 300,  .std = 25  , .ln_idx = 16},// MS_A1_REF_START_per_100mlps_10bar
@@ -93,6 +161,7 @@ static const machine_setting_specs _specs [NUM_SETTINGS] = {
     {.scale = 100, .min =-300, .max = 300,  .std = 0   , .ln_idx = 16},// MS_A1_TRGR_FLOW_100mlps
     {.scale = 10,  .min =-150, .max = 150,  .std = 0   , .ln_idx = 16},// MS_A1_TRGR_PRSR_10bar
     {.scale = 10,  .min =-300, .max = 300,  .std = 0   , .ln_idx = 16},// MS_A1_TRGR_MASS_10g
+    {.scale = 1,   .min = 0,   .max = 1000, .std = 0   , .ln_idx = 16},// MS_A1_TRGR_VOL_ml
     {.scale = 10,  .min = 0,   .max = 600,  .std = 0   , .ln_idx = 16},// MS_A1_TIMEOUT_s
     {.scale = 0,   .min = 0,   .max = 2,    .std = 0   , .ln_idx = 17},// MS_A1_REF_STYLE_ENM
     {.scale = 10,  .min = 0,   .max = 300,  .std = 25  , .ln_idx = 17},// MS_A1_REF_START_per_100mlps_10bar
@@ -100,6 +169,7 @@ static const machine_setting_specs _specs [NUM_SETTINGS] = {
     {.scale = 100, .min =-300, .max = 300,  .std = 0   , .ln_idx = 17},// MS_A1_TRGR_FLOW_100mlps
     {.scale = 10,  .min =-150, .max = 150,  .std = 0   , .ln_idx = 17},// MS_A1_TRGR_PRSR_10bar
     {.scale = 10,  .min =-300, .max = 300,  .std = 0   , .ln_idx = 17},// MS_A1_TRGR_MASS_10g
+    {.scale = 1,   .min = 0,   .max = 1000, .std = 0   , .ln_idx = 17},// MS_A1_TRGR_VOL_ml
     {.scale = 10,  .min = 0,   .max = 600,  .std = 0   , .ln_idx = 17},// MS_A1_TIMEOUT_s
     {.scale = 0,   .min = 0,   .max = 2,    .std = 0   , .ln_idx = 18},// MS_A1_REF_STYLE_ENM
     {.scale = 10,  .min = 0,   .max = 300,  .std = 25  , .ln_idx = 18},// MS_A1_REF_START_per_100mlps_10bar
@@ -107,6 +177,7 @@ static const machine_setting_specs _specs [NUM_SETTINGS] = {
     {.scale = 100, .min =-300, .max = 300,  .std = 0   , .ln_idx = 18},// MS_A1_TRGR_FLOW_100mlps
     {.scale = 10,  .min =-150, .max = 150,  .std = 0   , .ln_idx = 18},// MS_A1_TRGR_PRSR_10bar
     {.scale = 10,  .min =-300, .max = 300,  .std = 0   , .ln_idx = 18},// MS_A1_TRGR_MASS_10g
+    {.scale = 1,   .min = 0,   .max = 1000, .std = 0   , .ln_idx = 18},// MS_A1_TRGR_VOL_ml
     {.scale = 10,  .min = 0,   .max = 600,  .std = 0   , .ln_idx = 18},// MS_A1_TIMEOUT_s
     {.scale = 0,   .min = 0,   .max = 2,    .std = 0   , .ln_idx = 19},// MS_A1_REF_STYLE_ENM
     {.scale = 10,  .min = 0,   .max = 300,  .std = 25  , .ln_idx = 19},// MS_A1_REF_START_per_100mlps_10bar
@@ -114,6 +185,7 @@ static const machine_setting_specs _specs [NUM_SETTINGS] = {
     {.scale = 100, .min =-300, .max = 300,  .std = 0   , .ln_idx = 19},// MS_A1_TRGR_FLOW_100mlps
     {.scale = 10,  .min =-150, .max = 150,  .std = 0   , .ln_idx = 19},// MS_A1_TRGR_PRSR_10bar
     {.scale = 10,  .min =-300, .max = 300,  .std = 0   , .ln_idx = 19},// MS_A1_TRGR_MASS_10g
+    {.scale = 1,   .min = 0,   .max = 1000, .std = 0   , .ln_idx = 19},// MS_A1_TRGR_VOL_ml
     {.scale = 10,  .min = 0,   .max = 600,  .std = 0   , .ln_idx = 19},// MS_A1_TIMEOUT_s
     {.scale = 0,   .min = 0,   .max = 2,    .std = 0   , .ln_idx = 20},// MS_A1_REF_STYLE_ENM
     {.scale = 10,  .min = 0,   .max = 300,  .std = 25  , .ln_idx = 20},// MS_A1_REF_START_per_100mlps_10bar
@@ -121,6 +193,7 @@ static const machine_setting_specs _specs [NUM_SETTINGS] = {
     {.scale = 100, .min =-300, .max = 300,  .std = 0   , .ln_idx = 20},// MS_A1_TRGR_FLOW_100mlps
     {.scale = 10,  .min =-150, .max = 150,  .std = 0   , .ln_idx = 20},// MS_A1_TRGR_PRSR_10bar
     {.scale = 10,  .min =-300, .max = 300,  .std = 0   , .ln_idx = 20},// MS_A1_TRGR_MASS_10g
+    {.scale = 1,   .min = 0,   .max = 1000, .std = 0   , .ln_idx = 20},// MS_A1_TRGR_VOL_ml
     {.scale = 10,  .min = 0,   .max = 600,  .std = 0   , .ln_idx = 20},// MS_A1_TIMEOUT_s
     {.scale = 0,   .min = 0,   .max = 2,    .std = 0   , .ln_idx = 21},// MS_A1_REF_STYLE_ENM
     {.scale = 10,  .min = 0,   .max = 300,  .std = 25  , .ln_idx = 21},// MS_A1_REF_START_per_100mlps_10bar
@@ -128,7 +201,16 @@ static const machine_setting_specs _specs [NUM_SETTINGS] = {
     {.scale = 100, .min =-300, .max = 300,  .std = 0   , .ln_idx = 21},// MS_A1_TRGR_FLOW_100mlps
     {.scale = 10,  .min =-150, .max = 150,  .std = 0   , .ln_idx = 21},// MS_A1_TRGR_PRSR_10bar
     {.scale = 10,  .min =-300, .max = 300,  .std = 0   , .ln_idx = 21},// MS_A1_TRGR_MASS_10g
+    {.scale = 1,   .min = 0,   .max = 1000, .std = 0   , .ln_idx = 21},// MS_A1_TRGR_VOL_ml
     {.scale = 10,  .min = 0,   .max = 600,  .std = 0   , .ln_idx = 21},// MS_A1_TIMEOUT_s
+    {.scale = 0,   .min = 0,   .max = 2,    .std = 0   , .ln_idx = 22},// MS_A1_REF_STYLE_ENM
+    {.scale = 10,  .min = 0,   .max = 300,  .std = 25  , .ln_idx = 22},// MS_A1_REF_START_per_100mlps_10bar
+    {.scale = 1,   .min = 0,   .max = 300,  .std = 25  , .ln_idx = 22},// MS_A1_REF_END_per_100mlps_10bar
+    {.scale = 100, .min =-300, .max = 300,  .std = 0   , .ln_idx = 22},// MS_A1_TRGR_FLOW_100mlps
+    {.scale = 10,  .min =-150, .max = 150,  .std = 0   , .ln_idx = 22},// MS_A1_TRGR_PRSR_10bar
+    {.scale = 10,  .min =-300, .max = 300,  .std = 0   , .ln_idx = 22},// MS_A1_TRGR_MASS_10g
+    {.scale = 1,   .min = 0,   .max = 1000, .std = 0   , .ln_idx = 22},// MS_A1_TRGR_VOL_ml
+    {.scale = 10,  .min = 0,   .max = 600,  .std = 0   , .ln_idx = 22},// MS_A1_TIMEOUT_s
     };
 
 static local_ui_folder_tree settings_modifier; /**< \brief Local UI folder tree for updating machine settings*/
@@ -141,6 +223,7 @@ static local_ui_folder              f_set_temp_steam; /**< \brief Folder in tree
 static local_ui_folder          f_set_weight; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder              f_set_weight_yield; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder              f_set_weight_dose;  /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder              f_set_weight_hot;   /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder          f_set_power; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder              f_set_power_brew; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder              f_set_power_hot; /**< \brief Folder in tree used to update machine settings. */
@@ -154,7 +237,9 @@ static local_ui_folder                      f_ab_ab13_ab1_ref_end; /**< \brief F
 static local_ui_folder                  f_ab_ab13_ab1_trgr; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab13_ab1_trgr_flow; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab13_ab1_trgr_prsr; /**< \brief Folder in tree used to update machine settings. */
-static local_ui_folder                      f_ab_ab13_ab1_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                      f_ab_ab13_ab1_trgr_out; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab13_ab1_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab13_ab1_trgr_vol; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab13_ab1_timeout; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder              f_ab_ab13_ab2; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab13_ab2_ref; /**< \brief Folder in tree used to update machine settings. */
@@ -164,7 +249,9 @@ static local_ui_folder                      f_ab_ab13_ab2_ref_end; /**< \brief F
 static local_ui_folder                  f_ab_ab13_ab2_trgr; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab13_ab2_trgr_flow; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab13_ab2_trgr_prsr; /**< \brief Folder in tree used to update machine settings. */
-static local_ui_folder                      f_ab_ab13_ab2_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                      f_ab_ab13_ab2_trgr_out; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab13_ab2_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab13_ab2_trgr_vol; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab13_ab2_timeout; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder              f_ab_ab13_ab3; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab13_ab3_ref; /**< \brief Folder in tree used to update machine settings. */
@@ -174,7 +261,9 @@ static local_ui_folder                      f_ab_ab13_ab3_ref_end; /**< \brief F
 static local_ui_folder                  f_ab_ab13_ab3_trgr; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab13_ab3_trgr_flow; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab13_ab3_trgr_prsr; /**< \brief Folder in tree used to update machine settings. */
-static local_ui_folder                      f_ab_ab13_ab3_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                      f_ab_ab13_ab3_trgr_out; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab13_ab3_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab13_ab3_trgr_vol; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab13_ab3_timeout; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder          f_ab_ab46; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder              f_ab_ab46_ab4; /**< \brief Folder in tree used to update machine settings. */
@@ -185,7 +274,9 @@ static local_ui_folder                      f_ab_ab46_ab4_ref_end; /**< \brief F
 static local_ui_folder                  f_ab_ab46_ab4_trgr; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab46_ab4_trgr_flow; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab46_ab4_trgr_prsr; /**< \brief Folder in tree used to update machine settings. */
-static local_ui_folder                      f_ab_ab46_ab4_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                      f_ab_ab46_ab4_trgr_out; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab46_ab4_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab46_ab4_trgr_vol; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab46_ab4_timeout; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder              f_ab_ab46_ab5; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab46_ab5_ref; /**< \brief Folder in tree used to update machine settings. */
@@ -195,7 +286,9 @@ static local_ui_folder                      f_ab_ab46_ab5_ref_end;  /**< \brief
 static local_ui_folder                  f_ab_ab46_ab5_trgr; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab46_ab5_trgr_flow; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab46_ab5_trgr_prsr; /**< \brief Folder in tree used to update machine settings. */
-static local_ui_folder                      f_ab_ab46_ab5_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                      f_ab_ab46_ab5_trgr_out; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab46_ab5_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab46_ab5_trgr_vol; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab46_ab5_timeout; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder              f_ab_ab46_ab6; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab46_ab6_ref; /**< \brief Folder in tree used to update machine settings. */
@@ -205,7 +298,9 @@ static local_ui_folder                      f_ab_ab46_ab6_ref_end; /**< \brief F
 static local_ui_folder                  f_ab_ab46_ab6_trgr; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab46_ab6_trgr_flow; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab46_ab6_trgr_prsr; /**< \brief Folder in tree used to update machine settings. */
-static local_ui_folder                      f_ab_ab46_ab6_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                      f_ab_ab46_ab6_trgr_out; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab46_ab6_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab46_ab6_trgr_vol; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab46_ab6_timeout; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder          f_ab_ab79; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder              f_ab_ab79_ab7; /**< \brief Folder in tree used to update machine settings. */
@@ -216,7 +311,9 @@ static local_ui_folder                      f_ab_ab79_ab7_ref_end; /**< \brief F
 static local_ui_folder                  f_ab_ab79_ab7_trgr; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab79_ab7_trgr_flow; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab79_ab7_trgr_prsr; /**< \brief Folder in tree used to update machine settings. */
-static local_ui_folder                      f_ab_ab79_ab7_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                      f_ab_ab79_ab7_trgr_out; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab79_ab7_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab79_ab7_trgr_vol; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab79_ab7_timeout; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder              f_ab_ab79_ab8; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab79_ab8_ref; /**< \brief Folder in tree used to update machine settings. */
@@ -226,7 +323,9 @@ static local_ui_folder                      f_ab_ab79_ab8_ref_end;  /**< \brief
 static local_ui_folder                  f_ab_ab79_ab8_trgr; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab79_ab8_trgr_flow; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab79_ab8_trgr_prsr; /**< \brief Folder in tree used to update machine settings. */
-static local_ui_folder                      f_ab_ab79_ab8_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                      f_ab_ab79_ab8_trgr_out; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab79_ab8_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab79_ab8_trgr_vol; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab79_ab8_timeout; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder              f_ab_ab79_ab9; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab79_ab9_ref; /**< \brief Folder in tree used to update machine settings. */
@@ -236,7 +335,9 @@ static local_ui_folder                      f_ab_ab79_ab9_ref_end; /**< \brief F
 static local_ui_folder                  f_ab_ab79_ab9_trgr; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab79_ab9_trgr_flow; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                      f_ab_ab79_ab9_trgr_prsr; /**< \brief Folder in tree used to update machine settings. */
-static local_ui_folder                      f_ab_ab79_ab9_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                      f_ab_ab79_ab9_trgr_out; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab79_ab9_trgr_mass; /**< \brief Folder in tree used to update machine settings. */
+static local_ui_folder                          f_ab_ab79_ab9_trgr_vol; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder                  f_ab_ab79_ab9_timeout; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder      f_presets; /**< \brief Folder in tree used to update machine settings. */
 static local_ui_folder          f_presets_profile_a; /**< \brief Folder in tree used to update machine settings. */
@@ -258,21 +359,24 @@ static local_ui_folder              f_presets_profile_c_2; /**< \brief Folder in
  * \return Started memory address where profile is stored 
  */
 static inline reg_addr _machine_settings_id_to_addr(uint8_t id){
-    return MACHINE_SETTINGS_START_ADDR + (1+id)*MACHINE_SETTINGS_MEMORY_SIZE;
+    return MACHINE_SETTINGS_START_ADDR + (1+id)*MACHINE_SETTINGS_BLOCK_STRIDE;
 }
 
 /**
- * \brief Restores settings to default state if any invalid values are found
+ * \brief Restores a block of settings to default state if any invalid values are found
+ * 
+ * Only needed when a block's CRC doesn't match or after a migration.
  * 
+ * \param block The NUM_SETTINGS settings to check.
  * \return true Invalid values found.
  * \return false No invalid values found.
  */
-static bool _machine_settings_verify(){
+static bool _machine_settings_verify(machine_setting * block){
     for(uint8_t p_id = 0; p_id < NUM_SETTINGS; p_id++){
-        if(_ms[p_id] > _specs[p_id].max || _ms[p_id] < _specs[p_id].min){
+        if(block[p_id] > _specs[p_id].max || block[p_id] < _specs[p_id].min){
             // Invalid setting found. Copy in defaults and return true
             for(uint8_t p_id_2 = 0; p_id_2 < NUM_SETTINGS; p_id_2++){
-                _ms[p_id_2] = _specs[p_id_2].std;
+                block[p_id_2] = _specs[p_id_2].std;
             }
             return true;
         }
@@ -281,42 +385,236 @@ static bool _machine_settings_verify(){
 }
 
 /**
- * \brief Save the current settings array, \p _ms to the MB85 FRAM, \p _mem.
+ * \brief CRC-16 (CCITT) of a block of settings.
+ * 
+ * \param block The NUM_SETTINGS settings to check.
+ * \return The CRC of the block's bytes.
+ */
+static uint16_t _machine_settings_crc(const machine_setting * block){
+    const uint8_t * bytes = (const uint8_t *)block;
+    uint16_t crc = 0xFFFF;
+    for(uint16_t i = 0; i < MACHINE_SETTINGS_MEMORY_SIZE; i++){
+        crc ^= (uint16_t)bytes[i]<<8;
+        for(uint8_t b = 0; b < 8; b++) crc = (crc & 0x8000) ? (crc<<1) ^ 0x1021 : (crc<<1);
+    }
+    return crc;
+}
+
+/**
+ * \brief Update the CRC of a block in the header and queue its write to the FRAM.
+ * 
+ * \param block_id The block, 0 for the current settings or 1 + the profile ID.
+ * \param block The settings now stored in the block.
+ * \return The result of queuing the write.
+ */
+static int _machine_settings_save_crc(uint8_t block_id, const machine_setting * block){
+    _header.crc[block_id] = _machine_settings_crc(block);
+    return mb85_fram_save_range_async(_mem, _header_var, offsetof(machine_settings_header, crc) + block_id*sizeof(uint16_t),
+                                      sizeof(uint16_t), NULL, NULL);
+}
+
+/**
+ * \brief Function converting one block of settings from the previous layout version.
+ * 
+ * \param old The block in the previous layout.
+ * \param dst Where the block in the new layout is written.
+ */
+typedef void (*machine_settings_migration)(const machine_setting * old, machine_setting * dst);
+
+/** \brief A version of the settings layout in the FRAM. */
+typedef struct {
+    uint16_t num_settings;              /**<\brief Settings in each block. */
+    uint16_t stride;                    /**<\brief Bytes between the start of each block. Never shrinks between versions. */
+    machine_settings_migration migrate; /**<\brief Converts a block from the previous version. NULL keeps the settings both share and defaults the rest. */
+} machine_settings_layout;
+
+/**
+ * \brief Convert a block from layout 0 to layout 1.
+ * 
+ * Layout 1 added the hot-water volume after the hot-water power and a volume trigger after each
+ * autobrew leg's mass trigger. They are set to 0, their default, which disables them. The indices
+ * are spelled out so later layouts can move settings without changing this conversion.
+ */
+static void _machine_settings_migrate_v1(const machine_setting * old, machine_setting * dst){
+    const uint8_t head = 7, legs = 9, per_leg = 7; // Layout 0
+    uint8_t o = 0, d = 0;
+    while(o < head) dst[d++] = old[o++];
+    dst[d++] = 0; // Hot-water volume
+    for(uint8_t leg = 0; leg < legs; leg++){
+        for(uint8_t i = 0; i < per_leg - 1; i++) dst[d++] = old[o++]; // Reference and triggers
+        dst[d++] = 0;                                                 // Volume trigger
+        dst[d++] = old[o++];                                          // Timeout
+    }
+}
+
+/** \brief Every settings layout, indexed by version. */
+static const machine_settings_layout _layouts [MACHINE_SETTINGS_LAYOUT_VERSION + 1] = {
+    {.num_settings = 70, .stride = 70*sizeof(machine_setting), .migrate = NULL},                         // 0: No header. Blocks packed.
+    {.num_settings = 80, .stride = MACHINE_SETTINGS_BLOCK_STRIDE, .migrate = _machine_settings_migrate_v1}, // 1: Header with CRCs. Padded blocks. Volume settings.
+};
+
+/**
+ * \brief Default conversion between layouts. Settings both layouts have are kept and the rest are 
+ * set to their defaults.
+ */
+static void _machine_settings_migrate_block(const machine_setting * old, uint16_t old_num, machine_setting * dst, uint16_t dst_num){
+    for(uint16_t i = 0; i < dst_num; i++){
+        dst[i] = (i < old_num ? old[i] : (i < NUM_SETTINGS ? _specs[i].std : 0));
+    }
+}
+
+/**
+ * \brief Convert every block in the FRAM from an older layout to the current one, check them, and
+ * write them with a new header.
+ * 
+ * The whole settings region is read, converted one version at a time in RAM, range checked, and
+ * written back. The header is written last so an interrupted migration is rerun at the next boot.
+ * Passing the current version just rechecks the blocks and rewrites their CRCs.
+ * 
+ * \param from_version The layout version currently in the FRAM.
+ * \return PICO_ERROR_NONE on success. PICO_ERROR_GENERIC if out of memory. Else the I2C error.
+ */
+static int _machine_settings_migrate(uint16_t from_version){
+    // Strides never shrink, so every older layout fits in the current region
+    const uint16_t region_size = MACHINE_SETTINGS_NUM_BLOCKS*MACHINE_SETTINGS_BLOCK_STRIDE;
+    uint8_t * src = malloc(region_size);
+    uint8_t * dst = malloc(region_size);
+    mb85_fram_var region = PICO_ERROR_GENERIC;
+    if(src != NULL && dst != NULL){
+        region = mb85_fram_link_var(_mem, src, MACHINE_SETTINGS_START_ADDR, region_size, MB85_FRAM_INIT_FROM_FRAM);
+    }
+    if(region < 0){
+        free(src);
+        free(dst);
+        return region;
+    }
+    mb85_fram_unlink_var(_mem, region);
+
+    for(uint16_t v = from_version + 1; v <= MACHINE_SETTINGS_LAYOUT_VERSION; v++){
+        const machine_settings_layout * old = &_layouts[v-1];
+        const machine_settings_layout * new = &_layouts[v];
+        for(uint8_t b = 0; b < MACHINE_SETTINGS_NUM_BLOCKS; b++){
+            const machine_setting * old_block = (const machine_setting *)(src + b*old->stride);
+            machine_setting * new_block = (machine_setting *)(dst + b*new->stride);
+            if(new->migrate != NULL) new->migrate(old_block, new_block);
+            else _machine_settings_migrate_block(old_block, old->num_settings, new_block, new->num_settings);
+        }
+        uint8_t * tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    // Check each block once and record its CRC
+    for(uint8_t b = 0; b < MACHINE_SETTINGS_NUM_BLOCKS; b++){
+        machine_setting * block = (machine_setting *)(src + b*MACHINE_SETTINGS_BLOCK_STRIDE);
+        _machine_settings_verify(block);
+        _header.crc[b] = _machine_settings_crc(block);
+    }
+    _header.magic = MACHINE_SETTINGS_MAGIC;
+    _header.version = MACHINE_SETTINGS_LAYOUT_VERSION;
+
+    region = mb85_fram_link_var(_mem, src, MACHINE_SETTINGS_START_ADDR, region_size, MB85_FRAM_INIT_FROM_VAR);
+    int result = region;
+    if(region >= 0){
+        mb85_fram_unlink_var(_mem, region);
+        result = mb85_fram_save(_mem, _header_var);
+    }
+
+    free(src);
+    free(dst);
+    return result;
+}
+
+/** \brief Mark a setting as changed so the next flush writes it to the FRAM. */
+static inline void _machine_settings_mark_dirty(uint8_t id){
+    _dirty[id/32] |= 1u<<(id%32);
+}
+
+/** \brief Check if a setting has changed since it was last written to the FRAM. */
+static inline bool _machine_settings_is_dirty(uint8_t id){
+    return _dirty[id/32] & (1u<<(id%32));
+}
+
+/**
+ * \brief Queue writes of the changed settings to the MB85 FRAM, \p _mem.
+ * 
+ * Runs of changed settings are written together. Runs separated by no more than
+ * ::MACHINE_SETTINGS_FLUSH_MAX_GAP unchanged settings are joined into one write. The block's CRC 
+ * is written once every run is queued. If the I2C queue fills, the settings not yet queued stay 
+ * changed and the next flush continues from them.
+ */
+static void _machine_settings_flush(){
+    if(_read_only) return;
+    bool wrote = _crc_pending;
+    uint8_t id = 0;
+    while(id < NUM_SETTINGS){
+        if(!_machine_settings_is_dirty(id)){
+            id++;
+            continue;
+        }
+        // Extend the run to the last changed setting within the allowed gap
+        const uint8_t first = id;
+        uint8_t last = id;
+        for(id++; id < NUM_SETTINGS && id <= last + MACHINE_SETTINGS_FLUSH_MAX_GAP + 1; id++){
+            if(_machine_settings_is_dirty(id)) last = id;
+        }
+        id = last + 1;
+        if(mb85_fram_save_range_async(_mem, _ms_var, first*sizeof(machine_setting), 
+                                      (last - first + 1)*sizeof(machine_setting), NULL, NULL)){
+            return;
+        }
+        for(uint8_t i = first; i <= last; i++) _dirty[i/32] &= ~(1u<<(i%32));
+        wrote = true;
+    }
+    if(wrote) _crc_pending = (_machine_settings_save_crc(0, _ms) != PICO_ERROR_NONE);
+}
+
+/**
+ * \brief Queue a save of the current settings array, \p _ms to the MB85 FRAM, \p _mem.
  * 
  * \param profile_id The number to save the profile under, 0 <= profile_id <= 8
- * \return PICO_ERROR_GENERIC if library not setup. Else PICO_ERROR_GENERIC.
+ * \return PICO_ERROR_GENERIC if library not setup or the FRAM is from newer firmware. Else the result 
+ * of queuing the save.
  */
 static int _machine_settings_save_profile(uint8_t profile_id){
-    if(_mem == NULL) return PICO_ERROR_GENERIC;
-    // Break link with profile buffer and connect to profile save address
-    mb85_fram_unlink_var(_mem, &_ms);
-    mb85_fram_link_var(_mem, &_ms, _machine_settings_id_to_addr(profile_id), MACHINE_SETTINGS_MEMORY_SIZE, MB85_FRAM_INIT_FROM_VAR);
-
-    // Break link with save address and connect with profile buffer
-    mb85_fram_unlink_var(_mem, &_ms);
-    mb85_fram_link_var(_mem, &_ms, MACHINE_SETTINGS_START_ADDR, MACHINE_SETTINGS_MEMORY_SIZE, MB85_FRAM_INIT_FROM_VAR);
-    return PICO_ERROR_NONE;
+    if(_mem == NULL || _read_only) return PICO_ERROR_GENERIC;
+    _profile = profile_id;
+    const int result = mb85_fram_save_to_async(_mem, _ms_var, _machine_settings_id_to_addr(profile_id), NULL, NULL);
+    return (result ? result : _machine_settings_save_crc(1 + profile_id, _ms));
 }
 
 /**
  * \brief Load the indicated profile into the settings array, \p _ms from the MB85 FRAM, \p _mem.
  * 
+ * The profile is read straight away. Only the settings it changes are queued to be saved as the 
+ * current settings.
+ * 
  * \param profile_id The profile number to load, 0 <= profile_id <= 8
- * \return PICO_ERROR_GENERIC if library not setup. Else PICO_ERROR_GENERIC.
+ * \return PICO_ERROR_GENERIC if library not setup or the FRAM is from newer firmware. Else the result 
+ * of reading the profile.
  */
 static int _machine_settings_load_profile(uint8_t profile_id){
-    if(_mem == NULL) return PICO_ERROR_GENERIC;
-    // Break link with profile buffer and connect to profile load address
-    mb85_fram_unlink_var(_mem, &_ms);
-    mb85_fram_link_var(_mem, &_ms, _machine_settings_id_to_addr(profile_id), MACHINE_SETTINGS_MEMORY_SIZE, MB85_FRAM_INIT_FROM_FRAM);
+    if(_mem == NULL || _read_only) return PICO_ERROR_GENERIC;
+    machine_setting prev [NUM_SETTINGS];
+    for(uint8_t id = 0; id < NUM_SETTINGS; id++) prev[id] = _ms[id];
 
-    // Verify that loaded address is valid. If it wasn't, save back into profile.
-    if(_machine_settings_verify()) mb85_fram_save(_mem, &_ms);
+    const int result = mb85_fram_load_from(_mem, _ms_var, _machine_settings_id_to_addr(profile_id));
+    // Range check the profile only if its CRC doesn't match. If invalid, save the defaults back into profile.
+    if(result == PICO_ERROR_NONE && _machine_settings_crc(_ms) != _header.crc[1 + profile_id]){
+        if(_machine_settings_verify(_ms)){
+            mb85_fram_save_to_async(_mem, _ms_var, _machine_settings_id_to_addr(profile_id), NULL, NULL);
+        }
+        _machine_settings_save_crc(1 + profile_id, _ms);
+    } else if(result){
+        _machine_settings_verify(_ms);
+    }
 
-    // Break link with load address and connect with profile buffer
-    mb85_fram_unlink_var(_mem, &_ms);
-    mb85_fram_link_var(_mem, &_ms, MACHINE_SETTINGS_START_ADDR, MACHINE_SETTINGS_MEMORY_SIZE, MB85_FRAM_INIT_FROM_VAR);
-    return PICO_ERROR_NONE;
+    for(uint8_t id = 0; id < NUM_SETTINGS; id++){
+        if(_ms[id] != prev[id]) _machine_settings_mark_dirty(id);
+    }
+    _machine_settings_flush();
+    _profile = (result == PICO_ERROR_NONE ? profile_id : MACHINE_SETTINGS_NO_PROFILE);
+    return result;
 }
 
 /**
@@ -336,11 +634,16 @@ static bool _ms_f_cb(folder_id id, uint8_t val, folder_action_data ms_id){
         const int16_t step = (_specs[ms_id].scale==0) ? val-1 : deltas[val];
 
         // Increment and clamp setting
+        const machine_setting prev = _ms[ms_id];
         _ms[ms_id] = CLAMP(_ms[ms_id] + step, _specs[ms_id].min, _specs[ms_id].max);
 
-        // Print results and save
+        // Print results and save once the setting stops changing
         _machine_settings_print_ln(_specs[ms_id].ln_idx);
-        mb85_fram_save(_mem, _ms);
+        if(_ms[ms_id] != prev){
+            _machine_settings_mark_dirty(ms_id);
+            _profile = MACHINE_SETTINGS_NO_PROFILE;
+            _flush_time_us = time_us_64() + 1000*MACHINE_SETTINGS_FLUSH_DELAY_MS;
+        }
     } else if (local_ui_id_in_subtree(&f_presets, id)){
         // Save or load presets
         if (val == 0){
@@ -362,9 +665,10 @@ static void _machine_settings_setup_local_ui(){
     local_ui_add_subfolder(&f_set_temp,         &f_set_temp_brew,         "Brew (-1, 0.1, 1)",            &_ms_f_cb, MS_TEMP_BREW_10C);
     local_ui_add_subfolder(&f_set_temp,         &f_set_temp_hot,          "Hot (-1, 0.1, 1)",             &_ms_f_cb, MS_TEMP_HOT_10C);
     local_ui_add_subfolder(&f_set_temp,         &f_set_temp_steam,        "Steam (-1, 0.1, 1)",           &_ms_f_cb, MS_TEMP_STEAM_10C);
-    local_ui_add_subfolder(&f_set,              &f_set_weight,            "Weights",                      NULL, 0);
+    local_ui_add_subfolder(&f_set,              &f_set_weight,            "Amounts",                      NULL, 0);
     local_ui_add_subfolder(&f_set_weight,       &f_set_weight_dose,       "Dose (-1, 0.1, 1)",            &_ms_f_cb, MS_WEIGHT_DOSE_10g);
     local_ui_add_subfolder(&f_set_weight,       &f_set_weight_yield,      "Yield (-1, 0.1, 1)",           &_ms_f_cb, MS_WEIGHT_YIELD_10g);
+    local_ui_add_subfolder(&f_set_weight,       &f_set_weight_hot,        "Hot Water (ml, -10, 1, 10)",   &_ms_f_cb, MS_VOLUME_HOT_ml);
     local_ui_add_subfolder(&f_set,              &f_set_power,             "Power",                        NULL, 0);
     local_ui_add_subfolder(&f_set_power,        &f_set_power_brew,        "Brew (-10, 1, 10)",            &_ms_f_cb, MS_POWER_BREW_PER);
     local_ui_add_subfolder(&f_set_power,        &f_set_power_hot,         "Hot (-10, 1, 10)",             &_ms_f_cb, MS_POWER_HOT_PER);
@@ -379,7 +683,9 @@ static void _machine_settings_setup_local_ui(){
     local_ui_add_subfolder(&f_ab_ab13_ab1,      &f_ab_ab13_ab1_trgr,      "Trigger",                      NULL, 0);
     local_ui_add_subfolder(&f_ab_ab13_ab1_trgr, &f_ab_ab13_ab1_trgr_flow, "Flow (ml/s, -0.1, 0.01, 0.1)", _ms_f_cb, MS_A1_TRGR_FLOW_100mlps);
     local_ui_add_subfolder(&f_ab_ab13_ab1_trgr, &f_ab_ab13_ab1_trgr_prsr, "Prsr (bar, -1, 0.1, 1)",       _ms_f_cb, MS_A1_TRGR_PRSR_10bar);
-    local_ui_add_subfolder(&f_ab_ab13_ab1_trgr, &f_ab_ab13_ab1_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A1_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab13_ab1_trgr, &f_ab_ab13_ab1_trgr_out,  "Output (Mass, Vol)",           NULL, 0);
+    local_ui_add_subfolder(&f_ab_ab13_ab1_trgr_out, &f_ab_ab13_ab1_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A1_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab13_ab1_trgr_out, &f_ab_ab13_ab1_trgr_vol,  "Vol (ml, -10, 1, 10)",         _ms_f_cb, MS_A1_TRGR_VOL_ml);
     local_ui_add_subfolder(&f_ab_ab13_ab1,      &f_ab_ab13_ab1_timeout,   "Timeout (-1, 0.1, 1)",         _ms_f_cb, MS_A1_TIMEOUT_10s);
     local_ui_add_subfolder(&f_ab_ab13,          &f_ab_ab13_ab2,           "Autobrew Leg 2",               NULL, 0);
     local_ui_add_subfolder(&f_ab_ab13_ab2,      &f_ab_ab13_ab2_ref,       "Setpoint",                     NULL, 0);
@@ -389,7 +695,9 @@ static void _machine_settings_setup_local_ui(){
     local_ui_add_subfolder(&f_ab_ab13_ab2,      &f_ab_ab13_ab2_trgr,      "Trigger",                      NULL, 0);
     local_ui_add_subfolder(&f_ab_ab13_ab2_trgr, &f_ab_ab13_ab2_trgr_flow, "Flow (ml/s, -0.1, 0.01, 0.1)", _ms_f_cb, MS_A2_TRGR_FLOW_100mlps);
     local_ui_add_subfolder(&f_ab_ab13_ab2_trgr, &f_ab_ab13_ab2_trgr_prsr, "Prsr (bar, -1, 0.1, 1)",       _ms_f_cb, MS_A2_TRGR_PRSR_10bar);
-    local_ui_add_subfolder(&f_ab_ab13_ab2_trgr, &f_ab_ab13_ab2_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A2_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab13_ab2_trgr, &f_ab_ab13_ab2_trgr_out,  "Output (Mass, Vol)",           NULL, 0);
+    local_ui_add_subfolder(&f_ab_ab13_ab2_trgr_out, &f_ab_ab13_ab2_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A2_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab13_ab2_trgr_out, &f_ab_ab13_ab2_trgr_vol,  "Vol (ml, -10, 1, 10)",         _ms_f_cb, MS_A2_TRGR_VOL_ml);
     local_ui_add_subfolder(&f_ab_ab13_ab2,      &f_ab_ab13_ab2_timeout,   "Timeout (-1, 0.1, 1)",         _ms_f_cb, MS_A2_TIMEOUT_10s);
     local_ui_add_subfolder(&f_ab_ab13,          &f_ab_ab13_ab3,           "Autobrew Leg 3",               NULL, 0);
     local_ui_add_subfolder(&f_ab_ab13_ab3,      &f_ab_ab13_ab3_ref,       "Setpoint",                     NULL, 0);
@@ -399,7 +707,9 @@ static void _machine_settings_setup_local_ui(){
     local_ui_add_subfolder(&f_ab_ab13_ab3,      &f_ab_ab13_ab3_trgr,      "Trigger",                      NULL, 0);
     local_ui_add_subfolder(&f_ab_ab13_ab3_trgr, &f_ab_ab13_ab3_trgr_flow, "Flow (ml/s, -0.1, 0.01, 0.1)", _ms_f_cb, MS_A3_TRGR_FLOW_100mlps);
     local_ui_add_subfolder(&f_ab_ab13_ab3_trgr, &f_ab_ab13_ab3_trgr_prsr, "Prsr (bar, -1, 0.1, 1)",       _ms_f_cb, MS_A3_TRGR_PRSR_10bar);
-    local_ui_add_subfolder(&f_ab_ab13_ab3_trgr, &f_ab_ab13_ab3_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A3_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab13_ab3_trgr, &f_ab_ab13_ab3_trgr_out,  "Output (Mass, Vol)",           NULL, 0);
+    local_ui_add_subfolder(&f_ab_ab13_ab3_trgr_out, &f_ab_ab13_ab3_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A3_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab13_ab3_trgr_out, &f_ab_ab13_ab3_trgr_vol,  "Vol (ml, -10, 1, 10)",         _ms_f_cb, MS_A3_TRGR_VOL_ml);
     local_ui_add_subfolder(&f_ab_ab13_ab3,      &f_ab_ab13_ab3_timeout,   "Timeout (-1, 0.1, 1)",         _ms_f_cb, MS_A3_TIMEOUT_10s);
     local_ui_add_subfolder(&f_ab,               &f_ab_ab46,               "Autobrew Legs 4-6",            NULL, 0);
     local_ui_add_subfolder(&f_ab_ab46,          &f_ab_ab46_ab4,           "Autobrew Leg 4",               NULL, 0);
@@ -410,7 +720,9 @@ static void _machine_settings_setup_local_ui(){
     local_ui_add_subfolder(&f_ab_ab46_ab4,      &f_ab_ab46_ab4_trgr,      "Trigger",                      NULL, 0);
     local_ui_add_subfolder(&f_ab_ab46_ab4_trgr, &f_ab_ab46_ab4_trgr_flow, "Flow (ml/s, -0.1, 0.01, 0.1)", _ms_f_cb, MS_A4_TRGR_FLOW_100mlps);
     local_ui_add_subfolder(&f_ab_ab46_ab4_trgr, &f_ab_ab46_ab4_trgr_prsr, "Prsr (bar, -1, 0.1, 1)",       _ms_f_cb, MS_A4_TRGR_PRSR_10bar);
-    local_ui_add_subfolder(&f_ab_ab46_ab4_trgr, &f_ab_ab46_ab4_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A4_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab46_ab4_trgr, &f_ab_ab46_ab4_trgr_out,  "Output (Mass, Vol)",           NULL, 0);
+    local_ui_add_subfolder(&f_ab_ab46_ab4_trgr_out, &f_ab_ab46_ab4_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A4_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab46_ab4_trgr_out, &f_ab_ab46_ab4_trgr_vol,  "Vol (ml, -10, 1, 10)",         _ms_f_cb, MS_A4_TRGR_VOL_ml);
     local_ui_add_subfolder(&f_ab_ab46_ab4,      &f_ab_ab46_ab4_timeout,   "Timeout (-1, 0.1, 1)",         _ms_f_cb, MS_A4_TIMEOUT_10s);
     local_ui_add_subfolder(&f_ab_ab46,          &f_ab_ab46_ab5,           "Autobrew Leg 5",               NULL, 0);
     local_ui_add_subfolder(&f_ab_ab46_ab5,      &f_ab_ab46_ab5_ref,       "Setpoint",                     NULL, 0);
@@ -420,7 +732,9 @@ static void _machine_settings_setup_local_ui(){
     local_ui_add_subfolder(&f_ab_ab46_ab5,      &f_ab_ab46_ab5_trgr,      "Trigger",                      NULL, 0);
     local_ui_add_subfolder(&f_ab_ab46_ab5_trgr, &f_ab_ab46_ab5_trgr_flow, "Flow (ml/s, -0.1, 0.01, 0.1)", _ms_f_cb, MS_A5_TRGR_FLOW_100mlps);
     local_ui_add_subfolder(&f_ab_ab46_ab5_trgr, &f_ab_ab46_ab5_trgr_prsr, "Prsr (bar, -1, 0.1, 1)",       _ms_f_cb, MS_A5_TRGR_PRSR_10bar);
-    local_ui_add_subfolder(&f_ab_ab46_ab5_trgr, &f_ab_ab46_ab5_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A5_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab46_ab5_trgr, &f_ab_ab46_ab5_trgr_out,  "Output (Mass, Vol)",           NULL, 0);
+    local_ui_add_subfolder(&f_ab_ab46_ab5_trgr_out, &f_ab_ab46_ab5_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A5_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab46_ab5_trgr_out, &f_ab_ab46_ab5_trgr_vol,  "Vol (ml, -10, 1, 10)",         _ms_f_cb, MS_A5_TRGR_VOL_ml);
     local_ui_add_subfolder(&f_ab_ab46_ab5,      &f_ab_ab46_ab5_timeout,   "Timeout (-1, 0.1, 1)",         _ms_f_cb, MS_A5_TIMEOUT_10s);
     local_ui_add_subfolder(&f_ab_ab46,          &f_ab_ab46_ab6,           "Autobrew Leg 6",               NULL, 0);
     local_ui_add_subfolder(&f_ab_ab46_ab6,      &f_ab_ab46_ab6_ref,       "Setpoint",                     NULL, 0);
@@ -430,7 +744,9 @@ static void _machine_settings_setup_local_ui(){
     local_ui_add_subfolder(&f_ab_ab46_ab6,      &f_ab_ab46_ab6_trgr,      "Trigger",                      NULL, 0);
     local_ui_add_subfolder(&f_ab_ab46_ab6_trgr, &f_ab_ab46_ab6_trgr_flow, "Flow (ml/s, -0.1, 0.01, 0.1)", _ms_f_cb, MS_A6_TRGR_FLOW_100mlps);
     local_ui_add_subfolder(&f_ab_ab46_ab6_trgr, &f_ab_ab46_ab6_trgr_prsr, "Prsr (bar, -1, 0.1, 1)",       _ms_f_cb, MS_A6_TRGR_PRSR_10bar);
-    local_ui_add_subfolder(&f_ab_ab46_ab6_trgr, &f_ab_ab46_ab6_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A6_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab46_ab6_trgr, &f_ab_ab46_ab6_trgr_out,  "Output (Mass, Vol)",           NULL, 0);
+    local_ui_add_subfolder(&f_ab_ab46_ab6_trgr_out, &f_ab_ab46_ab6_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A6_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab46_ab6_trgr_out, &f_ab_ab46_ab6_trgr_vol,  "Vol (ml, -10, 1, 10)",         _ms_f_cb, MS_A6_TRGR_VOL_ml);
     local_ui_add_subfolder(&f_ab_ab46_ab6,      &f_ab_ab46_ab6_timeout,   "Timeout (-1, 0.1, 1)",         _ms_f_cb, MS_A6_TIMEOUT_10s);
     local_ui_add_subfolder(&f_ab,               &f_ab_ab79,               "Autobrew Legs 7-9",            NULL, 0);
     local_ui_add_subfolder(&f_ab_ab79,          &f_ab_ab79_ab7,           "Autobrew Leg 7",               NULL, 0);
@@ -441,7 +757,9 @@ static void _machine_settings_setup_local_ui(){
     local_ui_add_subfolder(&f_ab_ab79_ab7,      &f_ab_ab79_ab7_trgr,      "Trigger",                      NULL, 0);
     local_ui_add_subfolder(&f_ab_ab79_ab7_trgr, &f_ab_ab79_ab7_trgr_flow, "Flow (ml/s, -0.1, 0.01, 0.1)", _ms_f_cb, MS_A7_TRGR_FLOW_100mlps);
     local_ui_add_subfolder(&f_ab_ab79_ab7_trgr, &f_ab_ab79_ab7_trgr_prsr, "Prsr (bar, -1, 0.1, 1)",       _ms_f_cb, MS_A7_TRGR_PRSR_10bar);
-    local_ui_add_subfolder(&f_ab_ab79_ab7_trgr, &f_ab_ab79_ab7_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A7_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab79_ab7_trgr, &f_ab_ab79_ab7_trgr_out,  "Output (Mass, Vol)",           NULL, 0);
+    local_ui_add_subfolder(&f_ab_ab79_ab7_trgr_out, &f_ab_ab79_ab7_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A7_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab79_ab7_trgr_out, &f_ab_ab79_ab7_trgr_vol,  "Vol (ml, -10, 1, 10)",         _ms_f_cb, MS_A7_TRGR_VOL_ml);
     local_ui_add_subfolder(&f_ab_ab79_ab7,      &f_ab_ab79_ab7_timeout,   "Timeout (-1, 0.1, 1)",         _ms_f_cb, MS_A7_TIMEOUT_10s);
     local_ui_add_subfolder(&f_ab_ab79,          &f_ab_ab79_ab8,           "Autobrew Leg 8",               NULL, 0);
     local_ui_add_subfolder(&f_ab_ab79_ab8,      &f_ab_ab79_ab8_ref,       "Setpoint",                     NULL, 0);
@@ -451,7 +769,9 @@ static void _machine_settings_setup_local_ui(){
     local_ui_add_subfolder(&f_ab_ab79_ab8,      &f_ab_ab79_ab8_trgr,      "Trigger",                      NULL, 0);
     local_ui_add_subfolder(&f_ab_ab79_ab8_trgr, &f_ab_ab79_ab8_trgr_flow, "Flow (ml/s, -0.1, 0.01, 0.1)", _ms_f_cb, MS_A8_TRGR_FLOW_100mlps);
     local_ui_add_subfolder(&f_ab_ab79_ab8_trgr, &f_ab_ab79_ab8_trgr_prsr, "Prsr (bar, -1, 0.1, 1)",       _ms_f_cb, MS_A8_TRGR_PRSR_10bar);
-    local_ui_add_subfolder(&f_ab_ab79_ab8_trgr, &f_ab_ab79_ab8_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A8_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab79_ab8_trgr, &f_ab_ab79_ab8_trgr_out,  "Output (Mass, Vol)",           NULL, 0);
+    local_ui_add_subfolder(&f_ab_ab79_ab8_trgr_out, &f_ab_ab79_ab8_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A8_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab79_ab8_trgr_out, &f_ab_ab79_ab8_trgr_vol,  "Vol (ml, -10, 1, 10)",         _ms_f_cb, MS_A8_TRGR_VOL_ml);
     local_ui_add_subfolder(&f_ab_ab79_ab8,      &f_ab_ab79_ab8_timeout,   "Timeout (-1, 0.1, 1)",         _ms_f_cb, MS_A8_TIMEOUT_10s);
     local_ui_add_subfolder(&f_ab_ab79,          &f_ab_ab79_ab9,           "Autobrew Leg 9",               NULL, 0);
     local_ui_add_subfolder(&f_ab_ab79_ab9,      &f_ab_ab79_ab9_ref,       "Setpoint",                     NULL, 0);
@@ -461,7 +781,9 @@ static void _machine_settings_setup_local_ui(){
     local_ui_add_subfolder(&f_ab_ab79_ab9,      &f_ab_ab79_ab9_trgr,      "Trigger",                      NULL, 0);
     local_ui_add_subfolder(&f_ab_ab79_ab9_trgr, &f_ab_ab79_ab9_trgr_flow, "Flow (ml/s, -0.1, 0.01, 0.1)", _ms_f_cb, MS_A9_TRGR_FLOW_100mlps);
     local_ui_add_subfolder(&f_ab_ab79_ab9_trgr, &f_ab_ab79_ab9_trgr_prsr, "Prsr (bar, -1, 0.1, 1)",       _ms_f_cb, MS_A9_TRGR_PRSR_10bar);
-    local_ui_add_subfolder(&f_ab_ab79_ab9_trgr, &f_ab_ab79_ab9_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A9_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab79_ab9_trgr, &f_ab_ab79_ab9_trgr_out,  "Output (Mass, Vol)",           NULL, 0);
+    local_ui_add_subfolder(&f_ab_ab79_ab9_trgr_out, &f_ab_ab79_ab9_trgr_mass, "Mass (g, -1, 0.1, 1)",         _ms_f_cb, MS_A9_TRGR_MASS_10g);
+    local_ui_add_subfolder(&f_ab_ab79_ab9_trgr_out, &f_ab_ab79_ab9_trgr_vol,  "Vol (ml, -10, 1, 10)",         _ms_f_cb, MS_A9_TRGR_VOL_ml);
     local_ui_add_subfolder(&f_ab_ab79_ab9,      &f_ab_ab79_ab9_timeout,   "Timeout (-1, 0.1, 1)",         _ms_f_cb, MS_A9_TIMEOUT_10s);
 
     local_ui_add_subfolder(&f_,                 &f_presets,               "Presets",                      NULL, 0);
@@ -482,13 +804,32 @@ static void _machine_settings_setup_local_ui(){
 void machine_settings_setup(mb85_fram mem){
     if(_mem == NULL){
         _mem = mem;
-        if(mb85_fram_link_var(_mem, &_ms, MACHINE_SETTINGS_START_ADDR, MACHINE_SETTINGS_MEMORY_SIZE, MB85_FRAM_INIT_FROM_FRAM)){
+        _header_var = mb85_fram_link_var(_mem, &_header, MACHINE_SETTINGS_HEADER_ADDR, sizeof(_header), MB85_FRAM_INIT_FROM_FRAM);
+        if(_header_var < 0){
+            _mem = NULL;
+            return;
+        }
+        // Bring older layouts up to date. The first layout had no header. A newer layout can't be
+        // read, so it is left for the firmware that wrote it and the defaults are used in RAM.
+        _read_only = (_header.magic == MACHINE_SETTINGS_MAGIC && _header.version > MACHINE_SETTINGS_LAYOUT_VERSION);
+        if(_header.magic != MACHINE_SETTINGS_MAGIC){
+            _machine_settings_migrate(0);
+        } else if(_header.version < MACHINE_SETTINGS_LAYOUT_VERSION){
+            _machine_settings_migrate(_header.version);
+        }
+
+        _ms_var = mb85_fram_link_var(_mem, _ms, MACHINE_SETTINGS_START_ADDR, MACHINE_SETTINGS_MEMORY_SIZE, 
+                                     (_read_only ? MB85_FRAM_INIT_NONE : MB85_FRAM_INIT_FROM_FRAM));
+        if(_ms_var < 0){
             _mem = NULL;
             return;
         }
-        if(_machine_settings_verify()){
-            // If settings had to be reset to defaults, save new values.
-            mb85_fram_save(_mem, &_ms);
+        if(_read_only){
+            for(uint8_t id = 0; id < NUM_SETTINGS; id++) _ms[id] = _specs[id].std;
+        } else if(_machine_settings_crc(_ms) != _header.crc[0]){
+            // Range check only if the CRC doesn't match. If settings had to be reset to defaults, save new values.
+            if(_machine_settings_verify(_ms)) mb85_fram_save(_mem, _ms_var);
+            _machine_settings_save_crc(0, _ms);
         }
         _machine_settings_setup_local_ui();
 
@@ -500,6 +841,10 @@ void machine_settings_setup(mb85_fram mem){
     }
 }
 
+uint8_t machine_settings_get_profile(){
+    return _profile;
+}
+
 machine_setting machine_settings_get(setting_id id){
     assert(id < NUM_SETTINGS || id == MS_UI_MASK);
     if(_mem == NULL) return 0; // nothing setup yet :(
@@ -559,6 +904,14 @@ int machine_settings_update(setting_command cmd){
         machine_settings_print_local_ui();
         break;
 
+        case MS_CMD_I2C_TRACE:
+        i2c_bus_trace_print();
+        break;
+
+        case MS_CMD_SHOT_LOG:
+        shot_log_print();
+        break;
+
         case MS_CMD_NONE:
         break;
 
@@ -570,6 +923,9 @@ int machine_settings_update(setting_command cmd){
         machine_settings_print_local_ui();
         _update_value_flasher();
     }
+
+    // Write changes once settings stop changing or when returning to the root
+    if(_mem != NULL && (cmd == MS_CMD_ROOT || time_us_64() >= _flush_time_us)) _machine_settings_flush();
     return PICO_ERROR_NONE;
 }
 
@@ -583,21 +939,22 @@ enum {
     LN_YIELD,           // Yield       : %5.1fC
     LN_BREW_POWER,      // Brew Power  : %5.1fC
     LN_HOT_POWER,       // Hot Power   : %5.1fC  
+    LN_HOT_VOLUME,      // Hot Volume  :  %4d ml
     LN_MID_BUFF,        //      
-    LN_AB_TOP_BOUNDARY, // |=|=========================|========================|=========|
-    LN_AB_H1,           // | |        Setpoint         |         Target         | Timeout |
-    LN_AB_H2,           // |#|  Style  : Start :  End  | Flow : Pressure : Mass |         |
-    LN_AB_TOP_DIVIDE,   // |-|---------:-------:-------|------:----------:------|---------|
-    LN_AB_LEG_1,        // |1|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f|  %4.1f  |
-    LN_AB_LEG_2,        // |2|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f|  %4.1f  |
-    LN_AB_LEG_3,        // |3|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f|  %4.1f  |
-    LN_AB_LEG_4,        // |4|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f|  %4.1f  |
-    LN_AB_LEG_5,        // |5|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f|  %4.1f  |
-    LN_AB_LEG_6,        // |6|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f|  %4.1f  |
-    LN_AB_LEG_7,        // |7|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f|  %4.1f  |
-    LN_AB_LEG_8,        // |8|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f|  %4.1f  |
-    LN_AB_LEG_9,        // |9|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f|  %4.1f  |
-    LN_AB_LOW_BOUNDARY, // |-|---------:-------:-------|------:----------:------|---------|
+    LN_AB_TOP_BOUNDARY, // |=|=========================|===============================|=========|
+    LN_AB_H1,           // | |        Setpoint         |            Target             | Timeout |
+    LN_AB_H2,           // |#|  Style  : Start :  End  | Flow : Pressure : Mass : Vol  |         |
+    LN_AB_TOP_DIVIDE,   // |-|---------:-------:-------|------:----------:------:------|---------|
+    LN_AB_LEG_1,        // |1|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f: %4d |  %4.1f  |
+    LN_AB_LEG_2,        // |2|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f: %4d |  %4.1f  |
+    LN_AB_LEG_3,        // |3|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f: %4d |  %4.1f  |
+    LN_AB_LEG_4,        // |4|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f: %4d |  %4.1f  |
+    LN_AB_LEG_5,        // |5|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f: %4d |  %4.1f  |
+    LN_AB_LEG_6,        // |6|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f: %4d |  %4.1f  |
+    LN_AB_LEG_7,        // |7|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f: %4d |  %4.1f  |
+    LN_AB_LEG_8,        // |8|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f: %4d |  %4.1f  |
+    LN_AB_LEG_9,        // |9|   %s    : %5.1f : %5.1f | %4.2f:   %4.1f  : %4.1f: %4d |  %4.1f  |
+    LN_AB_LOW_BOUNDARY, // |-|---------:-------:-------|------:----------:------:------|---------|
     LN_LOW_BUFF,        //
     LN_COUNT
 };
@@ -637,24 +994,28 @@ static void _machine_settings_print_ln(uint ln_num){
         printf("\033[%d;1H\033[2KHot Power   :   %3d %%\n",
         LN_HOT_POWER+1, _ms[MS_POWER_HOT_PER]);
         break;
+    case LN_HOT_VOLUME:
+        printf("\033[%d;1H\033[2KHot Volume  :  %4d ml\n",
+        LN_HOT_VOLUME+1, _ms[MS_VOLUME_HOT_ml]);
+        break;
     case LN_MID_BUFF:
         printf("\033[%d;1H\033[2K\n",
         LN_MID_BUFF + 1);
         break;
     case LN_AB_TOP_BOUNDARY:
-        printf("\033[%d;1H\033[2K|=|=========================|========================|=========|\n",
+        printf("\033[%d;1H\033[2K|=|=========================|===============================|=========|\n",
         LN_AB_TOP_BOUNDARY+1);
         break;
     case LN_AB_H1:
-        printf("\033[%d;1H\033[2K| |        Setpoint         |         Target         | Timeout |\n",
+        printf("\033[%d;1H\033[2K| |        Setpoint         |            Target             | Timeout |\n",
         LN_AB_H1+1);
         break;
     case LN_AB_H2:
-        printf("\033[%d;1H\033[2K|#|  Style  : Start :  End  | Flow : Pressure : Mass |         |\n",
+        printf("\033[%d;1H\033[2K|#|  Style  : Start :  End  | Flow : Pressure : Mass : Vol  |         |\n",
         LN_AB_H2+1);
         break;
     case LN_AB_TOP_DIVIDE:
-        printf("\033[%d;1H\033[2K|-|---------:-------:-------|------:----------:------|---------|\n",
+        printf("\033[%d;1H\033[2K|-|---------:-------:-------|------:----------:------:------|---------|\n",
         LN_AB_TOP_DIVIDE+1);
         break;
     case LN_AB_LEG_1:
@@ -678,15 +1039,16 @@ static void _machine_settings_print_ln(uint ln_num){
                     _ms[offset + MS_A1_REF_END_per_100mlps_10bar]/10.);
                     break;
             }
-            printf("| %4.2f :   %4.1f   : %4.1f |  %4.1f   |\n",
+            printf("| %4.2f :   %4.1f   : %4.1f : %4d |  %4.1f   |\n",
                 _ms[offset + MS_A1_TRGR_FLOW_100mlps]/100.,
                 _ms[offset + MS_A1_TRGR_PRSR_10bar]/10.,
                 _ms[offset + MS_A1_TRGR_MASS_10g]/10.,
+                _ms[offset + MS_A1_TRGR_VOL_ml],
                 _ms[offset + MS_A1_TIMEOUT_10s]/10.);        
             break;
         }
     case LN_AB_LOW_BOUNDARY:
-        printf("\033[%d;1H\033[2K|=|=========================|========================|=========|\n",
+        printf("\033[%d;1H\033[2K|=|=========================|===============================|=========|\n",
         LN_AB_LOW_BOUNDARY + 1);
         break;
     case LN_LOW_BUFF:
@@ -735,4 +1097,157 @@ int machine_settings_print_local_ui(){
     printf("\033[%d;1H", LN_COUNT + local_ui_num_ln + 2);
     return PICO_ERROR_NONE;
 }
+
+#ifdef MACHINE_SETTINGS_TESTS
+#ifndef I2C_BUS_EMULATION
+#error "MACHINE_SETTINGS_TESTS requires I2C_BUS_EMULATION"
+#endif
+#include <string.h>
+#include "utils/i2c_emulator.h"
+
+#define TEST_FRAM_SIZE 0x8000   // MB85RC256V
+#define TEST_V0_NUM_SETTINGS 70 // Settings in a layout 0 block
+#define TEST_V0_HEAD 7          // Layout 0 settings before the first autobrew leg
+#define TEST_V0_PER_LEG 7       // Layout 0 settings per autobrew leg
+
+/** \brief Wait for the queued FRAM writes and run their callbacks. */
+static void _machine_settings_test_drain(){
+    while(!i2c_bus_is_idle(i2c0)) tight_loop_contents();
+    i2c_bus_process_completed();
+}
+
+/** \brief Detach the settings, if attached, and set them up again on a new FRAM driver as at boot. */
+static void _machine_settings_test_boot(){
+    if(_mem != NULL){
+        mb85_fram_deinit(_mem);
+        value_flasher_deinit(_setting_flasher);
+        _mem = NULL;
+    }
+    for(uint8_t i = 0; i < sizeof(_dirty)/sizeof(_dirty[0]); i++) _dirty[i] = 0;
+    _crc_pending = false;
+    machine_settings_setup(mb85_fram_setup(i2c0, 0, NULL));
+    _machine_settings_test_drain();
+}
+
+/** \brief Value of a setting in block \p b of the test's layout 0 image. Every value is in range. */
+static machine_setting _machine_settings_test_v0_value(uint8_t b, uint8_t i){
+    if(i < TEST_V0_HEAD) return _specs[i].std - b;
+    const uint8_t leg = (i - TEST_V0_HEAD)/TEST_V0_PER_LEG, param = (i - TEST_V0_HEAD)%TEST_V0_PER_LEG;
+    if(param == 0) return leg % 3;    // Reference style
+    return 10*param + leg + b;
+}
+
+/** \brief Check that a block holds block \p b of the layout 0 image in the current layout. */
+static bool _machine_settings_test_migrated(const machine_setting * block, uint8_t b){
+    bool pass = (block[MS_VOLUME_HOT_ml] == _specs[MS_VOLUME_HOT_ml].std);
+    for(uint8_t i = 0; i < TEST_V0_HEAD; i++) pass &= (block[i] == _machine_settings_test_v0_value(b, i));
+    for(uint8_t leg = 0; leg < NUM_AUTOBREW_LEGS; leg++){
+        const uint8_t v0 = TEST_V0_HEAD + leg*TEST_V0_PER_LEG;
+        const machine_setting * l = block + MS_A1_REF_STYLE_ENM + leg*NUM_AUTOBREW_PARAMS_PER_LEG;
+        for(uint8_t i = 0; i < TEST_V0_PER_LEG - 1; i++) pass &= (l[i] == _machine_settings_test_v0_value(b, v0 + i));
+        pass &= (l[MS_A1_TRGR_VOL_ml - MS_A1_REF_STYLE_ENM] == _specs[MS_A1_TRGR_VOL_ml].std);
+        pass &= (l[MS_A1_TIMEOUT_10s - MS_A1_REF_STYLE_ENM] == _machine_settings_test_v0_value(b, v0 + TEST_V0_PER_LEG - 1));
+    }
+    return pass;
+}
+
+/** \brief Check the header in the FRAM is the current version with a matching CRC for every block. */
+static bool _machine_settings_test_header_ok(const uint8_t * mem){
+    machine_settings_header header;
+    memcpy(&header, mem + MACHINE_SETTINGS_HEADER_ADDR, sizeof(header));
+    bool pass = (header.magic == MACHINE_SETTINGS_MAGIC && header.version == MACHINE_SETTINGS_LAYOUT_VERSION);
+    for(uint8_t b = 0; b < MACHINE_SETTINGS_NUM_BLOCKS; b++){
+        pass &= (header.crc[b] == _machine_settings_crc((const machine_setting *)(mem + b*MACHINE_SETTINGS_BLOCK_STRIDE)));
+    }
+    return pass;
+}
+
+void machine_settings_test(){
+    i2c_emulator_mb85 fram_emu = i2c_emulator_mb85_setup(i2c0, 0, TEST_FRAM_SIZE);
+    if(fram_emu == NULL){
+        printf("Test 1:  FAIL (emulated FRAM not setup)\n");
+        return;
+    }
+    uint8_t * mem = i2c_emulator_mb85_memory(fram_emu);
+    bool pass [6];
+    uint32_t bytes [6] = {0};
+
+    // Blank FRAM, read as out of range values
+    memset(mem, 0xFF, TEST_FRAM_SIZE);
+    uint32_t bytes_before = i2c_emulator_mb85_bytes_written(fram_emu);
+    _machine_settings_test_boot();
+    bytes[0] = i2c_emulator_mb85_bytes_written(fram_emu) - bytes_before;
+    pass[0] = (_mem != NULL && _machine_settings_test_header_ok(mem));
+    for(uint8_t id = 0; id < NUM_SETTINGS; id++) pass[0] &= (_ms[id] == _specs[id].std);
+
+    // Image in layout 0: the current settings and 9 profiles of 70 settings, packed
+    memset(mem, 0, TEST_FRAM_SIZE);
+    for(uint8_t b = 0; b < MACHINE_SETTINGS_NUM_BLOCKS; b++){
+        machine_setting * block = (machine_setting *)(mem + b*TEST_V0_NUM_SETTINGS*sizeof(machine_setting));
+        for(uint8_t i = 0; i < TEST_V0_NUM_SETTINGS; i++) block[i] = _machine_settings_test_v0_value(b, i);
+    }
+    bytes_before = i2c_emulator_mb85_bytes_written(fram_emu);
+    _machine_settings_test_boot();
+    bytes[1] = i2c_emulator_mb85_bytes_written(fram_emu) - bytes_before;
+    pass[1] = (_mem != NULL && _machine_settings_test_header_ok(mem) && _machine_settings_test_migrated(_ms, 0));
+    for(uint8_t b = 1; b < MACHINE_SETTINGS_NUM_BLOCKS; b++){
+        pass[1] &= _machine_settings_test_migrated((const machine_setting *)(mem + b*MACHINE_SETTINGS_BLOCK_STRIDE), b);
+    }
+
+    // Second boot, then load a migrated profile
+    bytes_before = i2c_emulator_mb85_bytes_written(fram_emu);
+    _machine_settings_test_boot();
+    bytes[2] = i2c_emulator_mb85_bytes_written(fram_emu) - bytes_before;
+    pass[2] = (bytes[2] == 0 && _machine_settings_test_migrated(_ms, 0));
+    pass[3] = (_machine_settings_load_profile(4) == PICO_ERROR_NONE && _machine_settings_test_migrated(_ms, 5));
+    _machine_settings_test_drain();
+    pass[3] &= (_machine_settings_test_migrated((const machine_setting *)mem, 5) && _machine_settings_test_header_ok(mem));
+
+    // Header from newer firmware
+    machine_settings_header header;
+    memcpy(&header, mem + MACHINE_SETTINGS_HEADER_ADDR, sizeof(header));
+    header.version = MACHINE_SETTINGS_LAYOUT_VERSION + 1;
+    memcpy(mem + MACHINE_SETTINGS_HEADER_ADDR, &header, sizeof(header));
+    uint8_t * before = malloc(SHOT_LOG_START_ADDR);
+    if(before != NULL) memcpy(before, mem, SHOT_LOG_START_ADDR);
+    bytes_before = i2c_emulator_mb85_bytes_written(fram_emu);
+    _machine_settings_test_boot();
+    pass[4] = (_read_only && _machine_settings_save_profile(0) == PICO_ERROR_GENERIC);
+    for(uint8_t id = 0; id < NUM_SETTINGS; id++) pass[4] &= (_ms[id] == _specs[id].std);
+    _ms[MS_WEIGHT_YIELD_10g] += 1;
+    _machine_settings_mark_dirty(MS_WEIGHT_YIELD_10g);
+    machine_settings_update(MS_CMD_ROOT);
+    _machine_settings_test_drain();
+    bytes[4] = i2c_emulator_mb85_bytes_written(fram_emu) - bytes_before;
+    pass[4] &= (bytes[4] == 0 && before != NULL && memcmp(before, mem, SHOT_LOG_START_ADDR) == 0);
+    free(before);
+
+    // CRC mismatch: an in-range change is kept, an out-of-range value resets the block
+    header.version = MACHINE_SETTINGS_LAYOUT_VERSION;
+    memcpy(mem + MACHINE_SETTINGS_HEADER_ADDR, &header, sizeof(header));
+    machine_setting * current = (machine_setting *)mem;
+    current[MS_WEIGHT_DOSE_10g] += 1;
+    _machine_settings_test_boot();
+    pass[5] = (_ms[MS_WEIGHT_DOSE_10g] == current[MS_WEIGHT_DOSE_10g] && _machine_settings_test_header_ok(mem));
+    current[MS_TEMP_BREW_10C] = _specs[MS_TEMP_BREW_10C].max + 1;
+    _machine_settings_test_boot();
+    pass[5] &= (_ms[MS_TEMP_BREW_10C] == _specs[MS_TEMP_BREW_10C].std && _ms[MS_WEIGHT_DOSE_10g] == _specs[MS_WEIGHT_DOSE_10g].std
+                && current[MS_TEMP_BREW_10C] == _specs[MS_TEMP_BREW_10C].std && _machine_settings_test_header_ok(mem));
+
+    mb85_fram_deinit(_mem);
+    value_flasher_deinit(_setting_flasher);
+    _mem = NULL;
+    i2c_emulator_mb85_deinit(fram_emu);
+
+    printf("\033[2J\033[1;1H");
+    printf("Test 1:  %s (blank FRAM set to defaults with a valid header, %lu bytes written)\n", (pass[0] ? "PASS" : "FAIL"), bytes[0]);
+    printf("Test 2:  %s (70-setting layout migrated: volumes inserted at defaults, 10 blocks moved to a %d byte stride, %lu bytes written)\n", 
+           (pass[1] ? "PASS" : "FAIL"), MACHINE_SETTINGS_BLOCK_STRIDE, bytes[1]);
+    printf("Test 3:  %s (second boot wrote %lu bytes)\n", (pass[2] ? "PASS" : "FAIL"), bytes[2]);
+    printf("Test 4:  %s (migrated preset 5 loaded and saved as the current settings)\n", (pass[3] ? "PASS" : "FAIL"));
+    printf("Test 5:  %s (newer layout left untouched with defaults in RAM, %lu bytes written after a change and a preset save)\n", 
+           (pass[4] ? "PASS" : "FAIL"), bytes[4]);
+    printf("Test 6:  %s (CRC mismatch: in-range change kept, out-of-range value reset the block)\n", (pass[5] ? "PASS" : "FAIL"));
+}
+#endif
 /** @} */
@@ -0,0 +1,325 @@
+/**
+ * \ingroup shot_log
+ * @{
+ *
+ * \file shot_log.c
+ * \author Richard Hall (hallboyone@icloud.com)
+ * \brief Shot Log source
+ * \version 0.4
+ * \date 2026-10-18
+ */
+
+#include "machine_logic/shot_log.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "machine_logic/espresso_machine.h"
+#include "utils/macros.h"
+
+/** \brief Value marking a valid log header ("SL"). */
+#define SHOT_LOG_MAGIC 0x534C
+
+/** \brief Header at the start of the log region. Locates the newest record without a search. */
+typedef struct {
+    uint16_t magic;         /**< \brief ::SHOT_LOG_MAGIC if the header is valid. */
+    uint16_t capacity;      /**< \brief The number of record slots. A change clears the log. */
+    uint16_t next_slot;     /**< \brief The slot the next record is written to. */
+    uint16_t count;         /**< \brief The number of records in the log. */
+    uint16_t next_shot_num; /**< \brief The number of the next shot. */
+    uint8_t reserved;       /**< \brief Unused. Written as 0. */
+    uint8_t check;          /**< \brief CRC-8 of the preceding bytes. */
+} shot_log_header;
+
+static_assert(sizeof(shot_log_record) == 20, "shot_log_record must have no padding");
+static_assert(sizeof(shot_log_header) == 12, "shot_log_header must have no padding");
+
+/** \brief Pointer to FRAM memory IC object where the log is stored */
+static mb85_fram _mem = NULL;
+
+/** \brief Local copy of the log header. Linked to ::SHOT_LOG_START_ADDR. */
+static shot_log_header _header;
+
+/** \brief Record being written. Must not change until its queued write has run. */
+static shot_log_record _record;
+
+/** \brief Buffer records are read into. */
+static shot_log_record _read_buf;
+
+static mb85_fram_var _header_var; /**< \brief FRAM link of ::_header. */
+static mb85_fram_var _record_var; /**< \brief FRAM link of ::_record. */
+static mb85_fram_var _read_var;   /**< \brief FRAM link of ::_read_buf. */
+
+/** \brief True while a shot is being summarized. */
+static bool _running = false;
+static uint64_t _start_us;     /**< \brief Time the running shot started. */
+static int32_t _start_mass_mg; /**< \brief Scale reading when the running shot started. */
+static int32_t _peak_mbar;     /**< \brief Peak pressure of the running shot. */
+static int64_t _temp_sum_cC;   /**< \brief Sum of the boiler temperatures of the running shot. */
+static uint32_t _temp_n;       /**< \brief Number of temperatures in ::_temp_sum_cC. */
+
+static uint16_t _print_slot; /**< \brief Slot of the next record to print. */
+static uint16_t _print_left; /**< \brief Records left to print. 0 if not printing. */
+
+/**
+ * \brief CRC-8 (polynomial 0x07) of a block of bytes.
+ *
+ * \param data The bytes to check.
+ * \param len The number of bytes.
+ * \return The CRC of the bytes.
+ */
+static uint8_t _shot_log_crc8(const void * data, uint len){
+    const uint8_t * bytes = (const uint8_t *)data;
+    uint8_t crc = 0;
+    for(uint i = 0; i < len; i++){
+        crc ^= bytes[i];
+        for(uint8_t b = 0; b < 8; b++) crc = (crc & 0x80) ? (crc<<1) ^ 0x07 : (crc<<1);
+    }
+    return crc;
+}
+
+/** \brief Returns the FRAM address of a record slot. */
+static inline reg_addr _shot_log_slot_addr(uint16_t slot){
+    return SHOT_LOG_START_ADDR + sizeof(shot_log_header) + slot*sizeof(shot_log_record);
+}
+
+/**
+ * \brief Read the record in a slot into ::_read_buf and check it.
+ *
+ * \param slot The slot to read.
+ * \return PICO_ERROR_NONE on success. PICO_ERROR_IO if the check failed. Else the I2C error.
+ */
+static int _shot_log_read_slot(uint16_t slot){
+    const int result = mb85_fram_load_from(_mem, _read_var, _shot_log_slot_addr(slot));
+    if(result) return result;
+    if(_shot_log_crc8(&_read_buf, sizeof(_read_buf) - 1) != _read_buf.check) return PICO_ERROR_IO;
+    return PICO_ERROR_NONE;
+}
+
+/** \brief Returns the slot of the record with the given age. The age must be less than the count. */
+static inline uint16_t _shot_log_age_to_slot(uint16_t age){
+    return (_header.next_slot + _header.capacity - 1 - age) % _header.capacity;
+}
+
+int shot_log_setup(mb85_fram mem){
+    if(mem == NULL) return PICO_ERROR_GENERIC;
+
+    const uint32_t fram_size = (uint32_t)mb85_fram_get_max_addr(mem) + 1;
+    const uint32_t first_slot = _shot_log_slot_addr(0);
+    if(fram_size < first_slot + sizeof(shot_log_record)) return PICO_ERROR_GENERIC;
+    const uint16_t capacity = MIN((fram_size - first_slot)/sizeof(shot_log_record), SHOT_LOG_MAX_RECORDS);
+
+    _header_var = mb85_fram_link_var(mem, &_header, SHOT_LOG_START_ADDR, sizeof(_header), MB85_FRAM_INIT_FROM_FRAM);
+    if(_header_var < 0) return _header_var;
+    _record_var = mb85_fram_link_var(mem, &_record, first_slot, sizeof(_record), MB85_FRAM_INIT_NONE);
+    _read_var = mb85_fram_link_var(mem, &_read_buf, first_slot, sizeof(_read_buf), MB85_FRAM_INIT_NONE);
+    if(_record_var < 0 || _read_var < 0){
+        // Free the links that were made so the FRAM's table doesn't lose them
+        if(_read_var >= 0) mb85_fram_unlink_var(mem, _read_var);
+        if(_record_var >= 0) mb85_fram_unlink_var(mem, _record_var);
+        mb85_fram_unlink_var(mem, _header_var);
+        return PICO_ERROR_GENERIC;
+    }
+    _mem = mem;
+
+    int result = PICO_ERROR_NONE;
+
+    if(_header.magic != SHOT_LOG_MAGIC || _header.capacity != capacity || _header.next_slot >= capacity
+       || _header.count > capacity || _shot_log_crc8(&_header, sizeof(_header) - 1) != _header.check){
+        // Start an empty log
+        _header = (shot_log_header){.magic = SHOT_LOG_MAGIC, .capacity = capacity};
+        _header.check = _shot_log_crc8(&_header, sizeof(_header) - 1);
+        result = mb85_fram_save(_mem, _header_var);
+    }
+    return result;
+}
+
+void shot_log_start(uint8_t mode, uint8_t profile, int32_t mass_mg){
+    _running = true;
+    _start_us = time_us_64();
+    _start_mass_mg = mass_mg;
+    _peak_mbar = 0;
+    _temp_sum_cC = 0;
+    _temp_n = 0;
+    _record = (shot_log_record){.mode = mode, .profile = profile, .temp_min_cC = INT16_MAX, .temp_max_cC = INT16_MIN};
+}
+
+void shot_log_update(int16_t temp_cC, int32_t pressure_mbar){
+    if(!_running) return;
+    _peak_mbar = MAX(_peak_mbar, pressure_mbar);
+    _record.temp_min_cC = MIN(_record.temp_min_cC, temp_cC);
+    _record.temp_max_cC = MAX(_record.temp_max_cC, temp_cC);
+    _temp_sum_cC += temp_cC;
+    _temp_n++;
+}
+
+int shot_log_finish(int32_t mass_mg, int32_t volume_ul){
+    if(!_running) return PICO_ERROR_GENERIC;
+    _running = false;
+    const uint64_t duration_ms = (time_us_64() - _start_us)/1000;
+    if(_mem == NULL || duration_ms < SHOT_LOG_MIN_DURATION_MS) return PICO_ERROR_GENERIC;
+
+    // Fill in the record. The temperature stats were updated while the shot ran.
+    _record.shot_num = _header.next_shot_num;
+    _record.duration_100ms = MIN(duration_ms/100, UINT16_MAX);
+    _record.yield_100mg = CLAMP((mass_mg - _start_mass_mg)/100, INT16_MIN, INT16_MAX);
+    _record.volume_ml = CLAMP(volume_ul/1000, 0, UINT16_MAX);
+    _record.peak_pressure_10mbar = CLAMP(_peak_mbar/10, 0, UINT16_MAX);
+    if(_temp_n == 0){
+        _record.temp_min_cC = _record.temp_max_cC = 0;
+    } else {
+        _record.temp_mean_cC = _temp_sum_cC/(int64_t)_temp_n;
+    }
+    _record.check = _shot_log_crc8(&_record, sizeof(_record) - 1);
+
+    // Queue the record, then the header that includes it
+    const int result = mb85_fram_save_to_async(_mem, _record_var, _shot_log_slot_addr(_header.next_slot), NULL, NULL);
+    if(result) return result;
+    _header.next_slot = (_header.next_slot + 1) % _header.capacity;
+    _header.count = MIN(_header.count + 1, _header.capacity);
+    _header.next_shot_num++;
+    _header.check = _shot_log_crc8(&_header, sizeof(_header) - 1);
+    return mb85_fram_save_async(_mem, _header_var, NULL, NULL);
+}
+
+bool shot_log_running(){
+    return _running;
+}
+
+uint16_t shot_log_count(){
+    return (_mem == NULL ? 0 : _header.count);
+}
+
+int shot_log_read(uint16_t age, shot_log_record * dst){
+    if(age >= shot_log_count()) return PICO_ERROR_INVALID_ARG;
+    const int result = _shot_log_read_slot(_shot_log_age_to_slot(age));
+    *dst = _read_buf;
+    return result;
+}
+
+void shot_log_print(){
+    printf("\nShot log: %u of %u records, newest first\n", shot_log_count(), (_mem == NULL ? 0 : _header.capacity));
+    _print_left = shot_log_count();
+    if(_print_left > 0) _print_slot = _shot_log_age_to_slot(0);
+}
+
+void shot_log_tick(){
+    if(_print_left == 0) return;
+    _print_left--;
+    const uint16_t slot = _print_slot;
+    _print_slot = (_print_slot + _header.capacity - 1) % _header.capacity;
+
+    if(_shot_log_read_slot(slot)){
+        printf("  (slot %u unreadable)\n", slot);
+        return;
+    }
+    const shot_log_record * r = &_read_buf;
+    printf("  #%u %s", r->shot_num, (r->mode == MODE_AUTO ? "auto" : (r->mode == MODE_MANUAL ? "manual" : "other")));
+    if(r->profile != SHOT_LOG_NO_PROFILE) printf(" (preset %u)", r->profile + 1);
+    printf(": %.1f s, %.1f g, %u ml, peak %.2f bar, boiler %.1f/%.1f/%.1f C (min/mean/max)\n",
+           r->duration_100ms/10.f, r->yield_100mg/10.f, r->volume_ml, r->peak_pressure_10mbar/100.f,
+           r->temp_min_cC/100.f, r->temp_mean_cC/100.f, r->temp_max_cC/100.f);
+}
+
+#ifdef SHOT_LOG_TESTS
+#ifndef I2C_BUS_EMULATION
+#error "SHOT_LOG_TESTS requires I2C_BUS_EMULATION"
+#endif
+#include <string.h>
+#include "utils/i2c_emulator.h"
+
+#define TEST_FRAM_SIZE 0x8000  // MB85RC256V
+#define TEST_WRAP_SHOTS 1030   // Logged after the first two so 1032 are logged in total
+
+/** \brief Log a shot of the given duration without waiting for it and run the queued writes. */
+static void _shot_log_test_shot(uint32_t duration_ms, int16_t yield_100mg){
+    shot_log_start(MODE_AUTO, 2, 1000);
+    for(uint32_t t = 0; t < duration_ms; t += 10){
+        shot_log_update(9300 + (t/10)%50, 9000 + (t < 5000 ? t : 0));
+    }
+    _start_us -= 1000ull*duration_ms; // Backdate the start instead of waiting out the shot
+    shot_log_finish(1000 + yield_100mg*100, 36000);
+    while(!i2c_bus_is_idle(i2c0)) tight_loop_contents();
+    i2c_bus_process_completed();
+}
+
+void shot_log_test(){
+    i2c_emulator_mb85 fram_emu = i2c_emulator_mb85_setup(i2c0, 0, TEST_FRAM_SIZE);
+    mb85_fram fram = mb85_fram_setup(i2c0, 0, NULL);
+    if(fram_emu == NULL || fram == NULL){
+        printf("Test 1:  FAIL (emulated FRAM not found)\n");
+        return;
+    }
+    uint8_t * mem = i2c_emulator_mb85_memory(fram_emu);
+
+    // Blank FRAM
+    int result = shot_log_setup(fram);
+    bool pass = (result == PICO_ERROR_NONE && shot_log_count() == 0 && _header.capacity == SHOT_LOG_MAX_RECORDS);
+    printf("Test 1:  %s (blank %d byte FRAM: result %d, capacity %u)\n", (pass ? "PASS" : "FAIL"), TEST_FRAM_SIZE, result, _header.capacity);
+
+    // Two shots and a flush
+    const uint32_t bytes_before = i2c_emulator_mb85_bytes_written(fram_emu);
+    _shot_log_test_shot(28000, 362);
+    _shot_log_test_shot(1500, 10);
+    _shot_log_test_shot(31000, 400);
+    const uint32_t bytes_per_shot = (i2c_emulator_mb85_bytes_written(fram_emu) - bytes_before)/2;
+    shot_log_record rec;
+    result = shot_log_read(0, &rec);
+    pass = (result == PICO_ERROR_NONE && shot_log_count() == 2 && rec.shot_num == 1 && rec.duration_100ms == 310
+            && rec.yield_100mg == 400 && rec.volume_ml == 36 && rec.peak_pressure_10mbar == 1399
+            && rec.temp_min_cC == 9300 && rec.temp_max_cC == 9349 && rec.profile == 2 && rec.mode == MODE_AUTO);
+    printf("Test 2:  %s (2 of 3 shots logged with the 1.5 s one skipped, newest #%u: %u ds, %d hg, peak %u, %lu bytes written per shot)\n",
+           (pass ? "PASS" : "FAIL"), rec.shot_num, rec.duration_100ms, rec.yield_100mg, rec.peak_pressure_10mbar, bytes_per_shot);
+
+    // Raw layout of the header and the newest record
+    const uint8_t * raw = mem + _shot_log_slot_addr(1);
+    pass = (raw[0] == 1 && raw[1] == 0 && raw[2] == MODE_AUTO && raw[3] == 2 && raw[4] == (310 & 0xFF) && raw[5] == (310 >> 8)
+            && raw[6] == (400 & 0xFF) && raw[18] == 0 && raw[19] == _shot_log_crc8(raw, sizeof(shot_log_record) - 1)
+            && mem[SHOT_LOG_START_ADDR] == 0x4C && mem[SHOT_LOG_START_ADDR + 1] == 0x53
+            && mem[SHOT_LOG_START_ADDR + 4] == 2 && mem[SHOT_LOG_START_ADDR + 6] == 2);
+    printf("Test 3:  %s (little endian record at 0x%X, header magic, next slot, and count at 0x%X)\n",
+           (pass ? "PASS" : "FAIL"), _shot_log_slot_addr(1), SHOT_LOG_START_ADDR);
+
+    // Reboot with a new driver instance
+    mb85_fram_deinit(fram);
+    _mem = NULL;
+    memset(&_header, 0, sizeof(_header));
+    fram = mb85_fram_setup(i2c0, 0, NULL);
+    result = shot_log_setup(fram);
+    if(result == PICO_ERROR_NONE) result = shot_log_read(1, &rec);
+    pass = (result == PICO_ERROR_NONE && shot_log_count() == 2 && rec.shot_num == 0 && rec.duration_100ms == 280);
+    printf("Test 4:  %s (after a reboot: %u records, oldest #%u)\n", (pass ? "PASS" : "FAIL"), shot_log_count(), rec.shot_num);
+
+    // Wrap
+    const uint64_t t0 = time_us_64();
+    for(uint i = 0; i < TEST_WRAP_SHOTS; i++) _shot_log_test_shot(SHOT_LOG_MIN_DURATION_MS, i % 500);
+    const uint64_t wrap_us = time_us_64() - t0;
+    pass = (shot_log_count() == SHOT_LOG_MAX_RECORDS && _header.next_slot == (2 + TEST_WRAP_SHOTS) % SHOT_LOG_MAX_RECORDS);
+    for(uint16_t age = 0; pass && age < shot_log_count(); age++){
+        pass = (shot_log_read(age, &rec) == PICO_ERROR_NONE && rec.shot_num == 2 + TEST_WRAP_SHOTS - 1 - age);
+    }
+    printf("Test 5:  %s (%u more shots in %llu us: %u records, newest first down to #%u, next slot %u)\n",
+           (pass ? "PASS" : "FAIL"), TEST_WRAP_SHOTS, wrap_us, shot_log_count(), rec.shot_num, _header.next_slot);
+
+    // Corrupted newest record
+    mem[_shot_log_slot_addr(_shot_log_age_to_slot(0)) + 6] ^= 1;
+    pass = (shot_log_read(0, &rec) == PICO_ERROR_IO && shot_log_read(1, &rec) == PICO_ERROR_NONE
+            && shot_log_read(SHOT_LOG_MAX_RECORDS, &rec) == PICO_ERROR_INVALID_ARG);
+    printf("Test 6:  %s (corrupted newest record rejected, the next one read)\n", (pass ? "PASS" : "FAIL"));
+
+    // Too few free links: setup fails and frees the links it made
+    _mem = NULL;
+    mb85_fram_deinit(fram);
+    fram = mb85_fram_setup(i2c0, 0, NULL);
+    uint8_t dummy;
+    for(uint i = 0; i < MB85_FRAM_MAX_VARS - 2; i++) mb85_fram_link_var(fram, &dummy, 0, 1, MB85_FRAM_INIT_NONE);
+    result = shot_log_setup(fram);
+    pass = (result == PICO_ERROR_GENERIC && _mem == NULL);
+    for(uint i = 0; i < 2; i++) pass &= (mb85_fram_link_var(fram, &dummy, 0, 1, MB85_FRAM_INIT_NONE) >= 0);
+    printf("Test 7:  %s (setup with 2 free links failed with %d and left both free)\n", (pass ? "PASS" : "FAIL"), result);
+
+    mb85_fram_deinit(fram);
+    i2c_emulator_mb85_deinit(fram_emu);
+}
+#endif
+/** @} */
@@ -0,0 +1,155 @@
+/**
+ * \ingroup gpio_event_queue
+ * 
+ * \file gpio_event_queue.c
+ * \author Richard Hall (hallboyone@icloud.com)
+ * \brief GPIO Event Queue source
+ * \version 0.2
+ * \date 2026-10-18
+ */
+
+#include "utils/gpio_event_queue.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/** \brief Structure holding the buffer and indices of a single SPSC queue. */
+typedef struct gpio_event_queue_s {
+    gpio_event * buf;          /**< \brief Ring buffer of events. */
+    uint32_t mask;             /**< \brief Capacity minus one. Used to wrap the indices. */
+    atomic_uint_least32_t head;    /**< \brief Count of pushed events. Only written by the producer. */
+    atomic_uint_least32_t tail;    /**< \brief Count of popped events. Only written by the consumer. */
+    atomic_uint_least32_t dropped; /**< \brief Count of overwritten events. Only written by the consumer. */
+} gpio_event_queue_;
+
+gpio_event_queue gpio_event_queue_setup(uint8_t capacity_pow2){
+    if(capacity_pow2 < 1 || capacity_pow2 > 15) return NULL;
+
+    gpio_event_queue q = malloc(sizeof(gpio_event_queue_));
+    if(q == NULL) return NULL;
+    q->buf = malloc(sizeof(gpio_event) << capacity_pow2);
+    if(q->buf == NULL){
+        free(q);
+        return NULL;
+    }
+    q->mask = (1u << capacity_pow2) - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->dropped, 0);
+    return q;
+}
+
+void gpio_event_queue_push(gpio_event_queue q, const gpio_event * e){
+    // Always write the newest event. If the queue is full this overwrites the oldest unread event,
+    // which the consumer detects and counts when it next pops.
+    const uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    q->buf[head & q->mask] = *e;
+    // Publish the event only after it has been written
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+}
+
+bool gpio_event_queue_pop(gpio_event_queue q, gpio_event * e){
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    while(true){
+        const uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+        if(head == tail) return false;
+
+        // Skip past overwritten events. Only the newest mask events are kept so the slot being
+        // read is never the one the producer writes next.
+        if(head - tail > q->mask){
+            // Only the consumer writes the drop count so a load and store is enough (no RMW needed on the M0+)
+            const uint32_t dropped = atomic_load_explicit(&q->dropped, memory_order_relaxed);
+            atomic_store_explicit(&q->dropped, dropped + (head - q->mask - tail), memory_order_relaxed);
+            tail = head - q->mask;
+        }
+
+        *e = q->buf[tail & q->mask];
+        // If the producer lapped the slot while it was read, the copy may be torn. Try again.
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&q->head, memory_order_relaxed) - tail > q->mask) continue;
+
+        // Release the slot only after it has been read
+        atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+        return true;
+    }
+}
+
+uint32_t gpio_event_queue_size(gpio_event_queue q){
+    const uint32_t size = atomic_load_explicit(&q->head, memory_order_acquire) - atomic_load_explicit(&q->tail, memory_order_acquire);
+    return MIN(size, q->mask);
+}
+
+uint32_t gpio_event_queue_dropped(gpio_event_queue q){
+    return atomic_load_explicit(&q->dropped, memory_order_relaxed);
+}
+
+void gpio_event_queue_deinit(gpio_event_queue q){
+    free(q->buf);
+    free(q);
+}
+
+#ifdef GPIO_EVENT_QUEUE_TESTS
+#include <stdio.h>
+
+#define TEST_DURATION_MS 2000
+#define TEST_PERIOD_US 5
+#define TEST_OVERFILL 20
+
+static uint32_t _test_next_seq = 0;
+
+/** \brief Timer callback acting as the producer. The sequence number is stored in the timestamp. */
+static bool _gpio_event_queue_test_producer(repeating_timer_t * rt){
+    const uint32_t seq = _test_next_seq++;
+    const gpio_event e = {.timestamp_us = seq, .gpio = seq & 0x1F, .events = GPIO_IRQ_EDGE_RISE};
+    gpio_event_queue_push((gpio_event_queue)rt->user_data, &e);
+    return true;
+}
+
+void gpio_event_queue_test(){
+    gpio_event_queue q = gpio_event_queue_setup(4);
+    repeating_timer_t timer;
+    add_repeating_timer_us(-TEST_PERIOD_US, &_gpio_event_queue_test_producer, q, &timer);
+
+    uint32_t expected = 0, popped = 0, errors = 0, max_size = 0;
+    const absolute_time_t end_time = make_timeout_time_ms(TEST_DURATION_MS);
+    while(!time_reached(end_time)){
+        max_size = MAX(max_size, gpio_event_queue_size(q));
+        gpio_event e;
+        if(gpio_event_queue_pop(q, &e)){
+            // Events may be skipped (dropped) but never reordered, repeated, or torn
+            if(e.timestamp_us < expected || e.gpio != (e.timestamp_us & 0x1F) || e.events != GPIO_IRQ_EDGE_RISE) errors++;
+            expected = e.timestamp_us + 1;
+            popped++;
+        }
+    }
+    cancel_repeating_timer(&timer);
+
+    // Drain what is left and check that every pushed event is either popped or dropped
+    gpio_event e;
+    while(gpio_event_queue_pop(q, &e)) popped++;
+    const uint32_t dropped = gpio_event_queue_dropped(q);
+
+    printf("Test 1:  %s (%lu errors in %lu events)\n", (errors == 0 ? "PASS" : "FAIL"), errors, popped);
+    printf("Test 2:  %s (%lu popped + %lu dropped = %lu pushed)\n", (popped + dropped == _test_next_seq ? "PASS" : "FAIL"),
+           popped, dropped, _test_next_seq);
+    printf("Test 3:  %s (max size %lu of %lu)\n", (max_size <= 15 ? "PASS" : "FAIL"), max_size, 15ul);
+
+    // Overfill the queue without popping. The oldest events must be the ones dropped.
+    const uint32_t dropped_before = gpio_event_queue_dropped(q);
+    for(uint32_t seq = 0; seq < TEST_OVERFILL; seq++){
+        const gpio_event e = {.timestamp_us = seq, .gpio = seq & 0x1F, .events = GPIO_IRQ_EDGE_RISE};
+        gpio_event_queue_push(q, &e);
+    }
+    uint32_t first = UINT32_MAX, last = 0, overfill_popped = 0;
+    while(gpio_event_queue_pop(q, &e)){
+        first = MIN(first, e.timestamp_us);
+        last = e.timestamp_us;
+        overfill_popped++;
+    }
+    const uint32_t overfill_dropped = gpio_event_queue_dropped(q) - dropped_before;
+    printf("Test 4:  %s (kept events %lu to %lu, %lu dropped)\n",
+           (first == TEST_OVERFILL - 15 && last == TEST_OVERFILL - 1 && overfill_popped == 15 && overfill_dropped == TEST_OVERFILL - 15 ? "PASS" : "FAIL"),
+           first, last, overfill_dropped);
+    gpio_event_queue_deinit(q);
+}
+#endif
@@ -4,7 +4,7 @@
  * \file gpio_irq_timestamp.c
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief GPIO IRQ Timestamp source
- * \version 0.1
+ * \version 0.2
  * \date 2023-01-23 
  */
 
@@ -12,16 +12,20 @@
 #include "utils/gpio_multi_callback.h"
 #include "utils/macros.h"
 
-/** Array of all timestamps. One for each GPIO. */
+/** Array of all timestamps. One for each GPIO. Only written from the main loop. */
 static absolute_time_t _timestamps [32];
 /** Array of bitfields defining triggering events for corresponding GPIO. */
 static uint32_t _events [32] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-/** Callback function that records the current time in the corresponding GPIO's field of ::_timestamps*/
-static void gpio_irq_timestamp_cb(uint gpio, uint32_t event, void* data){
+/** 
+ * Deferred callback that records the time of the event in the corresponding GPIO's field of ::_timestamps.
+ * The 32 bit timestamp is extended using the current time.
+ */
+static void gpio_irq_timestamp_cb(uint gpio, uint32_t event, uint32_t timestamp_us, void* data){
     UNUSED_PARAMETER(event);
     UNUSED_PARAMETER(data);
-    _timestamps[gpio] = get_absolute_time();
+    const uint64_t now_us = time_us_64();
+    update_us_since_boot(&_timestamps[gpio], now_us - (uint32_t)((uint32_t)now_us - timestamp_us));
 }
 
 int gpio_irq_timestamp_setup(uint8_t gpio, uint32_t events){
@@ -33,18 +37,18 @@ int gpio_irq_timestamp_setup(uint8_t gpio, uint32_t events){
 
     // Save events and setup new ones
     _events[gpio] = _events[gpio] | events;
-    gpio_multi_callback_attach(gpio, events, true, &gpio_irq_timestamp_cb, NULL);
-    
-    return PICO_ERROR_NONE;
+    return gpio_multi_callback_attach_deferred(gpio, events, true, &gpio_irq_timestamp_cb, NULL);
 }
 
 absolute_time_t gpio_irq_timestamp_read(uint8_t gpio){
     if(gpio>=32) return nil_time;
-    return get_absolute_time();
+    gpio_multi_callback_process_deferred();
+    return _timestamps[gpio];
 }
 
 int64_t gpio_irq_timestamp_read_duration_us(uint8_t gpio){
     if(gpio>=32) return PICO_ERROR_INVALID_ARG;
+    gpio_multi_callback_process_deferred();
     return absolute_time_diff_us(_timestamps[gpio], get_absolute_time());
 }
 
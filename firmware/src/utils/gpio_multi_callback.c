@@ -4,7 +4,7 @@
  * \file gpio_multi_callback.c
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief GPIO Multi-Callback source
- * \version 0.2
+ * \version 0.4
  * \date 2023-01-24
 */
 
@@ -13,12 +13,21 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "utils/gpio_event_queue.h"
+
+/** \brief The deferred event queue keeps the newest 2^GPIO_MULTI_CALLBACK_QUEUE_POW2 - 1 events. */
+#define GPIO_MULTI_CALLBACK_QUEUE_POW2 6
+
 /** \brief Flag indicating if IRQ dispatch has been setup. */
 static bool _irq_dispatch_setup = false;
 
+/** \brief Events waiting for their deferred callbacks. Created with the first deferred callback. */
+static gpio_event_queue _deferred_events = NULL;
+
 /** \brief The callback function, triggering events, and optional data for a multi-callback. */
 typedef struct {
-    gpio_multi_callback_t fun; /**<\brief The callback function. */
+    gpio_multi_callback_t fun;               /**<\brief The callback function if run in the IRQ. Else NULL. */
+    gpio_multi_callback_deferred_t deferred; /**<\brief The callback function if deferred. Else NULL. */
     uint32_t events;           /**<\brief Event flags indicating what will trigger callback (see Pico SDK for more info).*/
     void * data;               /**<\brief Optional pointer to data that will be passed to callback. */
 } gpio_multi_callback_config_t;
@@ -53,23 +62,43 @@ static gpio_multi_callback_array_t _callbacks [32] = {
 /**
  * \brief Centralized callback that dispatches calls to the correct custom callback
  * 
+ * Immediate callbacks are called here. If any deferred callbacks match, the event is queued
+ * once for ::gpio_multi_callback_process_deferred.
+ * 
  * \param gpio The GPIO pin that generated the interrupt
  * \param event The GPIO even the generated the interrupt
  */
 static void _gpio_multi_callback_irq_dispatch(uint gpio, uint32_t event){
+    const uint32_t timestamp_us = time_us_32();
+    bool defer = false;
+
     // Call all callbacks with matching events.
     const gpio_multi_callback_array_t cb = _callbacks[gpio];
     for(uint8_t i = 0; i < cb.num_cb; i++){
         if(event & cb.callbacks[i].events) {
-            cb.callbacks[i].fun(gpio, event, cb.callbacks[i].data);
+            if(cb.callbacks[i].fun != NULL){
+                cb.callbacks[i].fun(gpio, event, cb.callbacks[i].data);
+            } else {
+                defer = true;
+            }
         }
     }
-}  
 
-int gpio_multi_callback_attach(uint8_t gpio, uint32_t event_mask, bool enabled, gpio_multi_callback_t cb, void * data){
-    assert(gpio < 32);
-    assert(cb != NULL);
+    if(defer){
+        const gpio_event e = {.timestamp_us = timestamp_us, .gpio = gpio, .events = event};
+        gpio_event_queue_push(_deferred_events, &e);
+    }
+}  
 
+/**
+ * \brief Add a callback configuration to a GPIO and setup its interrupt.
+ * 
+ * \param gpio The GPIO number to attach to
+ * \param config The callback configuration to add
+ * \param enabled Flag indicating if interrupt should be active
+ * \return PICO_ERROR_NONE if no error. Errors will crash the program
+ */
+static int _gpio_multi_callback_add(uint8_t gpio, gpio_multi_callback_config_t config, bool enabled){
     const uint8_t idx = _callbacks[gpio].num_cb;
 
     // Just adding one to callback array. Computationally inefficient but uses less memory.
@@ -80,9 +109,7 @@ int gpio_multi_callback_attach(uint8_t gpio, uint32_t event_mask, bool enabled,
     _callbacks[gpio].num_cb += 1;
     
     // Add custom callback to list.
-    _callbacks[gpio].callbacks[idx].fun = cb;
-    _callbacks[gpio].callbacks[idx].data = data;
-    _callbacks[gpio].callbacks[idx].events = event_mask;
+    _callbacks[gpio].callbacks[idx] = config;
 
     // Setup local dispatch if not already done 
     if(!_irq_dispatch_setup){
@@ -91,11 +118,54 @@ int gpio_multi_callback_attach(uint8_t gpio, uint32_t event_mask, bool enabled,
     }
 
     // Setup GPIO as interrupt
-    gpio_set_irq_enabled(gpio, event_mask, enabled);
+    gpio_set_irq_enabled(gpio, config.events, enabled);
     
     return PICO_ERROR_NONE;
 }
 
+int gpio_multi_callback_attach(uint8_t gpio, uint32_t event_mask, bool enabled, gpio_multi_callback_t cb, void * data){
+    assert(gpio < 32);
+    assert(cb != NULL);
+
+    const gpio_multi_callback_config_t config = {.fun = cb, .deferred = NULL, .events = event_mask, .data = data};
+    return _gpio_multi_callback_add(gpio, config, enabled);
+}
+
+int gpio_multi_callback_attach_deferred(uint8_t gpio, uint32_t event_mask, bool enabled, 
+                                        gpio_multi_callback_deferred_t cb, void * data){
+    assert(gpio < 32);
+    assert(cb != NULL);
+
+    if(_deferred_events == NULL){
+        _deferred_events = gpio_event_queue_setup(GPIO_MULTI_CALLBACK_QUEUE_POW2);
+        if(_deferred_events == NULL) return PICO_ERROR_GENERIC;
+    }
+
+    const gpio_multi_callback_config_t config = {.fun = NULL, .deferred = cb, .events = event_mask, .data = data};
+    return _gpio_multi_callback_add(gpio, config, enabled);
+}
+
+uint gpio_multi_callback_process_deferred(){
+    if(_deferred_events == NULL) return 0;
+
+    uint num_events = 0;
+    gpio_event e;
+    while(gpio_event_queue_pop(_deferred_events, &e)){
+        const gpio_multi_callback_array_t cb = _callbacks[e.gpio];
+        for(uint8_t i = 0; i < cb.num_cb; i++){
+            if(cb.callbacks[i].deferred != NULL && (e.events & cb.callbacks[i].events)){
+                cb.callbacks[i].deferred(e.gpio, e.events, e.timestamp_us, cb.callbacks[i].data);
+            }
+        }
+        num_events++;
+    }
+    return num_events;
+}
+
+uint32_t gpio_multi_callback_dropped_events(){
+    return (_deferred_events == NULL ? 0 : gpio_event_queue_dropped(_deferred_events));
+}
+
 int gpio_multi_callback_enabled(uint8_t gpio, uint32_t event_mask, bool enable){
     assert(gpio < 32);
 
@@ -2,11 +2,140 @@
  * \file 
  * \author Richard Hall (hallboyone@icloud.com)
  * \brief I2C Bus source
- * \version 0.1
+ * \version 0.8
  * \date 2022-08-17
  */
 #include "utils/i2c_bus.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/clocks.h"
 #include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+/** \brief Depth of the I2C controller's TX and RX FIFOs. */
+#define I2C_BUS_FIFO_DEPTH 16
+
+/** \brief Half period of the SCL pulses used to clear the bus (100 kHz). */
+#define I2C_BUS_CLEAR_HALF_PERIOD_US 5
+
+/** \brief Direction of a queued transaction. */
+typedef enum {
+    I2C_BUS_OP_READ,
+    I2C_BUS_OP_WRITE
+} i2c_bus_op;
+
+/** \brief A single queued transaction. */
+typedef struct {
+    i2c_bus_op op;                        /**< \brief Read or write. */
+    dev_addr dev;                         /**< \brief The device address. */
+    uint8_t reg_addr_len;                 /**< \brief Length of the register address in bytes. */
+    reg_addr flipped_reg;                 /**< \brief Register address with its bytes in the order they are sent. */
+    uint16_t len;                         /**< \brief Number of bytes read or written after the register address. */
+    byte * buf;                           /**< \brief Destination of a read or source of a write. */
+    byte inline_buf [I2C_BUS_INLINE_LEN]; /**< \brief Copy of short writes. */
+    uint8_t speed;                        /**< \brief Index of the clock speed of the device. */
+    i2c_bus_callback_t cb;                /**< \brief Called from the main loop once finished. Can be NULL. */
+    void * data;                          /**< \brief User data passed to cb. */
+    volatile int result;                  /**< \brief Result of the transaction. Set by the IRQ. */
+#ifdef I2C_BUS_TRACE
+    uint32_t queued_us;                   /**< \brief When the transaction was queued (time_us_32). */
+#endif
+} i2c_bus_transaction;
+
+/** \brief SCL timing of one clock speed. Matches the timing set by the SDK's i2c_set_baudrate. */
+typedef struct {
+    uint baudrate;     /**< \brief The requested baudrate. */
+    uint16_t hcnt;     /**< \brief SCL high period in system clock cycles. */
+    uint16_t lcnt;     /**< \brief SCL low period in system clock cycles. */
+    uint8_t spklen;    /**< \brief Longest spike suppressed on SCL and SDA in system clock cycles. */
+    uint16_t sda_hold; /**< \brief SDA hold time after SCL falls in system clock cycles. */
+    uint8_t byte_us;   /**< \brief Time to send one byte (8 bits and the ACK) in us, rounded up. */
+} i2c_bus_speed;
+
+#ifdef I2C_BUS_EMULATION
+/** \brief A device replaced by an emulator. */
+typedef struct {
+    dev_addr dev;                   /**< \brief The device address. */
+    i2c_bus_emulator_read_t read;   /**< \brief Runs reads of the device. */
+    i2c_bus_emulator_write_t write; /**< \brief Runs writes to the device. */
+    void * data;                    /**< \brief User data passed to read and write. */
+} i2c_bus_emulator;
+#endif
+
+#ifdef I2C_BUS_TRACE
+/** \brief Trace of the transactions in one direction with one device. */
+typedef struct {
+    dev_addr dev;                         /**< \brief The device address. */
+    i2c_bus_op op;                        /**< \brief Read or write. */
+    uint32_t count;                       /**< \brief Number of finished transactions. */
+    uint32_t bytes;                       /**< \brief Register address and data bytes of those transactions. */
+    uint32_t bus_us;                      /**< \brief Time from the start of their first attempts to their stops. */
+    uint32_t latency_sum_us;              /**< \brief Sum of their latencies (queued to finished). */
+    uint32_t latency_min_us;              /**< \brief Shortest latency. */
+    uint32_t latency_max_us;              /**< \brief Longest latency. */
+    uint32_t hist [I2C_BUS_TRACE_BINS];   /**< \brief log2 histogram of the latencies. */
+} i2c_bus_trace_entry;
+#endif
+
+/**
+ * \brief Queue of transactions for one bus. 
+ * 
+ * Transactions are queued by the main loop (tail), run by the IRQ (done), and their callbacks run
+ * by the main loop (head). A slot is only reused once its callback has run.
+ */
+typedef struct {
+    i2c_inst_t * bus;                                 /**< \brief The bus. NULL until setup. */
+    i2c_bus_transaction queue [I2C_BUS_QUEUE_LEN];    /**< \brief Ring of transactions. */
+    atomic_uint_least32_t head;                       /**< \brief Count of processed transactions. Only written by the main loop. */
+    atomic_uint_least32_t done;                       /**< \brief Count of finished transactions. Only written by the IRQ. */
+    atomic_uint_least32_t tail;                       /**< \brief Count of queued transactions. Only written by the main loop. */
+    volatile bool running;                            /**< \brief True while the IRQ is working through the queue. */
+    uint16_t cmds_sent;                               /**< \brief Commands pushed to the TX FIFO for the running transaction. */
+    uint16_t bytes_read;                              /**< \brief Bytes popped from the RX FIFO for the running transaction. */
+    bool aborted;                                     /**< \brief True if the running transaction was aborted (e.g. NACK). */
+    i2c_bus_speed speeds [I2C_BUS_MAX_SPEEDS];        /**< \brief Clock speeds used on the bus. Speed 0 is the default. */
+    uint8_t num_speeds;                               /**< \brief Number of speeds in use. */
+    uint8_t dev_speed [0x80];                         /**< \brief Index of the speed of each device address. */
+    uint8_t speed;                                    /**< \brief Index of the speed the controller is set to. */
+    uint8_t scl_pin;                                  /**< \brief GPIO of SCL. Driven directly to clear the bus. */
+    uint8_t sda_pin;                                  /**< \brief GPIO of SDA. */
+    uint32_t timeout_us;                              /**< \brief Time allowed beyond a transaction's time on the bus. */
+    volatile uint32_t deadline_us;                    /**< \brief When the running attempt times out (time_us_32). */
+    uint8_t attempts;                                 /**< \brief Number of retries of the running transaction. */
+    i2c_bus_device_stats stats [0x80];                /**< \brief Failure counts of each device address. */
+#ifdef I2C_BUS_TRACE
+    uint32_t started_us;                              /**< \brief When the running transaction's first attempt started. */
+    i2c_bus_trace_entry trace [I2C_BUS_TRACE_ENTRIES];/**< \brief Traced device and direction pairs. */
+    uint8_t num_traced;                               /**< \brief Number of entries in use. */
+    uint32_t untraced;                                /**< \brief Transactions dropped since every entry was in use. */
+    uint32_t trace_start_us;                          /**< \brief When the trace was last reset. */
+#endif
+#ifdef I2C_BUS_EMULATION
+    i2c_bus_emulator emulators [I2C_BUS_MAX_EMULATORS];/**< \brief Emulated devices. */
+    uint8_t num_emulators;                            /**< \brief Number of emulated devices. */
+    bool emulator_stalled;                            /**< \brief True while the running attempt is a stalled emulator's. */
+    uint32_t emulator_sda_pulses;                     /**< \brief SCL pulses until the stalled emulator releases SDA. */
+#endif
+} i2c_bus_queue;
+
+static i2c_bus_queue _queues [2];
+
+#define I2C_BUS_SHADOW_CACHED 0x1 /**< \brief Flag set once a shadow register holds the device's value. */
+#define I2C_BUS_SHADOW_DIRTY  0x2 /**< \brief Flag set while a shadow register has staged bits. */
+
+/** \brief Shadow of a block of registers on one device. */
+typedef struct i2c_bus_shadow_s {
+    i2c_inst_t * bus;       /**< \brief The I2C bus the device is attached to. */
+    dev_addr dev;           /**< \brief The device address. */
+    reg_addr first_reg;     /**< \brief Address of the first register in the block. */
+    uint8_t reg_addr_len;   /**< \brief Length of the register addresses in bytes. */
+    uint8_t num_regs;       /**< \brief Number of registers in the block. */
+    byte * vals;            /**< \brief Cached value of each register. Volatile bits are 0 unless staged. */
+    byte * volatile_bits;   /**< \brief Mask of the volatile bits of each register. */
+    uint8_t * flags;        /**< \brief I2C_BUS_SHADOW_CACHED and I2C_BUS_SHADOW_DIRTY flags of each register. */
+} i2c_bus_shadow_;
 /**
  * \brief Checks if the provided GPIO numbers corrispond to valid pins for the indicated I2C channel.
  *
@@ -39,19 +168,589 @@ static reg_addr i2c_bus_reverse_addr_bytes(reg_addr reg, uint8_t reg_addr_len){
     return flipped_addr;
 }
 
+/**
+ * \brief Compute the SCL timing of a baudrate the same way as the SDK's i2c_set_baudrate.
+ * 
+ * \returns True if the baudrate can be generated from the system clock. False otherwise.
+ */
+static bool i2c_bus_compute_speed(uint baudrate, i2c_bus_speed * speed){
+    if(baudrate == 0 || baudrate > 1000000) return false;
+    const uint freq_in = clock_get_hz(clk_sys);
+    const uint period = (freq_in + baudrate/2)/baudrate;
+    const uint lcnt = period*3/5;
+    const uint hcnt = period - lcnt;
+    const uint sda_hold = (baudrate < 1000000 ? (freq_in*3)/10000000 : (freq_in*3)/25000000) + 1;
+    if(hcnt < 8 || lcnt < 8 || hcnt > I2C_IC_FS_SCL_HCNT_IC_FS_SCL_HCNT_BITS 
+       || lcnt > I2C_IC_FS_SCL_LCNT_IC_FS_SCL_LCNT_BITS || sda_hold > lcnt - 2){
+        return false;
+    }
+    speed->baudrate = baudrate;
+    speed->hcnt = hcnt;
+    speed->lcnt = lcnt;
+    speed->spklen = (lcnt < 16 ? 1 : lcnt/16);
+    speed->sda_hold = sda_hold;
+    speed->byte_us = (9000000 + baudrate - 1)/baudrate;
+    return true;
+}
+
+/**
+ * \brief Write the SCL timing of one of a bus's speeds. The controller must be disabled.
+ */
+static void i2c_bus_apply_speed(i2c_bus_queue * q, uint8_t speed){
+    i2c_hw_t * hw = i2c_get_hw(q->bus);
+    const i2c_bus_speed * s = &q->speeds[speed];
+    hw->fs_scl_hcnt = s->hcnt;
+    hw->fs_scl_lcnt = s->lcnt;
+    hw->fs_spklen = s->spklen;
+    hw_write_masked(&hw->sda_hold, (uint32_t)s->sda_hold << I2C_IC_SDA_HOLD_IC_SDA_TX_HOLD_LSB, I2C_IC_SDA_HOLD_IC_SDA_TX_HOLD_BITS);
+    q->speed = speed;
+}
+
+/** \brief Increment a failure count unless it has saturated. */
+static inline void i2c_bus_count(uint16_t * count){
+    if(*count < UINT16_MAX) (*count)++;
+}
+
+/**
+ * \brief Get the queue of a bus.
+ * 
+ * \returns The queue. NULL if the bus hasn't been setup.
+ */
+static i2c_bus_queue * i2c_bus_get_queue(i2c_inst_t * bus){
+    i2c_bus_queue * q = &_queues[i2c_hw_index(bus)];
+    return (q->bus == bus ? q : NULL);
+}
+
+#ifdef I2C_BUS_EMULATION
+/**
+ * \brief Find the emulator of a device.
+ * 
+ * \returns The emulator. NULL if the device isn't emulated.
+ */
+static const i2c_bus_emulator * i2c_bus_find_emulator(const i2c_bus_queue * q, dev_addr dev){
+    for(uint8_t i = 0; i < q->num_emulators; i++){
+        if(q->emulators[i].dev == dev) return &q->emulators[i];
+    }
+    return NULL;
+}
+#endif
+
+static void i2c_bus_finish(i2c_bus_queue * q, i2c_bus_transaction * t, int result);
+
+/**
+ * \brief Address the device of the oldest unfinished transaction, switch to its speed if needed, 
+ * and enable the interrupts that run it. The TX empty interrupt fires immediately and starts 
+ * filling the FIFO.
+ * 
+ * Transactions with emulated devices are run and finished straight away.
+ */
+static void i2c_bus_start(i2c_bus_queue * q){
+    i2c_bus_transaction * t = &q->queue[atomic_load_explicit(&q->done, memory_order_relaxed) & (I2C_BUS_QUEUE_LEN-1)];
+#ifdef I2C_BUS_TRACE
+    if(q->attempts == 0) q->started_us = time_us_32();
+#endif
+    // The address and a possible restart take up to two more bytes
+    const uint32_t bus_us = (t->reg_addr_len + t->len + 2)*q->speeds[t->speed].byte_us;
+    q->deadline_us = time_us_32() + bus_us + q->timeout_us;
+#ifdef I2C_BUS_EMULATION
+    const i2c_bus_emulator * emu = i2c_bus_find_emulator(q, t->dev);
+    if(emu != NULL){
+        const reg_addr reg = i2c_bus_reverse_addr_bytes(t->flipped_reg, t->reg_addr_len);
+        const int result = (t->op == I2C_BUS_OP_READ ? emu->read(emu->data, reg, t->len, t->buf) 
+                                                     : emu->write(emu->data, reg, t->len, t->buf));
+        if(result > 0){
+            // Left running until its deadline. The controller's interrupts belong to the last real transaction.
+            i2c_get_hw(q->bus)->intr_mask = 0;
+            q->emulator_stalled = true;
+            q->emulator_sda_pulses = result;
+            return;
+        }
+        i2c_bus_finish(q, t, result);
+        return;
+    }
+#endif
+    i2c_hw_t * hw = i2c_get_hw(q->bus);
+    hw->enable = 0;
+    if(t->speed != q->speed) i2c_bus_apply_speed(q, t->speed);
+    hw->tar = t->dev;
+    hw->enable = 1;
+    (void)hw->clr_intr;
+
+    q->cmds_sent = 0;
+    q->bytes_read = 0;
+    q->aborted = false;
+    hw->intr_mask = I2C_IC_INTR_MASK_M_TX_EMPTY_BITS | I2C_IC_INTR_MASK_M_TX_ABRT_BITS | I2C_IC_INTR_MASK_M_STOP_DET_BITS
+                    | (t->op == I2C_BUS_OP_READ ? I2C_IC_INTR_MASK_M_RX_FULL_BITS : 0);
+}
+
+/**
+ * \brief Push as many of the running transaction's commands into the TX FIFO as will fit.
+ * 
+ * The register address is written first. Writes follow with their data while reads restart and 
+ * send one read command per byte. Read commands are limited so the RX FIFO can't overflow. The 
+ * last command has the stop bit. The TX empty interrupt is disabled while nothing can be pushed.
+ */
+static void i2c_bus_fill_tx(i2c_bus_queue * q, const i2c_bus_transaction * t){
+    i2c_hw_t * hw = i2c_get_hw(q->bus);
+    const uint16_t num_cmds = t->reg_addr_len + t->len;
+    size_t space = i2c_get_write_available(q->bus);
+    bool rx_full = false;
+    while(space > 0 && q->cmds_sent < num_cmds){
+        const uint16_t i = q->cmds_sent;
+        uint32_t cmd = (i + 1 == num_cmds ? I2C_IC_DATA_CMD_STOP_BITS : 0);
+        if(i < t->reg_addr_len){
+            cmd |= ((const byte*)&t->flipped_reg)[i];
+        } else if(t->op == I2C_BUS_OP_WRITE){
+            cmd |= t->buf[i - t->reg_addr_len];
+        } else {
+            if(i - t->reg_addr_len - q->bytes_read >= I2C_BUS_FIFO_DEPTH){
+                rx_full = true;
+                break;
+            }
+            cmd |= I2C_IC_DATA_CMD_CMD_BITS | (i == t->reg_addr_len && i > 0 ? I2C_IC_DATA_CMD_RESTART_BITS : 0);
+        }
+        hw->data_cmd = cmd;
+        q->cmds_sent++;
+        space--;
+    }
+    if(q->cmds_sent == num_cmds || rx_full){
+        hw->intr_mask &= ~I2C_IC_INTR_MASK_M_TX_EMPTY_BITS;
+    } else {
+        hw->intr_mask |= I2C_IC_INTR_MASK_M_TX_EMPTY_BITS;
+    }
+}
+
+#ifdef I2C_BUS_TRACE
+/**
+ * \brief Add the finished transaction to the trace entry of its device and direction.
+ */
+static void i2c_bus_trace_record(i2c_bus_queue * q, const i2c_bus_transaction * t){
+    const uint32_t now_us = time_us_32();
+    uint8_t i = 0;
+    while(i < q->num_traced && (q->trace[i].dev != t->dev || q->trace[i].op != t->op)) i++;
+    if(i == q->num_traced){
+        if(i == I2C_BUS_TRACE_ENTRIES){
+            q->untraced++;
+            return;
+        }
+        memset(&q->trace[i], 0, sizeof(i2c_bus_trace_entry));
+        q->trace[i].dev = t->dev;
+        q->trace[i].op = t->op;
+        q->trace[i].latency_min_us = UINT32_MAX;
+        q->num_traced++;
+    }
+    i2c_bus_trace_entry * e = &q->trace[i];
+    const uint32_t latency_us = now_us - t->queued_us;
+    e->count++;
+    e->bytes += t->reg_addr_len + t->len;
+    e->bus_us += now_us - q->started_us;
+    e->latency_sum_us += latency_us;
+    if(latency_us < e->latency_min_us) e->latency_min_us = latency_us;
+    if(latency_us > e->latency_max_us) e->latency_max_us = latency_us;
+    const uint8_t bin = (latency_us == 0 ? 0 : 32 - __builtin_clz(latency_us));
+    e->hist[MIN(bin, I2C_BUS_TRACE_BINS - 1)]++;
+}
+#endif
+
+/**
+ * \brief Finish an attempt of the running transaction.
+ * 
+ * A failed attempt is retried until the transaction has been retried ::I2C_BUS_MAX_RETRIES times.
+ * Otherwise, the result is recorded and the next transaction is started if any are queued.
+ */
+static void i2c_bus_finish(i2c_bus_queue * q, i2c_bus_transaction * t, int result){
+    if(result != I2C_BUS_SUCCESS){
+        if(q->attempts < I2C_BUS_MAX_RETRIES){
+            q->attempts++;
+            i2c_bus_count(&q->stats[t->dev].retries);
+            i2c_bus_start(q);
+            return;
+        }
+        i2c_bus_count(&q->stats[t->dev].errors);
+    }
+    t->result = result;
+    q->attempts = 0;
+#ifdef I2C_BUS_TRACE
+    i2c_bus_trace_record(q, t);
+#endif
+
+    // Publish the result only after it has been written
+    const uint32_t done = atomic_load_explicit(&q->done, memory_order_relaxed) + 1;
+    atomic_store_explicit(&q->done, done, memory_order_release);
+    if(done != atomic_load_explicit(&q->tail, memory_order_acquire)){
+        i2c_bus_start(q);
+    } else {
+        i2c_get_hw(q->bus)->intr_mask = 0;
+        q->running = false;
+    }
+}
+
+/**
+ * \brief Progress the running transaction of a bus. Runs in the I2C IRQ.
+ * 
+ * A transaction finishes when the stop is detected. If it was aborted (e.g. the device NACKed),
+ * the controller flushes the TX FIFO and sends the stop itself.
+ */
+static void i2c_bus_irq(i2c_bus_queue * q){
+    // Left pending by a bus clear
+    if(!q->running) return;
+    i2c_hw_t * hw = i2c_get_hw(q->bus);
+    i2c_bus_transaction * t = &q->queue[atomic_load_explicit(&q->done, memory_order_relaxed) & (I2C_BUS_QUEUE_LEN-1)];
+    const uint32_t stat = hw->intr_stat;
+
+    if(stat & I2C_IC_INTR_STAT_R_TX_ABRT_BITS){
+        q->aborted = true;
+        (void)hw->clr_tx_abrt;
+        hw->intr_mask &= ~I2C_IC_INTR_MASK_M_TX_EMPTY_BITS;
+    }
+    while(i2c_get_read_available(q->bus) > 0){
+        const byte b = hw->data_cmd;
+        if(q->bytes_read < t->len) t->buf[q->bytes_read++] = b;
+    }
+    if(stat & I2C_IC_INTR_STAT_R_STOP_DET_BITS){
+        (void)hw->clr_stop_det;
+        int result = I2C_BUS_SUCCESS;
+        if(q->aborted || q->cmds_sent < t->reg_addr_len + t->len){
+            result = I2C_BUS_ERROR_WRITE_FAILURE;
+        } else if(t->op == I2C_BUS_OP_READ && q->bytes_read < t->len){
+            result = I2C_BUS_ERROR_READ_FAILURE;
+        }
+        i2c_bus_finish(q, t, result);
+    } else if(!q->aborted){
+        i2c_bus_fill_tx(q, t);
+    }
+}
+
+/** \brief IRQ handler of i2c0. */
+static void i2c_bus_irq_0(){
+    i2c_bus_irq(&_queues[0]);
+}
+
+/** \brief IRQ handler of i2c1. */
+static void i2c_bus_irq_1(){
+    i2c_bus_irq(&_queues[1]);
+}
+
+/**
+ * \brief Reset the controller of a bus and restore its configuration. Leaves the default speed set.
+ */
+static void i2c_bus_init_controller(i2c_bus_queue * q){
+    i2c_init(q->bus, q->speeds[0].baudrate);
+    gpio_set_function(q->sda_pin, GPIO_FUNC_I2C);
+    gpio_set_function(q->scl_pin, GPIO_FUNC_I2C);
+
+    // Refill the TX FIFO once half empty so long writes never starve the bus. Read every byte.
+    i2c_hw_t * hw = i2c_get_hw(q->bus);
+    hw->intr_mask = 0;
+    hw->tx_tl = I2C_BUS_FIFO_DEPTH/2;
+    hw->rx_tl = 0;
+    q->speed = 0;
+}
+
+/** \brief Check if a device is holding SDA low. */
+static bool i2c_bus_sda_low(const i2c_bus_queue * q){
+#ifdef I2C_BUS_EMULATION
+    if(q->emulator_stalled) return q->emulator_sda_pulses > 0;
+#endif
+    return !gpio_get(q->sda_pin);
+}
+
+/**
+ * \brief Free a stuck bus and reset the controller.
+ * 
+ * A device that lost clocks mid-byte can hold SDA low forever. SCL is pulsed until the device 
+ * releases SDA (at most 9 pulses, one byte and its ACK) and then a stop is sent so every device
+ * is idle. The pins are driven open-drain by switching them between a low output and an input.
+ */
+static void i2c_bus_clear(i2c_bus_queue * q){
+    i2c_get_hw(q->bus)->enable = 0;
+    gpio_init(q->sda_pin);
+    gpio_init(q->scl_pin);
+    busy_wait_us_32(I2C_BUS_CLEAR_HALF_PERIOD_US);
+    for(uint8_t i = 0; i < 9 && i2c_bus_sda_low(q); i++){
+        gpio_set_dir(q->scl_pin, GPIO_OUT);
+        busy_wait_us_32(I2C_BUS_CLEAR_HALF_PERIOD_US);
+        gpio_set_dir(q->scl_pin, GPIO_IN);
+        busy_wait_us_32(I2C_BUS_CLEAR_HALF_PERIOD_US);
+#ifdef I2C_BUS_EMULATION
+        if(q->emulator_stalled) q->emulator_sda_pulses--;
+#endif
+    }
+    // Stop: SDA rises while SCL is high
+    gpio_set_dir(q->scl_pin, GPIO_OUT);
+    gpio_set_dir(q->sda_pin, GPIO_OUT);
+    busy_wait_us_32(I2C_BUS_CLEAR_HALF_PERIOD_US);
+    gpio_set_dir(q->scl_pin, GPIO_IN);
+    busy_wait_us_32(I2C_BUS_CLEAR_HALF_PERIOD_US);
+    gpio_set_dir(q->sda_pin, GPIO_IN);
+    busy_wait_us_32(I2C_BUS_CLEAR_HALF_PERIOD_US);
+
+#ifdef I2C_BUS_EMULATION
+    q->emulator_stalled = false;
+#endif
+    i2c_bus_init_controller(q);
+}
+
+/** \brief Check if the running attempt has stopped or aborted and its interrupt hasn't run yet. */
+static bool i2c_bus_irq_pending(const i2c_bus_queue * q){
+#ifdef I2C_BUS_EMULATION
+    if(q->emulator_stalled) return false;
+#endif
+    return i2c_get_hw(q->bus)->raw_intr_stat & (I2C_IC_RAW_INTR_STAT_STOP_DET_BITS | I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS);
+}
+
+/**
+ * \brief Stop the running transaction if it missed its deadline, clear the bus, and retry or fail it.
+ * 
+ * The bus's IRQ is disabled so it can't finish the transaction at the same time. A transaction that
+ * stopped or aborted just before the IRQ was disabled is finished by its pending interrupt instead. 
+ * Only called from the main loop.
+ */
+static void i2c_bus_check_deadline(i2c_bus_queue * q){
+    if(!q->running || (int32_t)(time_us_32() - q->deadline_us) < 0) return;
+
+    const uint irq_num = I2C0_IRQ + i2c_hw_index(q->bus);
+    irq_set_enabled(irq_num, false);
+    if(q->running && i2c_bus_irq_pending(q)){
+        i2c_bus_irq(q);
+    }
+    if(q->running && (int32_t)(time_us_32() - q->deadline_us) >= 0){
+        i2c_bus_transaction * t = &q->queue[atomic_load_explicit(&q->done, memory_order_relaxed) & (I2C_BUS_QUEUE_LEN-1)];
+        i2c_bus_count(&q->stats[t->dev].timeouts);
+        i2c_bus_clear(q);
+        i2c_bus_finish(q, t, I2C_BUS_ERROR_TIMEOUT);
+    }
+    irq_set_enabled(irq_num, true);
+}
+
+/**
+ * \brief Copy a transaction into the queue and start the IRQ if it was idle.
+ * 
+ * \param q The queue of the bus.
+ * \param t The transaction to queue. Short writes are copied into the queue.
+ * \param id Set to the number of the queued transaction.
+ * \returns I2C_BUS_SUCCESS if queued. I2C_BUS_ERROR_QUEUE_FULL if not.
+ */
+static int i2c_bus_push(i2c_bus_queue * q, const i2c_bus_transaction * t, uint32_t * id){
+    const uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if(tail - atomic_load_explicit(&q->head, memory_order_relaxed) >= I2C_BUS_QUEUE_LEN){
+        return I2C_BUS_ERROR_QUEUE_FULL;
+    }
+    i2c_bus_transaction * slot = &q->queue[tail & (I2C_BUS_QUEUE_LEN-1)];
+    *slot = *t;
+    if(slot->op == I2C_BUS_OP_WRITE && slot->len <= I2C_BUS_INLINE_LEN){
+        memcpy(slot->inline_buf, t->buf, t->len);
+        slot->buf = slot->inline_buf;
+    }
+#ifdef I2C_BUS_TRACE
+    slot->queued_us = time_us_32();
+#endif
+    *id = tail;
+
+    // The IRQ stops once the queue is empty. Restart it without racing its last finish.
+    const uint32_t status = save_and_disable_interrupts();
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    if(!q->running){
+        q->running = true;
+        i2c_bus_start(q);
+    }
+    restore_interrupts(status);
+    return I2C_BUS_SUCCESS;
+}
+
+/**
+ * \brief Build and queue a transaction.
+ * 
+ * \returns I2C_BUS_SUCCESS if queued. I2C_BUS_ERROR_QUEUE_FULL or I2C_BUS_ERROR_CONFIGURATION if not.
+ */
+static int i2c_bus_queue_transaction(i2c_inst_t * bus, i2c_bus_op op, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, 
+                                     uint len, byte * buf, i2c_bus_callback_t cb, void * data, uint32_t * id){
+    i2c_bus_queue * q = i2c_bus_get_queue(bus);
+    if(q == NULL || dev > 0x7F || reg_addr_len > sizeof(reg_addr) || reg_addr_len + len == 0 || len > UINT16_MAX - 4){
+        return I2C_BUS_ERROR_CONFIGURATION;
+    }
+    const i2c_bus_transaction t = {
+        .op = op,
+        .dev = dev,
+        .reg_addr_len = reg_addr_len,
+        .flipped_reg = i2c_bus_reverse_addr_bytes(reg, reg_addr_len),
+        .len = len,
+        .buf = buf,
+        .speed = q->dev_speed[dev],
+        .cb = cb,
+        .data = data,
+        .result = I2C_BUS_SUCCESS};
+    return i2c_bus_push(q, &t, id);
+}
+
+/**
+ * \brief Run the callbacks of the finished transactions on one bus.
+ * 
+ * A callback may make a blocking call, which processes the queue itself if it is full. The head
+ * is reloaded after every callback so a nested call's progress is never undone.
+ * 
+ * \returns The number of finished transactions.
+ */
+static uint i2c_bus_process_queue(i2c_bus_queue * q){
+    uint num_processed = 0;
+    uint32_t head;
+    while((head = atomic_load_explicit(&q->head, memory_order_relaxed)) != atomic_load_explicit(&q->done, memory_order_acquire)){
+        // Copy out and release the slot first since the callback may queue a new transaction
+        const i2c_bus_transaction * t = &q->queue[head & (I2C_BUS_QUEUE_LEN-1)];
+        const i2c_bus_callback_t cb = t->cb;
+        void * data = t->data;
+        const int result = t->result;
+        atomic_store_explicit(&q->head, head + 1, memory_order_release);
+        if(cb != NULL) cb(result, data);
+        num_processed++;
+    }
+    return num_processed;
+}
+
+/**
+ * \brief Queue a transaction and wait for it to finish.
+ * 
+ * If the queue is full, finished transactions are processed (running their callbacks) to make room.
+ * 
+ * \returns The result of the transaction. I2C_BUS_ERROR_CONFIGURATION if it couldn't be queued.
+ */
+static int i2c_bus_run_blocking(i2c_inst_t * bus, i2c_bus_op op, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, 
+                                uint len, byte * buf){
+    uint32_t id;
+    int result;
+    while((result = i2c_bus_queue_transaction(bus, op, dev, reg, reg_addr_len, len, buf, NULL, NULL, &id)) == I2C_BUS_ERROR_QUEUE_FULL){
+        i2c_bus_check_deadline(i2c_bus_get_queue(bus));
+        i2c_bus_process_queue(i2c_bus_get_queue(bus));
+    }
+    if(result != I2C_BUS_SUCCESS) return result;
+
+    i2c_bus_queue * q = i2c_bus_get_queue(bus);
+    while((int32_t)(atomic_load_explicit(&q->done, memory_order_acquire) - id) <= 0){
+        i2c_bus_check_deadline(q);
+        tight_loop_contents();
+    }
+    // The slot can't be reused until the main loop processes it
+    return q->queue[id & (I2C_BUS_QUEUE_LEN-1)].result;
+}
+
 int i2c_bus_setup(i2c_inst_t * bus, uint baudrate, uint8_t scl_pin, uint8_t sda_pin){
     if (!i2c_bus_are_valid_pins(bus, scl_pin, sda_pin)){
         return I2C_BUS_ERROR_CONFIGURATION;
     }
-    i2c_init(bus, baudrate);
-    gpio_set_function(sda_pin, GPIO_FUNC_I2C);
-    gpio_set_function(scl_pin, GPIO_FUNC_I2C);
+    const uint8_t idx = i2c_hw_index(bus);
+    i2c_bus_queue * q = &_queues[idx];
+    if(!i2c_bus_compute_speed(baudrate, &q->speeds[0])){
+        return I2C_BUS_ERROR_CONFIGURATION;
+    }
+    q->bus = bus;
+    q->scl_pin = scl_pin;
+    q->sda_pin = sda_pin;
+    i2c_bus_init_controller(q);
     gpio_pull_up(sda_pin);
     gpio_pull_up(scl_pin);
+
+    atomic_init(&q->head, 0);
+    atomic_init(&q->done, 0);
+    atomic_init(&q->tail, 0);
+    q->running = false;
+    q->num_speeds = 1;
+    memset(q->dev_speed, 0, sizeof(q->dev_speed));
+    q->timeout_us = I2C_BUS_DEFAULT_TIMEOUT_US;
+    q->attempts = 0;
+    memset(q->stats, 0, sizeof(q->stats));
+#ifdef I2C_BUS_TRACE
+    q->num_traced = 0;
+    q->untraced = 0;
+    q->trace_start_us = time_us_32();
+#endif
+#ifdef I2C_BUS_EMULATION
+    q->num_emulators = 0;
+    q->emulator_stalled = false;
+#endif
+    irq_set_exclusive_handler(I2C0_IRQ + idx, (idx == 0 ? i2c_bus_irq_0 : i2c_bus_irq_1));
+    irq_set_enabled(I2C0_IRQ + idx, true);
     return I2C_BUS_SUCCESS;
 }
 
+int i2c_bus_set_device_baudrate(i2c_inst_t * bus, dev_addr dev, uint max_baudrate){
+    i2c_bus_queue * q = i2c_bus_get_queue(bus);
+    if(q == NULL || dev > 0x7F) return I2C_BUS_ERROR_CONFIGURATION;
+
+    // Reuse a matching speed before adding a new one
+    uint8_t idx = 0;
+    while(idx < q->num_speeds && q->speeds[idx].baudrate != max_baudrate) idx++;
+    if(idx == q->num_speeds){
+        if(q->num_speeds == I2C_BUS_MAX_SPEEDS || !i2c_bus_compute_speed(max_baudrate, &q->speeds[idx])){
+            return I2C_BUS_ERROR_CONFIGURATION;
+        }
+        q->num_speeds++;
+    }
+    q->dev_speed[dev] = idx;
+    return I2C_BUS_SUCCESS;
+}
+
+int i2c_bus_set_timeout_us(i2c_inst_t * bus, uint32_t timeout_us){
+    i2c_bus_queue * q = i2c_bus_get_queue(bus);
+    if(q == NULL) return I2C_BUS_ERROR_CONFIGURATION;
+    q->timeout_us = timeout_us;
+    return I2C_BUS_SUCCESS;
+}
+
+int i2c_bus_get_device_stats(i2c_inst_t * bus, dev_addr dev, i2c_bus_device_stats * stats){
+    i2c_bus_queue * q = i2c_bus_get_queue(bus);
+    if(q == NULL) return I2C_BUS_ERROR_CONFIGURATION;
+    *stats = q->stats[dev & 0x7F];
+    return I2C_BUS_SUCCESS;
+}
+
+#ifdef I2C_BUS_EMULATION
+int i2c_bus_attach_emulator(i2c_inst_t * bus, dev_addr dev, i2c_bus_emulator_read_t read, 
+                            i2c_bus_emulator_write_t write, void * data){
+    i2c_bus_queue * q = i2c_bus_get_queue(bus);
+    if(q == NULL || dev > 0x7F || read == NULL || write == NULL) return I2C_BUS_ERROR_CONFIGURATION;
+
+    // Replace an existing emulator of the device
+    i2c_bus_emulator * emu = (i2c_bus_emulator *)i2c_bus_find_emulator(q, dev);
+    if(emu == NULL){
+        if(q->num_emulators == I2C_BUS_MAX_EMULATORS) return I2C_BUS_ERROR_CONFIGURATION;
+        emu = &q->emulators[q->num_emulators];
+    }
+    const uint32_t status = save_and_disable_interrupts();
+    *emu = (i2c_bus_emulator){.dev = dev, .read = read, .write = write, .data = data};
+    if(emu == &q->emulators[q->num_emulators]) q->num_emulators++;
+    restore_interrupts(status);
+    return I2C_BUS_SUCCESS;
+}
+
+void i2c_bus_detach_emulator(i2c_inst_t * bus, dev_addr dev){
+    i2c_bus_queue * q = i2c_bus_get_queue(bus);
+    if(q == NULL) return;
+    const i2c_bus_emulator * emu = i2c_bus_find_emulator(q, dev);
+    if(emu == NULL) return;
+
+    const uint32_t status = save_and_disable_interrupts();
+    q->num_emulators--;
+    q->emulators[emu - q->emulators] = q->emulators[q->num_emulators];
+    restore_interrupts(status);
+}
+#endif
+
 bool i2c_bus_is_connected(i2c_inst_t * bus, dev_addr dev){
+    // The SDK's blocking read needs the controller to itself
+    i2c_bus_queue * q = i2c_bus_get_queue(bus);
+#ifdef I2C_BUS_EMULATION
+    if(q != NULL && i2c_bus_find_emulator(q, dev) != NULL) return true;
+#endif
+    while(q != NULL && !i2c_bus_is_idle(bus)){
+        i2c_bus_check_deadline(q);
+        tight_loop_contents();
+    }
+    if(q != NULL && q->speed != q->dev_speed[dev & 0x7F]){
+        i2c_get_hw(bus)->enable = 0;
+        i2c_bus_apply_speed(q, q->dev_speed[dev & 0x7F]);
+        i2c_get_hw(bus)->enable = 1;
+    }
+
     uint8_t dummy;
     int result = i2c_read_timeout_us(bus, dev, &dummy, 1, false, 500);
     return result>=0;
@@ -64,29 +763,11 @@ void i2c_bus_set_bits(byte* buf, bit_range bits, uint8_t val){
 }
 
 int i2c_bus_read_bytes(i2c_inst_t * bus, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, uint len, byte * dst){
-    reg_addr flipped_reg_addr = i2c_bus_reverse_addr_bytes(reg, reg_addr_len);
-    if(i2c_write_blocking(bus, dev, (uint8_t *)(&flipped_reg_addr), reg_addr_len, false) == PICO_ERROR_GENERIC){
-        return I2C_BUS_ERROR_WRITE_FAILURE;
-    }
-    // Read each register into dst 
-    if(i2c_read_blocking(bus, dev, dst, len, false) == PICO_ERROR_GENERIC){
-        return I2C_BUS_ERROR_READ_FAILURE;
-    }
-    return I2C_BUS_SUCCESS;
+    return i2c_bus_run_blocking(bus, I2C_BUS_OP_READ, dev, reg, reg_addr_len, len, dst);
 }
 
 int i2c_bus_write_bytes(i2c_inst_t * bus, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, uint len, byte * src){
-    reg_addr flipped_reg_addr = i2c_bus_reverse_addr_bytes(reg, reg_addr_len);
-
-    // Copy register address and payload into message buffer
-    uint8_t msg_buff [reg_addr_len + len];
-    memcpy(msg_buff, (uint8_t*)&flipped_reg_addr, reg_addr_len);
-    memcpy(&msg_buff[reg_addr_len], src, len);
-
-    if(i2c_write_blocking(bus, dev, msg_buff, reg_addr_len + len, false) == PICO_ERROR_GENERIC){
-        return I2C_BUS_ERROR_WRITE_FAILURE;
-    }
-    return I2C_BUS_SUCCESS;
+    return i2c_bus_run_blocking(bus, I2C_BUS_OP_WRITE, dev, reg, reg_addr_len, len, src);
 }
 
 int i2c_bus_read_bits(i2c_inst_t * bus, const dev_addr dev, const bit_range bits, byte * dst){
@@ -112,4 +793,542 @@ int i2c_bus_write_bits(i2c_inst_t * bus, const dev_addr dev, const bit_range bit
     if(result != I2C_BUS_SUCCESS) return result;
     
     return I2C_BUS_SUCCESS;
-}
\ No newline at end of file
+}
+
+int i2c_bus_read_bytes_async(i2c_inst_t * bus, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, uint len, byte * dst,
+                             i2c_bus_callback_t cb, void * data){
+    uint32_t id;
+    return i2c_bus_queue_transaction(bus, I2C_BUS_OP_READ, dev, reg, reg_addr_len, len, dst, cb, data, &id);
+}
+
+int i2c_bus_write_bytes_async(i2c_inst_t * bus, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, uint len, byte * src,
+                              i2c_bus_callback_t cb, void * data){
+    uint32_t id;
+    return i2c_bus_queue_transaction(bus, I2C_BUS_OP_WRITE, dev, reg, reg_addr_len, len, src, cb, data, &id);
+}
+
+uint i2c_bus_process_completed(){
+    uint num_processed = 0;
+    for(uint8_t i = 0; i < 2; i++){
+        if(_queues[i].bus != NULL){
+            i2c_bus_check_deadline(&_queues[i]);
+            num_processed += i2c_bus_process_queue(&_queues[i]);
+        }
+    }
+    return num_processed;
+}
+
+bool i2c_bus_is_idle(i2c_inst_t * bus){
+    i2c_bus_queue * q = i2c_bus_get_queue(bus);
+    if(q == NULL) return true;
+    return atomic_load_explicit(&q->done, memory_order_acquire) == atomic_load_explicit(&q->tail, memory_order_relaxed);
+}
+
+void i2c_bus_trace_print(){
+#ifdef I2C_BUS_TRACE
+    for(uint8_t b = 0; b < 2; b++){
+        i2c_bus_queue * q = &_queues[b];
+        if(q->bus == NULL) continue;
+
+        // Copy the trace so the IRQ can keep recording while it prints
+        i2c_bus_trace_entry trace [I2C_BUS_TRACE_ENTRIES];
+        const uint32_t status = save_and_disable_interrupts();
+        const uint8_t num_traced = q->num_traced;
+        const uint32_t untraced = q->untraced;
+        const uint32_t duration_us = time_us_32() - q->trace_start_us;
+        memcpy(trace, q->trace, num_traced*sizeof(i2c_bus_trace_entry));
+        restore_interrupts(status);
+
+        printf("i2c%d: %lu ms traced, %lu untraced transactions\n", b, duration_us/1000, untraced);
+        for(uint8_t i = 0; i < num_traced; i++){
+            const i2c_bus_trace_entry * e = &trace[i];
+            printf("  0x%02X %c: %6lu trans %8lu bytes, bus %8lu us (%5.2f%%), latency %lu/%lu/%lu us\n      hist:",
+                   e->dev, (e->op == I2C_BUS_OP_READ ? 'R' : 'W'), e->count, e->bytes, e->bus_us, 
+                   (duration_us > 0 ? 100.f*e->bus_us/duration_us : 0.f),
+                   e->latency_min_us, e->latency_sum_us/e->count, e->latency_max_us);
+            for(uint8_t n = 0; n < I2C_BUS_TRACE_BINS; n++) printf(" %lu", e->hist[n]);
+            printf("\n");
+        }
+    }
+    i2c_bus_trace_reset();
+#endif
+}
+
+void i2c_bus_trace_reset(){
+#ifdef I2C_BUS_TRACE
+    const uint32_t status = save_and_disable_interrupts();
+    for(uint8_t b = 0; b < 2; b++){
+        _queues[b].num_traced = 0;
+        _queues[b].untraced = 0;
+        _queues[b].trace_start_us = time_us_32();
+    }
+    restore_interrupts(status);
+#endif
+}
+
+/**
+ * \brief Find the index of a register in a shadow.
+ * 
+ * \returns The index. -1 if the register is outside the block or all of its bits are volatile.
+ */
+static int i2c_bus_shadow_index(i2c_bus_shadow s, reg_addr reg){
+    if(reg < s->first_reg || reg - s->first_reg >= s->num_regs) return -1;
+    const int idx = reg - s->first_reg;
+    return (s->volatile_bits[idx] == 0xFF ? -1 : idx);
+}
+
+/** \brief Mask of the bits in a bit range. */
+static byte i2c_bus_bit_mask(const bit_range bits){
+    return (0xFFu>>(7-(bits.to - bits.from)))<<bits.from;
+}
+
+/**
+ * \brief Read a shadowed register from the device and cache its non-volatile bits. Staged bits are kept.
+ * 
+ * \param s The shadow of the device's registers.
+ * \param idx Index of the register in the shadow.
+ * \param dst Set to the register's value with any staged bits applied.
+ * \returns I2C_BUS_SUCCESS If successful. Else either I2C_BUS_ERROR_WRITE_FAILURE or I2C_BUS_ERROR_READ_FAILURE.
+ */
+static int i2c_bus_shadow_fetch(i2c_bus_shadow s, int idx, byte * dst){
+    byte reg = 0;
+    int result = i2c_bus_read_bytes(s->bus, s->dev, s->first_reg + idx, s->reg_addr_len, 1, &reg);
+    if(result != I2C_BUS_SUCCESS) return result;
+
+    if(s->flags[idx] & I2C_BUS_SHADOW_DIRTY){
+        *dst = (s->vals[idx] & ~s->volatile_bits[idx]) | (reg & s->volatile_bits[idx]);
+    } else {
+        s->vals[idx] = reg & ~s->volatile_bits[idx];
+        *dst = reg;
+    }
+    s->flags[idx] |= I2C_BUS_SHADOW_CACHED;
+    return I2C_BUS_SUCCESS;
+}
+
+i2c_bus_shadow i2c_bus_shadow_setup(i2c_inst_t * bus, dev_addr dev, reg_addr first_reg, uint8_t reg_addr_len, 
+                                    uint8_t num_regs, const byte * volatile_bits){
+    if(num_regs == 0 || reg_addr_len > sizeof(reg_addr)) return NULL;
+
+    i2c_bus_shadow s = malloc(sizeof(i2c_bus_shadow_));
+    if(s == NULL) return NULL;
+    // One block holds the values, volatile masks, and flags
+    s->vals = malloc(3*num_regs);
+    if(s->vals == NULL){
+        free(s);
+        return NULL;
+    }
+    s->volatile_bits = &s->vals[num_regs];
+    s->flags = &s->vals[2*num_regs];
+    memcpy(s->volatile_bits, volatile_bits, num_regs);
+
+    s->bus = bus;
+    s->dev = dev;
+    s->first_reg = first_reg;
+    s->reg_addr_len = reg_addr_len;
+    s->num_regs = num_regs;
+    i2c_bus_shadow_invalidate(s);
+    return s;
+}
+
+void i2c_bus_shadow_invalidate(i2c_bus_shadow s){
+    memset(s->flags, 0, s->num_regs);
+}
+
+int i2c_bus_shadow_read_bits(i2c_bus_shadow s, const bit_range bits, byte * dst){
+    const int idx = i2c_bus_shadow_index(s, bits.in_reg);
+    if(idx < 0) return i2c_bus_read_bits(s->bus, s->dev, bits, dst);
+
+    byte reg = s->vals[idx];
+    if(!(s->flags[idx] & I2C_BUS_SHADOW_CACHED) || (i2c_bus_bit_mask(bits) & s->volatile_bits[idx])){
+        int result = i2c_bus_shadow_fetch(s, idx, &reg);
+        if(result != I2C_BUS_SUCCESS) return result;
+    }
+    *dst = (reg & i2c_bus_bit_mask(bits))>>bits.from;
+    return I2C_BUS_SUCCESS;
+}
+
+int i2c_bus_shadow_stage_bits(i2c_bus_shadow s, const bit_range bits, const byte val){
+    const int idx = i2c_bus_shadow_index(s, bits.in_reg);
+    if(idx < 0) return i2c_bus_write_bits(s->bus, s->dev, bits, val);
+
+    if(!(s->flags[idx] & I2C_BUS_SHADOW_CACHED)){
+        byte reg;
+        int result = i2c_bus_shadow_fetch(s, idx, &reg);
+        if(result != I2C_BUS_SUCCESS) return result;
+    }
+    i2c_bus_set_bits(&s->vals[idx], bits, val);
+    s->flags[idx] |= I2C_BUS_SHADOW_DIRTY;
+    return I2C_BUS_SUCCESS;
+}
+
+int i2c_bus_shadow_flush(i2c_bus_shadow s){
+    uint8_t i = 0;
+    while(i < s->num_regs){
+        if(!(s->flags[i] & I2C_BUS_SHADOW_DIRTY)){
+            i++;
+            continue;
+        }
+        uint8_t n = 1;
+        while(i + n < s->num_regs && (s->flags[i + n] & I2C_BUS_SHADOW_DIRTY)) n++;
+
+        const int result = i2c_bus_write_bytes(s->bus, s->dev, s->first_reg + i, s->reg_addr_len, n, &s->vals[i]);
+        for(uint8_t j = i; j < i + n; j++){
+            // Staged volatile bits were commands. Don't cache them.
+            s->vals[j] &= ~s->volatile_bits[j];
+            s->flags[j] = (result == I2C_BUS_SUCCESS ? I2C_BUS_SHADOW_CACHED : 0);
+        }
+        if(result != I2C_BUS_SUCCESS) return result;
+        i += n;
+    }
+    return I2C_BUS_SUCCESS;
+}
+
+int i2c_bus_shadow_write_bits(i2c_bus_shadow s, const bit_range bits, const byte val){
+    int result = i2c_bus_shadow_stage_bits(s, bits, val);
+    if(result != I2C_BUS_SUCCESS) return result;
+    return i2c_bus_shadow_flush(s);
+}
+
+void i2c_bus_shadow_deinit(i2c_bus_shadow s){
+    free(s->vals);
+    free(s);
+}
+
+#ifdef I2C_BUS_TESTS
+#ifndef I2C_BUS_EMULATION
+#error "I2C_BUS_TESTS requires I2C_BUS_EMULATION"
+#endif
+
+#define TEST_DEV 0x10     // Emulated device. Not used on the machine.
+#define TEST_NUM_REGS 256 // Single byte addresses that wrap
+#define TEST_NESTED 40    // Transactions whose callbacks queue and block
+#define TEST_LOG_LEN 64
+#define TEST_STUCK_PULSES 1000 // A device that never releases SDA
+
+/** \brief Emulated device with a block of registers. Counts its transactions and injects faults. */
+typedef struct {
+    byte regs [TEST_NUM_REGS];
+    uint32_t reads;        // Attempts, including failed ones
+    uint32_t writes;
+    uint32_t nacks;        // Attempts left to NACK
+    uint32_t stalls;       // Attempts left to stall once the NACKs are done
+    uint32_t stall_pulses; // SCL pulses until a stalled attempt releases SDA
+} _i2c_bus_test_dev;
+
+/** \brief Callback log shared by the tests. */
+typedef struct {
+    uint32_t num_calls;
+    int order [TEST_LOG_LEN];
+    int results [TEST_LOG_LEN];
+} _i2c_bus_test_log;
+
+static _i2c_bus_test_dev _test_dev;
+static _i2c_bus_test_log _test_log;
+static uint32_t _test_nested_calls;
+
+/** \brief Get the fault of the next attempt. 0 if it should succeed. */
+static int _i2c_bus_test_fault(_i2c_bus_test_dev * d){
+    if(d->nacks > 0){
+        d->nacks--;
+        return I2C_BUS_ERROR_WRITE_FAILURE;
+    }
+    if(d->stalls > 0){
+        d->stalls--;
+        return d->stall_pulses;
+    }
+    return I2C_BUS_SUCCESS;
+}
+
+static int _i2c_bus_test_read(void * data, reg_addr reg, uint len, byte * dst){
+    _i2c_bus_test_dev * d = (_i2c_bus_test_dev *)data;
+    d->reads++;
+    const int fault = _i2c_bus_test_fault(d);
+    if(fault) return fault;
+    for(uint i = 0; i < len; i++) dst[i] = d->regs[(reg + i) % TEST_NUM_REGS];
+    return I2C_BUS_SUCCESS;
+}
+
+static int _i2c_bus_test_write(void * data, reg_addr reg, uint len, const byte * src){
+    _i2c_bus_test_dev * d = (_i2c_bus_test_dev *)data;
+    d->writes++;
+    const int fault = _i2c_bus_test_fault(d);
+    if(fault) return fault;
+    for(uint i = 0; i < len; i++) d->regs[(reg + i) % TEST_NUM_REGS] = src[i];
+    return I2C_BUS_SUCCESS;
+}
+
+/** \brief Log the order the callbacks run in. The data is the transaction's index. */
+static void _i2c_bus_test_log_cb(int result, void * data){
+    _i2c_bus_test_log * log = &_test_log;
+    if(log->num_calls < TEST_LOG_LEN){
+        log->order[log->num_calls] = (int)(intptr_t)data;
+        log->results[log->num_calls] = result;
+    }
+    log->num_calls++;
+}
+
+static void _i2c_bus_test_nested_cb(int result, void * data){
+    _test_nested_calls++;
+}
+
+/** \brief Queue another write and make a blocking read from inside a callback. */
+static void _i2c_bus_test_reentrant_cb(int result, void * data){
+    _i2c_bus_test_log_cb(result, data);
+    byte b = 0;
+    i2c_bus_write_bytes_async(i2c0, TEST_DEV, 0xF0, 1, 1, &b, _i2c_bus_test_nested_cb, NULL);
+    i2c_bus_read_bytes(i2c0, TEST_DEV, (reg_addr)(intptr_t)data, 1, 1, &b);
+}
+
+/** \brief Check that the logged callbacks ran once each, in order, and succeeded. */
+static bool _i2c_bus_test_log_in_order(uint32_t num_expected){
+    if(_test_log.num_calls != num_expected) return false;
+    for(uint32_t i = 0; i < num_expected && i < TEST_LOG_LEN; i++){
+        if(_test_log.order[i] != (int)i || _test_log.results[i] != I2C_BUS_SUCCESS) return false;
+    }
+    return true;
+}
+
+static void _i2c_bus_test_reset(){
+    while(!i2c_bus_is_idle(i2c0) || i2c_bus_process_completed()) tight_loop_contents();
+    memset(&_test_dev, 0, sizeof(_test_dev));
+    memset(&_test_log, 0, sizeof(_test_log));
+}
+
+/** \brief Get the change in the test device's failure counts since \p before. */
+static i2c_bus_device_stats _i2c_bus_test_stats_since(const i2c_bus_device_stats * before){
+    i2c_bus_device_stats now;
+    i2c_bus_get_device_stats(i2c0, TEST_DEV, &now);
+    return (i2c_bus_device_stats){.errors = now.errors - before->errors, .retries = now.retries - before->retries,
+                                  .timeouts = now.timeouts - before->timeouts};
+}
+
+void i2c_bus_test(){
+    if(i2c_bus_attach_emulator(i2c0, TEST_DEV, _i2c_bus_test_read, _i2c_bus_test_write, &_test_dev)){
+        printf("Test 1:  FAIL (i2c0 is not setup)\n");
+        return;
+    }
+
+    // Test 1: Interleaved writes and reads of the same registers run and call back in the order queued
+    _i2c_bus_test_reset();
+    byte vals [6] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+    byte read_back [6] = {0};
+    bool pass = true;
+    for(uint8_t i = 0; i < 6; i++){
+        pass &= (i2c_bus_write_bytes_async(i2c0, TEST_DEV, 0x20, 1, 1, &vals[i], _i2c_bus_test_log_cb, (void*)(intptr_t)(2*i)) == I2C_BUS_SUCCESS);
+        pass &= (i2c_bus_read_bytes_async(i2c0, TEST_DEV, 0x20, 1, 1, &read_back[i], _i2c_bus_test_log_cb, (void*)(intptr_t)(2*i + 1)) == I2C_BUS_SUCCESS);
+    }
+    while(!i2c_bus_is_idle(i2c0)) tight_loop_contents();
+    const uint processed = i2c_bus_process_completed();
+    pass &= (processed == 12 && _i2c_bus_test_log_in_order(12) && memcmp(read_back, "\x11\x22\x33\x44\x55\x66", 6) == 0);
+    printf("Test 1:  %s (%u of 12 callbacks in order, each read saw the write queued before it: %02X..%02X)\n", 
+           (pass ? "PASS" : "FAIL"), processed, read_back[0], read_back[5]);
+
+    // Test 2: A blocking read waits behind a queued write. Its callback runs later from the main loop.
+    _i2c_bus_test_reset();
+    byte block [32];
+    for(uint8_t i = 0; i < sizeof(block); i++) block[i] = 0x80 + i;
+    byte b = 0;
+    pass = (i2c_bus_write_bytes_async(i2c0, TEST_DEV, 0x40, 1, sizeof(block), block, _i2c_bus_test_log_cb, (void*)0) == I2C_BUS_SUCCESS);
+    pass &= (i2c_bus_read_bytes(i2c0, TEST_DEV, 0x40 + sizeof(block) - 1, 1, 1, &b) == I2C_BUS_SUCCESS && b == 0x80 + sizeof(block) - 1);
+    const uint32_t calls_before = _test_log.num_calls;
+    i2c_bus_process_completed();
+    pass &= (calls_before == 0 && _i2c_bus_test_log_in_order(1));
+    printf("Test 2:  %s (blocking read after a %u byte async write read 0x%02X. Callbacks before/after processing: %lu/%lu)\n", 
+           (pass ? "PASS" : "FAIL"), (uint)sizeof(block), b, calls_before, _test_log.num_calls);
+
+    // Test 3: A full queue rejects the next transaction until the finished ones are processed
+    _i2c_bus_test_reset();
+    uint queued = 0;
+    while(queued <= I2C_BUS_QUEUE_LEN 
+          && i2c_bus_read_bytes_async(i2c0, TEST_DEV, queued, 1, 1, &b, _i2c_bus_test_log_cb, (void*)(intptr_t)queued) == I2C_BUS_SUCCESS){
+        queued++;
+    }
+    const int full = i2c_bus_read_bytes_async(i2c0, TEST_DEV, 0, 1, 1, &b, _i2c_bus_test_log_cb, (void*)(intptr_t)queued);
+    while(!i2c_bus_is_idle(i2c0)) tight_loop_contents();
+    i2c_bus_process_completed();
+    const int after = i2c_bus_read_bytes_async(i2c0, TEST_DEV, 0, 1, 1, &b, _i2c_bus_test_log_cb, (void*)(intptr_t)queued);
+    while(!i2c_bus_is_idle(i2c0)) tight_loop_contents();
+    i2c_bus_process_completed();
+    pass = (queued == I2C_BUS_QUEUE_LEN && full == I2C_BUS_ERROR_QUEUE_FULL && after == I2C_BUS_SUCCESS 
+            && _i2c_bus_test_log_in_order(I2C_BUS_QUEUE_LEN + 1));
+    printf("Test 3:  %s (%u queued before full (%d), %d once processed, %lu callbacks)\n", 
+           (pass ? "PASS" : "FAIL"), queued, full, after, _test_log.num_calls);
+
+    // Test 4: Callbacks that queue and block, with the queue full, each run exactly once
+    _i2c_bus_test_reset();
+    _test_nested_calls = 0;
+    b = 1;
+    for(intptr_t i = 0; i < TEST_NESTED; i++){
+        while(i2c_bus_write_bytes_async(i2c0, TEST_DEV, i, 1, 1, &b, _i2c_bus_test_reentrant_cb, (void*)i) == I2C_BUS_ERROR_QUEUE_FULL){
+            i2c_bus_process_completed();
+        }
+    }
+    while(!i2c_bus_is_idle(i2c0) || i2c_bus_process_completed()) tight_loop_contents();
+    pass = (_i2c_bus_test_log_in_order(TEST_NESTED) && _test_nested_calls == TEST_NESTED);
+    printf("Test 4:  %s (%d reentrant callbacks ran %lu times, their %d writes called back %lu times)\n", 
+           (pass ? "PASS" : "FAIL"), TEST_NESTED, _test_log.num_calls, TEST_NESTED, _test_nested_calls);
+
+    // Test 5: A NACK is retried without a bus clear
+    _i2c_bus_test_reset();
+    _test_dev.regs[0x30] = 0x5A;
+    i2c_bus_device_stats before;
+    i2c_bus_get_device_stats(i2c0, TEST_DEV, &before);
+    _test_dev.nacks = 1;
+    b = 0;
+    int result = i2c_bus_read_bytes(i2c0, TEST_DEV, 0x30, 1, 1, &b);
+    i2c_bus_device_stats d = _i2c_bus_test_stats_since(&before);
+    pass = (result == I2C_BUS_SUCCESS && b == 0x5A && _test_dev.reads == 2 && d.retries == 1 && d.timeouts == 0 && d.errors == 0);
+    printf("Test 5:  %s (one NACK: result %d after %lu attempts, read 0x%02X, stats t%u r%u e%u)\n", 
+           (pass ? "PASS" : "FAIL"), result, _test_dev.reads, b, d.timeouts, d.retries, d.errors);
+
+    // Test 6: A device that keeps NACKing fails after its retries
+    _i2c_bus_test_reset();
+    i2c_bus_get_device_stats(i2c0, TEST_DEV, &before);
+    _test_dev.nacks = 1 + I2C_BUS_MAX_RETRIES;
+    result = i2c_bus_read_bytes(i2c0, TEST_DEV, 0x30, 1, 1, &b);
+    d = _i2c_bus_test_stats_since(&before);
+    pass = (result == I2C_BUS_ERROR_WRITE_FAILURE && _test_dev.reads == 1 + I2C_BUS_MAX_RETRIES 
+            && d.retries == I2C_BUS_MAX_RETRIES && d.timeouts == 0 && d.errors == 1);
+    printf("Test 6:  %s (NACK on every attempt: result %d after %lu attempts, stats t%u r%u e%u)\n", 
+           (pass ? "PASS" : "FAIL"), result, _test_dev.reads, d.timeouts, d.retries, d.errors);
+
+    // Test 7: A write stalls holding SDA low for 5 clocks. It times out, the bus is cleared, and the retry succeeds.
+    _i2c_bus_test_reset();
+    i2c_bus_get_device_stats(i2c0, TEST_DEV, &before);
+    _test_dev.stalls = 1;
+    _test_dev.stall_pulses = 5;
+    b = 0xA7;
+    uint32_t t0 = time_us_32();
+    result = i2c_bus_write_bytes(i2c0, TEST_DEV, 0x31, 1, 1, &b);
+    uint32_t dt = time_us_32() - t0;
+    d = _i2c_bus_test_stats_since(&before);
+    pass = (result == I2C_BUS_SUCCESS && _test_dev.regs[0x31] == 0xA7 && _test_dev.writes == 2 && _queues[0].emulator_sda_pulses == 0
+            && d.timeouts == 1 && d.retries == 1 && d.errors == 0 && dt >= _queues[0].timeout_us);
+    printf("Test 7:  %s (stall holding SDA for 5 clocks: result %d after %lu attempts in %lu us, %lu clocks left, stats t%u r%u e%u)\n", 
+           (pass ? "PASS" : "FAIL"), result, _test_dev.writes, dt, _queues[0].emulator_sda_pulses, d.timeouts, d.retries, d.errors);
+
+    // Test 8: SDA stuck low on every attempt. Each clear gives up after 9 clocks and the read times out.
+    _i2c_bus_test_reset();
+    _test_dev.regs[0x30] = 0x5A;
+    i2c_bus_get_device_stats(i2c0, TEST_DEV, &before);
+    _test_dev.stalls = 1 + I2C_BUS_MAX_RETRIES;
+    _test_dev.stall_pulses = TEST_STUCK_PULSES;
+    t0 = time_us_32();
+    result = i2c_bus_read_bytes(i2c0, TEST_DEV, 0x30, 1, 1, &b);
+    dt = time_us_32() - t0;
+    d = _i2c_bus_test_stats_since(&before);
+    const uint32_t left = _queues[0].emulator_sda_pulses;
+    const bool idle = i2c_bus_is_idle(i2c0);
+    b = 0;
+    const int next = i2c_bus_read_bytes(i2c0, TEST_DEV, 0x30, 1, 1, &b);
+    pass = (result == I2C_BUS_ERROR_TIMEOUT && _test_dev.reads == 2 + I2C_BUS_MAX_RETRIES && left == TEST_STUCK_PULSES - 9 && idle
+            && d.timeouts == 1 + I2C_BUS_MAX_RETRIES && d.retries == I2C_BUS_MAX_RETRIES && d.errors == 1 
+            && next == I2C_BUS_SUCCESS && b == 0x5A);
+    printf("Test 8:  %s (stuck SDA: result %d after %u attempts in %lu us, %lu clocks sent per clear, stats t%u r%u e%u. Next read %d)\n", 
+           (pass ? "PASS" : "FAIL"), result, 1 + I2C_BUS_MAX_RETRIES, dt, TEST_STUCK_PULSES - left, d.timeouts, d.retries, d.errors, next);
+
+    // Test 9: Reads queued behind a stall finish, in order, once the main loop finds the missed deadline
+    _i2c_bus_test_reset();
+    for(uint8_t i = 0; i < 3; i++) _test_dev.regs[0x50 + i] = 0xC0 + i;
+    _test_dev.stalls = 1;
+    _test_dev.stall_pulses = 3;
+    byte queued_reads [3] = {0};
+    for(uint8_t i = 0; i < 3; i++){
+        i2c_bus_read_bytes_async(i2c0, TEST_DEV, 0x50 + i, 1, 1, &queued_reads[i], _i2c_bus_test_log_cb, (void*)(intptr_t)i);
+    }
+    const uint32_t before_deadline = _test_log.num_calls + i2c_bus_process_completed();
+    uint loops = 0;
+    while(_test_log.num_calls < 3 && loops < 100){
+        sleep_ms(1);
+        i2c_bus_process_completed();
+        loops++;
+    }
+    pass = (before_deadline == 0 && _i2c_bus_test_log_in_order(3) && memcmp(queued_reads, "\xC0\xC1\xC2", 3) == 0);
+    printf("Test 9:  %s (3 reads queued behind a stall: %lu callbacks in order after %u ms, read %02X %02X %02X)\n", 
+           (pass ? "PASS" : "FAIL"), _test_log.num_calls, loops, queued_reads[0], queued_reads[1], queued_reads[2]);
+
+    i2c_bus_detach_emulator(i2c0, TEST_DEV);
+}
+#endif
+
+#ifdef I2C_BUS_BENCHMARK
+#define BENCH_LEN 64       // Bytes per transaction
+#define BENCH_REPEATS 100  // Transactions timed per case
+
+/** \brief Time a number of blocking transactions. Returns the total time in us, 0 if any failed. */
+static uint32_t _i2c_bus_bench_blocking(i2c_inst_t * bus, i2c_bus_op op, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, byte * buf){
+    const uint32_t t0 = time_us_32();
+    for(uint i = 0; i < BENCH_REPEATS; i++){
+        if(i2c_bus_run_blocking(bus, op, dev, reg, reg_addr_len, BENCH_LEN, buf)) return 0;
+    }
+    return MAX(time_us_32() - t0, 1);
+}
+
+/** \brief Count the queued reads that failed. */
+static void _i2c_bus_bench_cb(int result, void * data){
+    if(result != I2C_BUS_SUCCESS) (*(uint *)data)++;
+}
+
+/** \brief Time a number of reads queued back to back. Returns the total time in us, 0 if any failed. */
+static uint32_t _i2c_bus_bench_async(i2c_inst_t * bus, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, byte * buf){
+    const uint32_t t0 = time_us_32();
+    uint queued = 0, failed = 0;
+    while(queued < BENCH_REPEATS){
+        const int result = i2c_bus_read_bytes_async(bus, dev, reg, reg_addr_len, BENCH_LEN, buf, _i2c_bus_bench_cb, &failed);
+        if(result == I2C_BUS_SUCCESS){
+            queued++;
+        } else if(result == I2C_BUS_ERROR_QUEUE_FULL){
+            i2c_bus_process_completed();
+            tight_loop_contents();
+        } else {
+            return 0;
+        }
+    }
+    while(!i2c_bus_is_idle(bus) || i2c_bus_process_completed()) tight_loop_contents();
+    return (failed ? 0 : MAX(time_us_32() - t0, 1));
+}
+
+/** \brief Print the throughput of a timed case. */
+static void _i2c_bus_bench_print(const char * name, uint32_t us){
+    if(us == 0){
+        printf(" %s failed.", name);
+    } else {
+        printf(" %s %6lu B/s (%4lu us each).", name, (uint32_t)(1000000ull*BENCH_LEN*BENCH_REPEATS/us), us/BENCH_REPEATS);
+    }
+}
+
+void i2c_bus_benchmark(i2c_inst_t * bus, dev_addr dev, reg_addr reg, uint8_t reg_addr_len, uint max_baudrate){
+    static const uint speeds [] = {100000, 400000, 1000000};
+    i2c_bus_queue * q = i2c_bus_get_queue(bus);
+    byte buf [BENCH_LEN];
+    if(q == NULL || i2c_bus_read_bytes(bus, dev, reg, reg_addr_len, BENCH_LEN, buf)){
+        printf("Device 0x%02X not found\n", dev);
+        return;
+    }
+#ifdef I2C_BUS_EMULATION
+    if(i2c_bus_find_emulator(q, dev) != NULL) printf("Device 0x%02X is emulated. Times are the emulator's, not the bus's.\n", dev);
+#endif
+
+    printf("%d byte transactions with 0x%02X, %d of each:\n", BENCH_LEN, dev, BENCH_REPEATS);
+    for(uint8_t i = 0; i < sizeof(speeds)/sizeof(speeds[0]) && speeds[i] <= max_baudrate; i++){
+        if(i2c_bus_set_device_baudrate(bus, dev, speeds[i])){
+            printf("%7u Hz: no free speed\n", speeds[i]);
+            continue;
+        }
+        // Writes put back what was read so the device is unchanged
+        const uint32_t read_us = _i2c_bus_bench_blocking(bus, I2C_BUS_OP_READ, dev, reg, reg_addr_len, buf);
+        const uint32_t write_us = _i2c_bus_bench_blocking(bus, I2C_BUS_OP_WRITE, dev, reg, reg_addr_len, buf);
+        const uint32_t async_us = _i2c_bus_bench_async(bus, dev, reg, reg_addr_len, buf);
+
+        // 9 clocks per byte. Reads also resend the address after a restart.
+        const uint32_t ideal_us = (9ull*(BENCH_LEN + reg_addr_len + 2)*1000000*BENCH_REPEATS)/speeds[i];
+        printf("%7u Hz:", speeds[i]);
+        _i2c_bus_bench_print("read", read_us);
+        _i2c_bus_bench_print("write", write_us);
+        _i2c_bus_bench_print("queued reads", async_us);
+        _i2c_bus_bench_print("ideal", ideal_us);
+        printf("\n");
+    }
+    i2c_bus_set_device_baudrate(bus, dev, max_baudrate);
+}
+#endif
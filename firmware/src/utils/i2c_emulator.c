@@ -0,0 +1,381 @@
+/**
+ * \ingroup i2c_emulator
+ *
+ * \file i2c_emulator.c
+ * \author Richard Hall (hallboyone@icloud.com)
+ * \brief I2C Device Emulators source
+ * \version 0.3
+ * \date 2026-10-18
+ */
+
+#include "utils/i2c_emulator.h"
+
+#ifdef I2C_BUS_EMULATION
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef I2C_EMULATOR_TESTS
+#include <stdio.h>
+#include "drivers/mb85_fram.h"
+#include "drivers/nau7802.h"
+#endif
+
+#define NAU7802_EMU_ADDR    0x2A /**< I2C address of the NAU7802. */
+#define NAU7802_EMU_NUM_REGS 0x20 /**< Number of NAU7802 registers. Addresses wrap after the last. */
+#define NAU7802_EMU_PU_CTRL 0x00 /**< Power-up control register. */
+#define NAU7802_EMU_CTRL_2  0x02 /**< Configuration 2 register. */
+#define NAU7802_EMU_ADCO_B2 0x12 /**< Most significant byte of the conversion. */
+#define NAU7802_EMU_ADCO_B0 0x14 /**< Least significant byte of the conversion. */
+#define NAU7802_EMU_DEV_REV 0x1F /**< Device revision register. */
+
+#define NAU7802_EMU_RR   0x01 /**< PU_CTRL: register reset. */
+#define NAU7802_EMU_PUD  0x02 /**< PU_CTRL: power up digital. */
+#define NAU7802_EMU_PUA  0x04 /**< PU_CTRL: power up analog. */
+#define NAU7802_EMU_PUR  0x08 /**< PU_CTRL: power up ready. Read only. */
+#define NAU7802_EMU_CS   0x10 /**< PU_CTRL: cycle start. */
+#define NAU7802_EMU_CR   0x20 /**< PU_CTRL: conversion ready. Read only. */
+#define NAU7802_EMU_CALS 0x04 /**< CTRL_2: start calibration. Clears when done. */
+#define NAU7802_EMU_CAL_ERR 0x08 /**< CTRL_2: calibration error. Read only. */
+#define NAU7802_EMU_CRS_LSB 4 /**< CTRL_2: first bit of the conversion rate select. */
+
+#define MB85_EMU_DEVICE_CODE 0x50 /**< Device code of MB85 ICs. Or'ed with the address pins. */
+
+/** \brief Emulated NAU7802. */
+typedef struct i2c_emulator_nau7802_s {
+    i2c_inst_t * bus;                    /**< The bus the emulator is attached to. */
+    byte regs [NAU7802_EMU_NUM_REGS];    /**< The registers. */
+    int32_t input;                       /**< The value converted without noise. */
+    uint32_t noise;                      /**< Amplitude of the uniform noise in counts. */
+    uint32_t rand_state;                 /**< State of the noise generator. */
+    uint64_t cycle_start_us;             /**< When conversions, or the running calibration, started. */
+    uint32_t cycle_conversions;          /**< Conversions made since cycle_start_us. */
+    uint32_t conversion_count;           /**< Conversions made since setup. */
+    uint32_t transaction_count;          /**< Reads and writes since setup. */
+} i2c_emulator_nau7802_;
+
+/** \brief Emulated MB85 FRAM. */
+typedef struct i2c_emulator_mb85_s {
+    i2c_inst_t * bus;  /**< The bus the emulator is attached to. */
+    dev_addr dev;      /**< The device address. */
+    uint32_t size;     /**< Size of the memory in bytes. A power of 2. */
+    byte * mem;        /**< The memory. */
+    uint32_t bytes_written; /**< Data bytes written since setup. */
+} i2c_emulator_mb85_;
+
+/** \brief Conversion period of the NAU7802 rate selected in CTRL_2. Reserved rates are 10 SPS. */
+static uint32_t _nau7802_emu_period_us(const i2c_emulator_nau7802 emu){
+    const uint8_t crs = (emu->regs[NAU7802_EMU_CTRL_2]>>NAU7802_EMU_CRS_LSB) & 0x7;
+    const uint32_t sps = (crs == 0x7 ? 320 : (crs < 4 ? 10u<<crs : 10));
+    return 1000000/sps;
+}
+
+/** \brief Restart the conversion (or calibration) cycle. */
+static void _nau7802_emu_restart_cycle(i2c_emulator_nau7802 emu){
+    emu->cycle_start_us = time_us_64();
+    emu->cycle_conversions = 0;
+}
+
+/** \brief Uniform noise within +/- the emulator's amplitude. */
+static int32_t _nau7802_emu_noise(i2c_emulator_nau7802 emu){
+    if(emu->noise == 0) return 0;
+    // xorshift32
+    emu->rand_state ^= emu->rand_state<<13;
+    emu->rand_state ^= emu->rand_state>>17;
+    emu->rand_state ^= emu->rand_state<<5;
+    return (int32_t)(emu->rand_state % (2*emu->noise + 1)) - (int32_t)emu->noise;
+}
+
+/**
+ * \brief Bring the emulated NAU7802 up to date. Finishes a calibration or makes a new conversion
+ * if a period has passed.
+ */
+static void _nau7802_emu_update(i2c_emulator_nau7802 emu){
+    byte * regs = emu->regs;
+    if((regs[NAU7802_EMU_PU_CTRL] & (NAU7802_EMU_RR | NAU7802_EMU_PUD | NAU7802_EMU_PUA))
+       != (NAU7802_EMU_PUD | NAU7802_EMU_PUA)){
+        return;
+    }
+    const uint32_t period_us = _nau7802_emu_period_us(emu);
+    const uint32_t periods = (time_us_64() - emu->cycle_start_us)/period_us;
+
+    if(regs[NAU7802_EMU_CTRL_2] & NAU7802_EMU_CALS){
+        if(periods < I2C_EMULATOR_NAU7802_CAL_CONVERSIONS) return;
+        regs[NAU7802_EMU_CTRL_2] &= ~NAU7802_EMU_CALS;
+        _nau7802_emu_restart_cycle(emu);
+        return;
+    }
+    if(!(regs[NAU7802_EMU_PU_CTRL] & NAU7802_EMU_CS) || periods <= emu->cycle_conversions) return;
+
+    // Only the latest conversion is kept, as on the IC
+    emu->cycle_conversions = periods;
+    emu->conversion_count++;
+    int32_t val = emu->input + _nau7802_emu_noise(emu);
+    val = (val > 0x7FFFFF ? 0x7FFFFF : (val < -0x800000 ? -0x800000 : val));
+    regs[NAU7802_EMU_ADCO_B2] = (val>>16) & 0xFF;
+    regs[NAU7802_EMU_ADCO_B2 + 1] = (val>>8) & 0xFF;
+    regs[NAU7802_EMU_ADCO_B0] = val & 0xFF;
+    regs[NAU7802_EMU_PU_CTRL] |= NAU7802_EMU_CR;
+}
+
+/** \brief Put the emulated NAU7802's registers in their reset state. */
+static void _nau7802_emu_reset(i2c_emulator_nau7802 emu){
+    memset(emu->regs, 0, sizeof(emu->regs));
+    emu->regs[NAU7802_EMU_DEV_REV] = 0x0F;
+    _nau7802_emu_restart_cycle(emu);
+}
+
+/** \brief Emulate a read of the NAU7802. Reading the conversion clears CR. */
+static int _nau7802_emu_read(void * data, reg_addr reg, uint len, byte * dst){
+    i2c_emulator_nau7802 emu = (i2c_emulator_nau7802)data;
+    _nau7802_emu_update(emu);
+    emu->transaction_count++;
+    for(uint i = 0; i < len; i++){
+        const uint8_t r = (reg + i) % NAU7802_EMU_NUM_REGS;
+        dst[i] = emu->regs[r];
+        if(r >= NAU7802_EMU_ADCO_B2 && r <= NAU7802_EMU_ADCO_B0) emu->regs[NAU7802_EMU_PU_CTRL] &= ~NAU7802_EMU_CR;
+    }
+    return I2C_BUS_SUCCESS;
+}
+
+/** \brief Emulate a write to the NAU7802. Read-only bits and registers are left unchanged. */
+static int _nau7802_emu_write(void * data, reg_addr reg, uint len, const byte * src){
+    i2c_emulator_nau7802 emu = (i2c_emulator_nau7802)data;
+    _nau7802_emu_update(emu);
+    emu->transaction_count++;
+    for(uint i = 0; i < len; i++){
+        const uint8_t r = (reg + i) % NAU7802_EMU_NUM_REGS;
+        const byte old = emu->regs[r];
+        switch(r){
+        case NAU7802_EMU_PU_CTRL:
+            if(src[i] & NAU7802_EMU_RR){
+                _nau7802_emu_reset(emu);
+                emu->regs[r] = NAU7802_EMU_RR;
+                break;
+            }
+            emu->regs[r] = (src[i] & ~(NAU7802_EMU_PUR | NAU7802_EMU_CR)) | (old & NAU7802_EMU_CR);
+            // Power up is ready at once
+            if(src[i] & NAU7802_EMU_PUD) emu->regs[r] |= NAU7802_EMU_PUR;
+            if((src[i] & NAU7802_EMU_CS) && !(old & NAU7802_EMU_CS)) _nau7802_emu_restart_cycle(emu);
+            break;
+        case NAU7802_EMU_CTRL_2:
+            emu->regs[r] = (src[i] & ~NAU7802_EMU_CAL_ERR) | (old & NAU7802_EMU_CAL_ERR);
+            if((src[i] & NAU7802_EMU_CALS) || ((src[i] ^ old)>>NAU7802_EMU_CRS_LSB & 0x7)) _nau7802_emu_restart_cycle(emu);
+            break;
+        case NAU7802_EMU_ADCO_B2:
+        case NAU7802_EMU_ADCO_B2 + 1:
+        case NAU7802_EMU_ADCO_B0:
+        case NAU7802_EMU_DEV_REV:
+            break;
+        default:
+            emu->regs[r] = src[i];
+            break;
+        }
+    }
+    return I2C_BUS_SUCCESS;
+}
+
+i2c_emulator_nau7802 i2c_emulator_nau7802_setup(i2c_inst_t * bus){
+    i2c_emulator_nau7802 emu = malloc(sizeof(i2c_emulator_nau7802_));
+    if(emu == NULL) return NULL;
+    emu->bus = bus;
+    emu->input = 0;
+    emu->noise = 0;
+    emu->rand_state = 0x2A2A2A2A;
+    emu->conversion_count = 0;
+    emu->transaction_count = 0;
+    _nau7802_emu_reset(emu);
+    if(i2c_bus_attach_emulator(bus, NAU7802_EMU_ADDR, _nau7802_emu_read, _nau7802_emu_write, emu)){
+        free(emu);
+        return NULL;
+    }
+    return emu;
+}
+
+void i2c_emulator_nau7802_set_input(i2c_emulator_nau7802 emu, int32_t raw){
+    emu->input = raw;
+}
+
+void i2c_emulator_nau7802_set_noise(i2c_emulator_nau7802 emu, uint32_t amplitude){
+    emu->noise = amplitude;
+}
+
+uint32_t i2c_emulator_nau7802_conversion_count(i2c_emulator_nau7802 emu){
+    _nau7802_emu_update(emu);
+    return emu->conversion_count;
+}
+
+uint32_t i2c_emulator_nau7802_transaction_count(i2c_emulator_nau7802 emu){
+    return emu->transaction_count;
+}
+
+void i2c_emulator_nau7802_deinit(i2c_emulator_nau7802 emu){
+    i2c_bus_detach_emulator(emu->bus, NAU7802_EMU_ADDR);
+    free(emu);
+}
+
+/** \brief Emulate a read of the FRAM. The address wraps at the end of the memory. */
+static int _mb85_emu_read(void * data, reg_addr reg, uint len, byte * dst){
+    i2c_emulator_mb85 emu = (i2c_emulator_mb85)data;
+    for(uint i = 0; i < len; i++) dst[i] = emu->mem[(reg + i) & (emu->size - 1)];
+    return I2C_BUS_SUCCESS;
+}
+
+/** \brief Emulate a write to the FRAM. The address wraps at the end of the memory. */
+static int _mb85_emu_write(void * data, reg_addr reg, uint len, const byte * src){
+    i2c_emulator_mb85 emu = (i2c_emulator_mb85)data;
+    for(uint i = 0; i < len; i++) emu->mem[(reg + i) & (emu->size - 1)] = src[i];
+    emu->bytes_written += len;
+    return I2C_BUS_SUCCESS;
+}
+
+i2c_emulator_mb85 i2c_emulator_mb85_setup(i2c_inst_t * bus, dev_addr address_pins, uint32_t size_bytes){
+    if(address_pins > 7 || size_bytes < 512 || size_bytes > 0x10000 || (size_bytes & (size_bytes - 1))) return NULL;
+
+    i2c_emulator_mb85 emu = malloc(sizeof(i2c_emulator_mb85_));
+    if(emu == NULL) return NULL;
+    emu->mem = calloc(size_bytes, 1);
+    if(emu->mem == NULL){
+        free(emu);
+        return NULL;
+    }
+    emu->bus = bus;
+    emu->dev = MB85_EMU_DEVICE_CODE | address_pins;
+    emu->size = size_bytes;
+    emu->bytes_written = 0;
+    if(i2c_bus_attach_emulator(bus, emu->dev, _mb85_emu_read, _mb85_emu_write, emu)){
+        free(emu->mem);
+        free(emu);
+        return NULL;
+    }
+    return emu;
+}
+
+byte * i2c_emulator_mb85_memory(i2c_emulator_mb85 emu){
+    return emu->mem;
+}
+
+uint32_t i2c_emulator_mb85_bytes_written(i2c_emulator_mb85 emu){
+    return emu->bytes_written;
+}
+
+void i2c_emulator_mb85_deinit(i2c_emulator_mb85 emu){
+    i2c_bus_detach_emulator(emu->bus, emu->dev);
+    free(emu->mem);
+    free(emu);
+}
+
+#ifdef I2C_EMULATOR_TESTS
+#define TEST_FRAM_SIZE 0x8000   // MB85RC256V
+#define TEST_SCALE_BASE 0x200000 // Empty scale
+#define TEST_SCALE_STEP 20000    // A cup, in counts
+#define TEST_SCALE_NOISE 30
+#define TEST_POLL_TICKS 100      // 1 s
+#define TEST_READS_PER_TICK 5    // Each of read_raw, read_mg, and at_val_mg
+
+/** \brief Run the main loop's I2C work and tick the scale every 10 ms for a number of ticks. */
+static void _i2c_emulator_test_ticks(nau7802 scale, uint ticks){
+    for(uint i = 0; i < ticks; i++){
+        i2c_bus_process_completed();
+        nau7802_tick(scale);
+        sleep_ms(10);
+    }
+}
+
+void i2c_emulator_test(){
+    // FRAM size probe and fill
+    i2c_emulator_mb85 fram_emu = i2c_emulator_mb85_setup(i2c0, 0, TEST_FRAM_SIZE);
+    uint8_t fill = 0xA5;
+    uint64_t t0 = time_us_64();
+    mb85_fram fram = mb85_fram_setup(i2c0, 0, &fill);
+    const uint64_t fill_us = time_us_64() - t0;
+    bool pass = (fram_emu != NULL && fram != NULL && mb85_fram_get_max_addr(fram) == TEST_FRAM_SIZE - 1);
+    for(uint32_t i = 0; pass && i < TEST_FRAM_SIZE; i++) pass = (i2c_emulator_mb85_memory(fram_emu)[i] == fill);
+    printf("Test 1:  %s (FRAM of %d bytes found and filled in %llu us)\n", (pass ? "PASS" : "FAIL"), TEST_FRAM_SIZE, fill_us);
+    if(fram == NULL) return;
+
+    // Linked variable round trip, blocking and queued
+    uint8_t var [64];
+    for(uint8_t i = 0; i < sizeof(var); i++) var[i] = i;
+    const mb85_fram_var var_link = mb85_fram_link_var(fram, var, 0x100, sizeof(var), MB85_FRAM_INIT_FROM_VAR);
+    pass = (var_link >= 0);
+    var[0] = 0x42;
+    pass &= (mb85_fram_save_async(fram, var_link, NULL, NULL) == PICO_ERROR_NONE);
+    while(!i2c_bus_is_idle(i2c0)) tight_loop_contents();
+    i2c_bus_process_completed();
+    memset(var, 0, sizeof(var));
+    pass &= (mb85_fram_load(fram, var_link) == PICO_ERROR_NONE && var[0] == 0x42 && var[63] == 63
+             && i2c_emulator_mb85_memory(fram_emu)[0x100 + 63] == 63);
+    printf("Test 2:  %s (linked variable saved and loaded: first %d, last %d)\n", (pass ? "PASS" : "FAIL"), var[0], var[63]);
+
+    // Scale bring-up
+    i2c_emulator_nau7802 scale_emu = i2c_emulator_nau7802_setup(i2c0);
+    i2c_emulator_nau7802_set_input(scale_emu, TEST_SCALE_BASE);
+    i2c_emulator_nau7802_set_noise(scale_emu, TEST_SCALE_NOISE);
+    t0 = time_us_64();
+    nau7802 scale = nau7802_setup(i2c0, 1.0f);
+    uint ticks = 0;
+    while(nau7802_get_status(scale) == NAU7802_STARTING && ticks < 200){
+        _i2c_emulator_test_ticks(scale, 1);
+        ticks++;
+    }
+    uint32_t raw = 0;
+    nau7802_read_raw(scale, &raw);
+    pass = (nau7802_get_status(scale) == NAU7802_READY && raw + TEST_SCALE_NOISE >= TEST_SCALE_BASE && raw <= TEST_SCALE_BASE + TEST_SCALE_NOISE);
+    printf("Test 3:  %s (scale ready after %u ticks (%llu ms) and %lu transactions, first conversion 0x%06lX)\n", 
+           (pass ? "PASS" : "FAIL"), ticks, (time_us_64() - t0)/1000, i2c_emulator_nau7802_transaction_count(scale_emu), raw);
+
+    // Conversions read at 80 SPS and a step in the input
+    nau7802_set_conversion_rate(scale, SPS_080);
+    _i2c_emulator_test_ticks(scale, 10);
+    const uint32_t made_0 = i2c_emulator_nau7802_conversion_count(scale_emu);
+    const uint32_t read_0 = nau7802_sample_count(scale);
+    i2c_emulator_nau7802_set_input(scale_emu, TEST_SCALE_BASE + TEST_SCALE_STEP);
+    uint settle_ticks = 0;
+    for(uint i = 0; i < 100; i++){
+        _i2c_emulator_test_ticks(scale, 1);
+        const int err = nau7802_read_mg(scale) - TEST_SCALE_STEP;
+        if(settle_ticks == 0 && err < 2*TEST_SCALE_NOISE && err > -2*TEST_SCALE_NOISE) settle_ticks = i + 1;
+    }
+    const uint32_t made = i2c_emulator_nau7802_conversion_count(scale_emu) - made_0;
+    const uint32_t read = nau7802_sample_count(scale) - read_0;
+    pass = (settle_ticks > 0 && read + 2 >= made && made >= 75);
+    printf("Test 4:  %s (80 SPS for 1 s: %lu conversions made, %lu read. Step settled in %u ticks. Final %d mg)\n",
+           (pass ? "PASS" : "FAIL"), made, read, settle_ticks, nau7802_read_mg(scale));
+
+    // Polled reads cost two transactions per tick however often the scale is read
+    const uint32_t trans_0 = i2c_emulator_nau7802_transaction_count(scale_emu);
+    const uint32_t poll_made_0 = i2c_emulator_nau7802_conversion_count(scale_emu);
+    const uint32_t poll_read_0 = nau7802_sample_count(scale);
+    uint32_t raw_sum = 0;
+    for(uint i = 0; i < TEST_POLL_TICKS; i++){
+        _i2c_emulator_test_ticks(scale, 1);
+        for(uint8_t j = 0; j < TEST_READS_PER_TICK; j++){
+            nau7802_read_raw(scale, &raw);
+            raw_sum += raw + nau7802_read_mg(scale) + nau7802_at_val_mg(scale, TEST_SCALE_STEP);
+        }
+    }
+    const uint32_t poll_trans = i2c_emulator_nau7802_transaction_count(scale_emu) - trans_0;
+    const uint32_t poll_made = i2c_emulator_nau7802_conversion_count(scale_emu) - poll_made_0;
+    const uint32_t poll_read = nau7802_sample_count(scale) - poll_read_0;
+    // A conversion made just before or after the ticks may be counted on only one side
+    pass = (poll_trans == 2*TEST_POLL_TICKS && poll_read + 1 >= poll_made && poll_read <= poll_made + 1);
+    printf("Test 5:  %s (%u polled ticks with %u reads each: %lu transactions, %lu conversions made, %lu read)\n",
+           (pass ? "PASS" : "FAIL"), TEST_POLL_TICKS, 3*TEST_READS_PER_TICK, poll_trans, poll_made, poll_read);
+
+    // Configuration bits are cached by the register shadow so each write skips the read. The values are unchanged.
+    const uint32_t cfg_0 = i2c_emulator_nau7802_transaction_count(scale_emu);
+    pass = (nau7802_set_gain(scale, GAIN_128) == PICO_OK && nau7802_set_ldo_voltage(scale, VLDO_3_0) == PICO_OK
+            && nau7802_set_pga_filter(scale, PGA_ON) == PICO_OK && nau7802_set_conversion_rate(scale, SPS_080) == PICO_OK);
+    const uint32_t cfg_trans = i2c_emulator_nau7802_transaction_count(scale_emu) - cfg_0;
+    pass &= (cfg_trans == 4);
+    printf("Test 6:  %s (4 configuration writes took %lu transactions)\n", (pass ? "PASS" : "FAIL"), cfg_trans);
+
+    while(!i2c_bus_is_idle(i2c0)) tight_loop_contents();
+    nau7802_deinit(scale);
+    i2c_emulator_nau7802_deinit(scale_emu);
+    i2c_emulator_mb85_deinit(fram_emu);
+}
+#endif
+
+#endif
+/** \} */
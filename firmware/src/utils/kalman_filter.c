@@ -0,0 +1,245 @@
+/**
+ * \ingroup kalman_filter
+ *
+ * \file kalman_filter.c
+ * \author Richard Hall (hallboyone@icloud.com)
+ * \brief Kalman Filter source
+ * \version 0.3
+ * \date 2026-10-18
+ */
+
+#include "utils/kalman_filter.h"
+
+#include <stdlib.h>
+
+#include "utils/macros.h"
+
+/** \brief Number of fractional bits in the state and covariance. */
+#define KF_Q 8
+/** \brief Number of fractional bits in the Kalman gains. */
+#define KF_GAIN_Q 16
+/** \brief Longest single prediction step. Longer gaps are split to keep the noise terms from overflowing. */
+#define KF_MAX_DT_MS 250
+/** 
+ * \brief Largest value and rate variance, with KF_Q fractional bits (a standard deviation of 65536). 
+ * Keeps the gain math within 64 bits when no measurements arrive for a long time. 
+ */
+#define KF_MAX_VAR ((int64_t)1 << 40)
+
+/** \brief Structure holding the state, covariance, and process noise of a two-state Kalman filter. */
+typedef struct kalman_filter_s {
+    int32_t value;      /**< \brief Value estimate with KF_Q fractional bits. */
+    int32_t rate;       /**< \brief Rate estimate in units/s with KF_Q fractional bits. */
+    int64_t p00;        /**< \brief Variance of the value estimate. */
+    int64_t p01;        /**< \brief Covariance of the value and rate estimates. */
+    int64_t p11;        /**< \brief Variance of the rate estimate. */
+    int64_t rate_noise; /**< \brief Rate variance added each second. */
+    uint32_t t_ms;      /**< \brief Time of the last prediction. */
+} kalman_filter_;
+
+/**
+ * \brief Propagate the filter forward by \p dt_ms using a constant rate model.
+ *
+ * \param kf The kalman_filter object to propagate.
+ * \param dt_ms Time step no larger than KF_MAX_DT_MS.
+ */
+static void _kalman_filter_step(kalman_filter kf, int64_t dt_ms){
+    // Discrete white noise on the rate: Q = q*[dt^3/3, dt^2/2; dt^2/2, dt]
+    const int64_t q11 = kf->rate_noise*dt_ms/1000;
+    const int64_t q01 = q11*dt_ms/2000;
+    const int64_t q00 = q01*dt_ms/1500;
+
+    kf->value += (int64_t)kf->rate*dt_ms/1000;
+
+    kf->p00 += 2*kf->p01*dt_ms/1000 + kf->p11*dt_ms*dt_ms/1000000 + q00;
+    kf->p01 += kf->p11*dt_ms/1000 + q01;
+    kf->p11 += q11;
+
+    // Saturate the covariance of a filter left without measurements. Limiting the covariance to the
+    // smaller variance keeps the matrix positive semi-definite.
+    if(kf->p00 > KF_MAX_VAR || kf->p11 > KF_MAX_VAR){
+        kf->p00 = MIN(kf->p00, KF_MAX_VAR);
+        kf->p11 = MIN(kf->p11, KF_MAX_VAR);
+        const int64_t p01_max = MIN(kf->p00, kf->p11);
+        kf->p01 = CLAMP(kf->p01, -p01_max, p01_max);
+    }
+}
+
+kalman_filter kalman_filter_setup(uint32_t rate_noise){
+    kalman_filter kf = malloc(sizeof(kalman_filter_));
+    if(kf == NULL) return NULL;
+
+    kf->rate_noise = (int64_t)rate_noise*(1 << KF_Q);
+    kalman_filter_reset(kf, 0, 0, 0);
+    return kf;
+}
+
+void kalman_filter_reset(kalman_filter kf, int32_t value, int32_t rate, uint32_t t_ms){
+    kf->value = value*(1 << KF_Q);
+    kf->rate  = rate*(1 << KF_Q);
+    kf->p00   = 0;
+    kf->p01   = 0;
+    kf->p11   = kf->rate_noise;
+    kf->t_ms  = t_ms;
+}
+
+void kalman_filter_predict(kalman_filter kf, uint32_t t_ms){
+    // Signed difference handles the ms counter wrapping
+    int32_t dt_ms = (int32_t)(t_ms - kf->t_ms);
+    if(dt_ms <= 0) return;
+
+    kf->t_ms = t_ms;
+    while(dt_ms > KF_MAX_DT_MS){
+        _kalman_filter_step(kf, KF_MAX_DT_MS);
+        dt_ms -= KF_MAX_DT_MS;
+    }
+    _kalman_filter_step(kf, dt_ms);
+}
+
+void kalman_filter_update_value(kalman_filter kf, int32_t value, uint32_t var){
+    const int64_t s = kf->p00 + (int64_t)var*(1 << KF_Q);
+    if(s <= 0) return;
+
+    // Scaled by multiplying since the operands can be negative
+    const int64_t k0 = kf->p00*(1 << KF_GAIN_Q)/s;
+    const int64_t k1 = kf->p01*(1 << KF_GAIN_Q)/s;
+    const int64_t y  = (int64_t)value*(1 << KF_Q) - kf->value;
+
+    kf->value += (k0*y) >> KF_GAIN_Q;
+    kf->rate  += (k1*y) >> KF_GAIN_Q;
+
+    // P = (I - KH)P with H = [1 0]. p11 uses the old p01 so it is updated first.
+    kf->p11 -= (k1*kf->p01) >> KF_GAIN_Q;
+    kf->p01 -= (k0*kf->p01) >> KF_GAIN_Q;
+    kf->p00 -= (k0*kf->p00) >> KF_GAIN_Q;
+    kf->p00 = MAX(kf->p00, 0);
+    kf->p11 = MAX(kf->p11, 0);
+}
+
+void kalman_filter_update_rate(kalman_filter kf, int32_t rate, uint32_t var){
+    const int64_t s = kf->p11 + (int64_t)var*(1 << KF_Q);
+    if(s <= 0) return;
+
+    const int64_t k0 = kf->p01*(1 << KF_GAIN_Q)/s;
+    const int64_t k1 = kf->p11*(1 << KF_GAIN_Q)/s;
+    const int64_t y  = (int64_t)rate*(1 << KF_Q) - kf->rate;
+
+    kf->value += (k0*y) >> KF_GAIN_Q;
+    kf->rate  += (k1*y) >> KF_GAIN_Q;
+
+    // P = (I - KH)P with H = [0 1]. p00 uses the old p01 so it is updated first.
+    kf->p00 -= (k0*kf->p01) >> KF_GAIN_Q;
+    kf->p01 -= (k0*kf->p11) >> KF_GAIN_Q;
+    kf->p11 -= (k1*kf->p11) >> KF_GAIN_Q;
+    kf->p00 = MAX(kf->p00, 0);
+    kf->p11 = MAX(kf->p11, 0);
+}
+
+void kalman_filter_add_rate_uncertainty(kalman_filter kf, uint32_t rate_var){
+    kf->p11 += (int64_t)rate_var*(1 << KF_Q);
+}
+
+int32_t kalman_filter_value(kalman_filter kf){
+    return kf->value >> KF_Q;
+}
+
+int32_t kalman_filter_rate(kalman_filter kf){
+    return kf->rate >> KF_Q;
+}
+
+void kalman_filter_deinit(kalman_filter kf){
+    free(kf);
+}
+
+#ifdef KALMAN_FILTER_TESTS
+#include <stdio.h>
+
+#define TEST_UL_PER_PULSE 500
+#define TEST_TICK_MS 10
+#define TEST_IDLE_MS 3600000 // An hour without measurements
+#define TEST_NEG_START -100000 // Start of the negative ramp
+#define TEST_NEG_RATE -2000    // Rate of the negative ramp in units/s
+
+/** \brief Segment of the simulated flow profile. */
+typedef struct {
+    uint32_t start_ms;  /**< \brief Time the segment starts. */
+    int32_t flow_ul_s;  /**< \brief Flow through the simulated meter during the segment. */
+} kalman_filter_test_segment;
+
+void kalman_filter_test(){
+    const kalman_filter_test_segment profile [] = {{0, 0}, {1000, 2000}, {5000, 800}, {8000, 0}, {10000, 0}};
+    const uint num_segments = sizeof(profile)/sizeof(profile[0]) - 1;
+
+    kalman_filter kf = kalman_filter_setup(10000);
+    int32_t volume_ul = 0, pulses = 0, last_pulses = 0;
+
+    for(uint s = 0; s < num_segments; s++){
+        const int32_t step = profile[s].flow_ul_s - (s == 0 ? 0 : profile[s-1].flow_ul_s);
+        kalman_filter_add_rate_uncertainty(kf, step*step);
+
+        int32_t settle_ms = -1, max_err = 0;
+        for(uint32_t t = profile[s].start_ms; t < profile[s+1].start_ms; t += TEST_TICK_MS){
+            // Simulate the flow meter pulses and a tick of the estimator
+            volume_ul += profile[s].flow_ul_s*TEST_TICK_MS/1000;
+            pulses = volume_ul/TEST_UL_PER_PULSE;
+
+            kalman_filter_predict(kf, t);
+            if(pulses != last_pulses){
+                kalman_filter_update_value(kf, pulses*TEST_UL_PER_PULSE, 2500);
+            } else if(kalman_filter_value(kf) > (pulses+1)*TEST_UL_PER_PULSE){
+                kalman_filter_update_value(kf, (pulses+1)*TEST_UL_PER_PULSE, TEST_UL_PER_PULSE*TEST_UL_PER_PULSE/3);
+            }
+            last_pulses = pulses;
+
+            const int32_t err = abs(kalman_filter_rate(kf) - profile[s].flow_ul_s);
+            if(settle_ms < 0 && err <= MAX(abs(step)/10, 100)) settle_ms = t - profile[s].start_ms;
+            if(t >= profile[s].start_ms + 1500) max_err = MAX(max_err, err);
+        }
+
+        if(settle_ms >= 0 && settle_ms <= 1200 && max_err <= 100){
+            printf("Test %d:  PASS (settled in %ld ms, max error %ld ul/s)\n", s+1, settle_ms, max_err);
+        } else {
+            printf("Test %d:  FAIL (settled in %ld ms, max error %ld ul/s)\n", s+1, settle_ms, max_err);
+        }
+    }
+
+    // Predict through a long idle time, then follow a new flow. The covariance must not overflow.
+    kalman_filter_reset(kf, 0, 0, 0);
+    uint32_t t = 0;
+    for(; t < TEST_IDLE_MS; t += TEST_TICK_MS) kalman_filter_predict(kf, t);
+    volume_ul = 0;
+    last_pulses = 0;
+    for(const uint32_t end = t + 5000; t < end; t += TEST_TICK_MS){
+        volume_ul += 2000*TEST_TICK_MS/1000;
+        pulses = volume_ul/TEST_UL_PER_PULSE;
+        kalman_filter_predict(kf, t);
+        if(pulses != last_pulses) kalman_filter_update_value(kf, pulses*TEST_UL_PER_PULSE, 2500);
+        last_pulses = pulses;
+    }
+    const int32_t err = abs(kalman_filter_rate(kf) - 2000);
+    printf("Test %d:  %s (after %lu s idle, rate error %ld ul/s)\n", num_segments+1, 
+           (err <= 100 ? "PASS" : "FAIL"), TEST_IDLE_MS/1000, err);
+
+    // Follow a falling, negative value, then pull the rate back with negative rate measurements
+    kalman_filter_reset(kf, TEST_NEG_START, 0, 0);
+    int32_t value = TEST_NEG_START, value_err = 0, rate_err = 0;
+    for(t = TEST_TICK_MS; t <= 5000; t += TEST_TICK_MS){
+        value += TEST_NEG_RATE*TEST_TICK_MS/1000;
+        kalman_filter_predict(kf, t);
+        kalman_filter_update_value(kf, value, 2500);
+        if(t >= 2000){
+            value_err = MAX(value_err, abs(kalman_filter_value(kf) - value));
+            rate_err = MAX(rate_err, abs(kalman_filter_rate(kf) - TEST_NEG_RATE));
+        }
+    }
+    for(const uint32_t end = t + 2000; t < end; t += TEST_TICK_MS){
+        kalman_filter_predict(kf, t);
+        kalman_filter_update_rate(kf, 2*TEST_NEG_RATE, 2500);
+    }
+    const int32_t pulled_err = abs(kalman_filter_rate(kf) - 2*TEST_NEG_RATE);
+    const bool pass = (value_err <= 50 && rate_err <= 100 && pulled_err <= 100);
+    printf("Test %d:  %s (negative ramp: max value error %ld, max rate error %ld ul/s, rate error %ld ul/s after negative rate updates)\n", 
+           num_segments+2, (pass ? "PASS" : "FAIL"), value_err, rate_err, pulled_err);
+    kalman_filter_deinit(kf);
+}
+#endif
@@ -78,6 +78,7 @@ typedef struct pid_s{
     pid_gains K;                        /**< The gains of the PID controller. */
     sensor_getter read_fb;              /**< The sensor function. */
     sensor_getter read_ff;              /**< The sensor providing feedforward values. */
+    sensor_time_getter read_time;       /**< Optional function returning the time of the latest feedback value. */
     input_setter apply_input;           /**< The plant function that applies the input to the system. */
     discrete_derivative err_slope;      /**< A discrete_derivative tracking the slope of the error. */
     discrete_integral err_sum;          /**< A discrete_integral tracking the sum of the error. */
@@ -361,6 +362,7 @@ pid pid_setup(const pid_gains K, sensor_getter feedback_sensor, sensor_getter fe
     controller->K = K;
     controller->read_fb = feedback_sensor;
     controller->read_ff = feedforward_sensor;
+    controller->read_time = NULL;
     controller->apply_input = plant;
     controller->min_time_between_ticks_ms = time_between_ticks_ms;
     controller->setpoint = 0;
@@ -386,10 +388,15 @@ void pid_update_bias(pid controller, float bias){
     controller->bias = bias;
 }
 
+void pid_set_sensor_time_getter(pid controller, sensor_time_getter read_time){
+    controller->read_time = read_time;
+}
+
 float pid_tick(pid controller, pid_viewer * viewer){
     if(absolute_time_diff_us(get_absolute_time(), controller->_next_tick_time) < 0){
         controller->_next_tick_time = delayed_by_ms(get_absolute_time(), controller->min_time_between_ticks_ms);
-        const datapoint new_reading = {.t = ms_since_boot(), .v = controller->read_fb()};
+        const pid_time t = (controller->read_time != NULL ? controller->read_time() : ms_since_boot());
+        const datapoint new_reading = {.t = t, .v = controller->read_fb()};
         const datapoint new_err = {.t = new_reading.t, .v = controller->setpoint - new_reading.v};
 
         // Compute proportional, bias, and ff terms